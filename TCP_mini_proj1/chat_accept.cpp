@@ -0,0 +1,128 @@
+#include "chat_accept.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Back off this long when out of descriptors, so a listen socket that
+// stays readable does not spin the acceptor
+#define OUT_OF_FDS_SLEEP_US 10000
+
+int enable_defer_accept(int listen_socket, int seconds) {
+  return setsockopt(listen_socket, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(seconds));
+}
+
+int enable_keepalive(int listen_socket, uint32_t timeout_ms) {
+  unsigned int user_timeout = timeout_ms;
+  int one = 1;
+  // Half the time quiet, then four probes over the other half
+  int idle_s = timeout_ms / 2000 > 0 ? (int)(timeout_ms / 2000) : 1;
+  int interval_s = idle_s / 4 > 0 ? idle_s / 4 : 1;
+  int probes = 4;
+
+  if (setsockopt(listen_socket, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one)) == -1 ||
+      setsockopt(listen_socket, IPPROTO_TCP, TCP_KEEPIDLE, &idle_s, sizeof(idle_s)) == -1 ||
+      setsockopt(listen_socket, IPPROTO_TCP, TCP_KEEPINTVL, &interval_s, sizeof(interval_s)) == -1 ||
+      setsockopt(listen_socket, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes)) == -1) {
+    return -1;
+  }
+  // Also bounds the probes: the connection goes once this passes without an ack
+  return setsockopt(listen_socket, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout));
+}
+
+int init_chat_acceptor(struct ChatAcceptor *acceptor, int listen_socket, struct ChatWorkerGroup *group,
+                       struct MetricsRegistry *registry) {
+  acceptor->listen_socket = listen_socket;
+  acceptor->group = group;
+  acceptor->next_worker = 0;
+  acceptor->ids.accepts = metrics_counter(registry, "chat.accepts");
+  acceptor->ids.accept_errors = metrics_counter(registry, "chat.accept_errors");
+  acceptor->ids.handoff_full = metrics_counter(registry, "chat.handoff_full");
+  acceptor->ids.accept_batch = metrics_histogram(registry, "chat.accept_batch");
+  acceptor->metrics = metrics_shard(registry);
+  return acceptor->metrics == NULL ? -1 : 0;
+}
+
+/**
+ * Give a socket to the next worker with room, round robin.
+ *
+ * @return the worker's index, or -1 if every worker is full
+ */
+static int hand_off(struct ChatAcceptor *acceptor, int fd) {
+  struct ChatWorkerGroup *group = acceptor->group;
+
+  for (int tries = 0; tries < group->num_workers; ++tries) {
+    int w = acceptor->next_worker;
+    acceptor->next_worker = (w + 1) % group->num_workers;
+    if (hand_off_socket(group->workers[w], fd)) {
+      return w;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Accept up to CHAT_ACCEPT_BATCH sockets and wake the workers that got
+ * any.
+ *
+ * @return sockets accepted, or -1 if the queue ran dry or descriptors
+ *         ran out before the batch was full
+ */
+static int accept_batch(struct ChatAcceptor *acceptor) {
+  uint64_t woken = 0;
+  int accepted = 0;
+  int worker;
+  int fd;
+  bool more = true;
+
+  while (accepted < CHAT_ACCEPT_BATCH) {
+    fd = accept4(acceptor->listen_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EMFILE || errno == ENFILE) {
+        metrics_add(acceptor->metrics, acceptor->ids.accept_errors, 1);
+        usleep(OUT_OF_FDS_SLEEP_US);
+      } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        metrics_add(acceptor->metrics, acceptor->ids.accept_errors, 1);
+      }
+      more = false;
+      break;
+    }
+    worker = hand_off(acceptor, fd);
+    if (worker < 0) {
+      metrics_add(acceptor->metrics, acceptor->ids.handoff_full, 1);
+      close(fd);
+      continue;
+    }
+    woken |= 1ull << worker;
+    accepted++;
+  }
+
+  for (int w = 0; woken != 0; ++w) {
+    if (woken & (1ull << w)) {
+      wake_chat_worker(acceptor->group->workers[w]);
+      woken &= ~(1ull << w);
+    }
+  }
+  if (accepted > 0) {
+    metrics_add(acceptor->metrics, acceptor->ids.accepts, accepted);
+    metrics_record(acceptor->metrics, acceptor->ids.accept_batch, accepted);
+  }
+  return more ? accepted : -1;
+}
+
+void run_chat_acceptor(struct ChatAcceptor *acceptor, const std::atomic<bool> *stop) {
+  struct pollfd pfd;
+
+  pfd.fd = acceptor->listen_socket;
+  pfd.events = POLLIN;
+  while (!stop->load()) {
+    if (poll(&pfd, 1, 200) <= 0) {
+      continue;
+    }
+    // Keep draining while batches come back full
+    while (accept_batch(acceptor) == CHAT_ACCEPT_BATCH && !stop->load()) {
+    }
+  }
+}
@@ -0,0 +1,83 @@
+//
+// Accept path of the chat server. After a restart every client and
+// monitor reconnects at once, so the acceptor drains the listen queue
+// with accept4() a batch at a time, hands each socket to a worker
+// through its FdRing and wakes each worker once per batch rather than
+// once per socket.
+//
+// With TCP_DEFER_ACCEPT the kernel keeps a connection out of the
+// accept queue until its first data arrives, so the CLIENT_CONNECT or
+// MON_CONNECT every peer sends straight away is already readable when
+// the worker takes the socket, and connections that never send
+// anything never cost a descriptor.
+//
+// Keepalive settings on the listen socket are inherited by every
+// accepted socket, so the kernel's dead peer detection, a fallback for
+// peers that never heartbeat, costs no syscalls per connection.
+//
+
+#ifndef TCP_CHAT_CHAT_ACCEPT_H
+#define TCP_CHAT_CHAT_ACCEPT_H
+
+#include <stdint.h>
+#include <atomic>
+
+#include "chat_server.h"
+#include "metrics.h"
+
+// Most sockets accepted before the workers are woken
+#define CHAT_ACCEPT_BATCH 64
+
+// Default TCP_DEFER_ACCEPT timeout, in seconds
+#define CHAT_DEFAULT_DEFER_ACCEPT 5
+
+// Default TCP_USER_TIMEOUT, and roughly how long keepalive takes to
+// give up on a silent peer
+#define CHAT_DEFAULT_USER_TIMEOUT_MS 120000
+
+struct ChatAcceptorMetricIds {
+  int accepts;
+  int accept_errors;
+  int handoff_full;
+  int accept_batch;
+};
+
+struct ChatAcceptor {
+  int listen_socket;
+  struct ChatWorkerGroup *group;
+  int next_worker; // round robin position
+  struct MetricsShard *metrics;
+  struct ChatAcceptorMetricIds ids;
+};
+
+/**
+ * Hold connections out of the accept queue until they have sent
+ * something, or for at most seconds.
+ *
+ * @return 0 on success, -1 if the option was refused
+ */
+int enable_defer_accept(int listen_socket, int seconds);
+
+/**
+ * Have the kernel drop accepted connections whose peer has been
+ * unreachable for about timeout_ms: TCP_USER_TIMEOUT for unacknowledged
+ * data, and keepalive probes, starting after half of it, for quiet ones.
+ *
+ * @return 0 on success, -1 if an option was refused
+ */
+int enable_keepalive(int listen_socket, uint32_t timeout_ms);
+
+/**
+ * @param listen_socket bound, listening, non-blocking TCP socket
+ * @return 0 on success, -1 if no metrics shard was left
+ */
+int init_chat_acceptor(struct ChatAcceptor *acceptor, int listen_socket, struct ChatWorkerGroup *group,
+                       struct MetricsRegistry *registry);
+
+/**
+ * Accept and hand off connections until stop is set. Checked at least
+ * every 200 ms.
+ */
+void run_chat_acceptor(struct ChatAcceptor *acceptor, const std::atomic<bool> *stop);
+
+#endif //TCP_CHAT_CHAT_ACCEPT_H
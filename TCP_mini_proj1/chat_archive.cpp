@@ -0,0 +1,427 @@
+#include "chat_archive.h"
+#include "chat_wire.h"
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Longest segment file name: six digits and ".seg"
+#define SEGMENT_NAME_LEN 10
+
+static uint64_t realtime_now_ns() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static std::string segment_path(const std::string &dir, uint32_t segment, const char *suffix) {
+  char name[32];
+
+  snprintf(name, sizeof(name), "/%06u%s", segment, suffix);
+  return dir + name;
+}
+
+static int write_all_at(int fd, const char *buf, size_t len, uint64_t offset) {
+  ssize_t ret;
+
+  while (len > 0) {
+    ret = pwrite(fd, buf, len, (off_t)offset);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    buf += ret;
+    len -= ret;
+    offset += ret;
+  }
+  return 0;
+}
+
+static int write_index(struct ChatArchiveWriter *writer) {
+  const char *buf = writer->index.data();
+  size_t len = writer->index.size();
+  ssize_t ret;
+
+  while (len > 0) {
+    ret = write(writer->index_fd, buf, len);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    buf += ret;
+    len -= ret;
+  }
+  writer->index.clear();
+  return 0;
+}
+
+/**
+ * Create the writer's current segment and its index, and put the
+ * segment header in the buffer.
+ */
+static int open_segment(struct ChatArchiveWriter *writer) {
+  std::string path = segment_path(writer->dir, writer->segment, ".seg");
+  struct ChatArchiveHeader header;
+  int flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+
+  writer->fd = open(path.c_str(), flags | (writer->direct ? O_DIRECT : 0), 0644);
+  if (writer->fd == -1 && writer->direct && errno == EINVAL) {
+    // tmpfs and some others
+    writer->direct = false;
+    writer->fd = open(path.c_str(), flags, 0644);
+  }
+  if (writer->fd == -1) {
+    return -1;
+  }
+  writer->index_fd = open(segment_path(writer->dir, writer->segment, ".idx").c_str(), flags | O_APPEND, 0644);
+  if (writer->index_fd == -1) {
+    close(writer->fd);
+    writer->fd = -1;
+    return -1;
+  }
+
+  memcpy(header.magic, CHAT_ARCHIVE_MAGIC, sizeof(header.magic));
+  header.segment = writer->segment;
+  header.nickname_len = (uint32_t)writer->nickname.size();
+  header.created_ns = realtime_now_ns();
+  writer->buffered = ChatArchiveHeaderCodec::encode(header, writer->buf, CHAT_ARCHIVE_BUFFER_SIZE);
+  memcpy(&writer->buf[writer->buffered], writer->nickname.data(), writer->nickname.size());
+  writer->buffered += writer->nickname.size();
+  writer->flushed = 0;
+  writer->next_index = 0;
+  return 0;
+}
+
+/**
+ * Write out the buffer, which must be full.
+ */
+static int flush_buffer(struct ChatArchiveWriter *writer) {
+  if (write_all_at(writer->fd, writer->buf, CHAT_ARCHIVE_BUFFER_SIZE, writer->flushed) == -1) {
+    return -1;
+  }
+  writer->flushed += CHAT_ARCHIVE_BUFFER_SIZE;
+  writer->buffered = 0;
+  return write_index(writer);
+}
+
+/**
+ * Write out the buffered tail, padded to the alignment O_DIRECT wants
+ * if it is on, and the index entries so far. The tail stays buffered.
+ */
+static int write_tail(struct ChatArchiveWriter *writer) {
+  size_t len = writer->buffered;
+
+  if (writer->direct) {
+    len = (len + CHAT_ARCHIVE_ALIGN - 1) & ~(size_t)(CHAT_ARCHIVE_ALIGN - 1);
+    memset(&writer->buf[writer->buffered], 0, len - writer->buffered);
+  }
+  if (len > 0 && write_all_at(writer->fd, writer->buf, len, writer->flushed) == -1) {
+    return -1;
+  }
+  return write_index(writer);
+}
+
+static int close_segment(struct ChatArchiveWriter *writer) {
+  int ret = write_tail(writer);
+
+  // Drop the padding
+  if (ret == 0 && writer->direct && ftruncate(writer->fd, (off_t)(writer->flushed + writer->buffered)) == -1) {
+    ret = -1;
+  }
+  close(writer->fd);
+  close(writer->index_fd);
+  writer->fd = -1;
+  writer->index_fd = -1;
+  return ret;
+}
+
+/**
+ * Copy bytes into the buffer, writing it out each time it fills.
+ */
+static int buffer_bytes(struct ChatArchiveWriter *writer, const char *data, size_t len) {
+  size_t room;
+
+  while (len > 0) {
+    room = CHAT_ARCHIVE_BUFFER_SIZE - writer->buffered;
+    if (room > len) {
+      room = len;
+    }
+    memcpy(&writer->buf[writer->buffered], data, room);
+    writer->buffered += room;
+    data += room;
+    len -= room;
+    if (writer->buffered == CHAT_ARCHIVE_BUFFER_SIZE && flush_buffer(writer) == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int open_archive(struct ChatArchiveWriter *writer, const char *dir, const char *nickname, uint64_t max_segment_bytes,
+                 bool direct) {
+  std::vector<std::string> existing;
+  void *buf;
+
+  if (max_segment_bytes > CHAT_ARCHIVE_MAX_SEGMENT_BYTES || (nickname != NULL && strlen(nickname) > UINT16_MAX)) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+    return -1;
+  }
+  writer->dir = dir;
+  writer->nickname = nickname != NULL ? nickname : "";
+  writer->max_segment_bytes = max_segment_bytes;
+  writer->direct = direct;
+  writer->segment = 0;
+  writer->fd = -1;
+  writer->index_fd = -1;
+  writer->buffered = 0;
+  writer->flushed = 0;
+  writer->next_index = 0;
+  writer->records = 0;
+  // Carry on after whatever an earlier run left
+  existing = list_archive_segments(dir);
+  if (!existing.empty()) {
+    writer->segment = (uint32_t)strtoul(&existing.back()[existing.back().size() - SEGMENT_NAME_LEN], NULL, 10) + 1;
+  }
+  if (posix_memalign(&buf, CHAT_ARCHIVE_ALIGN, CHAT_ARCHIVE_BUFFER_SIZE) != 0) {
+    errno = ENOMEM;
+    return -1;
+  }
+  writer->buf = (char *)buf;
+  if (open_segment(writer) == -1) {
+    free(writer->buf);
+    writer->buf = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+int archive_append(struct ChatArchiveWriter *writer, uint64_t recv_ns, const char *frame, uint32_t frame_len) {
+  char header[ChatArchiveRecordCodec::wire_size];
+  char entry[ChatArchiveIndexCodec::wire_size];
+  struct ChatArchiveRecord record = {frame_len, recv_ns};
+  struct ChatArchiveIndexEntry index_entry;
+  uint64_t offset = writer->flushed + writer->buffered;
+
+  if (offset + sizeof(header) + frame_len > writer->max_segment_bytes &&
+      offset > ChatArchiveHeaderCodec::wire_size + writer->nickname.size()) {
+    if (close_segment(writer) == -1) {
+      return -1;
+    }
+    writer->segment++;
+    if (open_segment(writer) == -1) {
+      return -1;
+    }
+    offset = writer->buffered;
+  }
+  if (offset >= writer->next_index) {
+    index_entry.recv_ns = recv_ns;
+    index_entry.offset = offset;
+    ChatArchiveIndexCodec::encode(index_entry, entry, sizeof(entry));
+    writer->index.insert(writer->index.end(), entry, entry + sizeof(entry));
+    writer->next_index = (offset / CHAT_ARCHIVE_INDEX_STRIDE + 1) * CHAT_ARCHIVE_INDEX_STRIDE;
+  }
+
+  ChatArchiveRecordCodec::encode(record, header, sizeof(header));
+  // Almost always room for both in the buffer as it is
+  if (writer->buffered + sizeof(header) + frame_len < CHAT_ARCHIVE_BUFFER_SIZE) {
+    memcpy(&writer->buf[writer->buffered], header, sizeof(header));
+    memcpy(&writer->buf[writer->buffered + sizeof(header)], frame, frame_len);
+    writer->buffered += sizeof(header) + frame_len;
+  } else if (buffer_bytes(writer, header, sizeof(header)) == -1 || buffer_bytes(writer, frame, frame_len) == -1) {
+    return -1;
+  }
+  writer->records++;
+  return 0;
+}
+
+int archive_sync(struct ChatArchiveWriter *writer) {
+  return write_tail(writer);
+}
+
+int close_archive(struct ChatArchiveWriter *writer) {
+  int ret = close_segment(writer);
+
+  free(writer->buf);
+  writer->buf = NULL;
+  return ret;
+}
+
+std::vector<std::string> list_archive_segments(const char *dir) {
+  std::vector<std::string> paths;
+  struct dirent *entry;
+  DIR *handle = opendir(dir);
+  size_t len;
+
+  if (handle == NULL) {
+    return paths;
+  }
+  while ((entry = readdir(handle)) != NULL) {
+    len = strlen(entry->d_name);
+    if (len == SEGMENT_NAME_LEN && strcmp(&entry->d_name[len - 4], ".seg") == 0 &&
+        strspn(entry->d_name, "0123456789") == len - 4) {
+      paths.push_back(std::string(dir) + "/" + entry->d_name);
+    }
+  }
+  closedir(handle);
+  // Names are zero padded, so this is segment order
+  std::sort(paths.begin(), paths.end());
+  return paths;
+}
+
+static const char *map_file(const std::string &path, size_t *len) {
+  struct stat info;
+  void *data;
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+  *len = 0;
+  if (fd == -1) {
+    return NULL;
+  }
+  if (fstat(fd, &info) == -1 || info.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return NULL;
+  }
+  *len = info.st_size;
+  return (const char *)data;
+}
+
+int map_archive_segment(struct ChatArchiveSegment *segment, const std::string &path) {
+  struct ChatArchiveHeader header;
+
+  segment->index = NULL;
+  segment->index_len = 0;
+  segment->data = map_file(path, &segment->len);
+  if (segment->data == NULL) {
+    return -1;
+  }
+  if (!ChatArchiveHeaderCodec::decode(segment->data, segment->len, header) ||
+      memcmp(header.magic, CHAT_ARCHIVE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.nickname_len > segment->len - ChatArchiveHeaderCodec::wire_size) {
+    munmap((void *)segment->data, segment->len);
+    segment->data = NULL;
+    errno = EINVAL;
+    return -1;
+  }
+  madvise((void *)segment->data, segment->len, MADV_SEQUENTIAL);
+  segment->nickname = segment->data + ChatArchiveHeaderCodec::wire_size;
+  segment->nickname_len = header.nickname_len;
+  segment->offset = ChatArchiveHeaderCodec::wire_size + header.nickname_len;
+  // Without an index a segment can still be read from the start
+  segment->index = map_file(path.substr(0, path.size() - 4) + ".idx", &segment->index_len);
+  return 0;
+}
+
+void unmap_archive_segment(struct ChatArchiveSegment *segment) {
+  if (segment->data != NULL) {
+    munmap((void *)segment->data, segment->len);
+  }
+  if (segment->index != NULL) {
+    munmap((void *)segment->index, segment->index_len);
+  }
+  segment->data = NULL;
+  segment->index = NULL;
+}
+
+void seek_archive_segment(struct ChatArchiveSegment *segment, uint64_t since_ns) {
+  struct ChatArchiveIndexEntry entry;
+  size_t low = 0;
+  size_t high = segment->index_len / ChatArchiveIndexCodec::wire_size;
+  size_t middle;
+
+  // Find the first entry at or after since_ns; the one before it is where to start
+  while (low < high) {
+    middle = low + (high - low) / 2;
+    ChatArchiveIndexCodec::decode(&segment->index[middle * ChatArchiveIndexCodec::wire_size],
+                                  ChatArchiveIndexCodec::wire_size, entry);
+    if (entry.recv_ns < since_ns) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  if (low == 0) {
+    return;
+  }
+  ChatArchiveIndexCodec::decode(&segment->index[(low - 1) * ChatArchiveIndexCodec::wire_size],
+                                ChatArchiveIndexCodec::wire_size, entry);
+  if (entry.offset > segment->offset && entry.offset < segment->len) {
+    segment->offset = entry.offset;
+  }
+}
+
+bool next_archive_record(struct ChatArchiveSegment *segment, struct ChatArchiveRecord *record, const char **frame) {
+  size_t start = segment->offset + ChatArchiveRecordCodec::wire_size;
+
+  if (!ChatArchiveRecordCodec::decode(&segment->data[segment->offset], segment->len - segment->offset, *record)) {
+    return false;
+  }
+  // Zeroes are the padding of a segment written with O_DIRECT and not yet closed
+  if (record->frame_len == 0 || record->frame_len > segment->len - start) {
+    return false;
+  }
+  *frame = &segment->data[start];
+  segment->offset = start + record->frame_len;
+  return true;
+}
+
+bool decode_archived_message(const char *frame, uint32_t len, struct ArchivedMessage *message) {
+  struct ChatMonMsg header;
+  struct ChatTimedMonMsg timed_header;
+  size_t header_len = ChatMonCodec::wire_size;
+
+  if (!ChatMonCodec::decode(frame, len, header)) {
+    return false;
+  }
+  message->send_ns = 0;
+  if (header.type == MON_TIMED_MESSAGE) {
+    if (!ChatTimedMonCodec::decode(frame, len, timed_header)) {
+      return false;
+    }
+    header_len = ChatTimedMonCodec::wire_size;
+    message->send_ns = timed_header.send_ns;
+  }
+  if (header_len + header.nickname_len + header.data_len > len) {
+    return false;
+  }
+  message->type = header.type;
+  message->nickname = frame + header_len;
+  message->nickname_len = header.nickname_len;
+  message->data = message->nickname + header.nickname_len;
+  message->data_len = header.data_len;
+  return true;
+}
+
+void print_archived_message(FILE *out, const struct ChatArchiveRecord *record, const struct ArchivedMessage *message) {
+  fprintf(out, "%llu.%09llu ", (unsigned long long)(record->recv_ns / 1000000000),
+          (unsigned long long)(record->recv_ns % 1000000000));
+  if (message->type == MON_DIRECT_MESSAGE) {
+    fputs("[DIRECT] ", out);
+  }
+  fwrite(message->nickname, 1, message->nickname_len, out);
+  fputs(" said: ", out);
+  fwrite(message->data, 1, message->data_len, out);
+  if (message->send_ns != 0 && record->recv_ns >= message->send_ns) {
+    fprintf(out, " (%llu us)", (unsigned long long)((record->recv_ns - message->send_ns) / 1000));
+  }
+  putc('\n', out);
+}
@@ -0,0 +1,197 @@
+//
+// Binary archive of the chat messages a monitor receives (tcpchatmon
+// --archive), written without any formatting so it keeps up with
+// whatever the connection delivers, and read back by chat_archive.
+//
+// An archive is a directory of segments, NNNNNN.seg, each with an
+// index, NNNNNN.idx. A segment is a ChatArchiveHeader and the
+// monitor's nickname (the one its direct messages were sent to)
+// followed by records, each a ChatArchiveRecord and then the message exactly as it
+// came off the wire (MON_MESSAGE, MON_DIRECT_MESSAGE or
+// MON_TIMED_MESSAGE, header, nickname and data). The index has a
+// ChatArchiveIndexEntry for the first record starting in each
+// CHAT_ARCHIVE_INDEX_STRIDE bytes of its segment, so a reader can jump
+// to a receive time. Integers are big endian, as on the wire.
+//
+// Records are gathered in an aligned buffer and written
+// CHAT_ARCHIVE_BUFFER_SIZE at a time, optionally with O_DIRECT so a
+// long recording does not push everything else out of the page cache.
+// archive_sync() writes out a partial buffer without giving it up, so
+// an idle archive is still current on disk.
+//
+
+#ifndef TCP_CHAT_CHAT_ARCHIVE_H
+#define TCP_CHAT_CHAT_ARCHIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "wire_codec.h"
+
+// Bytes of records written at a time, a multiple of any O_DIRECT alignment
+#define CHAT_ARCHIVE_BUFFER_SIZE (1024 * 1024)
+#define CHAT_ARCHIVE_ALIGN 4096
+
+// Default segment size before a new one is started
+#define CHAT_ARCHIVE_DEFAULT_SEGMENT_BYTES (256ull * 1024 * 1024)
+// Largest, so offsets in a segment fit in 32 bits
+#define CHAT_ARCHIVE_MAX_SEGMENT_BYTES 0xFFFFFFFFull
+
+// Segment bytes per index entry
+#define CHAT_ARCHIVE_INDEX_STRIDE (64 * 1024)
+
+#define CHAT_ARCHIVE_MAGIC "CHATARC1"
+
+struct ChatArchiveHeader {
+  char magic[8]; // CHAT_ARCHIVE_MAGIC
+  uint32_t segment;
+  uint32_t nickname_len; // bytes of nickname that follow
+  uint64_t created_ns; // CLOCK_REALTIME
+};
+
+struct ChatArchiveRecord {
+  uint32_t frame_len; // bytes of message that follow
+  uint64_t recv_ns; // CLOCK_REALTIME the message was received
+};
+
+struct ChatArchiveIndexEntry {
+  uint64_t recv_ns;
+  uint64_t offset; // of the record in its segment
+};
+
+using ChatArchiveHeaderCodec = wire::Codec<ChatArchiveHeader,
+                                           wire::Bytes<&ChatArchiveHeader::magic>,
+                                           wire::Field<&ChatArchiveHeader::segment>,
+                                           wire::Field<&ChatArchiveHeader::nickname_len>,
+                                           wire::Field<&ChatArchiveHeader::created_ns> >;
+
+using ChatArchiveRecordCodec = wire::Codec<ChatArchiveRecord,
+                                           wire::Field<&ChatArchiveRecord::frame_len>,
+                                           wire::Field<&ChatArchiveRecord::recv_ns> >;
+
+using ChatArchiveIndexCodec = wire::Codec<ChatArchiveIndexEntry,
+                                          wire::Field<&ChatArchiveIndexEntry::recv_ns>,
+                                          wire::Field<&ChatArchiveIndexEntry::offset> >;
+
+/**
+ * The segment being written and its buffered tail.
+ */
+struct ChatArchiveWriter {
+  std::string dir;
+  std::string nickname;
+  uint64_t max_segment_bytes;
+  bool direct; // O_DIRECT, if the file system takes it
+  uint32_t segment;
+  int fd;
+  int index_fd;
+  char *buf; // CHAT_ARCHIVE_BUFFER_SIZE, aligned to CHAT_ARCHIVE_ALIGN
+  size_t buffered;
+  uint64_t flushed; // segment bytes written before buf
+  uint64_t next_index; // segment offset that earns the next index entry
+  std::vector<char> index; // index entries not yet written
+  uint64_t records;
+};
+
+/**
+ * Create dir if need be and start a segment after any already there.
+ *
+ * @param nickname the monitor's, or NULL if it has none
+ * @param max_segment_bytes at most CHAT_ARCHIVE_MAX_SEGMENT_BYTES
+ * @param direct try O_DIRECT, falling back to normal writes if the file
+ *        system refuses it
+ * @return 0 on success, -1 on failure (see errno)
+ */
+int open_archive(struct ChatArchiveWriter *writer, const char *dir, const char *nickname, uint64_t max_segment_bytes,
+                 bool direct);
+
+/**
+ * Add a message to the archive, starting a new segment first if it
+ * would take this one past max_segment_bytes.
+ *
+ * @return 0 on success, -1 if a write failed (see errno)
+ */
+int archive_append(struct ChatArchiveWriter *writer, uint64_t recv_ns, const char *frame, uint32_t frame_len);
+
+/**
+ * Write out everything buffered so far, keeping the partial block
+ * buffered to be written again once it fills.
+ *
+ * @return 0 on success, -1 if a write failed (see errno)
+ */
+int archive_sync(struct ChatArchiveWriter *writer);
+
+/**
+ * Write out the rest of the archive and close it.
+ *
+ * @return 0 on success, -1 if a write failed (see errno)
+ */
+int close_archive(struct ChatArchiveWriter *writer);
+
+/**
+ * One segment of an archive being read, mapped into memory.
+ */
+struct ChatArchiveSegment {
+  const char *data;
+  size_t len;
+  const char *nickname; // the monitor's, in data
+  uint32_t nickname_len;
+  const char *index;
+  size_t index_len;
+  size_t offset; // next record
+};
+
+/**
+ * @return the archive's segment files, in order
+ */
+std::vector<std::string> list_archive_segments(const char *dir);
+
+/**
+ * Map a segment and its index (if it has one) and check its header.
+ *
+ * @return 0 on success, -1 on failure (see errno)
+ */
+int map_archive_segment(struct ChatArchiveSegment *segment, const std::string &path);
+
+void unmap_archive_segment(struct ChatArchiveSegment *segment);
+
+/**
+ * Move to the last indexed record received before since_ns, from
+ * which reading finds the first one received at or after it.
+ */
+void seek_archive_segment(struct ChatArchiveSegment *segment, uint64_t since_ns);
+
+/**
+ * Next record of a segment. A record cut short, as the last one of a
+ * segment still being written may be, ends the segment.
+ *
+ * @return false at the end of the segment
+ */
+bool next_archive_record(struct ChatArchiveSegment *segment, struct ChatArchiveRecord *record, const char **frame);
+
+/**
+ * An archived message's sender and text, pointing into its frame.
+ */
+struct ArchivedMessage {
+  uint16_t type;
+  const char *nickname;
+  uint16_t nickname_len;
+  const char *data;
+  uint16_t data_len;
+  uint64_t send_ns; // MON_TIMED_MESSAGE only
+};
+
+/**
+ * @return false if frame is not a whole chat message
+ */
+bool decode_archived_message(const char *frame, uint32_t len, struct ArchivedMessage *message);
+
+/**
+ * Print a message on one line with its receive time, as chat_archive
+ * does.
+ */
+void print_archived_message(FILE *out, const struct ChatArchiveRecord *record, const struct ArchivedMessage *message);
+
+#endif //TCP_CHAT_CHAT_ARCHIVE_H
@@ -0,0 +1,161 @@
+//
+// Reads an archive written by tcpchatmon --archive (chat_archive.h)
+// back as text, one message per line with its receive time, as the
+// monitor would have printed it:
+//
+//   1760000000.123456789 alice said: hello
+//   1760000000.123470001 [DIRECT] alice said: hi
+//
+// --nickname keeps only the messages sent by NAME, and --since and
+// --until (Unix time in seconds, fractions allowed) only those
+// received in that window; the index takes each segment straight to
+// --since. With --to DIR the messages that pass are written to a new
+// archive instead of printed, and --count only counts them.
+//
+// e.g., ./chat_archive /var/tmp/chat --nickname alice --since 1760000000
+//       ./chat_archive /var/tmp/chat --nickname alice --to /var/tmp/alice
+//
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "chat_archive.h"
+
+// stdout buffer, so printing costs one write per this many bytes
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+
+struct Filter {
+  const char *nickname;
+  size_t nickname_len;
+  uint64_t since_ns;
+  uint64_t until_ns;
+};
+
+static bool passes(const struct Filter *filter, const struct ChatArchiveRecord *record,
+                   const struct ArchivedMessage *message) {
+  if (record->recv_ns < filter->since_ns || record->recv_ns >= filter->until_ns) {
+    return false;
+  }
+  return filter->nickname == NULL ||
+         (message->nickname_len == filter->nickname_len &&
+          memcmp(message->nickname, filter->nickname, filter->nickname_len) == 0);
+}
+
+/**
+ * Seconds, with up to nine places after the point, as ns. Not through
+ * a double, which rounds today's times by hundreds of ns.
+ */
+static uint64_t parse_seconds(const char *text) {
+  char *end;
+  uint64_t ns = strtoull(text, &end, 10) * 1000000000;
+  uint64_t scale = 100000000;
+
+  if (*end == '.') {
+    for (++end; *end >= '0' && *end <= '9' && scale > 0; ++end, scale /= 10) {
+      ns += (*end - '0') * scale;
+    }
+  }
+  return ns;
+}
+
+int main(int argc, char *argv[]) {
+  struct Filter filter = {NULL, 0, 0, UINT64_MAX};
+  struct ChatArchiveWriter writer;
+  struct ChatArchiveSegment segment;
+  struct ChatArchiveRecord record;
+  struct ArchivedMessage message;
+  std::vector<std::string> segments;
+  const char *to_dir = NULL;
+  const char *frame;
+  bool count_only = false;
+  bool writing = false;
+  uint64_t matched = 0;
+  uint64_t total = 0;
+  uint64_t skipped = 0;
+  static char output_buf[OUTPUT_BUFFER_SIZE];
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s DIR [--nickname NAME] [--since SECONDS] [--until SECONDS] [--to DIR] [--count]\n",
+            argv[0]);
+    return 1;
+  }
+  for (int i = 2; i < argc; ++i) {
+    if (strcmp(argv[i], "--nickname") == 0 && i + 1 < argc) {
+      filter.nickname = argv[++i];
+      filter.nickname_len = strlen(filter.nickname);
+    } else if (strcmp(argv[i], "--since") == 0 && i + 1 < argc) {
+      filter.since_ns = parse_seconds(argv[++i]);
+    } else if (strcmp(argv[i], "--until") == 0 && i + 1 < argc) {
+      filter.until_ns = parse_seconds(argv[++i]);
+    } else if (strcmp(argv[i], "--to") == 0 && i + 1 < argc) {
+      to_dir = argv[++i];
+    } else if (strcmp(argv[i], "--count") == 0) {
+      count_only = true;
+    } else {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  segments = list_archive_segments(argv[1]);
+  if (segments.empty()) {
+    fprintf(stderr, "No archive segments in %s\n", argv[1]);
+    return 1;
+  }
+  setvbuf(stdout, output_buf, _IOFBF, sizeof(output_buf));
+
+  for (size_t s = 0; s < segments.size(); ++s) {
+    if (map_archive_segment(&segment, segments[s]) == -1) {
+      fprintf(stderr, "Skipping %s: %s\n", segments[s].c_str(), strerror(errno));
+      continue;
+    }
+    // The copy is for the same monitor
+    if (to_dir != NULL && !writing) {
+      std::string nickname(segment.nickname, segment.nickname_len);
+
+      if (open_archive(&writer, to_dir, nickname.c_str(), CHAT_ARCHIVE_DEFAULT_SEGMENT_BYTES, false) == -1) {
+        perror(to_dir);
+        return 1;
+      }
+      writing = true;
+    }
+    seek_archive_segment(&segment, filter.since_ns);
+    while (next_archive_record(&segment, &record, &frame)) {
+      total++;
+      if (!decode_archived_message(frame, record.frame_len, &message)) {
+        skipped++;
+        continue;
+      }
+      if (!passes(&filter, &record, &message)) {
+        continue;
+      }
+      matched++;
+      if (to_dir != NULL) {
+        if (archive_append(&writer, record.recv_ns, frame, record.frame_len) == -1) {
+          perror(to_dir);
+          return 1;
+        }
+      } else if (!count_only) {
+        print_archived_message(stdout, &record, &message);
+      }
+    }
+    unmap_archive_segment(&segment);
+  }
+  fflush(stdout);
+
+  if (writing && close_archive(&writer) == -1) {
+    perror(to_dir);
+    return 1;
+  }
+  if (count_only || to_dir != NULL) {
+    printf("%llu of the %llu messages read matched\n", (unsigned long long)matched, (unsigned long long)total);
+  }
+  if (skipped > 0) {
+    fprintf(stderr, "%llu records were not chat messages\n", (unsigned long long)skipped);
+  }
+  return 0;
+}
@@ -0,0 +1,293 @@
+//
+// What compressing monitor batches (MON_COMPRESSED, chat_lz.h) buys and
+// costs at each level. Messages are packed into batches of up to
+// --batch KB, as the server packs a pass's broadcasts, compressed one
+// after another through one encoder, as for the monitors sharing a
+// level, and decompressed again to check them.
+//
+// The messages come from an archive written by tcpchatmon --archive, or
+// are made up: --mb MB of MON_MESSAGEs from a few hundred nicknames,
+// their words drawn from a vocabulary with a few common ones, as chat
+// is. Made up chat compresses about as well as real chat of the same
+// vocabulary, so an archive of the real thing is the better guide.
+//
+// For each level it prints the ratio, and the CPU time per MB of
+// messages to compress and to decompress (thread CPU time, so what a
+// server worker or a monitor would spend). --reset starts every batch
+// with an empty window, to show what the window across batches is
+// worth.
+//
+// e.g., ./chat_compress_bench --archive /var/tmp/chat --batch 16
+//       ./chat_compress_bench --mb 256 --level 1
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "chat_archive.h"
+#include "chat_lz.h"
+#include "chat_wire.h"
+
+static uint64_t cpu_ns() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Messages to compress, and where each batch of them ends.
+ */
+struct Corpus {
+  std::vector<char> data;
+  std::vector<size_t> batch_ends;
+  size_t batch_start; // of the last batch
+};
+
+/**
+ * Start a new batch if len more bytes would not fit in this one.
+ */
+static void add_frame(struct Corpus *corpus, const char *frame, size_t len, size_t batch_bytes) {
+  if (len > batch_bytes) {
+    // The server sends these as they are
+    return;
+  }
+  if (corpus->batch_ends.empty() || corpus->data.size() + len - corpus->batch_start > batch_bytes) {
+    corpus->batch_start = corpus->data.size();
+    corpus->batch_ends.push_back(corpus->data.size());
+  }
+  corpus->data.insert(corpus->data.end(), frame, frame + len);
+  corpus->batch_ends.back() = corpus->data.size();
+}
+
+/**
+ * @return false if the archive has no messages
+ */
+static bool load_archive(struct Corpus *corpus, const char *dir, size_t batch_bytes) {
+  std::vector<std::string> segments = list_archive_segments(dir);
+  struct ChatArchiveSegment segment;
+  struct ChatArchiveRecord record;
+  const char *frame;
+
+  for (size_t s = 0; s < segments.size(); ++s) {
+    if (map_archive_segment(&segment, segments[s]) == -1) {
+      fprintf(stderr, "Skipping %s\n", segments[s].c_str());
+      continue;
+    }
+    while (next_archive_record(&segment, &record, &frame)) {
+      add_frame(corpus, frame, record.frame_len, batch_bytes);
+    }
+    unmap_archive_segment(&segment);
+  }
+  return !corpus->data.empty();
+}
+
+static uint32_t next_random(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return (uint32_t)(*state >> 32);
+}
+
+/**
+ * A made up word: common ones are short and drawn often.
+ */
+static std::string make_word(uint64_t *state) {
+  static const char letters[] = "etaoinshrdlucmfwypvbgkjqxz";
+  std::string word;
+  size_t len = 2 + next_random(state) % 7;
+
+  for (size_t i = 0; i < len; ++i) {
+    // Squared, so early letters come up more
+    uint32_t r = next_random(state) % 26;
+    word += letters[r * r / 26];
+  }
+  return word;
+}
+
+static void make_corpus(struct Corpus *corpus, size_t bytes, size_t batch_bytes) {
+  std::vector<std::string> nicknames;
+  std::vector<std::string> words;
+  struct ChatMonMsg message;
+  char frame[1024];
+  std::string text;
+  uint64_t state = 88172645463325252ull;
+  size_t len;
+
+  for (int i = 0; i < 300; ++i) {
+    nicknames.push_back("user" + std::to_string(next_random(&state) % 100000));
+  }
+  for (int i = 0; i < 5000; ++i) {
+    words.push_back(make_word(&state));
+  }
+  while (corpus->data.size() < bytes) {
+    text.clear();
+    for (uint32_t n = 1 + next_random(&state) % 20; n > 0; --n) {
+      // Mostly from the first few hundred words
+      uint32_t r = next_random(&state) % 5000;
+      text += words[(uint64_t)r * r / 5000 * r / 5000];
+      text += n > 1 ? " " : "";
+    }
+    const std::string &nickname = nicknames[next_random(&state) % nicknames.size()];
+    message.type = MON_MESSAGE;
+    message.nickname_len = (uint16_t)nickname.size();
+    message.data_len = (uint16_t)text.size();
+    len = ChatMonCodec::encode(message, frame, sizeof(frame));
+    memcpy(&frame[len], nickname.data(), nickname.size());
+    memcpy(&frame[len + nickname.size()], text.data(), text.size());
+    add_frame(corpus, frame, len + nickname.size() + text.size(), batch_bytes);
+  }
+}
+
+struct Result {
+  uint64_t compressed;
+  uint64_t stored; // batches that would not shrink
+  uint64_t compress_ns;
+  uint64_t decompress_ns;
+  bool verified;
+};
+
+static void run(const struct Corpus *corpus, int level, bool reset, struct Result *result) {
+  struct LzEncoder encoder;
+  struct LzDecoder decoder;
+  std::vector<size_t> lens(corpus->batch_ends.size());
+  std::vector<char> out(corpus->data.size() + corpus->batch_ends.size());
+  std::vector<size_t> out_ends(corpus->batch_ends.size());
+  const char *raw;
+  const char *batch;
+  size_t start = 0;
+  size_t out_start = 0;
+  size_t len;
+  uint64_t begin;
+
+  init_lz_encoder(&encoder, CHAT_MAX_BATCH, level);
+  init_lz_decoder(&decoder, CHAT_MAX_BATCH);
+  memset(result, 0, sizeof(*result));
+
+  begin = cpu_ns();
+  for (size_t b = 0; b < corpus->batch_ends.size(); ++b) {
+    len = corpus->batch_ends[b] - start;
+    if (reset) {
+      reset_lz_encoder(&encoder);
+    }
+    lens[b] = lz_compress(&encoder, &corpus->data[start], len, &out[out_start], len - 1);
+    if (lens[b] == 0) {
+      memcpy(&out[out_start], &corpus->data[start], len);
+      result->stored++;
+    }
+    out_start += lens[b] == 0 ? len : lens[b];
+    out_ends[b] = out_start;
+    start = corpus->batch_ends[b];
+  }
+  result->compress_ns = cpu_ns() - begin;
+  result->compressed = out_start;
+
+  result->verified = true;
+  start = 0;
+  out_start = 0;
+  begin = cpu_ns();
+  for (size_t b = 0; b < corpus->batch_ends.size(); ++b) {
+    len = corpus->batch_ends[b] - start;
+    raw = &corpus->data[start];
+    if (reset) {
+      reset_lz_decoder(&decoder);
+    }
+    if (lens[b] == 0) {
+      batch = lz_store(&decoder, &out[out_start], len);
+    } else {
+      batch = lz_decompress(&decoder, &out[out_start], lens[b], len);
+    }
+    // A cheap check inside the timing, the full one after
+    if (batch == NULL || batch[0] != raw[0] || batch[len - 1] != raw[len - 1]) {
+      result->verified = false;
+      break;
+    }
+    out_start = out_ends[b];
+    start = corpus->batch_ends[b];
+  }
+  result->decompress_ns = cpu_ns() - begin;
+
+  if (result->verified) {
+    reset_lz_decoder(&decoder);
+    start = 0;
+    out_start = 0;
+    for (size_t b = 0; b < corpus->batch_ends.size() && result->verified; ++b) {
+      len = corpus->batch_ends[b] - start;
+      if (reset) {
+        reset_lz_decoder(&decoder);
+      }
+      batch = lens[b] == 0 ? lz_store(&decoder, &out[out_start], len)
+                           : lz_decompress(&decoder, &out[out_start], lens[b], len);
+      result->verified = batch != NULL && memcmp(batch, &corpus->data[start], len) == 0;
+      out_start = out_ends[b];
+      start = corpus->batch_ends[b];
+    }
+  }
+  free_lz_encoder(&encoder);
+  free_lz_decoder(&decoder);
+}
+
+int main(int argc, char *argv[]) {
+  struct Corpus corpus;
+  struct Result result;
+  const char *archive_dir = NULL;
+  size_t batch_bytes = 16 * 1024;
+  size_t corpus_bytes = 64 * 1024 * 1024;
+  int first_level = 1;
+  int last_level = CHAT_LZ_MAX_LEVEL;
+  bool reset = false;
+  bool all_verified = true;
+  double mb;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--archive") == 0 && i + 1 < argc) {
+      archive_dir = argv[++i];
+    } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      batch_bytes = strtoul(argv[++i], NULL, 10) * 1024;
+    } else if (strcmp(argv[i], "--mb") == 0 && i + 1 < argc) {
+      corpus_bytes = strtoul(argv[++i], NULL, 10) * 1024 * 1024;
+    } else if (strcmp(argv[i], "--level") == 0 && i + 1 < argc) {
+      first_level = last_level = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--reset") == 0) {
+      reset = true;
+    } else {
+      fprintf(stderr, "Usage: %s [--archive DIR | --mb MB] [--batch KB] [--level N] [--reset]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (batch_bytes == 0 || batch_bytes > CHAT_MAX_BATCH) {
+    fprintf(stderr, "--batch must be 1 to %d KB\n", CHAT_MAX_BATCH / 1024);
+    return 1;
+  }
+  if (first_level < 1 || first_level > CHAT_LZ_MAX_LEVEL) {
+    fprintf(stderr, "--level must be 1 to %d\n", CHAT_LZ_MAX_LEVEL);
+    return 1;
+  }
+
+  if (archive_dir != NULL) {
+    if (!load_archive(&corpus, archive_dir, batch_bytes)) {
+      fprintf(stderr, "No messages in %s\n", archive_dir);
+      return 1;
+    }
+  } else {
+    make_corpus(&corpus, corpus_bytes, batch_bytes);
+  }
+  mb = corpus.data.size() / (1024.0 * 1024.0);
+  printf("%.1f MB of messages in %zu batches of up to %zu KB%s\n", mb, corpus.batch_ends.size(), batch_bytes / 1024,
+         reset ? ", each on its own" : "");
+  printf("level  ratio  stored  compress ms/MB  MB/s   decompress ms/MB  MB/s\n");
+
+  for (int level = first_level; level <= last_level; ++level) {
+    run(&corpus, level, reset, &result);
+    all_verified &= result.verified;
+    printf("%5d  %5.2f  %6llu  %14.2f  %5.0f  %16.2f  %5.0f%s\n", level, (double)corpus.data.size() / result.compressed,
+           (unsigned long long)result.stored, result.compress_ns / 1e6 / mb, mb / (result.compress_ns / 1e9),
+           result.decompress_ns / 1e6 / mb, mb / (result.decompress_ns / 1e9),
+           result.verified ? "" : "  DID NOT ROUND TRIP");
+  }
+  return all_verified ? 0 : 1;
+}
@@ -0,0 +1,255 @@
+//
+// Idle connection footprint of tcpchatserver. Opens N loopback chat
+// clients, each of which connects, sets a nickname and then goes
+// quiet, and reports how much the server's resident memory grew per
+// connection (from process.rss_bytes on its stats socket) next to the
+// bytes its connection slabs account for. Kernel memory is not in the
+// server's RSS, so the growth of Slab in /proc/meminfo (socket, file
+// and epoll structures for both ends of every connection) is shown
+// separately.
+//
+// Every loopback source address gets its own range of ephemeral ports,
+// so connections are spread over 127.1.0.0/16 to get past the ~28k
+// ports one address allows.
+//
+// The connections never heartbeat, so to --hold them longer than the
+// server's idle timeout, start it with --idle-timeout 0.
+//
+// e.g., ./tcpchatserver 127.0.0.1 8888 --stats /tmp/tcpchatserver.stats &
+//       ./chat_conn_bench 127.0.0.1 8888 /tmp/tcpchatserver.stats --connections 1000000
+//
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "chat_connections.h"
+#include "chat_wire.h"
+#include "metrics.h"
+#include "tcp_utils.h"
+
+// Connections per loopback source address, well inside the ephemeral range
+#define CONNECTIONS_PER_SOURCE 20000
+
+// Connections opened before waiting for the server to accept them
+#define CONNECT_BATCH 1000
+
+// Descriptors kept back for stdio, the stats socket and so on
+#define SPARE_FDS 64
+
+/**
+ * Slab: from /proc/meminfo, in bytes.
+ */
+static uint64_t kernel_slab_bytes() {
+  char line[256];
+  unsigned long long kb = 0;
+  FILE *meminfo = fopen("/proc/meminfo", "r");
+
+  if (meminfo == NULL) {
+    return 0;
+  }
+  while (fgets(line, sizeof(line), meminfo) != NULL) {
+    if (sscanf(line, "Slab: %llu kB", &kb) == 1) {
+      break;
+    }
+  }
+  fclose(meminfo);
+  return kb * 1024;
+}
+
+static uint64_t now_ms() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Wait for the server to report at least want of a metric.
+ *
+ * @return the last value read
+ */
+static uint64_t wait_for_metric(const char *stats_path, const char *name, uint64_t want, int timeout_ms) {
+  uint64_t value = 0;
+  uint64_t deadline = now_ms() + timeout_ms;
+
+  while (metrics_query(stats_path, name, &value) == 0 && value < want && now_ms() < deadline) {
+    usleep(1000);
+  }
+  return value;
+}
+
+/**
+ * Connect one idle client from source address number source and send
+ * CLIENT_CONNECT plus CLIENT_SET_NICKNAME in a single write.
+ *
+ * @return the socket, or -1 on failure
+ */
+static int open_client(const struct sockaddr_in *server_addr, uint32_t source, uint32_t number) {
+  char buf[64];
+  char nickname[16];
+  struct sockaddr_in source_addr;
+  struct ChatClientMessage message;
+  size_t len;
+  int nickname_len;
+  int one = 1;
+  int client_socket;
+
+  client_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+  if (client_socket < 0) {
+    return -1;
+  }
+  // Pick the port at connect() time, so it only has to be unique per
+  // source address and destination
+  setsockopt(client_socket, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+  memset(&source_addr, 0, sizeof(source_addr));
+  source_addr.sin_family = AF_INET;
+  source_addr.sin_addr.s_addr = htonl(0x7F010000u + 1 + source);
+  if (bind(client_socket, (struct sockaddr *)&source_addr, sizeof(source_addr)) == -1 ||
+      connect(client_socket, (const struct sockaddr *)server_addr, sizeof(*server_addr)) == -1) {
+    close(client_socket);
+    return -1;
+  }
+
+  nickname_len = snprintf(nickname, sizeof(nickname), "user%u", number);
+  message.type = CLIENT_CONNECT;
+  message.nickname_len = 0;
+  message.data_length = 0;
+  len = ChatClientCodec::encode(message, buf, sizeof(buf));
+  message.type = CLIENT_SET_NICKNAME;
+  message.data_length = nickname_len;
+  len += ChatClientCodec::encode(message, &buf[len], sizeof(buf) - len);
+  memcpy(&buf[len], nickname, nickname_len);
+  len += nickname_len;
+  if (send(client_socket, buf, len, MSG_NOSIGNAL) != (ssize_t)len) {
+    close(client_socket);
+    return -1;
+  }
+  return client_socket;
+}
+
+/**
+ *
+ * Reads in IP PORT STATS_SOCKET [--connections N] [--hold SECONDS]
+ *
+ * Connections are capped by this process's open file limit; the
+ * per connection figures are then extrapolated to a million.
+ *
+ * @param argc count of arguments on the command line
+ * @param argv array of command line arguments
+ * @return 0 on success, non-zero if an error occurred
+ */
+int main(int argc, char *argv[]) {
+  struct sockaddr_in server_addr;
+  std::vector<int> sockets;
+  const char *stats_path;
+  uint64_t want = 1000000;
+  uint64_t hold_s = 0;
+  uint64_t fd_limit;
+  uint64_t base_connections = 0;
+  uint64_t base_rss = 0;
+  uint64_t base_slab = 0;
+  uint64_t base_kernel;
+  uint64_t rss = 0;
+  uint64_t slab = 0;
+  uint64_t kernel;
+  uint64_t members;
+  uint64_t start_ms;
+  uint64_t elapsed_ms;
+  double n;
+  int fd;
+
+  if (argc < 4) {
+    fprintf(stderr, "Usage: %s IP PORT STATS_SOCKET [--connections N] [--hold SECONDS]\n", argv[0]);
+    return 1;
+  }
+  for (int i = 4; i < argc; ++i) {
+    if (strcmp(argv[i], "--connections") == 0 && i + 1 < argc) {
+      want = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--hold") == 0 && i + 1 < argc) {
+      hold_s = strtoull(argv[++i], NULL, 10);
+    } else {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+  stats_path = argv[3];
+  if (convert_ip_port_to_sockaddr_in(argv[1], argv[2], &server_addr) == -1) {
+    fprintf(stderr, "Invalid IP/port %s %s\n", argv[1], argv[2]);
+    return 1;
+  }
+
+  fd_limit = raise_fd_limit();
+  if (want + SPARE_FDS > fd_limit) {
+    fprintf(stderr, "Open file limit is %llu, opening %llu connections instead of %llu\n",
+            (unsigned long long)fd_limit, (unsigned long long)(fd_limit - SPARE_FDS), (unsigned long long)want);
+    want = fd_limit - SPARE_FDS;
+  }
+
+  if (metrics_query(stats_path, "chat.connections", &base_connections) == -1 ||
+      metrics_query(stats_path, "process.rss_bytes", &base_rss) == -1 ||
+      metrics_query(stats_path, "chat.slab_bytes", &base_slab) == -1) {
+    fprintf(stderr, "Could not read stats from %s\n", stats_path);
+    return 1;
+  }
+  base_kernel = kernel_slab_bytes();
+
+  sockets.reserve(want);
+  start_ms = now_ms();
+  while (sockets.size() < want) {
+    for (uint64_t i = 0; i < CONNECT_BATCH && sockets.size() < want; ++i) {
+      fd = open_client(&server_addr, sockets.size() / CONNECTIONS_PER_SOURCE, sockets.size());
+      if (fd < 0) {
+        break;
+      }
+      sockets.push_back(fd);
+    }
+    if (fd < 0) {
+      perror("connect");
+      fprintf(stderr, "Stopped at %zu connections\n", sockets.size());
+      break;
+    }
+    // Let the server's accept queue drain before piling on more
+    wait_for_metric(stats_path, "chat.connections", base_connections + sockets.size(), 10000);
+  }
+  if (sockets.empty()) {
+    return 1;
+  }
+
+  members = wait_for_metric(stats_path, "chat.members", sockets.size(), 30000);
+  elapsed_ms = now_ms() - start_ms;
+  if (metrics_query(stats_path, "process.rss_bytes", &rss) == -1 ||
+      metrics_query(stats_path, "chat.slab_bytes", &slab) == -1) {
+    fprintf(stderr, "Could not read stats from %s\n", stats_path);
+    return 1;
+  }
+  kernel = kernel_slab_bytes();
+
+  n = (double)sockets.size();
+  printf("connections          %zu (%llu with nicknames) in %.1f s\n", sockets.size(), (unsigned long long)members,
+         elapsed_ms / 1000.0);
+  printf("server rss           %.1f MB -> %.1f MB\n", base_rss / 1e6, rss / 1e6);
+  printf("server rss/conn      %.1f bytes\n", ((double)rss - (double)base_rss) / n);
+  printf("slab bytes/conn      %.1f bytes (%zu byte records)\n", ((double)slab - (double)base_slab) / n,
+         sizeof(struct ChatConnection));
+  printf("kernel slab/conn     %.1f bytes, both ends\n", ((double)kernel - (double)base_kernel) / n);
+  // Bytes per connection times a million connections, in MB
+  printf("1M connections       %.0f MB server rss, %.0f MB kernel\n",
+         base_rss / 1e6 + ((double)rss - (double)base_rss) / n, ((double)kernel - (double)base_kernel) / n);
+
+  if (hold_s > 0) {
+    sleep(hold_s);
+  }
+  for (size_t i = 0; i < sockets.size(); ++i) {
+    close(sockets[i]);
+  }
+  return 0;
+}
@@ -0,0 +1,283 @@
+#include "chat_connections.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Table slot layout: hash in the high word, id + 1 in the low word
+#define SLOT_EMPTY 0
+#define SLOT_DELETED 0xFFFFFFFFu
+
+void set_nickname(struct ChatNickname *nickname, const char *name, uint16_t len) {
+  char *heap;
+
+  clear_nickname(nickname);
+  if (len <= CHAT_INLINE_NICKNAME) {
+    memcpy(nickname->inline_chars, name, len);
+  } else {
+    heap = (char *)malloc(len);
+    if (heap == NULL) {
+      return;
+    }
+    memcpy(heap, name, len);
+    memcpy(nickname->inline_chars, &heap, sizeof(heap));
+  }
+  nickname->len = len;
+}
+
+void clear_nickname(struct ChatNickname *nickname) {
+  if (nickname->len > CHAT_INLINE_NICKNAME) {
+    free((void *)nickname_data(nickname));
+  }
+  nickname->len = 0;
+}
+
+bool nickname_equals(const struct ChatNickname *nickname, const char *name, uint16_t len) {
+  return nickname->len == len && memcmp(nickname_data(nickname), name, len) == 0;
+}
+
+uint32_t nickname_hash(const char *name, uint16_t len) {
+  uint32_t hash = 2166136261u;
+
+  for (uint16_t i = 0; i < len; ++i) {
+    hash ^= (uint8_t)name[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+void init_connection_slab(struct ConnectionSlab *slab) {
+  slab->free_head = UINT32_MAX;
+  slab->used = 0;
+}
+
+void free_connection_slab(struct ConnectionSlab *slab) {
+  for (size_t i = 0; i < slab->slabs.size(); ++i) {
+    free(slab->slabs[i]);
+  }
+  slab->slabs.clear();
+  slab->free_head = UINT32_MAX;
+  slab->used = 0;
+}
+
+/**
+ * Add one more slab, threading its records onto the free list in id
+ * order so they are handed out front to back.
+ */
+static int grow_connection_slab(struct ConnectionSlab *slab) {
+  struct ChatConnection *records;
+  uint32_t first = (uint32_t)(slab->slabs.size() << CHAT_SLAB_SHIFT);
+
+  records = (struct ChatConnection *)calloc(CHAT_SLAB_RECORDS, sizeof(struct ChatConnection));
+  if (records == NULL) {
+    return -1;
+  }
+  for (uint32_t i = 0; i < CHAT_SLAB_RECORDS; ++i) {
+    records[i].fd = -1;
+    records[i].list_index = i + 1 < CHAT_SLAB_RECORDS ? first + i + 1 : slab->free_head;
+  }
+  slab->slabs.push_back(records);
+  slab->free_head = first;
+  return 0;
+}
+
+struct ChatConnection *alloc_connection(struct ConnectionSlab *slab, uint32_t *id) {
+  struct ChatConnection *conn;
+
+  if (slab->free_head == UINT32_MAX && grow_connection_slab(slab) < 0) {
+    return NULL;
+  }
+  *id = slab->free_head;
+  conn = connection_at(slab, *id);
+  slab->free_head = conn->list_index;
+  slab->used++;
+
+  memset(conn, 0, sizeof(*conn));
+  conn->fd = -1;
+  conn->kind = CONN_NEW;
+  return conn;
+}
+
+void free_connection(struct ConnectionSlab *slab, uint32_t id) {
+  struct ChatConnection *conn = connection_at(slab, id);
+
+  conn->fd = -1;
+  conn->kind = CONN_FREE;
+  conn->list_index = slab->free_head;
+  slab->free_head = id;
+  slab->used--;
+}
+
+size_t connection_slab_bytes(const struct ConnectionSlab *slab) {
+  return slab->slabs.size() * CHAT_SLAB_RECORDS * sizeof(struct ChatConnection);
+}
+
+void init_chunk_pool(struct ChunkPool *pool) {
+  pool->free_head = CHAT_NO_CHUNK;
+  pool->allocated = 0;
+  pool->in_use = 0;
+}
+
+void free_chunk_pool(struct ChunkPool *pool) {
+  for (size_t i = 0; i < pool->blocks.size(); ++i) {
+    free(pool->blocks[i]);
+  }
+  pool->blocks.clear();
+  init_chunk_pool(pool);
+}
+
+uint32_t borrow_chunk(struct ChunkPool *pool) {
+  struct ChatChunk *chunk;
+  struct ChatChunk *block;
+  uint32_t handle;
+
+  if (pool->free_head == CHAT_NO_CHUNK) {
+    block = (struct ChatChunk *)malloc(CHAT_CHUNKS_PER_BLOCK * sizeof(struct ChatChunk));
+    if (block == NULL) {
+      return CHAT_NO_CHUNK;
+    }
+    pool->blocks.push_back(block);
+    for (uint32_t i = 0; i < CHAT_CHUNKS_PER_BLOCK; ++i) {
+      handle = pool->allocated + i + 1;
+      block[i].next = i + 1 < CHAT_CHUNKS_PER_BLOCK ? handle + 1 : CHAT_NO_CHUNK;
+    }
+    pool->free_head = pool->allocated + 1;
+    pool->allocated += CHAT_CHUNKS_PER_BLOCK;
+  }
+
+  handle = pool->free_head;
+  chunk = chunk_at(pool, handle);
+  pool->free_head = chunk->next;
+  pool->in_use++;
+
+  chunk->next = CHAT_NO_CHUNK;
+  chunk->start = 0;
+  chunk->end = 0;
+  return handle;
+}
+
+void return_chunks(struct ChunkPool *pool, uint32_t handle) {
+  struct ChatChunk *chunk;
+  uint32_t next;
+
+  while (handle != CHAT_NO_CHUNK) {
+    chunk = chunk_at(pool, handle);
+    next = chunk->next;
+    chunk->next = pool->free_head;
+    pool->free_head = handle;
+    pool->in_use--;
+    handle = next;
+  }
+}
+
+static uint64_t make_slot(uint32_t hash, uint32_t id) {
+  return ((uint64_t)hash << 32) | (uint32_t)(id + 1);
+}
+
+int init_nick_table(struct NickTable *table, uint32_t capacity) {
+  table->slots = (uint64_t *)calloc(capacity, sizeof(uint64_t));
+  if (table->slots == NULL) {
+    return -1;
+  }
+  table->mask = capacity - 1;
+  table->count = 0;
+  table->deleted = 0;
+  return 0;
+}
+
+void free_nick_table(struct NickTable *table) {
+  free(table->slots);
+  table->slots = NULL;
+  table->count = 0;
+  table->deleted = 0;
+}
+
+/**
+ * Put a slot in the first empty or deleted place along its probe sequence.
+ */
+static void place_slot(struct NickTable *table, uint64_t slot) {
+  uint32_t pos = (uint32_t)(slot >> 32) & table->mask;
+  uint32_t low;
+
+  for (;; pos = (pos + 1) & table->mask) {
+    low = (uint32_t)table->slots[pos];
+    if (low == SLOT_EMPTY || low == SLOT_DELETED) {
+      if (low == SLOT_DELETED) {
+        table->deleted--;
+      }
+      table->slots[pos] = slot;
+      return;
+    }
+  }
+}
+
+/**
+ * Rebuild at a size where live slots fill at most a quarter, which
+ * also drops every deleted slot.
+ */
+static int rehash_nick_table(struct NickTable *table) {
+  uint64_t *old_slots = table->slots;
+  uint32_t old_capacity = table->mask + 1;
+  uint32_t capacity = old_capacity;
+  uint32_t low;
+
+  while (capacity < (table->count + 1) * 4) {
+    capacity *= 2;
+  }
+  table->slots = (uint64_t *)calloc(capacity, sizeof(uint64_t));
+  if (table->slots == NULL) {
+    table->slots = old_slots;
+    return -1;
+  }
+  table->mask = capacity - 1;
+  table->deleted = 0;
+  for (uint32_t i = 0; i < old_capacity; ++i) {
+    low = (uint32_t)old_slots[i];
+    if (low != SLOT_EMPTY && low != SLOT_DELETED) {
+      place_slot(table, old_slots[i]);
+    }
+  }
+  free(old_slots);
+  return 0;
+}
+
+int nick_table_add(struct NickTable *table, uint32_t hash, uint32_t id) {
+  // Keep live plus deleted slots under half, so probes stay short
+  if ((table->count + table->deleted + 1) * 2 > table->mask + 1 && rehash_nick_table(table) < 0) {
+    return -1;
+  }
+  place_slot(table, make_slot(hash, id));
+  table->count++;
+  return 0;
+}
+
+void nick_table_remove(struct NickTable *table, uint32_t hash, uint32_t id) {
+  uint64_t slot = make_slot(hash, id);
+
+  for (uint32_t pos = hash & table->mask; (uint32_t)table->slots[pos] != SLOT_EMPTY; pos = (pos + 1) & table->mask) {
+    if (table->slots[pos] == slot) {
+      table->slots[pos] = SLOT_DELETED;
+      table->count--;
+      table->deleted++;
+      return;
+    }
+  }
+}
+
+bool nick_table_next(const struct NickTable *table, uint32_t hash, uint32_t *pos, uint32_t *id) {
+  uint32_t at;
+  uint64_t slot;
+
+  // *pos counts probes made so far, so a walk picks up where it left off
+  for (; *pos <= table->mask; ++*pos) {
+    at = (hash + *pos) & table->mask;
+    slot = table->slots[at];
+    if ((uint32_t)slot == SLOT_EMPTY) {
+      return false;
+    }
+    if ((uint32_t)slot != SLOT_DELETED && (uint32_t)(slot >> 32) == hash) {
+      *id = (uint32_t)slot - 1;
+      ++*pos;
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,239 @@
+//
+// Compact per-connection state for the chat server, sized so that a
+// million mostly idle connections fit comfortably on one host:
+//
+//  - connection records are 64 bytes (one cache line), allocated from
+//    slabs and named by a uint32_t id, which is also what epoll hands
+//    back
+//  - nicknames of up to 14 bytes live inside the record; longer ones
+//    (up to the protocol's uint16_t limit) get their own allocation
+//  - receive and send buffers are 4KB chunks borrowed from a shared
+//    pool only while a partial frame or unsent output is waiting, so
+//    an idle connection holds none
+//  - monitors are found by nickname through an open addressed table of
+//    ids, 8 bytes a slot
+//  - each record carries its own timer (chat_timers.h), a deadline and
+//    its links in the timer wheel, and its rate limits (chat_limits.h),
+//    a uint32_t per token bucket
+//
+
+#ifndef TCP_CHAT_CHAT_CONNECTIONS_H
+#define TCP_CHAT_CHAT_CONNECTIONS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Longest nickname kept inside the connection record
+#define CHAT_INLINE_NICKNAME 14
+
+// Connection records per slab
+#define CHAT_SLAB_SHIFT 12
+#define CHAT_SLAB_RECORDS (1u << CHAT_SLAB_SHIFT)
+
+// Pool chunk size, header included, and chunks allocated at a time
+#define CHAT_CHUNK_SIZE 4096
+#define CHAT_CHUNK_DATA (CHAT_CHUNK_SIZE - 8)
+#define CHAT_CHUNKS_PER_BLOCK 64
+
+// Chunk handle meaning "no chunk"
+#define CHAT_NO_CHUNK 0
+
+/**
+ * A nickname, stored inline when short. Longer names keep a pointer to
+ * a heap copy in the first bytes of inline_chars.
+ */
+struct ChatNickname {
+  uint16_t len;
+  char inline_chars[CHAT_INLINE_NICKNAME];
+};
+
+enum ChatConnectionKind {
+  CONN_FREE = 0,
+  CONN_NEW, // Connected, first message not seen yet
+  CONN_CLIENT,
+  CONN_MONITOR
+};
+
+// ChatConnection flags
+#define CONN_WANT_WRITE 0x1 // EPOLLOUT is armed
+#define CONN_MEMBER 0x2 // client with a nickname, on the member list
+#define CONN_SESSION 0x4 // has a session (chat_sessions.h)
+#define CONN_DETACHED 0x8 // session whose connection is gone, fd is -1
+#define CONN_TIMER 0x10 // linked into the timer wheel
+#define CONN_THROTTLED 0x20 // told it is throttled, not yet let through again
+#define CONN_PRESENCE 0x40 // monitor that sent MON_PRESENCE
+
+/**
+ * Everything the server keeps for one connection.
+ */
+struct ChatConnection {
+  int fd;
+  uint8_t kind; // A ChatConnectionKind
+  uint8_t flags;
+  uint16_t send_chunks; // chunks queued on send_head
+  struct ChatNickname nickname;
+  uint32_t list_index; // place on the monitor or member list; next free record when free
+  uint32_t recv_chunk; // partial frame, or CHAT_NO_CHUNK
+  uint32_t send_head; // unsent output, or CHAT_NO_CHUNK
+  uint32_t send_tail;
+  uint32_t deadline; // timer wheel tick the connection is reaped (or its session ended) at
+  uint32_t timer_next; // other connections in the same wheel slot
+  uint32_t timer_prev;
+  uint16_t timer_slot; // level * CHAT_WHEEL_SLOTS + slot
+  uint8_t compress_level; // monitor's MON_COMPRESSED level, 0 if it gets messages as they are
+  uint32_t message_full_at; // rate limit buckets, as times they are full again
+  uint32_t byte_full_at;
+};
+
+/**
+ * Connection records, never moved once allocated, so pointers to them
+ * stay good until the record is freed.
+ */
+struct ConnectionSlab {
+  std::vector<struct ChatConnection *> slabs;
+  uint32_t free_head; // UINT32_MAX when every record is in use
+  uint32_t used;
+};
+
+/**
+ * A pool chunk: a run of bytes [start, end) in data, and the next
+ * chunk of the same chain.
+ */
+struct ChatChunk {
+  uint32_t next;
+  uint16_t start;
+  uint16_t end;
+  char data[CHAT_CHUNK_DATA];
+};
+
+/**
+ * Shared pool of chunks. Handles are 1-based indexes, CHAT_NO_CHUNK
+ * is never handed out.
+ */
+struct ChunkPool {
+  std::vector<struct ChatChunk *> blocks;
+  uint32_t free_head;
+  uint32_t allocated;
+  uint32_t in_use;
+};
+
+/**
+ * Open addressed multimap from nickname to connection id. Each slot is
+ * the nickname's hash and id + 1; 0 is empty, id UINT32_MAX a deleted slot.
+ */
+struct NickTable {
+  uint64_t *slots;
+  uint32_t mask;
+  uint32_t count;
+  uint32_t deleted;
+};
+
+static_assert(sizeof(struct ChatNickname) == 16, "nickname is two words");
+static_assert(sizeof(struct ChatConnection) == 64, "connection record size");
+static_assert(sizeof(struct ChatChunk) == CHAT_CHUNK_SIZE, "chunk size");
+
+/**
+ * Set a nickname, replacing (and freeing) any old one.
+ */
+void set_nickname(struct ChatNickname *nickname, const char *name, uint16_t len);
+
+/**
+ * Release a nickname's heap copy, if any, and empty it.
+ */
+void clear_nickname(struct ChatNickname *nickname);
+
+static inline const char *nickname_data(const struct ChatNickname *nickname) {
+  const char *heap;
+
+  if (nickname->len <= CHAT_INLINE_NICKNAME) {
+    return nickname->inline_chars;
+  }
+  __builtin_memcpy(&heap, nickname->inline_chars, sizeof(heap));
+  return heap;
+}
+
+bool nickname_equals(const struct ChatNickname *nickname, const char *name, uint16_t len);
+
+/**
+ * 32 bit FNV-1a, for NickTable.
+ */
+uint32_t nickname_hash(const char *name, uint16_t len);
+
+void init_connection_slab(struct ConnectionSlab *slab);
+
+void free_connection_slab(struct ConnectionSlab *slab);
+
+/**
+ * Take a zeroed record, growing the slab by CHAT_SLAB_RECORDS if needed.
+ *
+ * @param id set to the record's id
+ * @return the record, or NULL if out of memory
+ */
+struct ChatConnection *alloc_connection(struct ConnectionSlab *slab, uint32_t *id);
+
+/**
+ * Return a record. Its nickname must already be cleared and its
+ * chunks returned.
+ */
+void free_connection(struct ConnectionSlab *slab, uint32_t id);
+
+static inline struct ChatConnection *connection_at(const struct ConnectionSlab *slab, uint32_t id) {
+  return &slab->slabs[id >> CHAT_SLAB_SHIFT][id & (CHAT_SLAB_RECORDS - 1)];
+}
+
+/**
+ * Bytes of connection records allocated, in use or not.
+ */
+size_t connection_slab_bytes(const struct ConnectionSlab *slab);
+
+void init_chunk_pool(struct ChunkPool *pool);
+
+void free_chunk_pool(struct ChunkPool *pool);
+
+/**
+ * Borrow an empty chunk.
+ *
+ * @return its handle, or CHAT_NO_CHUNK if out of memory
+ */
+uint32_t borrow_chunk(struct ChunkPool *pool);
+
+/**
+ * Give back a whole chain of chunks, starting at handle.
+ */
+void return_chunks(struct ChunkPool *pool, uint32_t handle);
+
+static inline struct ChatChunk *chunk_at(const struct ChunkPool *pool, uint32_t handle) {
+  return &pool->blocks[(handle - 1) / CHAT_CHUNKS_PER_BLOCK][(handle - 1) % CHAT_CHUNKS_PER_BLOCK];
+}
+
+/**
+ * @param capacity starting number of slots, a power of two
+ * @return 0 on success, -1 if out of memory
+ */
+int init_nick_table(struct NickTable *table, uint32_t capacity);
+
+void free_nick_table(struct NickTable *table);
+
+/**
+ * Add an id under a nickname hash; duplicates are allowed.
+ *
+ * @return 0 on success, -1 if out of memory
+ */
+int nick_table_add(struct NickTable *table, uint32_t hash, uint32_t id);
+
+/**
+ * Remove one id from under a nickname hash.
+ */
+void nick_table_remove(struct NickTable *table, uint32_t hash, uint32_t id);
+
+/**
+ * Walk the ids filed under a hash. Start with *pos = 0; each call
+ * returns the next candidate id, which may belong to another nickname
+ * with the same hash, so check the name.
+ *
+ * @return true if *id was set, false once there are no more
+ */
+bool nick_table_next(const struct NickTable *table, uint32_t hash, uint32_t *pos, uint32_t *id);
+
+#endif //TCP_CHAT_CHAT_CONNECTIONS_H
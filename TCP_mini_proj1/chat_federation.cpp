@@ -0,0 +1,1045 @@
+#include "chat_federation.h"
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+
+#include "chat_wire.h"
+#include "tcp_utils.h"
+
+// epoll data of the wake eventfd and the node port; links carry their index
+#define WAKE_TAG UINT64_MAX
+#define LISTEN_TAG (UINT64_MAX - 1)
+
+// Records taken from each worker's ring per pass, so links are not
+// starved while the workers keep pushing
+#define DRAIN_BATCH 4096
+
+// Sent bytes kept at the front of a link's queue before they are cut off
+#define OUT_COMPACT_BYTES (1024 * 1024)
+
+#define EPOCH_LEN 8
+
+static uint64_t monotonic_ms() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static uint64_t read_gauge(const void *arg) {
+  return ((const std::atomic<uint64_t> *)arg)->load(std::memory_order_relaxed);
+}
+
+static std::string directory_key(uint16_t flags, uint32_t origin, const char *nickname, uint16_t nickname_len) {
+  std::string key(1 + sizeof(origin) + nickname_len, '\0');
+
+  key[0] = (char)flags;
+  memcpy(&key[1], &origin, sizeof(origin));
+  memcpy(&key[1 + sizeof(origin)], nickname, nickname_len);
+  return key;
+}
+
+static uint32_t key_origin(const std::string &key) {
+  uint32_t origin;
+
+  memcpy(&origin, &key[1], sizeof(origin));
+  return origin;
+}
+
+static std::string key_nickname(const std::string &key) {
+  return key.substr(1 + sizeof(uint32_t));
+}
+
+static std::string describe_link(const struct ChatNodeLink *link) {
+  if (link->peer != 0) {
+    return "node " + std::to_string(link->peer);
+  }
+  return link->dialled ? link->host + ":" + link->port : link->host;
+}
+
+static void update_events(struct ChatFederation *federation, int index) {
+  struct ChatNodeLink *link = &federation->links[index];
+  struct epoll_event event;
+
+  event.events = (federation->paused ? 0 : (uint32_t)EPOLLIN) | (link->want_write ? (uint32_t)EPOLLOUT : 0);
+  event.data.u64 = (uint64_t)index;
+  epoll_ctl(federation->epoll_fd, EPOLL_CTL_MOD, link->fd, &event);
+}
+
+static void set_want_write(struct ChatFederation *federation, int index, bool want) {
+  if (federation->links[index].want_write == want) {
+    return;
+  }
+  federation->links[index].want_write = want;
+  update_events(federation, index);
+}
+
+/**
+ * @return true if every worker's ring can take what one read of a
+ *         link pushes to it
+ */
+static bool workers_have_room(struct ChatFederation *federation) {
+  for (int w = 0; w < federation->num_workers; ++w) {
+    if (relay_room(federation->to_workers[w]) < CHAT_NODE_WORKER_ROOM) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Stop or start reading every link.
+ */
+static void pause_links(struct ChatFederation *federation, bool pause) {
+  federation->paused = pause;
+  for (size_t i = 0; i < federation->links.size(); ++i) {
+    if (federation->links[i].fd >= 0 && !federation->links[i].connecting) {
+      update_events(federation, (int)i);
+    }
+  }
+}
+
+/**
+ * Close a link, forgetting the routes over it, and dial it again in a
+ * while if it is to a --peer.
+ */
+static void drop_link(struct ChatFederation *federation, int index, const char *reason) {
+  struct ChatNodeLink *link = &federation->links[index];
+
+  if (link->fd < 0) {
+    return;
+  }
+  if (!link->connecting) {
+    std::cout << "Link to " << describe_link(link) << " dropped: " << reason << std::endl;
+    metrics_add(federation->metrics, federation->ids.link_drops, 1);
+  }
+  epoll_ctl(federation->epoll_fd, EPOLL_CTL_DEL, link->fd, NULL);
+  close(link->fd);
+  link->fd = -1;
+  link->connecting = false;
+  link->want_write = false;
+  link->peer = 0;
+  link->in.clear();
+  link->out.clear();
+  link->out_sent = 0;
+  for (auto it = federation->nodes.begin(); it != federation->nodes.end(); ++it) {
+    if (it->second.link == index) {
+      it->second.link = -1;
+    }
+  }
+  if (link->dialled) {
+    link->dial_at_ms = monotonic_ms() + reconnect_delay_ms(link->attempt++, RECONNECT_BASE_MS, RECONNECT_MAX_MS);
+  }
+}
+
+/**
+ * Build a node message in frame_buf.
+ *
+ * @return the message's length
+ */
+static size_t build_node_message(struct ChatFederation *federation, uint16_t type, uint16_t flags, uint32_t origin,
+                                 uint64_t seq, uint16_t hops, const char *target, uint16_t target_len,
+                                 const char *frame, uint32_t frame_len) {
+  struct ChatNodeMsg message;
+  size_t len;
+
+  message.type = type;
+  message.flags = flags;
+  message.origin = origin;
+  message.seq = seq;
+  message.hops = hops;
+  message.target_len = target_len;
+  message.frame_len = frame_len;
+  len = ChatNodeCodec::encode(message, federation->frame_buf, ChatNodeCodec::wire_size);
+  memcpy(&federation->frame_buf[len], target, target_len);
+  len += target_len;
+  memcpy(&federation->frame_buf[len], frame, frame_len);
+  return len + frame_len;
+}
+
+/**
+ * Queue frame_buf to a link that is up, to be sent at the end of the
+ * pass.
+ */
+static void queue_to_link(struct ChatFederation *federation, int index, size_t len) {
+  struct ChatNodeLink *link = &federation->links[index];
+
+  if (link->fd < 0 || link->connecting) {
+    return;
+  }
+  if (link->out.size() - link->out_sent + len > CHAT_NODE_MAX_BACKLOG) {
+    drop_link(federation, index, "too far behind");
+    return;
+  }
+  link->out.insert(link->out.end(), federation->frame_buf, federation->frame_buf + len);
+}
+
+/**
+ * Queue frame_buf to every link but except, -1 for none.
+ */
+static void flood(struct ChatFederation *federation, int except, size_t len) {
+  for (int i = 0; i < (int)federation->links.size(); ++i) {
+    if (i != except) {
+      queue_to_link(federation, i, len);
+    }
+  }
+}
+
+static void push_to_workers(struct ChatFederation *federation, uint16_t kind, const char *target,
+                            uint16_t target_len, const char *frame, uint32_t frame_len) {
+  for (int w = 0; w < federation->num_workers; ++w) {
+    if (relay_push(federation->to_workers[w], kind, target, target_len, frame, frame_len)) {
+      federation->wake_workers |= 1ull << w;
+    } else {
+      metrics_add(federation->metrics, federation->ids.relay_drops, 1);
+    }
+  }
+}
+
+/**
+ * Find or start what is known of a node.
+ */
+static struct ChatNodeState *known_node(struct ChatFederation *federation, uint32_t origin) {
+  auto it = federation->nodes.find(origin);
+
+  if (it == federation->nodes.end()) {
+    it = federation->nodes.emplace(origin, ChatNodeState()).first;
+    memset(&it->second, 0, sizeof(it->second));
+    it->second.link = -1;
+    // Its ANNOUNCE may be a little behind what was heard of it first
+    it->second.heard_ms = monotonic_ms();
+  }
+  return &it->second;
+}
+
+/**
+ * Mark one of a node's numbers seen.
+ *
+ * @return false if it was already, or is from its last run or too old
+ *         to tell
+ */
+static bool first_sighting(struct ChatNodeState *node, uint64_t seq) {
+  uint64_t bit;
+
+  if (seq < node->epoch) {
+    return false;
+  }
+  if (seq > node->top) {
+    if (seq - node->top >= CHAT_NODE_SEEN) {
+      memset(node->seen, 0, sizeof(node->seen));
+    } else {
+      for (uint64_t s = node->top + 1; s <= seq; ++s) {
+        node->seen[(s % CHAT_NODE_SEEN) / 64] &= ~(1ull << (s % 64));
+      }
+    }
+    node->top = seq;
+  } else if (node->top - seq >= CHAT_NODE_SEEN) {
+    return false;
+  }
+  bit = 1ull << (seq % 64);
+  if (node->seen[(seq % CHAT_NODE_SEEN) / 64] & bit) {
+    return false;
+  }
+  node->seen[(seq % CHAT_NODE_SEEN) / 64] |= bit;
+  return true;
+}
+
+static void add_monitor_node(struct ChatFederation *federation, const std::string &nickname, uint32_t origin) {
+  federation->monitor_nodes[nickname].push_back(origin);
+}
+
+static void remove_monitor_node(struct ChatFederation *federation, const std::string &nickname, uint32_t origin) {
+  auto it = federation->monitor_nodes.find(nickname);
+
+  if (it == federation->monitor_nodes.end()) {
+    return;
+  }
+  for (size_t i = 0; i < it->second.size(); ++i) {
+    if (it->second[i] == origin) {
+      it->second[i] = it->second.back();
+      it->second.pop_back();
+      break;
+    }
+  }
+  if (it->second.empty()) {
+    federation->monitor_nodes.erase(it);
+  }
+}
+
+/**
+ * Log another node's client nickname coming or going, so the member
+ * lists the workers answer with cover the whole federation.
+ */
+static void log_remote_member(struct ChatFederation *federation, uint16_t flags, uint32_t origin,
+                              const char *nickname, uint16_t nickname_len, bool present) {
+  if ((flags & CHAT_NODE_MONITOR) || origin == federation->node_id) {
+    return;
+  }
+  federation->wake_workers |= log_member_change(federation->group, present, nickname, nickname_len);
+}
+
+/**
+ * Take a directory entry if it is newer than the one there.
+ *
+ * @return false if it was not
+ */
+static bool apply_entry(struct ChatFederation *federation, uint16_t flags, uint32_t origin, uint64_t seq,
+                        const char *nickname, uint16_t nickname_len, bool present) {
+  std::string key = directory_key(flags, origin, nickname, nickname_len);
+  auto it = federation->directory.find(key);
+  bool was_present = false;
+
+  if (it != federation->directory.end()) {
+    if (seq <= it->second.seq) {
+      return false;
+    }
+    was_present = it->second.present;
+  }
+  federation->directory[key] = {seq, present};
+  if ((flags & CHAT_NODE_MONITOR) && origin != federation->node_id && present != was_present) {
+    if (present) {
+      add_monitor_node(federation, std::string(nickname, nickname_len), origin);
+    } else {
+      remove_monitor_node(federation, std::string(nickname, nickname_len), origin);
+    }
+  }
+  if (present != was_present) {
+    log_remote_member(federation, flags, origin, nickname, nickname_len, present);
+  }
+  return true;
+}
+
+/**
+ * Drop a node's directory entries numbered before seq.
+ */
+static void forget_entries(struct ChatFederation *federation, uint32_t origin, uint64_t before) {
+  for (auto it = federation->directory.begin(); it != federation->directory.end();) {
+    if (key_origin(it->first) != origin || it->second.seq >= before) {
+      ++it;
+      continue;
+    }
+    if (it->second.present) {
+      std::string nickname = key_nickname(it->first);
+      if (it->first[0] & CHAT_NODE_MONITOR) {
+        remove_monitor_node(federation, nickname, origin);
+      }
+      log_remote_member(federation, (uint8_t)it->first[0], origin, nickname.data(), (uint16_t)nickname.size(), false);
+    }
+    it = federation->directory.erase(it);
+  }
+}
+
+/**
+ * Send a direct message on towards the nodes with monitors of its
+ * target nickname, or everywhere if the way to one of them is not
+ * known.
+ *
+ * @param from link it came in on, -1 if from here
+ */
+static void route_direct(struct ChatFederation *federation, int from, uint32_t origin, uint64_t seq, uint16_t hops,
+                         const char *nickname, uint16_t nickname_len, const char *frame, uint32_t frame_len) {
+  auto owners = federation->monitor_nodes.find(std::string(nickname, nickname_len));
+  std::vector<int> targets;
+  bool flooding = false;
+  size_t len;
+
+  if (owners == federation->monitor_nodes.end() || hops >= CHAT_NODE_MAX_HOPS) {
+    return;
+  }
+  for (size_t i = 0; i < owners->second.size() && !flooding; ++i) {
+    auto node = federation->nodes.find(owners->second[i]);
+    int link = node != federation->nodes.end() ? node->second.link : -1;
+
+    if (owners->second[i] == origin) {
+      continue;
+    }
+    if (link < 0) {
+      flooding = true;
+    } else if (link != from && std::find(targets.begin(), targets.end(), link) == targets.end()) {
+      targets.push_back(link);
+    }
+  }
+  if (!flooding && targets.empty()) {
+    return;
+  }
+  if (from < 0) {
+    metrics_add(federation->metrics, federation->ids.directs_out, 1);
+  }
+  len = build_node_message(federation, NODE_DIRECT, 0, origin, seq, hops, nickname, nickname_len, frame, frame_len);
+  if (flooding) {
+    flood(federation, from, len);
+    return;
+  }
+  for (size_t i = 0; i < targets.size(); ++i) {
+    queue_to_link(federation, targets[i], len);
+  }
+}
+
+/**
+ * Pass a message on over every other link, one hop further.
+ */
+static void forward(struct ChatFederation *federation, int from, const struct ChatNodeMsg *message,
+                    const char *target, const char *frame) {
+  size_t len;
+
+  if (message->hops + 1 >= CHAT_NODE_MAX_HOPS) {
+    return;
+  }
+  len = build_node_message(federation, message->type, message->flags, message->origin, message->seq,
+                           message->hops + 1, target, message->target_len, frame, message->frame_len);
+  flood(federation, from, len);
+}
+
+static void send_announce(struct ChatFederation *federation, int link) {
+  char epoch[EPOCH_LEN];
+  size_t len;
+
+  wire::store_be<uint64_t>((uint8_t *)epoch, federation->epoch);
+  len = build_node_message(federation, NODE_ANNOUNCE, 0, federation->node_id, federation->next_seq++, 0, NULL, 0,
+                           epoch, EPOCH_LEN);
+  if (link < 0) {
+    flood(federation, -1, len);
+  } else {
+    queue_to_link(federation, link, len);
+  }
+}
+
+/**
+ * Start a link that has just connected: who this node is, then the
+ * whole directory.
+ */
+static void link_up(struct ChatFederation *federation, int index) {
+  struct ChatNodeLink *link = &federation->links[index];
+  std::string nickname;
+  size_t len;
+  int one = 1;
+
+  link->connecting = false;
+  link->attempt = 0;
+  setsockopt(link->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  len = build_node_message(federation, NODE_HELLO, 0, federation->node_id, federation->epoch, 0, NULL, 0, NULL, 0);
+  queue_to_link(federation, index, len);
+  send_announce(federation, index);
+  for (auto it = federation->directory.begin(); it != federation->directory.end(); ++it) {
+    nickname = key_nickname(it->first);
+    len = build_node_message(federation, it->second.present ? NODE_JOIN : NODE_LEAVE, (uint8_t)it->first[0],
+                             key_origin(it->first), it->second.seq, 0, nickname.data(), (uint16_t)nickname.size(),
+                             NULL, 0);
+    queue_to_link(federation, index, len);
+  }
+}
+
+static void handle_announce(struct ChatFederation *federation, int from, const struct ChatNodeMsg *message,
+                            const char *frame) {
+  uint64_t epoch = wire::load_be<uint64_t>((const uint8_t *)frame);
+  struct ChatNodeState *node;
+
+  if (message->origin == federation->node_id) {
+    return;
+  }
+  node = known_node(federation, message->origin);
+  if (epoch < node->epoch) {
+    return;
+  }
+  if (epoch > node->epoch) {
+    std::cout << (node->epoch == 0 ? "Heard from node " : "Node restarted: ") << message->origin << std::endl;
+    forget_entries(federation, message->origin, epoch);
+    node->epoch = epoch;
+    node->top = 0;
+    memset(node->seen, 0, sizeof(node->seen));
+  }
+  if (!first_sighting(node, message->seq)) {
+    return;
+  }
+  // First to arrive came the quickest way
+  node->link = from;
+  node->heard_ms = monotonic_ms();
+  forward(federation, from, message, NULL, frame);
+}
+
+static void handle_presence(struct ChatFederation *federation, int from, const struct ChatNodeMsg *message,
+                            const char *nickname) {
+  if (message->origin == federation->node_id || message->seq < known_node(federation, message->origin)->epoch) {
+    return;
+  }
+  if (!apply_entry(federation, message->flags & CHAT_NODE_MONITOR, message->origin, message->seq, nickname,
+                   message->target_len, message->type == NODE_JOIN)) {
+    return;
+  }
+  metrics_add(federation->metrics, federation->ids.directory_events, 1);
+  forward(federation, from, message, nickname, NULL);
+}
+
+/**
+ * @return false if the message came from here or was seen before
+ */
+static bool first_arrival(struct ChatFederation *federation, const struct ChatNodeMsg *message) {
+  if (message->origin == federation->node_id ||
+      !first_sighting(known_node(federation, message->origin), message->seq)) {
+    metrics_add(federation->metrics, federation->ids.duplicates, 1);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @return false if the link was dropped
+ */
+static bool handle_node_message(struct ChatFederation *federation, int from, const struct ChatNodeMsg *message,
+                                const char *target, const char *frame) {
+  struct ChatNodeLink *link = &federation->links[from];
+  std::string key;
+
+  switch (message->type) {
+    case NODE_HELLO:
+      if (message->origin == federation->node_id) {
+        std::cout << "Link to " << describe_link(link) << " is to this node, not dialling it again" << std::endl;
+        link->dialled = false;
+        drop_link(federation, from, "loops back");
+        return false;
+      }
+      link->peer = message->origin;
+      std::cout << "Linked to node " << link->peer << std::endl;
+      break;
+    case NODE_ANNOUNCE:
+      if (message->frame_len != EPOCH_LEN) {
+        drop_link(federation, from, "bad ANNOUNCE");
+        return false;
+      }
+      handle_announce(federation, from, message, frame);
+      break;
+    case NODE_JOIN:
+    case NODE_LEAVE:
+      handle_presence(federation, from, message, target);
+      break;
+    case NODE_BROADCAST:
+      if (!first_arrival(federation, message)) {
+        break;
+      }
+      metrics_add(federation->metrics, federation->ids.broadcasts_in, 1);
+      push_to_workers(federation, RELAY_BROADCAST, NULL, 0, frame, message->frame_len);
+      forward(federation, from, message, NULL, frame);
+      break;
+    case NODE_DIRECT:
+      if (!first_arrival(federation, message)) {
+        break;
+      }
+      metrics_add(federation->metrics, federation->ids.directs_in, 1);
+      key = (char)CHAT_NODE_MONITOR + std::string(target, message->target_len);
+      if (federation->local.count(key) > 0) {
+        push_to_workers(federation, RELAY_DIRECT, target, message->target_len, frame, message->frame_len);
+      }
+      route_direct(federation, from, message->origin, message->seq, message->hops + 1, target, message->target_len,
+                   frame, message->frame_len);
+      break;
+    default:
+      drop_link(federation, from, "unknown message type");
+      return false;
+  }
+  return true;
+}
+
+static void read_link(struct ChatFederation *federation, int index) {
+  struct ChatNodeLink *link = &federation->links[index];
+  struct ChatNodeMsg message;
+  size_t have = link->in.size();
+  size_t offset = 0;
+  size_t len;
+  ssize_t received;
+
+  link->in.resize(have + CHAT_NODE_RECV_SIZE);
+  received = recv(link->fd, &link->in[have], CHAT_NODE_RECV_SIZE, 0);
+  if (received <= 0) {
+    link->in.resize(have);
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      return;
+    }
+    drop_link(federation, index, received == 0 ? "closed by peer" : strerror(errno));
+    return;
+  }
+  link->in.resize(have + received);
+  metrics_add(federation->metrics, federation->ids.bytes_in, received);
+
+  while (link->in.size() - offset >= ChatNodeCodec::wire_size) {
+    ChatNodeCodec::decode(&link->in[offset], link->in.size() - offset, message);
+    if (message.frame_len > CHAT_MAX_FRAME) {
+      drop_link(federation, index, "message too long");
+      return;
+    }
+    len = ChatNodeCodec::wire_size + message.target_len + message.frame_len;
+    if (link->in.size() - offset < len) {
+      break;
+    }
+    const char *target = &link->in[offset + ChatNodeCodec::wire_size];
+    if (!handle_node_message(federation, index, &message, target, target + message.target_len)) {
+      return;
+    }
+    offset += len;
+  }
+  link->in.erase(link->in.begin(), link->in.begin() + offset);
+}
+
+static void flush_link(struct ChatFederation *federation, int index) {
+  struct ChatNodeLink *link = &federation->links[index];
+  ssize_t sent;
+
+  if (link->fd < 0 || link->connecting || link->out_sent == link->out.size()) {
+    return;
+  }
+  sent = send(link->fd, &link->out[link->out_sent], link->out.size() - link->out_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+  if (sent < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      drop_link(federation, index, strerror(errno));
+      return;
+    }
+    sent = 0;
+  }
+  metrics_add(federation->metrics, federation->ids.bytes_out, sent);
+  link->out_sent += sent;
+  if (link->out_sent == link->out.size()) {
+    link->out.clear();
+    link->out_sent = 0;
+    set_want_write(federation, index, false);
+    return;
+  }
+  if (link->out_sent >= OUT_COMPACT_BYTES) {
+    link->out.erase(link->out.begin(), link->out.begin() + link->out_sent);
+    link->out_sent = 0;
+  }
+  set_want_write(federation, index, true);
+}
+
+static void add_to_epoll(struct ChatFederation *federation, int index, uint32_t events) {
+  struct epoll_event event;
+
+  event.events = events;
+  event.data.u64 = (uint64_t)index;
+  epoll_ctl(federation->epoll_fd, EPOLL_CTL_ADD, federation->links[index].fd, &event);
+}
+
+/**
+ * Start connecting a --peer link.
+ */
+static void dial(struct ChatFederation *federation, int index) {
+  struct ChatNodeLink *link = &federation->links[index];
+  struct addrinfo hints;
+  struct addrinfo *results;
+  int fd;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(link->host.c_str(), link->port.c_str(), &hints, &results) != 0) {
+    link->dial_at_ms = monotonic_ms() + reconnect_delay_ms(link->attempt++, RECONNECT_BASE_MS, RECONNECT_MAX_MS);
+    return;
+  }
+  fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+  if (fd >= 0 && connect(fd, results->ai_addr, results->ai_addrlen) == -1 && errno != EINPROGRESS) {
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(results);
+  if (fd < 0) {
+    link->dial_at_ms = monotonic_ms() + reconnect_delay_ms(link->attempt++, RECONNECT_BASE_MS, RECONNECT_MAX_MS);
+    return;
+  }
+  link->fd = fd;
+  link->connecting = true;
+  link->want_write = true;
+  add_to_epoll(federation, index, EPOLLIN | EPOLLOUT);
+}
+
+static void finish_connect(struct ChatFederation *federation, int index) {
+  struct ChatNodeLink *link = &federation->links[index];
+  int error = 0;
+  socklen_t error_len = sizeof(error);
+
+  getsockopt(link->fd, SOL_SOCKET, SO_ERROR, &error, &error_len);
+  if (error != 0) {
+    if (link->attempt == 0) {
+      std::cout << "Could not reach " << link->host << ":" << link->port << ": " << strerror(error)
+                << ", trying again" << std::endl;
+    }
+    drop_link(federation, index, strerror(error));
+    return;
+  }
+  set_want_write(federation, index, false);
+  link_up(federation, index);
+}
+
+static void accept_links(struct ChatFederation *federation) {
+  struct sockaddr_storage addr;
+  socklen_t addr_len = sizeof(addr);
+  const char *name;
+  int fd;
+  int index;
+
+  while ((fd = accept4(federation->listen_socket, (struct sockaddr *)&addr, &addr_len,
+                       SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    // Reuse the slot of a link that came in and went
+    for (index = 0; index < (int)federation->links.size(); ++index) {
+      if (!federation->links[index].dialled && federation->links[index].fd < 0) {
+        break;
+      }
+    }
+    if (index == (int)federation->links.size()) {
+      federation->links.push_back(ChatNodeLink());
+      federation->links[index].dialled = false;
+    }
+    federation->links[index].fd = fd;
+    federation->links[index].connecting = false;
+    federation->links[index].want_write = false;
+    federation->links[index].peer = 0;
+    federation->links[index].out_sent = 0;
+    name = printable_address(&addr, addr_len);
+    federation->links[index].host = name != NULL ? name : "a node";
+    addr_len = sizeof(addr);
+    add_to_epoll(federation, index, federation->paused ? 0 : (uint32_t)EPOLLIN);
+    link_up(federation, index);
+  }
+}
+
+/**
+ * Tell the others a nickname came or went here, if it is the first or
+ * last connection here with it.
+ */
+static void count_local(struct ChatFederation *federation, uint16_t flags, const char *nickname,
+                        uint16_t nickname_len, bool join) {
+  std::string key = (char)flags + std::string(nickname, nickname_len);
+  uint64_t seq;
+  size_t len;
+
+  if (join) {
+    if (federation->local[key]++ > 0) {
+      return;
+    }
+  } else {
+    auto it = federation->local.find(key);
+    if (it == federation->local.end() || --it->second > 0) {
+      return;
+    }
+    federation->local.erase(it);
+  }
+  seq = federation->next_seq++;
+  apply_entry(federation, flags, federation->node_id, seq, nickname, nickname_len, join);
+  len = build_node_message(federation, join ? NODE_JOIN : NODE_LEAVE, flags, federation->node_id, seq, 0, nickname,
+                           nickname_len, NULL, 0);
+  flood(federation, -1, len);
+}
+
+/**
+ * Take what the workers pushed.
+ *
+ * @return true if a ring had more than DRAIN_BATCH records waiting
+ */
+static bool drain_workers(struct ChatFederation *federation) {
+  const struct RelayRecord *record;
+  bool more = false;
+  size_t len;
+  int taken;
+
+  for (int w = 0; w < federation->num_workers; ++w) {
+    for (taken = 0; taken < DRAIN_BATCH && (record = relay_peek(federation->from_workers[w])) != NULL; ++taken) {
+      switch (record->kind) {
+        case RELAY_BROADCAST:
+          len = build_node_message(federation, NODE_BROADCAST, 0, federation->node_id, federation->next_seq++, 0,
+                                   NULL, 0, relay_frame(record), record->frame_len);
+          flood(federation, -1, len);
+          metrics_add(federation->metrics, federation->ids.broadcasts_out, 1);
+          break;
+        case RELAY_DIRECT:
+          route_direct(federation, -1, federation->node_id, federation->next_seq++, 0, relay_target(record),
+                       record->target_len, relay_frame(record), record->frame_len);
+          break;
+        case RELAY_MEMBER_JOIN:
+        case RELAY_MEMBER_LEAVE:
+          count_local(federation, 0, relay_target(record), record->target_len, record->kind == RELAY_MEMBER_JOIN);
+          break;
+        case RELAY_MONITOR_JOIN:
+        case RELAY_MONITOR_LEAVE:
+          count_local(federation, CHAT_NODE_MONITOR, relay_target(record), record->target_len,
+                      record->kind == RELAY_MONITOR_JOIN);
+          break;
+      }
+      relay_pop(federation->from_workers[w], record);
+    }
+    more |= taken == DRAIN_BATCH;
+  }
+  return more;
+}
+
+/**
+ * Forget the nodes that have not been heard of for CHAT_NODE_EXPIRE_MS,
+ * and what they had in the directory.
+ */
+static void expire_nodes(struct ChatFederation *federation, uint64_t now) {
+  for (auto it = federation->nodes.begin(); it != federation->nodes.end();) {
+    if (now - it->second.heard_ms < CHAT_NODE_EXPIRE_MS) {
+      ++it;
+      continue;
+    }
+    std::cout << "Lost node " << it->first << std::endl;
+    forget_entries(federation, it->first, UINT64_MAX);
+    it = federation->nodes.erase(it);
+  }
+}
+
+static void publish_stats(struct ChatFederation *federation) {
+  uint64_t up = 0;
+
+  for (size_t i = 0; i < federation->links.size(); ++i) {
+    up += federation->links[i].fd >= 0 && !federation->links[i].connecting;
+  }
+  federation->links_up.store(up, std::memory_order_relaxed);
+  federation->known_nodes.store(federation->nodes.size(), std::memory_order_relaxed);
+  federation->directory_size.store(federation->directory.size(), std::memory_order_relaxed);
+}
+
+static void run_federation(struct ChatFederation *federation, const std::atomic<bool> *stop) {
+  struct epoll_event events[CHAT_MAX_EVENTS];
+  struct ChatNodeLink *link;
+  uint64_t wakes;
+  uint64_t now;
+  bool more = false;
+  int num_events;
+  int index;
+
+  while (!stop->load()) {
+    // Nothing says when the workers have caught up, so look again soon
+    num_events = epoll_wait(federation->epoll_fd, events, CHAT_MAX_EVENTS, more ? 0 : federation->paused ? 1 : 100);
+    if (num_events < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      handle_error("epoll_wait");
+      return;
+    }
+    for (int i = 0; i < num_events; ++i) {
+      if (events[i].data.u64 == WAKE_TAG) {
+        if (read(federation->wake_fd, &wakes, sizeof(wakes)) < 0) {
+          wakes = 0;
+        }
+        continue;
+      }
+      if (events[i].data.u64 == LISTEN_TAG) {
+        accept_links(federation);
+        continue;
+      }
+      index = (int)events[i].data.u64;
+      link = &federation->links[index];
+      if (link->fd < 0) {
+        continue;
+      }
+      if (link->connecting) {
+        finish_connect(federation, index);
+        continue;
+      }
+      if (events[i].events & EPOLLOUT) {
+        flush_link(federation, index);
+      }
+      if (link->fd >= 0 && !federation->paused && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        if (workers_have_room(federation)) {
+          read_link(federation, index);
+        } else {
+          pause_links(federation, true);
+        }
+      }
+    }
+    if (federation->paused && workers_have_room(federation)) {
+      pause_links(federation, false);
+    }
+    more = drain_workers(federation);
+
+    now = monotonic_ms();
+    if (now >= federation->announce_at_ms) {
+      send_announce(federation, -1);
+      expire_nodes(federation, now);
+      federation->announce_at_ms = now + CHAT_NODE_ANNOUNCE_MS;
+    }
+    for (size_t i = 0; i < federation->links.size(); ++i) {
+      link = &federation->links[i];
+      if (link->dialled && link->fd < 0 && now >= link->dial_at_ms) {
+        dial(federation, (int)i);
+      }
+    }
+    // Everything queued this pass goes in one send() per link
+    for (size_t i = 0; i < federation->links.size(); ++i) {
+      flush_link(federation, (int)i);
+    }
+    for (int w = 0; federation->wake_workers != 0; ++w) {
+      if (federation->wake_workers & (1ull << w)) {
+        wake_chat_worker(federation->group->workers[w]);
+        federation->wake_workers &= ~(1ull << w);
+      }
+    }
+    publish_stats(federation);
+  }
+}
+
+/**
+ * @return the listening socket, or -1 on failure
+ */
+static int listen_on_node_port(const char *ip, const char *port) {
+  struct sockaddr_in address;
+  std::string ip_string(ip);
+  std::string port_string(port);
+  int reuse = 1;
+  int fd;
+
+  if (convert_ip_port_to_sockaddr_in(&ip_string[0], &port_string[0], &address) == -1) {
+    errno = EINVAL;
+    return -1;
+  }
+  fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+  if (fd < 0) {
+    return -1;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  if (bind(fd, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(fd, 64) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void register_federation_metrics(struct ChatFederation *federation, struct MetricsRegistry *registry) {
+  struct ChatFederationMetricIds *ids = &federation->ids;
+
+  ids->link_drops = metrics_counter(registry, "federation.link_drops");
+  ids->broadcasts_out = metrics_counter(registry, "federation.broadcasts_out");
+  ids->broadcasts_in = metrics_counter(registry, "federation.broadcasts_in");
+  ids->directs_out = metrics_counter(registry, "federation.directs_out");
+  ids->directs_in = metrics_counter(registry, "federation.directs_in");
+  ids->duplicates = metrics_counter(registry, "federation.duplicates");
+  ids->directory_events = metrics_counter(registry, "federation.directory_events");
+  ids->relay_drops = metrics_counter(registry, "federation.relay_drops");
+  ids->bytes_out = metrics_counter(registry, "federation.bytes_out");
+  ids->bytes_in = metrics_counter(registry, "federation.bytes_in");
+  metrics_gauge(registry, "federation.links", read_gauge, &federation->links_up);
+  metrics_gauge(registry, "federation.nodes", read_gauge, &federation->known_nodes);
+  metrics_gauge(registry, "federation.directory", read_gauge, &federation->directory_size);
+}
+
+int init_chat_federation(struct ChatFederation *federation, const struct ChatFederationConfig *config,
+                         struct ChatWorkerGroup *group, struct MetricsRegistry *registry) {
+  struct epoll_event event;
+  size_t colon;
+
+  if (config->node_id == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  federation->node_id = config->node_id;
+  federation->epoch = realtime_ns();
+  federation->next_seq = federation->epoch;
+  federation->group = group;
+  federation->num_workers = group->num_workers;
+  federation->wake_workers = 0;
+  federation->paused = false;
+  federation->announce_at_ms = 0;
+  federation->links_up.store(0);
+  federation->known_nodes.store(0);
+  federation->directory_size.store(0);
+  federation->frame_buf = (char *)malloc(ChatNodeCodec::wire_size + UINT16_MAX + CHAT_MAX_FRAME);
+  if (federation->frame_buf == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  for (size_t i = 0; i < config->peers.size(); ++i) {
+    colon = config->peers[i].rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 == config->peers[i].size()) {
+      errno = EINVAL;
+      return -1;
+    }
+    federation->links.push_back(ChatNodeLink());
+    struct ChatNodeLink *link = &federation->links.back();
+    link->fd = -1;
+    link->connecting = false;
+    link->dialled = true;
+    link->host = config->peers[i].substr(0, colon);
+    link->port = config->peers[i].substr(colon + 1);
+    link->attempt = 0;
+    link->dial_at_ms = 0;
+    link->peer = 0;
+    link->want_write = false;
+    link->out_sent = 0;
+  }
+
+  for (int w = 0; w < group->num_workers; ++w) {
+    federation->from_workers[w] = new RelayRing;
+    federation->to_workers[w] = new RelayRing;
+    init_relay_ring(federation->from_workers[w]);
+    init_relay_ring(federation->to_workers[w]);
+    group->workers[w]->to_federation = federation->from_workers[w];
+    group->workers[w]->from_federation = federation->to_workers[w];
+  }
+
+  federation->listen_socket = -1;
+  if (config->listen_port != NULL) {
+    federation->listen_socket = listen_on_node_port(config->listen_ip, config->listen_port);
+    if (federation->listen_socket < 0) {
+      return -1;
+    }
+  }
+  federation->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  federation->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (federation->epoll_fd < 0 || federation->wake_fd < 0) {
+    return -1;
+  }
+  group->federation_wake_fd = federation->wake_fd;
+  event.events = EPOLLIN;
+  event.data.u64 = WAKE_TAG;
+  epoll_ctl(federation->epoll_fd, EPOLL_CTL_ADD, federation->wake_fd, &event);
+  if (federation->listen_socket >= 0) {
+    event.data.u64 = LISTEN_TAG;
+    epoll_ctl(federation->epoll_fd, EPOLL_CTL_ADD, federation->listen_socket, &event);
+  }
+
+  register_federation_metrics(federation, registry);
+  federation->metrics = metrics_shard(registry);
+  if (federation->metrics == NULL) {
+    errno = ENOSPC;
+    return -1;
+  }
+  return 0;
+}
+
+void start_chat_federation(struct ChatFederation *federation, const std::atomic<bool> *stop) {
+  federation->thread = std::thread(run_federation, federation, stop);
+}
+
+void join_chat_federation(struct ChatFederation *federation) {
+  if (federation->thread.joinable()) {
+    federation->thread.join();
+  }
+}
+
+void free_chat_federation(struct ChatFederation *federation) {
+  for (size_t i = 0; i < federation->links.size(); ++i) {
+    if (federation->links[i].fd >= 0) {
+      close(federation->links[i].fd);
+    }
+  }
+  federation->links.clear();
+  for (int w = 0; w < federation->num_workers; ++w) {
+    delete federation->from_workers[w];
+    delete federation->to_workers[w];
+  }
+  if (federation->listen_socket >= 0) {
+    close(federation->listen_socket);
+  }
+  close(federation->epoll_fd);
+  close(federation->wake_fd);
+  free(federation->frame_buf);
+}
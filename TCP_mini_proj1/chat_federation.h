@@ -0,0 +1,190 @@
+//
+// Federation of chat servers. Each server is a node with its own id,
+// linked to other nodes over TCP on a node port of its own, and what
+// the clients of any node send reaches the monitors of every node.
+// Links may make any connected graph, a chain, a tree or a mesh, and
+// every node treats what it hears the same way, so none is special:
+//
+//  - a broadcast floods: each node hands it to its workers and passes
+//    it on over every link but the one it came in on. A node numbers
+//    what it sends and the others remember which of the last
+//    CHAT_NODE_SEEN numbers of each node they have had, so a message
+//    that comes round a loop of links is dropped the second time.
+//  - every node keeps a copy of the directory: which nodes have a
+//    client with a nickname, and which a monitor with one. A node only
+//    speaks for its own nicknames, with a JOIN when its first
+//    connection takes one and a LEAVE when its last gives it up,
+//    numbered as above; these flood too, and a copy only takes an
+//    entry newer than the one it has.
+//  - a direct message only goes towards the nodes with a monitor of
+//    its target nickname, over the link each of them was last heard
+//    on first, and floods if one of them has not been heard lately.
+//  - the clients of other nodes come and go in the workers' member log
+//    (chat_members.h) as the directory has them, so member lists,
+//    versioned or not, and MON_PRESENCE cover every node.
+//
+// Every node floods an ANNOUNCE every CHAT_NODE_ANNOUNCE_MS, which is
+// how the others find their way to it (the link its ANNOUNCE came in
+// on first is the quickest one) and how they know it is still there;
+// a node not heard of for CHAT_NODE_EXPIRE_MS is forgotten, its
+// directory entries with it. A node's epoch is the time it started
+// and its numbers start from there, so whatever a restarted node said
+// before is older than what it says now, and an ANNOUNCE with a newer
+// epoch drops what the directory had from its last run.
+//
+// A new link starts with a HELLO and an ANNOUNCE from each side, then
+// the whole directory as each side has it.
+//
+// One thread runs the links in its own epoll loop and trades messages
+// with each worker over a pair of RelayRings (chat_handoff.h), so no
+// worker ever waits on another server. While a worker's ring is short
+// of room, no link is read, so a busy node slows its peers through TCP
+// rather than dropping what they send. Links to --peer nodes are
+// dialled again with backoff when they drop; a link whose peer falls
+// CHAT_NODE_MAX_BACKLOG behind is dropped, losing what it had queued,
+// as a slow monitor is.
+//
+
+#ifndef TCP_CHAT_CHAT_FEDERATION_H
+#define TCP_CHAT_CHAT_FEDERATION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "chat_handoff.h"
+#include "chat_server.h"
+#include "metrics.h"
+
+// Numbers of each node remembered to tell repeats
+#define CHAT_NODE_SEEN 1024
+
+// Links a message may cross; far more than a sane federation has
+#define CHAT_NODE_MAX_HOPS 32
+
+#define CHAT_NODE_ANNOUNCE_MS 2000
+#define CHAT_NODE_EXPIRE_MS (3 * CHAT_NODE_ANNOUNCE_MS + 1000)
+
+// Bytes queued to a link before it is dropped
+#define CHAT_NODE_MAX_BACKLOG (64 * 1024 * 1024)
+
+// Bytes read from a link per recv()
+#define CHAT_NODE_RECV_SIZE (256 * 1024)
+
+// Room every worker's ring needs before a link is read, twice what one
+// read can push to it
+#define CHAT_NODE_WORKER_ROOM (2 * CHAT_NODE_RECV_SIZE)
+
+struct ChatFederationConfig {
+  uint32_t node_id; // nonzero and unique in the federation
+  const char *listen_ip;
+  const char *listen_port; // NULL to only dial out
+  std::vector<std::string> peers; // HOST:PORT of nodes to link to
+};
+
+struct ChatNodeLink {
+  int fd; // -1 while down
+  bool connecting; // dialled, connect() not done yet
+  bool dialled; // to a --peer, dialled again when it drops
+  std::string host; // the address it came from if it was not dialled
+  std::string port;
+  uint32_t attempt; // dials in a row that failed
+  uint64_t dial_at_ms;
+  uint32_t peer; // node id from its HELLO, 0 until then
+  bool want_write; // EPOLLOUT is armed
+  std::vector<char> in; // a partial message
+  std::vector<char> out;
+  size_t out_sent;
+};
+
+/**
+ * What a node knows of another.
+ */
+struct ChatNodeState {
+  uint64_t epoch;
+  int link; // its last ANNOUNCE came in on this link first, -1 if that is down
+  uint64_t heard_ms;
+  uint64_t top; // highest number seen from it
+  uint64_t seen[CHAT_NODE_SEEN / 64]; // which of the CHAT_NODE_SEEN numbers up to top were
+};
+
+struct ChatDirectoryEntry {
+  uint64_t seq;
+  bool present; // false once it left; kept so an older JOIN cannot bring it back
+};
+
+struct ChatFederationMetricIds {
+  int link_drops;
+  int broadcasts_out;
+  int broadcasts_in;
+  int directs_out;
+  int directs_in;
+  int duplicates;
+  int directory_events;
+  int relay_drops;
+  int bytes_out;
+  int bytes_in;
+};
+
+struct ChatFederation {
+  uint32_t node_id;
+  uint64_t epoch;
+  uint64_t next_seq;
+  int listen_socket; // -1 if only dialling out
+  int epoll_fd;
+  int wake_fd; // eventfd the workers write once a pass they pushed to us
+  struct ChatWorkerGroup *group;
+  int num_workers;
+  struct RelayRing *from_workers[CHAT_MAX_WORKERS];
+  struct RelayRing *to_workers[CHAT_MAX_WORKERS];
+  uint64_t wake_workers; // pushed to this pass
+  bool paused; // links are not read until the workers catch up
+  uint64_t announce_at_ms;
+  std::vector<struct ChatNodeLink> links; // the --peer links first, by index
+  std::unordered_map<uint32_t, struct ChatNodeState> nodes;
+  // key is the flags byte, the origin's 4 bytes and the nickname
+  std::unordered_map<std::string, struct ChatDirectoryEntry> directory;
+  std::unordered_map<std::string, std::vector<uint32_t> > monitor_nodes; // nickname -> other nodes with monitors
+  std::unordered_map<std::string, uint32_t> local; // flags byte and nickname -> connections here with it
+  char *frame_buf; // message being built
+  std::thread thread;
+  struct MetricsShard *metrics;
+  struct ChatFederationMetricIds ids;
+  std::atomic<uint64_t> links_up;
+  std::atomic<uint64_t> known_nodes;
+  std::atomic<uint64_t> directory_size;
+};
+
+/**
+ * Bind the node port, if there is one, connect the federation to
+ * every worker and register its metrics. The --peer links are dialled
+ * once it starts.
+ *
+ * @return 0 on success, -1 on failure (see errno)
+ */
+int init_chat_federation(struct ChatFederation *federation, const struct ChatFederationConfig *config,
+                         struct ChatWorkerGroup *group, struct MetricsRegistry *registry);
+
+/**
+ * Start the federation thread, serving until stop is set.
+ */
+void start_chat_federation(struct ChatFederation *federation, const std::atomic<bool> *stop);
+
+/**
+ * Wait for the thread to stop. It wakes the workers, so call this
+ * before free_chat_workers().
+ */
+void join_chat_federation(struct ChatFederation *federation);
+
+/**
+ * Close every link and free everything. The workers push to the
+ * federation's rings until they stop, so call this after
+ * free_chat_workers().
+ */
+void free_chat_federation(struct ChatFederation *federation);
+
+#endif //TCP_CHAT_CHAT_FEDERATION_H
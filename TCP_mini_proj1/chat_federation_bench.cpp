@@ -0,0 +1,356 @@
+//
+// Throughput of a federation of tcpchatservers (chat_federation.h) as
+// it grows. For k = 1 to the number of nodes given, --senders clients
+// and one monitor join each of the first k nodes, every client sends
+// --messages broadcasts as fast as the server takes them, and the
+// bench waits until each monitor has had every broadcast from every
+// node. It prints the messages sent per second and the deliveries to
+// monitors per second, which is k times that.
+//
+// Every client and monitor is on its own non-blocking socket, all in
+// one epoll loop. The servers need --rate 0 --byte-rate 0, or their
+// limits are what gets measured, and a --max-send-kb the monitors will
+// not fall behind by while the bench shares the CPUs with them.
+//
+// e.g., ./tcpchatserver 127.0.0.1 8881 --node 1 --node-port 9881 --rate 0 --byte-rate 0 --max-send-kb 65536 &
+//       ./tcpchatserver 127.0.0.1 8882 --node 2 --node-port 9882 --peer 127.0.0.1:9881 --rate 0 --byte-rate 0 --max-send-kb 65536 &
+//       ./chat_federation_bench 127.0.0.1:8881 127.0.0.1:8882 --senders 4 --messages 100000
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "chat_wire.h"
+#include "tcp_utils.h"
+
+// Bytes read from a socket per recv()
+#define RECV_SIZE (256 * 1024)
+
+// How long the servers get to see everyone join, and everyone leave
+#define SETTLE_US 500000
+
+static uint64_t now_us() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+struct Peer {
+  int fd;
+  bool monitor;
+  const std::vector<char> *out; // what a sender has to send
+  size_t sent;
+  std::vector<char> in; // a monitor's partial message
+  uint64_t received; // broadcasts a monitor has had
+};
+
+/**
+ * @return a blocking socket connected to address, or -1 on failure
+ */
+static int connect_to(const struct sockaddr_in *address) {
+  int peer_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+
+  if (peer_socket < 0) {
+    return -1;
+  }
+  if (connect(peer_socket, (const struct sockaddr *)address, sizeof(*address)) == -1) {
+    close(peer_socket);
+    return -1;
+  }
+  return peer_socket;
+}
+
+/**
+ * Send a client's CLIENT_CONNECT and CLIENT_SET_NICKNAME, or a
+ * monitor's MON_CONNECT.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int send_handshake(int peer_socket, bool monitor, const std::string &nickname) {
+  char buf[128];
+  struct ChatClientMessage client_message;
+  struct ChatMonMsg mon_message;
+  size_t len;
+
+  if (monitor) {
+    mon_message.type = MON_CONNECT;
+    mon_message.nickname_len = (uint16_t)nickname.size();
+    mon_message.data_len = 0;
+    len = ChatMonCodec::encode(mon_message, buf, sizeof(buf));
+  } else {
+    client_message.type = CLIENT_CONNECT;
+    client_message.nickname_len = 0;
+    client_message.data_length = 0;
+    len = ChatClientCodec::encode(client_message, buf, sizeof(buf));
+    client_message.type = CLIENT_SET_NICKNAME;
+    client_message.data_length = (uint16_t)nickname.size();
+    len += ChatClientCodec::encode(client_message, &buf[len], sizeof(buf) - len);
+  }
+  memcpy(&buf[len], nickname.data(), nickname.size());
+  len += nickname.size();
+  return send(peer_socket, buf, len, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+}
+
+/**
+ * messages CLIENT_SEND_MESSAGEs, back to back.
+ */
+static void build_messages(std::vector<char> *out, uint64_t messages, size_t text_len) {
+  struct ChatClientMessage message = {CLIENT_SEND_MESSAGE, 0, (uint16_t)text_len};
+  size_t frame_len = ChatClientCodec::wire_size + text_len;
+
+  out->resize(messages * frame_len);
+  for (uint64_t i = 0; i < messages; ++i) {
+    char *frame = &(*out)[i * frame_len];
+    ChatClientCodec::encode(message, frame, ChatClientCodec::wire_size);
+    memset(&frame[ChatClientCodec::wire_size], 'a' + (char)(i % 26), text_len);
+  }
+}
+
+/**
+ * Count the broadcasts among what a monitor read.
+ */
+static void count_broadcasts(struct Peer *peer, const char *data, size_t len) {
+  struct ChatMonMsg message;
+  size_t offset = 0;
+  size_t frame_len;
+
+  peer->in.insert(peer->in.end(), data, data + len);
+  while (offset < peer->in.size()) {
+    const char *frame = &peer->in[offset];
+    size_t left = peer->in.size() - offset;
+
+    if (left < sizeof(uint16_t)) {
+      break;
+    }
+    if (wire::load_be<uint16_t>((const uint8_t *)frame) == MON_RESUME) {
+      if (left < ChatSessionCodec::wire_size) {
+        break;
+      }
+      frame_len = ChatSessionCodec::wire_size;
+    } else {
+      if (!ChatMonCodec::decode_frame(frame, left, message)) {
+        break;
+      }
+      frame_len = ChatMonCodec::wire_size + ChatMonCodec::payload_size(message);
+      if (message.type == MON_MESSAGE) {
+        peer->received++;
+      }
+    }
+    offset += frame_len;
+  }
+  peer->in.erase(peer->in.begin(), peer->in.begin() + offset);
+}
+
+/**
+ * Send as much of a sender's messages as its socket takes.
+ *
+ * @return -1 if the connection failed
+ */
+static int send_more(struct Peer *peer) {
+  ssize_t ret;
+
+  while (peer->sent < peer->out->size()) {
+    ret = send(peer->fd, &(*peer->out)[peer->sent], peer->out->size() - peer->sent, MSG_NOSIGNAL);
+    if (ret < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    peer->sent += ret;
+  }
+  return 0;
+}
+
+/**
+ * One round with the first num_nodes nodes.
+ *
+ * @return 0 on success, -1 if a connection failed or the monitors did
+ *         not get everything in time
+ */
+static int run_round(const std::vector<struct sockaddr_in> &nodes, size_t num_nodes, uint64_t senders,
+                     const std::vector<char> &messages, uint64_t per_sender, uint64_t timeout_us) {
+  std::vector<struct Peer> peers;
+  std::vector<struct epoll_event> events(1024);
+  std::vector<char> buf(RECV_SIZE);
+  struct epoll_event event;
+  uint64_t expected = num_nodes * senders * per_sender;
+  uint64_t start_us;
+  uint64_t end_us;
+  uint64_t deadline_us;
+  uint64_t least;
+  size_t monitors_done = 0;
+  size_t senders_done = 0;
+  int epoll_fd;
+  int num_events;
+  int result = 0;
+  ssize_t ret;
+
+  for (size_t n = 0; n < num_nodes && result == 0; ++n) {
+    for (uint64_t s = 0; s <= senders; ++s) {
+      struct Peer peer;
+      bool monitor = s == senders;
+      std::string nickname = (monitor ? "fedmon" : "fedsend") + std::to_string(n) + "_" + std::to_string(s);
+
+      peer.fd = connect_to(&nodes[n]);
+      if (peer.fd < 0 || send_handshake(peer.fd, monitor, nickname) == -1) {
+        fprintf(stderr, "Could not join node %zu\n", n + 1);
+        result = -1;
+        break;
+      }
+      peer.monitor = monitor;
+      peer.out = &messages;
+      peer.sent = 0;
+      peer.received = 0;
+      peers.push_back(peer);
+    }
+  }
+  if (result == -1) {
+    for (size_t i = 0; i < peers.size(); ++i) {
+      close(peers[i].fd);
+    }
+    return -1;
+  }
+  // Let the handshakes and the joins they flood settle
+  usleep(SETTLE_US);
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  for (size_t i = 0; i < peers.size(); ++i) {
+    fcntl(peers[i].fd, F_SETFL, fcntl(peers[i].fd, F_GETFL) | O_NONBLOCK);
+    event.events = peers[i].monitor ? EPOLLIN : EPOLLIN | EPOLLOUT;
+    event.data.u64 = i;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, peers[i].fd, &event);
+  }
+
+  start_us = now_us();
+  deadline_us = start_us + timeout_us;
+  while (monitors_done < num_nodes && now_us() < deadline_us) {
+    num_events = epoll_wait(epoll_fd, events.data(), (int)events.size(), 100);
+    for (int e = 0; e < num_events; ++e) {
+      struct Peer *peer = &peers[events[e].data.u64];
+
+      if (events[e].events & EPOLLIN) {
+        while ((ret = recv(peer->fd, buf.data(), buf.size(), 0)) > 0) {
+          if (peer->monitor) {
+            bool was_done = peer->received >= expected;
+            count_broadcasts(peer, buf.data(), ret);
+            if (!was_done && peer->received >= expected) {
+              monitors_done++;
+            }
+          }
+        }
+        if (ret == 0) {
+          fprintf(stderr, "A server hung up on %s\n", peer->monitor ? "a monitor" : "a sender");
+          deadline_us = 0;
+          break;
+        }
+      }
+      if ((events[e].events & EPOLLOUT) && !peer->monitor && peer->sent < peer->out->size()) {
+        if (send_more(peer) == -1) {
+          fprintf(stderr, "A sender failed: %s\n", strerror(errno));
+          deadline_us = 0;
+          break;
+        }
+        if (peer->sent == peer->out->size()) {
+          senders_done++;
+          event.events = EPOLLIN;
+          event.data.u64 = events[e].data.u64;
+          epoll_ctl(epoll_fd, EPOLL_CTL_MOD, peer->fd, &event);
+        }
+      }
+    }
+  }
+  end_us = now_us();
+
+  least = expected;
+  for (size_t i = 0; i < peers.size(); ++i) {
+    if (peers[i].monitor && peers[i].received < least) {
+      least = peers[i].received;
+    }
+    close(peers[i].fd);
+  }
+  close(epoll_fd);
+
+  if (monitors_done < num_nodes) {
+    printf("%2zu nodes: %zu of %zu monitors got all %llu broadcasts, the slowest %llu, %zu of %llu senders done\n",
+           num_nodes, monitors_done, num_nodes, (unsigned long long)expected, (unsigned long long)least,
+           senders_done, (unsigned long long)(num_nodes * senders));
+    result = -1;
+  } else {
+    printf("%2zu nodes: %llu broadcasts in %.1f ms, %.0f msgs/s, %.0f deliveries/s\n", num_nodes,
+           (unsigned long long)expected, (end_us - start_us) / 1000.0, expected * 1e6 / (end_us - start_us),
+           (double)expected * num_nodes * 1e6 / (end_us - start_us));
+  }
+  // Let the servers see everyone leave before the next round
+  usleep(SETTLE_US);
+  return result;
+}
+
+/**
+ *
+ * Reads in HOST:PORT... [--senders S] [--messages M] [--size BYTES] [--timeout SECONDS]
+ *
+ * @param argc count of arguments on the command line
+ * @param argv array of command line arguments
+ * @return 0 on success, non-zero if an error occurred
+ */
+int main(int argc, char *argv[]) {
+  std::vector<struct sockaddr_in> nodes;
+  std::vector<char> messages;
+  struct sockaddr_in address;
+  uint64_t senders = 4;
+  uint64_t per_sender = 100000;
+  uint64_t timeout_s = 60;
+  size_t text_len = 32;
+  int result = 0;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--senders") == 0 && i + 1 < argc) {
+      senders = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--messages") == 0 && i + 1 < argc) {
+      per_sender = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+      text_len = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc) {
+      timeout_s = strtoull(argv[++i], NULL, 10);
+    } else if (argv[i][0] != '-' && strrchr(argv[i], ':') != NULL) {
+      std::string host(argv[i], strrchr(argv[i], ':') - argv[i]);
+      std::string port(strrchr(argv[i], ':') + 1);
+      if (convert_ip_port_to_sockaddr_in(&host[0], &port[0], &address) == -1) {
+        fprintf(stderr, "Invalid address %s\n", argv[i]);
+        return 1;
+      }
+      nodes.push_back(address);
+    } else {
+      fprintf(stderr, "Usage: %s HOST:PORT... [--senders S] [--messages M] [--size BYTES] [--timeout SECONDS]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (nodes.empty() || senders == 0 || per_sender == 0) {
+    fprintf(stderr, "Give at least one node, and senders and messages above 0\n");
+    return 1;
+  }
+  if (text_len == 0 || text_len > UINT16_MAX) {
+    fprintf(stderr, "--size must be 1 to %d\n", UINT16_MAX);
+    return 1;
+  }
+
+  build_messages(&messages, per_sender, text_len);
+  printf("%llu senders a node, %llu messages of %zu bytes each\n", (unsigned long long)senders,
+         (unsigned long long)per_sender, text_len);
+  for (size_t k = 1; k <= nodes.size(); ++k) {
+    if (run_round(nodes, k, senders, messages, per_sender, timeout_s * 1000000) == -1) {
+      result = 1;
+    }
+  }
+  return result;
+}
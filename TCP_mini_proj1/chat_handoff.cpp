@@ -0,0 +1,95 @@
+#include "chat_handoff.h"
+#include <string.h>
+
+void init_fd_ring(struct FdRing *ring) {
+  ring->head.store(0);
+  ring->tail.store(0);
+}
+
+bool fd_ring_push(struct FdRing *ring, int fd) {
+  uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+
+  if (tail - ring->head.load(std::memory_order_acquire) == CHAT_HANDOFF_SLOTS) {
+    return false;
+  }
+  ring->fds[tail % CHAT_HANDOFF_SLOTS] = fd;
+  ring->tail.store(tail + 1, std::memory_order_release);
+  return true;
+}
+
+bool fd_ring_pop(struct FdRing *ring, int *fd) {
+  uint32_t head = ring->head.load(std::memory_order_relaxed);
+
+  if (head == ring->tail.load(std::memory_order_acquire)) {
+    return false;
+  }
+  *fd = ring->fds[head % CHAT_HANDOFF_SLOTS];
+  ring->head.store(head + 1, std::memory_order_release);
+  return true;
+}
+
+void init_relay_ring(struct RelayRing *ring) {
+  ring->head.store(0);
+  ring->tail.store(0);
+}
+
+bool relay_push(struct RelayRing *ring, uint16_t kind, const char *target, uint16_t target_len, const char *frame,
+                uint32_t frame_len) {
+  uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+  uint64_t head = ring->head.load(std::memory_order_acquire);
+  uint32_t len = (uint32_t)((sizeof(struct RelayRecord) + target_len + frame_len + 7) & ~(size_t)7);
+  uint32_t offset = (uint32_t)(tail % CHAT_RELAY_RING_SIZE);
+  uint32_t to_end = CHAT_RELAY_RING_SIZE - offset;
+  struct RelayRecord *record;
+
+  // Records never wrap: pad out the end of the ring and start over
+  if (to_end < len) {
+    if (tail + to_end + len - head > CHAT_RELAY_RING_SIZE) {
+      return false;
+    }
+    record = (struct RelayRecord *)&ring->bytes[offset];
+    record->len = to_end;
+    record->kind = RELAY_PAD;
+    tail += to_end;
+    offset = 0;
+  } else if (tail + len - head > CHAT_RELAY_RING_SIZE) {
+    return false;
+  }
+
+  record = (struct RelayRecord *)&ring->bytes[offset];
+  record->len = len;
+  record->kind = kind;
+  record->target_len = target_len;
+  record->frame_len = frame_len;
+  memcpy((char *)relay_target(record), target, target_len);
+  memcpy((char *)relay_frame(record), frame, frame_len);
+  ring->tail.store(tail + len, std::memory_order_release);
+  return true;
+}
+
+size_t relay_room(struct RelayRing *ring) {
+  uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+  uint64_t head = ring->head.load(std::memory_order_acquire);
+
+  return CHAT_RELAY_RING_SIZE - (size_t)(tail - head);
+}
+
+const struct RelayRecord *relay_peek(struct RelayRing *ring) {
+  uint64_t head = ring->head.load(std::memory_order_relaxed);
+  uint64_t tail = ring->tail.load(std::memory_order_acquire);
+  const struct RelayRecord *record;
+
+  while (head != tail) {
+    record = (const struct RelayRecord *)&ring->bytes[head % CHAT_RELAY_RING_SIZE];
+    if (record->kind != RELAY_PAD) {
+      return record;
+    }
+    head += record->len;
+    ring->head.store(head, std::memory_order_release);
+  }
+  return NULL;
+}
+
+void relay_pop(struct RelayRing *ring, const struct RelayRecord *record) {
+  ring->head.store(ring->head.load(std::memory_order_relaxed) + record->len, std::memory_order_release);
+}
@@ -0,0 +1,116 @@
+//
+// Lock-free single producer, single consumer rings between the chat
+// server's threads:
+//
+//  - FdRing carries accepted sockets from the acceptor to one worker
+//  - RelayRing carries messages one worker relays to the monitors of
+//    another, as variable length records, and sockets that resume a
+//    session owned by another worker; the same rings connect each
+//    worker to the federation thread (chat_federation.h), both ways
+//
+// Producer and consumer each own one index and only read the other's,
+// so a push or pop is a couple of plain loads and stores with acquire
+// and release ordering. The indexes sit on separate cache lines so the
+// two threads do not pass one back and forth.
+//
+
+#ifndef TCP_CHAT_CHAT_HANDOFF_H
+#define TCP_CHAT_CHAT_HANDOFF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+// Sockets a worker can have waiting; a listen backlog's worth
+#define CHAT_HANDOFF_SLOTS 4096
+
+// Bytes of relayed messages one worker can have waiting from another
+#define CHAT_RELAY_RING_SIZE (1 << 20)
+
+enum RelayKind {
+  RELAY_PAD = 0, // filler up to the end of the ring
+  RELAY_BROADCAST, // frame for every monitor
+  RELAY_DIRECT, // frame for the monitors with the target nickname
+  RELAY_RESUME, // a socket resuming a session this worker owns: the target is
+                // the socket then the peer's nickname, the frame what was read
+                // from it from the resume on
+  RELAY_MEMBER_JOIN, // to the federation: a client took the target nickname
+  RELAY_MEMBER_LEAVE, // ... or gave it up
+  RELAY_MONITOR_JOIN, // a monitor connected with the target nickname
+  RELAY_MONITOR_LEAVE
+};
+
+struct FdRing {
+  alignas(64) std::atomic<uint32_t> head; // next slot to pop, owned by the consumer
+  alignas(64) std::atomic<uint32_t> tail; // next slot to push, owned by the producer
+  int fds[CHAT_HANDOFF_SLOTS];
+};
+
+/**
+ * Header of a RelayRing record, followed by the target nickname and
+ * then the frame. Records are padded to 8 bytes.
+ */
+struct RelayRecord {
+  uint32_t len; // whole record, padding included
+  uint16_t kind; // A RelayKind
+  uint16_t target_len;
+  uint32_t frame_len;
+  uint32_t pad;
+};
+
+struct RelayRing {
+  alignas(64) std::atomic<uint64_t> head;
+  alignas(64) std::atomic<uint64_t> tail;
+  alignas(64) char bytes[CHAT_RELAY_RING_SIZE];
+};
+
+void init_fd_ring(struct FdRing *ring);
+
+/**
+ * @return false if the ring is full
+ */
+bool fd_ring_push(struct FdRing *ring, int fd);
+
+/**
+ * @return false if the ring is empty
+ */
+bool fd_ring_pop(struct FdRing *ring, int *fd);
+
+void init_relay_ring(struct RelayRing *ring);
+
+/**
+ * Copy a record into the ring.
+ *
+ * @return false if there is no room, in which case nothing is written
+ */
+bool relay_push(struct RelayRing *ring, uint16_t kind, const char *target, uint16_t target_len, const char *frame,
+                uint32_t frame_len);
+
+/**
+ * Bytes free for the producer. A record needs its own length and, if
+ * it would run past the end of the ring, the bytes left to the end.
+ */
+size_t relay_room(struct RelayRing *ring);
+
+/**
+ * The oldest record, left in the ring until relay_pop(). Padding
+ * records are skipped.
+ *
+ * @return the record, or NULL if the ring is empty
+ */
+const struct RelayRecord *relay_peek(struct RelayRing *ring);
+
+/**
+ * Drop the record relay_peek() returned.
+ */
+void relay_pop(struct RelayRing *ring, const struct RelayRecord *record);
+
+static inline const char *relay_target(const struct RelayRecord *record) {
+  return (const char *)(record + 1);
+}
+
+static inline const char *relay_frame(const struct RelayRecord *record) {
+  return relay_target(record) + record->target_len;
+}
+
+#endif //TCP_CHAT_CHAT_HANDOFF_H
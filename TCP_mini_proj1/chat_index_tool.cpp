@@ -0,0 +1,100 @@
+//
+// Builds the search index (chat_search.h) of each segment of an
+// archive written by tcpchatmon --archive, for chat_query. A segment
+// whose index is already up to date is left alone, so running this
+// again as the monitor goes on only indexes what is new; the segment
+// still being written is indexed as far as it has got, and again next
+// time. --rebuild indexes everything over.
+//
+// e.g., ./chat_index /var/tmp/chat
+//
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "chat_archive.h"
+#include "chat_search.h"
+
+static uint64_t now_ns() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * @return whether path has an index of a segment of segment_len bytes
+ */
+static bool up_to_date(const std::string &path, uint64_t segment_len) {
+  struct ChatSearchIndex index;
+  bool current;
+
+  if (map_search_index(&index, path) == -1) {
+    return false;
+  }
+  current = index.header.segment_len == segment_len;
+  unmap_search_index(&index);
+  return current;
+}
+
+int main(int argc, char *argv[]) {
+  struct ChatArchiveSegment segment;
+  struct ChatSearchHeader header;
+  std::vector<std::string> segments;
+  std::string path;
+  struct stat info;
+  bool rebuild = false;
+  uint64_t start;
+  uint64_t messages = 0;
+  int indexed = 0;
+  int failed = 0;
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s DIR [--rebuild]\n", argv[0]);
+    return 1;
+  }
+  for (int i = 2; i < argc; ++i) {
+    if (strcmp(argv[i], "--rebuild") == 0) {
+      rebuild = true;
+    } else {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  segments = list_archive_segments(argv[1]);
+  if (segments.empty()) {
+    fprintf(stderr, "No archive segments in %s\n", argv[1]);
+    return 1;
+  }
+  for (size_t s = 0; s < segments.size(); ++s) {
+    path = search_index_path(segments[s]);
+    if (!rebuild && stat(segments[s].c_str(), &info) == 0 && up_to_date(path, (uint64_t)info.st_size)) {
+      continue;
+    }
+    if (map_archive_segment(&segment, segments[s]) == -1) {
+      fprintf(stderr, "Skipping %s: %s\n", segments[s].c_str(), strerror(errno));
+      failed++;
+      continue;
+    }
+    start = now_ns();
+    if (build_search_index(&segment, path, &header) == -1) {
+      fprintf(stderr, "Could not index %s: %s\n", segments[s].c_str(), strerror(errno));
+      failed++;
+    } else {
+      printf("%s: %u messages, %u keys in %.1f ms\n", path.c_str(), header.messages, header.keys,
+             (now_ns() - start) / 1e6);
+      messages += header.messages;
+      indexed++;
+    }
+    unmap_archive_segment(&segment);
+  }
+  printf("Indexed %d segments, %llu messages; %zu up to date already\n", indexed, (unsigned long long)messages,
+         segments.size() - indexed - failed);
+  return failed > 0;
+}
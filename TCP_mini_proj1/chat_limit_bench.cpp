@@ -0,0 +1,154 @@
+//
+// Cost of tcpchatserver's rate limits (chat_limits.h) per message. Runs
+// the same checks the server makes for every client message, on
+// connection records picked at random from --connections of them, and
+// compares with a pass that only touches the records, so the cache
+// misses of reaching a record are not counted against the limiter.
+//
+// The default 1000 connections fit in cache, as the server's record is
+// when it checks the limits, having just read the socket through it.
+// With millions, the gap also shows how much fewer cache misses can be
+// in flight at once when there is more work per record.
+//
+// The clock moves on every --batch messages, as the server reads it
+// once per pass of its loop, by as much as it would at --rate messages
+// a second in all.
+//
+// e.g., ./chat_limit_bench --connections 1000000 --messages 20000000
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include "chat_connections.h"
+#include "chat_limits.h"
+
+static uint64_t now_ns() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+struct Limits {
+  struct RateLimit messages;
+  struct RateLimit bytes;
+  struct RateLimit admission;
+  uint32_t admission_full_at;
+};
+
+/**
+ * What tcpchatserver's admit_message() does, short of the reply.
+ */
+static inline bool admit(struct Limits *limits, struct ChatConnection *conn, uint32_t now_us, uint32_t bytes) {
+  uint32_t message_full_at;
+  uint32_t byte_full_at;
+  uint32_t admission_full_at;
+
+  // & rather than &&, so every check runs and there is one branch
+  if (!(rate_limit_check(conn->message_full_at, now_us, &limits->messages, 1, &message_full_at) &
+        rate_limit_check(conn->byte_full_at, now_us, &limits->bytes, bytes, &byte_full_at) &
+        rate_limit_check(limits->admission_full_at, now_us, &limits->admission, 1, &admission_full_at))) {
+    conn->flags |= CONN_THROTTLED;
+    return false;
+  }
+  conn->message_full_at = message_full_at;
+  conn->byte_full_at = byte_full_at;
+  limits->admission_full_at = admission_full_at;
+  conn->flags &= ~CONN_THROTTLED;
+  return true;
+}
+
+/**
+ * @return ns per message, and in *admitted how many got through
+ */
+static double run(struct Limits *limits, std::vector<struct ChatConnection> &conns, const std::vector<uint32_t> &order,
+                  uint32_t batch, uint32_t step_us, bool limited, uint64_t *admitted) {
+  uint32_t now_us = 1;
+  uint64_t count = 0;
+  uint64_t start;
+
+  // Every run starts with full buckets
+  memset(conns.data(), 0, conns.size() * sizeof(struct ChatConnection));
+  limits->admission_full_at = 0;
+  start = now_ns();
+
+  for (size_t i = 0; i < order.size(); ++i) {
+    struct ChatConnection *conn = &conns[order[i]];
+
+    if (i % batch == 0) {
+      now_us += step_us;
+    }
+    if (limited) {
+      count += admit(limits, conn, now_us, 100);
+    } else {
+      // Touch the record as admit() does
+      conn->flags ^= CONN_THROTTLED;
+      count += conn->flags & CONN_THROTTLED;
+    }
+  }
+  *admitted = count;
+  return (double)(now_ns() - start) / order.size();
+}
+
+int main(int argc, char *argv[]) {
+  uint32_t num_connections = 1000;
+  uint32_t num_messages = 20000000;
+  uint32_t batch = 256;
+  uint32_t rate = 1000000;
+  uint32_t step_us;
+  uint64_t admitted;
+  uint64_t touched;
+  double base_ns;
+  double limited_ns;
+  struct Limits limits;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--connections") == 0 && i + 1 < argc) {
+      num_connections = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--messages") == 0 && i + 1 < argc) {
+      num_messages = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      batch = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+      rate = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else {
+      fprintf(stderr, "Usage: %s [--connections N] [--messages N] [--batch N] [--rate N]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (num_connections == 0 || batch == 0 || rate == 0) {
+    fprintf(stderr, "--connections, --batch and --rate must be above 0\n");
+    return 1;
+  }
+  step_us = (uint32_t)((uint64_t)batch * 1000000 / rate);
+
+  // The server's defaults, with a global limit so every check runs
+  init_rate_limit(&limits.messages, CHAT_DEFAULT_MESSAGE_RATE, CHAT_DEFAULT_MESSAGE_BURST);
+  init_rate_limit(&limits.bytes, CHAT_DEFAULT_BYTE_RATE, CHAT_DEFAULT_BYTE_BURST);
+  init_rate_limit(&limits.admission, rate, rate / 10 + 1);
+
+  std::vector<struct ChatConnection> conns(num_connections);
+  std::vector<uint32_t> order(num_messages);
+
+  srandom(1);
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = (uint32_t)random() % num_connections;
+  }
+
+  // Once to fault everything in, then for real
+  run(&limits, conns, order, batch, step_us, false, &touched);
+  base_ns = run(&limits, conns, order, batch, step_us, false, &touched);
+  run(&limits, conns, order, batch, step_us, true, &admitted);
+  limited_ns = run(&limits, conns, order, batch, step_us, true, &admitted);
+
+  printf("%u messages over %u connections (%zu KB of records)\n", num_messages, num_connections,
+         conns.size() * sizeof(struct ChatConnection) / 1024);
+  printf("touch only:  %.2f ns/message\n", base_ns);
+  printf("rate limits: %.2f ns/message, %.2f ns more, %.1f%% admitted\n", limited_ns, limited_ns - base_ns,
+         100.0 * admitted / num_messages);
+  return 0;
+}
@@ -0,0 +1,19 @@
+#include "chat_limits.h"
+
+// Furthest a bucket may run ahead of now, so one that has fallen
+// behind is still told apart once the clock wraps
+#define MAX_WINDOW_US 0x7FFFFFFFull
+
+void init_rate_limit(struct RateLimit *limit, uint32_t rate, uint32_t burst) {
+  uint64_t window;
+
+  if (rate == 0) {
+    // Never charged, and never behind
+    limit->cost_q16 = 0;
+    limit->window_us = UINT32_MAX;
+    return;
+  }
+  limit->cost_q16 = (1000000ull << 16) / rate;
+  window = ((burst > 0 ? burst : 1) * limit->cost_q16) >> 16;
+  limit->window_us = (uint32_t)(window < MAX_WINDOW_US ? window : MAX_WINDOW_US);
+}
@@ -0,0 +1,61 @@
+//
+// Rate limits on what chat clients send. Each limit is a token bucket
+// kept as a single number: the time at which the bucket would be full
+// again (the generic cell rate algorithm). Taking tokens pushes that
+// time on; a bucket whose time is more than a burst ahead of now has
+// run dry. Nothing needs refilling, so a limit costs a few arithmetic
+// operations on a coarse clock read once per pass of the event loop,
+// and no timer.
+//
+// Times are microseconds in a uint32_t, so they wrap every 71 minutes;
+// a bucket left alone that long may be taken for dry once, for at most
+// one burst.
+//
+
+#ifndef TCP_CHAT_CHAT_LIMITS_H
+#define TCP_CHAT_CHAT_LIMITS_H
+
+#include <stdint.h>
+
+// Default per-client limits: messages a second and how many may come
+// at once, and bytes a second and how many may come at once
+#define CHAT_DEFAULT_MESSAGE_RATE 1000
+#define CHAT_DEFAULT_MESSAGE_BURST 2000
+#define CHAT_DEFAULT_BYTE_RATE (4 * 1024 * 1024)
+#define CHAT_DEFAULT_BYTE_BURST (1024 * 1024)
+
+/**
+ * One bucket's settings.
+ */
+struct RateLimit {
+  uint64_t cost_q16; // microseconds per token, 16.16 fixed point; 0 for no limit
+  uint32_t window_us; // burst's worth of tokens in microseconds, UINT32_MAX for no limit
+};
+
+/**
+ * @param rate tokens a second, 0 for no limit
+ * @param burst most tokens taken at once, at least one
+ */
+void init_rate_limit(struct RateLimit *limit, uint32_t rate, uint32_t burst);
+
+/**
+ * Work out a bucket's state after taking tokens from it. Written
+ * without branches, as whether a bucket is behind now depends on the
+ * client and cannot be predicted.
+ *
+ * @param full_at the bucket's state, the time it would be full again
+ * @param next set to the state after taking them
+ * @return false if the bucket does not have them
+ */
+static inline bool rate_limit_check(uint32_t full_at, uint32_t now_us, const struct RateLimit *limit, uint32_t tokens,
+                                    uint32_t *next) {
+  uint32_t ahead = full_at - now_us;
+  uint64_t cost = (tokens * limit->cost_q16) >> 16;
+
+  // A bucket behind now (ahead wrapped round) is simply full
+  ahead = ahead > limit->window_us ? 0 : ahead;
+  *next = now_us + ahead + (uint32_t)cost;
+  return ahead + cost <= limit->window_us;
+}
+
+#endif //TCP_CHAT_CHAT_LIMITS_H
@@ -0,0 +1,338 @@
+#include "chat_lz.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Chain entries: the window rounded up to a power of two
+#define CHAIN_SIZE 65536
+#define CHAIN_MASK (CHAIN_SIZE - 1)
+
+static inline uint32_t read32(const char *p) {
+  uint32_t value;
+
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static inline uint32_t hash32(uint32_t value) {
+  return (value * 2654435761u) >> (32 - CHAT_LZ_HASH_BITS);
+}
+
+/**
+ * @return how many bytes from a and b are the same, stopping at end
+ *         (which b reaches first)
+ */
+static inline size_t count_match(const char *a, const char *b, const char *end) {
+  const char *start = b;
+  uint64_t x;
+  uint64_t y;
+
+  while (end - b >= 8) {
+    memcpy(&x, a, 8);
+    memcpy(&y, b, 8);
+    if (x != y) {
+      break;
+    }
+    a += 8;
+    b += 8;
+  }
+  while (b < end && *a == *b) {
+    a++;
+    b++;
+  }
+  return b - start;
+}
+
+/**
+ * Keep just the last CHAT_LZ_WINDOW bytes if n more will not fit.
+ *
+ * @return bytes dropped from the front
+ */
+static size_t make_room(char *buf, size_t capacity, size_t *len, size_t n) {
+  size_t keep;
+  size_t dropped;
+
+  if (*len + n <= capacity) {
+    return 0;
+  }
+  keep = *len < CHAT_LZ_WINDOW ? *len : CHAT_LZ_WINDOW;
+  dropped = *len - keep;
+  memmove(buf, buf + dropped, keep);
+  *len = keep;
+  return dropped;
+}
+
+int init_lz_encoder(struct LzEncoder *encoder, size_t max_batch, int level) {
+  if (level < 1) {
+    level = 1;
+  } else if (level > CHAT_LZ_MAX_LEVEL) {
+    level = CHAT_LZ_MAX_LEVEL;
+  }
+  encoder->capacity = CHAT_LZ_WINDOW + max_batch;
+  encoder->buf = (char *)malloc(encoder->capacity);
+  encoder->head = (uint32_t *)calloc((size_t)1 << CHAT_LZ_HASH_BITS, sizeof(uint32_t));
+  encoder->chain = (uint32_t *)calloc(CHAIN_SIZE, sizeof(uint32_t));
+  encoder->len = 0;
+  encoder->base = 0;
+  encoder->depth = 1 << (level - 1);
+  if (encoder->buf == NULL || encoder->head == NULL || encoder->chain == NULL) {
+    free_lz_encoder(encoder);
+    return -1;
+  }
+  return 0;
+}
+
+void free_lz_encoder(struct LzEncoder *encoder) {
+  free(encoder->buf);
+  free(encoder->head);
+  free(encoder->chain);
+  encoder->buf = NULL;
+  encoder->head = NULL;
+  encoder->chain = NULL;
+}
+
+void reset_lz_encoder(struct LzEncoder *encoder) {
+  // Positions carry on, so what the tables hold is all out of reach
+  encoder->base += (uint32_t)encoder->len;
+  encoder->len = 0;
+}
+
+static inline void insert(struct LzEncoder *encoder, size_t ip) {
+  uint32_t h = hash32(read32(&encoder->buf[ip]));
+  uint32_t position = encoder->base + (uint32_t)ip;
+
+  encoder->chain[position & CHAIN_MASK] = encoder->head[h];
+  encoder->head[h] = position;
+}
+
+static inline char *put_length(char *op, size_t n) {
+  while (n >= 255) {
+    *op++ = (char)255;
+    n -= 255;
+  }
+  *op++ = (char)n;
+  return op;
+}
+
+/**
+ * Write one sequence, or none if it would not fit before end.
+ *
+ * @param match_len 0 for the last sequence, which has no match
+ * @return where the next one goes, or NULL
+ */
+static char *put_sequence(char *op, char *end, const char *literals, size_t literal_len, uint32_t distance,
+                          size_t match_len) {
+  size_t extra = match_len >= CHAT_LZ_MIN_MATCH ? match_len - CHAT_LZ_MIN_MATCH : 0;
+
+  if ((size_t)(end - op) < 1 + literal_len / 255 + 1 + literal_len + 2 + extra / 255 + 1) {
+    return NULL;
+  }
+  *op++ = (char)(((literal_len < 15 ? literal_len : 15) << 4) | (extra < 15 ? extra : 15));
+  if (literal_len >= 15) {
+    op = put_length(op, literal_len - 15);
+  }
+  memcpy(op, literals, literal_len);
+  op += literal_len;
+  if (match_len == 0) {
+    return op;
+  }
+  *op++ = (char)(distance >> 8);
+  *op++ = (char)distance;
+  if (extra >= 15) {
+    op = put_length(op, extra - 15);
+  }
+  return op;
+}
+
+size_t lz_compress(struct LzEncoder *encoder, const char *in, size_t len, char *out, size_t cap) {
+  char *op = out;
+  char *out_end = out + cap;
+  const char *buf;
+  size_t start;
+  size_t end;
+  size_t ip;
+  size_t anchor;
+  size_t limit;
+  size_t max_distance;
+  size_t best_len;
+  size_t match_len;
+  uint32_t best_distance = 0;
+  uint32_t distance;
+  uint32_t last_distance;
+  uint32_t position;
+  uint32_t candidate;
+  uint32_t sequence;
+
+  encoder->base += (uint32_t)make_room(encoder->buf, encoder->capacity, &encoder->len, len);
+  start = encoder->len;
+  memcpy(&encoder->buf[start], in, len);
+  end = start + len;
+  encoder->len = end;
+  buf = encoder->buf;
+
+  ip = start;
+  anchor = start;
+  limit = len >= CHAT_LZ_MIN_MATCH ? end - CHAT_LZ_MIN_MATCH : start;
+  while (ip < limit) {
+    sequence = read32(&buf[ip]);
+    position = encoder->base + (uint32_t)ip;
+    max_distance = ip < CHAT_LZ_WINDOW ? ip : CHAT_LZ_WINDOW;
+    best_len = 0;
+    last_distance = 0;
+    candidate = encoder->head[hash32(sequence)];
+
+    // Newest first; a chain entry since reused for a later position
+    // would jump forward again, which ends the walk
+    for (int tries = 0; tries < encoder->depth; ++tries) {
+      distance = position - candidate;
+      if (distance == 0 || distance > max_distance || distance <= last_distance) {
+        break;
+      }
+      if (read32(&buf[ip - distance]) == sequence) {
+        match_len = CHAT_LZ_MIN_MATCH +
+                    count_match(&buf[ip - distance + CHAT_LZ_MIN_MATCH], &buf[ip + CHAT_LZ_MIN_MATCH], &buf[end]);
+        if (match_len > best_len) {
+          best_len = match_len;
+          best_distance = distance;
+          if (ip + match_len == end) {
+            break;
+          }
+        }
+      }
+      last_distance = distance;
+      candidate = encoder->chain[candidate & CHAIN_MASK];
+    }
+    insert(encoder, ip);
+
+    if (best_len < CHAT_LZ_MIN_MATCH) {
+      ip++;
+      continue;
+    }
+    op = put_sequence(op, out_end, &buf[anchor], ip - anchor, best_distance, best_len);
+    if (op == NULL) {
+      return 0;
+    }
+    // Later matches may start anywhere in this one
+    for (size_t i = ip + 1; i < ip + best_len && i < limit; ++i) {
+      insert(encoder, i);
+    }
+    ip += best_len;
+    anchor = ip;
+  }
+
+  op = put_sequence(op, out_end, &buf[anchor], end - anchor, 0, 0);
+  return op == NULL ? 0 : op - out;
+}
+
+int init_lz_decoder(struct LzDecoder *decoder, size_t max_batch) {
+  decoder->capacity = CHAT_LZ_WINDOW + max_batch;
+  decoder->buf = (char *)malloc(decoder->capacity);
+  decoder->len = 0;
+  return decoder->buf == NULL ? -1 : 0;
+}
+
+void free_lz_decoder(struct LzDecoder *decoder) {
+  free(decoder->buf);
+  decoder->buf = NULL;
+}
+
+void reset_lz_decoder(struct LzDecoder *decoder) {
+  decoder->len = 0;
+}
+
+/**
+ * Read a length's extra bytes.
+ *
+ * @return false if the data ends first
+ */
+static inline bool get_length(const unsigned char **ip, const unsigned char *end, size_t *n) {
+  unsigned char byte;
+
+  do {
+    if (*ip >= end) {
+      return false;
+    }
+    byte = *(*ip)++;
+    *n += byte;
+  } while (byte == 255);
+  return true;
+}
+
+const char *lz_decompress(struct LzDecoder *decoder, const char *in, size_t len, size_t raw_len) {
+  const unsigned char *ip = (const unsigned char *)in;
+  const unsigned char *in_end = ip + len;
+  char *start;
+  char *op;
+  char *out_end;
+  const char *from;
+  size_t literal_len;
+  size_t match_len;
+  size_t distance;
+  unsigned char token;
+
+  if (raw_len > decoder->capacity - CHAT_LZ_WINDOW) {
+    return NULL;
+  }
+  make_room(decoder->buf, decoder->capacity, &decoder->len, raw_len);
+  start = &decoder->buf[decoder->len];
+  op = start;
+  out_end = start + raw_len;
+
+  while (ip < in_end) {
+    token = *ip++;
+    literal_len = token >> 4;
+    if (literal_len == 15 && !get_length(&ip, in_end, &literal_len)) {
+      return NULL;
+    }
+    if (literal_len > (size_t)(in_end - ip) || literal_len > (size_t)(out_end - op)) {
+      return NULL;
+    }
+    memcpy(op, ip, literal_len);
+    op += literal_len;
+    ip += literal_len;
+    if (ip == in_end) {
+      break;
+    }
+
+    if (in_end - ip < 2) {
+      return NULL;
+    }
+    distance = (size_t)ip[0] << 8 | ip[1];
+    ip += 2;
+    match_len = token & 15;
+    if (match_len == 15 && !get_length(&ip, in_end, &match_len)) {
+      return NULL;
+    }
+    match_len += CHAT_LZ_MIN_MATCH;
+    if (distance == 0 || distance > (size_t)(op - decoder->buf) || match_len > (size_t)(out_end - op)) {
+      return NULL;
+    }
+    from = op - distance;
+    if (distance >= match_len) {
+      memcpy(op, from, match_len);
+      op += match_len;
+    } else {
+      // Overlapping: the match repeats the last distance bytes
+      for (size_t i = 0; i < match_len; ++i) {
+        *op++ = *from++;
+      }
+    }
+  }
+  if (op != out_end) {
+    return NULL;
+  }
+  decoder->len += raw_len;
+  return start;
+}
+
+const char *lz_store(struct LzDecoder *decoder, const char *in, size_t len) {
+  char *start;
+
+  if (len > decoder->capacity - CHAT_LZ_WINDOW) {
+    return NULL;
+  }
+  make_room(decoder->buf, decoder->capacity, &decoder->len, len);
+  start = &decoder->buf[decoder->len];
+  memcpy(start, in, len);
+  decoder->len += len;
+  return start;
+}
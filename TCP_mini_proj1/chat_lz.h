@@ -0,0 +1,115 @@
+//
+// A small LZ77 codec for the monitor stream (MON_COMPRESSED), with no
+// dependencies. The compressor and decompressor each keep the last
+// CHAT_LZ_WINDOW bytes that went through them, so a batch can refer
+// back into the batches before it: chat messages repeat nicknames and
+// phrases far more across batches than within a small one.
+//
+// A batch is a run of sequences, each
+//
+//   token          literal count in the high 4 bits, match length
+//                  less CHAT_LZ_MIN_MATCH in the low 4; 15 means more
+//                  follows as bytes of 255 and a last one below it
+//   [count bytes]
+//   literals
+//   offset         2 bytes, big endian: how far back the match starts
+//   [length bytes]
+//
+// except the last, which stops after its literals.
+//
+// The level (1 to CHAT_LZ_MAX_LEVEL) is how many earlier places with
+// the same 4 bytes are tried for each match, 1 << (level - 1), so each
+// level up costs more time for a little more compression.
+//
+
+#ifndef TCP_CHAT_CHAT_LZ_H
+#define TCP_CHAT_CHAT_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// History a match may reach back into
+#define CHAT_LZ_WINDOW 65535
+
+#define CHAT_LZ_MIN_MATCH 4
+#define CHAT_LZ_MAX_LEVEL 9
+#define CHAT_LZ_DEFAULT_LEVEL 3
+
+#define CHAT_LZ_HASH_BITS 15
+
+/**
+ * Compression state of one stream.
+ */
+struct LzEncoder {
+  char *buf; // the window, then the batch being compressed
+  size_t capacity; // CHAT_LZ_WINDOW + the largest batch
+  size_t len;
+  uint32_t base; // stream position of buf[0]
+  uint32_t *head; // hash of 4 bytes -> last stream position with them
+  uint32_t *chain; // stream position -> the one before with the same hash
+  int depth;
+};
+
+/**
+ * Decompression state of one stream.
+ */
+struct LzDecoder {
+  char *buf; // the window, then the batch being decompressed
+  size_t capacity;
+  size_t len;
+};
+
+/**
+ * @return the most a batch of len bytes can compress to
+ */
+static inline size_t lz_bound(size_t len) {
+  return len + len / 255 + 16;
+}
+
+/**
+ * @param max_batch largest batch that will be compressed
+ * @return 0 on success, -1 if out of memory
+ */
+int init_lz_encoder(struct LzEncoder *encoder, size_t max_batch, int level);
+
+void free_lz_encoder(struct LzEncoder *encoder);
+
+/**
+ * Forget the window, so the next batch can be decompressed on its own.
+ */
+void reset_lz_encoder(struct LzEncoder *encoder);
+
+/**
+ * Compress a batch, which stays in the window for later ones.
+ *
+ * @return its compressed length, or 0 if that would be more than cap,
+ *         in which case the batch is in the window all the same
+ */
+size_t lz_compress(struct LzEncoder *encoder, const char *in, size_t len, char *out, size_t cap);
+
+/**
+ * @param max_batch largest batch that will be decompressed
+ * @return 0 on success, -1 if out of memory
+ */
+int init_lz_decoder(struct LzDecoder *decoder, size_t max_batch);
+
+void free_lz_decoder(struct LzDecoder *decoder);
+
+void reset_lz_decoder(struct LzDecoder *decoder);
+
+/**
+ * Decompress a batch of raw_len bytes.
+ *
+ * @return the batch, valid until the next call, or NULL if the data is
+ *         not a batch of raw_len bytes for this window
+ */
+const char *lz_decompress(struct LzDecoder *decoder, const char *in, size_t len, size_t raw_len);
+
+/**
+ * Add a batch that was sent as it is to the window.
+ *
+ * @return the batch, as lz_decompress()
+ */
+const char *lz_store(struct LzDecoder *decoder, const char *in, size_t len);
+
+#endif //TCP_CHAT_CHAT_LZ_H
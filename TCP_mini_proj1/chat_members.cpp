@@ -0,0 +1,280 @@
+#include "chat_members.h"
+#include <string.h>
+
+#include "chat_wire.h"
+
+// Op byte and 2 byte length before each nickname
+#define CHANGE_HEADER 3
+
+static size_t change_size(uint16_t nickname_len) {
+  return CHANGE_HEADER + nickname_len;
+}
+
+static void put_change(char *at, char op, const char *nickname, uint16_t nickname_len) {
+  at[0] = op;
+  wire::store_be<uint16_t>((uint8_t *)&at[1], nickname_len);
+  memcpy(&at[CHANGE_HEADER], nickname, nickname_len);
+}
+
+void init_member_log(struct ChatMemberLog *log, uint64_t id, size_t max_bytes) {
+  log->id = id;
+  log->version = 0;
+  log->first = 0;
+  log->changes.assign(max_bytes, 0);
+  log->head = 0;
+  log->tail = 0;
+  log->starts.assign(CHAT_MEMBER_LOG_STARTS, 0);
+  log->starts_head = 0;
+  log->holders.clear();
+  log->snapshot_bytes = 0;
+  log->net.clear();
+}
+
+/**
+ * Where the i-th change kept starts in the ring.
+ */
+static size_t change_at(const struct ChatMemberLog *log, uint64_t i) {
+  return log->starts[(log->starts_head + i) & (log->starts.size() - 1)];
+}
+
+static uint16_t change_nickname_len(const struct ChatMemberLog *log, size_t at) {
+  return wire::load_be<uint16_t>((const uint8_t *)&log->changes[at + 1]);
+}
+
+static void drop_oldest(struct ChatMemberLog *log) {
+  log->starts_head = (log->starts_head + 1) & (log->starts.size() - 1);
+  log->first++;
+  if (log->first == log->version) {
+    log->head = 0;
+    log->tail = 0;
+  } else {
+    log->head = change_at(log, 0);
+  }
+}
+
+/**
+ * Find room for size bytes at the tail, wrapping it to the front if
+ * they do not fit before the end.
+ *
+ * @return false if the oldest change is in the way
+ */
+static bool make_room(struct ChatMemberLog *log, size_t size) {
+  // Changes run from head to tail, or wrap if the tail is not past the head
+  if (log->first == log->version || log->tail > log->head) {
+    if (log->tail + size <= log->changes.size()) {
+      return true;
+    }
+    if (size <= log->head) {
+      log->tail = 0;
+      return true;
+    }
+    return false;
+  }
+  return log->tail + size <= log->head;
+}
+
+static void add_change(struct ChatMemberLog *log, char op, const char *nickname, uint16_t nickname_len) {
+  size_t size = change_size(nickname_len);
+  uint64_t count;
+  std::vector<uint32_t> starts;
+
+  if (size > log->changes.size()) {
+    // Can never be kept, so nobody can be sent changes across it
+    log->starts_head = 0;
+    log->head = 0;
+    log->tail = 0;
+    log->version++;
+    log->first = log->version;
+    return;
+  }
+  while (!make_room(log, size)) {
+    drop_oldest(log);
+  }
+  count = log->version - log->first;
+  if (count == log->starts.size()) {
+    starts.resize(2 * count);
+    for (uint64_t i = 0; i < count; ++i) {
+      starts[i] = (uint32_t)change_at(log, i);
+    }
+    log->starts.swap(starts);
+    log->starts_head = 0;
+  }
+  put_change(&log->changes[log->tail], op, nickname, nickname_len);
+  log->starts[(log->starts_head + count) & (log->starts.size() - 1)] = (uint32_t)log->tail;
+  log->tail += size;
+  log->version++;
+}
+
+bool member_log_join(struct ChatMemberLog *log, const char *nickname, uint16_t nickname_len) {
+  uint32_t &count = log->holders[std::string(nickname, nickname_len)];
+
+  if (count++ > 0) {
+    return false;
+  }
+  log->snapshot_bytes += change_size(nickname_len);
+  add_change(log, CHAT_MEMBER_JOINED, nickname, nickname_len);
+  return true;
+}
+
+bool member_log_leave(struct ChatMemberLog *log, const char *nickname, uint16_t nickname_len) {
+  auto found = log->holders.find(std::string(nickname, nickname_len));
+
+  if (found == log->holders.end() || --found->second > 0) {
+    return false;
+  }
+  log->holders.erase(found);
+  log->snapshot_bytes -= change_size(nickname_len);
+  add_change(log, CHAT_MEMBER_LEFT, nickname, nickname_len);
+  return true;
+}
+
+/**
+ * Appends changes to out as ChatMembersMsgs, starting a new one when
+ * the current one is full.
+ */
+struct AnswerWriter {
+  std::vector<char> *out;
+  struct ChatMembersMsg message;
+  size_t header_at; // of the message being filled
+  size_t data_len;
+};
+
+static void start_message(struct AnswerWriter *writer) {
+  writer->header_at = writer->out->size();
+  writer->data_len = 0;
+  writer->out->resize(writer->header_at + ChatMembersCodec::wire_size);
+}
+
+static void finish_message(struct AnswerWriter *writer, bool more) {
+  writer->message.data_len = (uint32_t)writer->data_len;
+  if (more) {
+    writer->message.flags |= CHAT_MEMBERS_MORE;
+  }
+  ChatMembersCodec::encode(writer->message, &(*writer->out)[writer->header_at], ChatMembersCodec::wire_size);
+  writer->message.flags &= ~CHAT_MEMBERS_MORE;
+}
+
+static void write_change(struct AnswerWriter *writer, char op, const char *nickname, uint16_t nickname_len) {
+  size_t size = change_size(nickname_len);
+  size_t at;
+
+  if (writer->data_len + size > CHAT_MEMBERS_FRAME_DATA) {
+    finish_message(writer, true);
+    start_message(writer);
+  }
+  at = writer->out->size();
+  writer->out->resize(at + size);
+  put_change(&(*writer->out)[at], op, nickname, nickname_len);
+  writer->data_len += size;
+}
+
+/**
+ * Every member, as joins, as far as limit allows.
+ */
+static void write_snapshot(const struct ChatMemberLog *log, struct AnswerWriter *writer, size_t limit) {
+  size_t sent = 0;
+
+  writer->message.flags = CHAT_MEMBERS_SNAPSHOT;
+  if (log->snapshot_bytes > limit) {
+    writer->message.flags |= CHAT_MEMBERS_PARTIAL;
+  }
+  start_message(writer);
+  for (auto it = log->holders.begin(); it != log->holders.end(); ++it) {
+    sent += change_size((uint16_t)it->first.size());
+    if (sent > limit) {
+      break;
+    }
+    write_change(writer, CHAT_MEMBER_JOINED, it->first.data(), (uint16_t)it->first.size());
+  }
+  finish_message(writer, false);
+}
+
+/**
+ * 32 bit FNV-1a, for the netting table.
+ */
+static uint32_t hash_nickname(const char *nickname, uint16_t len) {
+  uint32_t hash = 2166136261u;
+
+  for (uint16_t i = 0; i < len; ++i) {
+    hash = (hash ^ (uint8_t)nickname[i]) * 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * Count each nickname's changes from since on in log->net, keyed by
+ * the change's own bytes in the ring.
+ */
+static void net_changes(struct ChatMemberLog *log, uint64_t since) {
+  uint64_t from = since - log->first;
+  uint32_t count = (uint32_t)(log->version - since);
+  size_t slots = 16;
+  size_t mask;
+  size_t slot;
+  size_t at;
+  size_t other;
+  uint16_t len;
+
+  while (slots < 2 * (size_t)count) {
+    slots *= 2;
+  }
+  log->net.assign(slots, {0, 0});
+  mask = slots - 1;
+  for (uint32_t i = 0; i < count; ++i) {
+    at = change_at(log, from + i);
+    len = change_nickname_len(log, at);
+    slot = hash_nickname(&log->changes[at + CHANGE_HEADER], len) & mask;
+    while (log->net[slot].last != 0) {
+      other = change_at(log, from + log->net[slot].last - 1);
+      if (change_nickname_len(log, other) == len &&
+          memcmp(&log->changes[other + CHANGE_HEADER], &log->changes[at + CHANGE_HEADER], len) == 0) {
+        break;
+      }
+      slot = (slot + 1) & mask;
+    }
+    log->net[slot].last = i + 1;
+    log->net[slot].changes++;
+  }
+}
+
+bool member_log_answer(struct ChatMemberLog *log, uint16_t type, uint64_t log_id, uint64_t since, size_t limit,
+                       std::vector<char> *out) {
+  struct AnswerWriter writer;
+  size_t delta_bytes = 0;
+  size_t at;
+
+  writer.out = out;
+  writer.message.type = type;
+  writer.message.flags = 0;
+  writer.message.log = log->id;
+  writer.message.version = log->version;
+
+  if (log_id != log->id || since < log->first || since > log->version) {
+    write_snapshot(log, &writer, limit);
+    return true;
+  }
+  // A nickname only changed if it came or went an odd number of times,
+  // and then as its last change did
+  net_changes(log, since);
+  for (size_t slot = 0; slot < log->net.size(); ++slot) {
+    if (log->net[slot].changes % 2 == 1) {
+      at = change_at(log, since - log->first + log->net[slot].last - 1);
+      delta_bytes += change_size(change_nickname_len(log, at));
+    }
+  }
+  // Every member instead only if that saves at least a message's worth
+  if (delta_bytes > log->snapshot_bytes + CHAT_MEMBERS_FRAME_DATA || delta_bytes > limit) {
+    write_snapshot(log, &writer, limit);
+    return true;
+  }
+
+  start_message(&writer);
+  for (size_t slot = 0; slot < log->net.size(); ++slot) {
+    if (log->net[slot].changes % 2 == 1) {
+      at = change_at(log, since - log->first + log->net[slot].last - 1);
+      write_change(&writer, log->changes[at], &log->changes[at + CHANGE_HEADER], change_nickname_len(log, at));
+    }
+  }
+  finish_message(&writer, false);
+  return false;
+}
@@ -0,0 +1,98 @@
+//
+// The log of who joined and left the chat, behind versioned member
+// lists (CLIENT_MEMBERS and MON_PRESENCE in tcp_chat.h). Every nickname
+// a client takes for the first time, or gives up for the last, adds a
+// change to the log and one to its version; a client that says which
+// version it last saw is sent only the changes since, netted out, so a
+// nickname that came and went twice is not mentioned at all.
+//
+// The changes are kept in a ring of max_bytes, the oldest dropped to
+// make room for the newest; a client further behind than that, or one
+// whose version is of another log (the server restarted), is sent
+// every member instead, as is one the changes would cost a message's
+// worth of bytes (CHAT_MEMBERS_FRAME_DATA) more than that. Netting the
+// changes hashes the nicknames where they lie in the ring, into a
+// table the log keeps, so answering allocates nothing once the table
+// has grown to the log's size.
+//
+// Nothing here locks: the server keeps one log for all its workers
+// and its federation, behind a mutex.
+//
+
+#ifndef TCP_CHAT_CHAT_MEMBERS_H
+#define TCP_CHAT_CHAT_MEMBERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Bytes of changes kept by default
+#define CHAT_MEMBER_LOG_BYTES (256 * 1024)
+
+// Starting number of changes ChatMemberLog::starts has room for
+#define CHAT_MEMBER_LOG_STARTS 1024
+
+// Bytes of changes sent in each CLIENT_MEMBERS or MON_PRESENCE
+#define CHAT_MEMBERS_FRAME_DATA (60 * 1024)
+
+/**
+ * How a nickname changed over the changes an answer covers: the last
+ * of them, and how many there were.
+ */
+struct NetChange {
+  uint32_t last; // index of the last change + 1, 0 for an empty slot
+  uint32_t changes;
+};
+
+struct ChatMemberLog {
+  uint64_t id; // tells this log from one before a restart; never 0
+  uint64_t version; // changes ever logged
+  uint64_t first; // version before the oldest change kept
+  // Ring of changes as on the wire. A change never wraps: one that
+  // does not fit before the end goes at the front, past a gap.
+  std::vector<char> changes;
+  size_t head; // where the oldest change starts
+  size_t tail; // where the next change goes
+  std::vector<uint32_t> starts; // ring of where each change kept starts, a power of two long
+  uint32_t starts_head; // of the oldest change
+  std::unordered_map<std::string, uint32_t> holders; // nickname -> connections with it
+  size_t snapshot_bytes; // every member as a change
+  std::vector<struct NetChange> net; // member_log_answer()'s table, open addressed by nickname
+};
+
+/**
+ * @param id nonzero, and different each time the server starts
+ * @param max_bytes below 4GB
+ */
+void init_member_log(struct ChatMemberLog *log, uint64_t id, size_t max_bytes);
+
+/**
+ * Count one more connection with a nickname.
+ *
+ * @return true if it is the first, so a join was logged
+ */
+bool member_log_join(struct ChatMemberLog *log, const char *nickname, uint16_t nickname_len);
+
+/**
+ * Count one connection fewer with a nickname.
+ *
+ * @return true if it was the last, so a leave was logged
+ */
+bool member_log_leave(struct ChatMemberLog *log, const char *nickname, uint16_t nickname_len);
+
+/**
+ * Build the answer to someone who has seen the log up to a version:
+ * ChatMembersMsgs of the given type, each with up to
+ * CHAT_MEMBERS_FRAME_DATA bytes of changes, appended to out.
+ *
+ * @param log_id log of the version seen, 0 for none
+ * @param limit most bytes of changes to send; a list of every member
+ *              longer than that is cut short with CHAT_MEMBERS_PARTIAL
+ * @return true if the answer is every member rather than changes
+ */
+bool member_log_answer(struct ChatMemberLog *log, uint16_t type, uint64_t log_id, uint64_t since, size_t limit,
+                       std::vector<char> *out);
+
+#endif //TCP_CHAT_CHAT_MEMBERS_H
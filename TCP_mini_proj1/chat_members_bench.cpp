@@ -0,0 +1,125 @@
+//
+// What versioned member lists (chat_members.h) save over sending every
+// member each time. A room of --members nicknames has --churn of them
+// come or go between each of --polls LISTs, and each LIST is answered
+// both ways: with every member, as a client with no version is, and
+// with the changes since the last LIST, as a client keeping up is.
+//
+// It prints the bytes and the CPU time (thread CPU time, so what a
+// server worker would spend, lock aside) per answer each way.
+//
+// e.g., ./chat_members_bench --members 100000 --churn 50
+//       ./chat_members_bench --members 1000 --churn 1000 --polls 1000
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "chat_members.h"
+#include "chat_wire.h"
+
+static uint64_t cpu_ns() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static uint32_t next_random(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return (uint32_t)(*state >> 32);
+}
+
+struct Way {
+  uint64_t bytes;
+  uint64_t ns;
+  uint64_t snapshots; // answers that were every member
+};
+
+static void answer(struct ChatMemberLog *log, uint64_t log_id, uint64_t since, std::vector<char> *out,
+                   struct Way *way) {
+  uint64_t start;
+
+  out->clear();
+  start = cpu_ns();
+  way->snapshots += member_log_answer(log, CLIENT_MEMBERS, log_id, since, SIZE_MAX, out) ? 1 : 0;
+  way->ns += cpu_ns() - start;
+  way->bytes += out->size();
+}
+
+int main(int argc, char *argv[]) {
+  struct ChatMemberLog log;
+  struct Way full = {0, 0, 0};
+  struct Way changes = {0, 0, 0};
+  std::vector<std::string> names;
+  std::vector<bool> present;
+  std::vector<char> out;
+  uint64_t state = 88172645463325252ull;
+  uint64_t since;
+  size_t members = 10000;
+  size_t churn = 10;
+  size_t polls = 100;
+  size_t log_bytes = CHAT_MEMBER_LOG_BYTES;
+  size_t n;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--members") == 0 && i + 1 < argc) {
+      members = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--churn") == 0 && i + 1 < argc) {
+      churn = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--polls") == 0 && i + 1 < argc) {
+      polls = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--log-kb") == 0 && i + 1 < argc) {
+      log_bytes = strtoul(argv[++i], NULL, 10) * 1024;
+    } else {
+      fprintf(stderr, "Usage: %s [--members N] [--churn N] [--polls N] [--log-kb KB]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (members == 0 || polls == 0) {
+    fprintf(stderr, "--members and --polls must be at least 1\n");
+    return 1;
+  }
+
+  // Twice as many nicknames as members, so churn both joins and leaves
+  init_member_log(&log, 1, log_bytes);
+  for (size_t i = 0; i < 2 * members; ++i) {
+    names.push_back("user" + std::to_string(i));
+    present.push_back(i < members);
+    if (i < members) {
+      member_log_join(&log, names[i].data(), (uint16_t)names[i].size());
+    }
+  }
+
+  since = log.version;
+  for (size_t p = 0; p < polls; ++p) {
+    for (size_t c = 0; c < churn; ++c) {
+      n = next_random(&state) % names.size();
+      if (present[n]) {
+        member_log_leave(&log, names[n].data(), (uint16_t)names[n].size());
+      } else {
+        member_log_join(&log, names[n].data(), (uint16_t)names[n].size());
+      }
+      present[n] = !present[n];
+    }
+    answer(&log, 0, 0, &out, &full);
+    answer(&log, log.id, since, &out, &changes);
+    since = log.version;
+  }
+
+  printf("%zu members, %zu changes between each of %zu LISTs, %zu KB of log\n", members, churn, polls,
+         log_bytes / 1024);
+  printf("answer          bytes/LIST     us/LIST  snapshots\n");
+  printf("every member  %12.0f  %10.2f  %9llu\n", (double)full.bytes / polls, full.ns / 1e3 / polls,
+         (unsigned long long)full.snapshots);
+  printf("changes       %12.0f  %10.2f  %9llu\n", (double)changes.bytes / polls, changes.ns / 1e3 / polls,
+         (unsigned long long)changes.snapshots);
+  printf("saved         %11.1fx\n", changes.bytes > 0 ? (double)full.bytes / changes.bytes : 0.0);
+  return 0;
+}
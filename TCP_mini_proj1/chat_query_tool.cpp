@@ -0,0 +1,260 @@
+//
+// Finds messages in an archive written by tcpchatmon --archive, using
+// the search indexes chat_index builds (chat_search.h), and prints them
+// as chat_archive does:
+//
+//   --from NICKNAME   sent by NICKNAME
+//   --to NICKNAME     direct messages to NICKNAME
+//   --term WORDS      with every one of WORDS in them (may be repeated)
+//   --since SECONDS   received at or after, in Unix time
+//   --until SECONDS   received before
+//
+// Only messages that match all of them are printed, or with --count
+// counted, up to --limit of them. A query needs at least one of --from,
+// --to or --term; for the rest there is chat_archive.
+//
+// The keys' postings are lined up by skipping through them, so a query
+// reads only the blocks of postings near a possible match and the
+// records it prints. The time range becomes a range of offsets in each
+// segment, using the archive's own index.
+//
+// e.g., ./chat_query /var/tmp/chat --from alice --term "deploy failed" --since 1760000000
+//
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "chat_archive.h"
+#include "chat_search.h"
+
+// stdout buffer, so printing costs one write per this many bytes
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+
+struct Query {
+  std::vector<std::string> keys;
+  uint64_t since_ns;
+  uint64_t until_ns;
+  bool count_only;
+  uint64_t limit;
+};
+
+static uint64_t now_ns() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Seconds, with up to nine places after the point, as ns. Not through
+ * a double, which rounds today's times by hundreds of ns.
+ */
+static uint64_t parse_seconds(const char *text) {
+  char *end;
+  uint64_t ns = strtoull(text, &end, 10) * 1000000000;
+  uint64_t scale = 100000000;
+
+  if (*end == '.') {
+    for (++end; *end >= '0' && *end <= '9' && scale > 0; ++end, scale /= 10) {
+      ns += (*end - '0') * scale;
+    }
+  }
+  return ns;
+}
+
+/**
+ * @return the offset of the segment's first record received at or
+ *         after ns, or its end if there is none
+ */
+static uint32_t first_record_at(const struct ChatArchiveSegment *segment, uint64_t ns) {
+  struct ChatArchiveSegment reader = *segment;
+  struct ChatArchiveRecord record;
+  const char *frame;
+  uint32_t offset;
+
+  seek_archive_segment(&reader, ns);
+  for (;;) {
+    offset = (uint32_t)reader.offset;
+    if (!next_archive_record(&reader, &record, &frame) || record.recv_ns >= ns) {
+      return offset;
+    }
+  }
+}
+
+static bool fewer_postings(const struct ChatPostings &a, const struct ChatPostings &b) {
+  return a.count < b.count;
+}
+
+/**
+ * Run the query over one segment.
+ *
+ * @return messages matched
+ */
+static uint64_t query_segment(const struct Query *query, const std::string &segment_path,
+                              const struct ChatSearchIndex *index, uint64_t limit) {
+  std::vector<struct ChatPostings> postings(query->keys.size());
+  struct ChatArchiveSegment segment;
+  struct ChatArchiveRecord record;
+  struct ArchivedMessage message;
+  const char *frame;
+  bool timed = query->since_ns > 0 || query->until_ns < UINT64_MAX;
+  uint32_t low = 0;
+  uint32_t high = UINT32_MAX;
+  uint32_t target;
+  uint64_t matched = 0;
+  size_t i;
+
+  for (i = 0; i < query->keys.size(); ++i) {
+    if (!find_search_key(index, query->keys[i], &postings[i])) {
+      return 0;
+    }
+  }
+  // The index already knows how many messages have one key
+  if (query->count_only && !timed && postings.size() == 1) {
+    return std::min((uint64_t)postings[0].count, limit);
+  }
+
+  if (map_archive_segment(&segment, segment_path) == -1) {
+    fprintf(stderr, "Skipping %s: %s\n", segment_path.c_str(), strerror(errno));
+    return 0;
+  }
+  // Only the matches are read, not the segment through
+  madvise((void *)segment.data, segment.len, MADV_RANDOM);
+  if (query->since_ns > 0) {
+    low = first_record_at(&segment, query->since_ns);
+  }
+  if (query->until_ns < UINT64_MAX) {
+    high = first_record_at(&segment, query->until_ns);
+  }
+
+  // Lead with the rarest key and have the others catch up with it
+  std::sort(postings.begin(), postings.end(), fewer_postings);
+  target = low;
+  while (matched < limit) {
+    seek_postings(&postings[0], target);
+    if (postings[0].done || postings[0].offset >= high) {
+      break;
+    }
+    target = postings[0].offset;
+    for (i = 1; i < postings.size(); ++i) {
+      seek_postings(&postings[i], target);
+      if (postings[i].done || postings[i].offset != target) {
+        break;
+      }
+    }
+    if (i < postings.size()) {
+      if (postings[i].done) {
+        break;
+      }
+      target = postings[i].offset;
+      continue;
+    }
+
+    matched++;
+    if (!query->count_only) {
+      segment.offset = target;
+      if (next_archive_record(&segment, &record, &frame) &&
+          decode_archived_message(frame, record.frame_len, &message)) {
+        print_archived_message(stdout, &record, &message);
+      }
+    }
+    target++;
+  }
+  unmap_archive_segment(&segment);
+  return matched;
+}
+
+int main(int argc, char *argv[]) {
+  struct Query query = {std::vector<std::string>(), 0, UINT64_MAX, false, UINT64_MAX};
+  struct ChatSearchIndex index;
+  std::vector<std::string> segments;
+  std::vector<std::string> terms;
+  std::string path;
+  struct stat info;
+  uint64_t start = now_ns();
+  uint64_t matched = 0;
+  int searched = 0;
+  int unindexed = 0;
+  int stale = 0;
+  static char output_buf[OUTPUT_BUFFER_SIZE];
+
+  if (argc < 2) {
+    fprintf(stderr,
+            "Usage: %s DIR [--from NICKNAME] [--to NICKNAME] [--term WORDS]... [--since SECONDS] "
+            "[--until SECONDS] [--count] [--limit N]\n",
+            argv[0]);
+    return 1;
+  }
+  for (int i = 2; i < argc; ++i) {
+    if (strcmp(argv[i], "--from") == 0 && i + 1 < argc) {
+      query.keys.push_back(std::string("f:") + argv[++i]);
+    } else if (strcmp(argv[i], "--to") == 0 && i + 1 < argc) {
+      query.keys.push_back(std::string("t:") + argv[++i]);
+    } else if (strcmp(argv[i], "--term") == 0 && i + 1 < argc) {
+      ++i;
+      terms = search_terms(argv[i], strlen(argv[i]));
+      for (size_t t = 0; t < terms.size(); ++t) {
+        query.keys.push_back("w:" + terms[t]);
+      }
+    } else if (strcmp(argv[i], "--since") == 0 && i + 1 < argc) {
+      query.since_ns = parse_seconds(argv[++i]);
+    } else if (strcmp(argv[i], "--until") == 0 && i + 1 < argc) {
+      query.until_ns = parse_seconds(argv[++i]);
+    } else if (strcmp(argv[i], "--count") == 0) {
+      query.count_only = true;
+    } else if (strcmp(argv[i], "--limit") == 0 && i + 1 < argc) {
+      query.limit = strtoull(argv[++i], NULL, 10);
+    } else {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if (query.keys.empty()) {
+    fprintf(stderr, "Give at least one of --from, --to or --term\n");
+    return 1;
+  }
+  // A repeated key only slows the query down
+  std::sort(query.keys.begin(), query.keys.end());
+  query.keys.erase(std::unique(query.keys.begin(), query.keys.end()), query.keys.end());
+
+  segments = list_archive_segments(argv[1]);
+  if (segments.empty()) {
+    fprintf(stderr, "No archive segments in %s\n", argv[1]);
+    return 1;
+  }
+  setvbuf(stdout, output_buf, _IOFBF, sizeof(output_buf));
+
+  for (size_t s = 0; s < segments.size() && matched < query.limit; ++s) {
+    path = search_index_path(segments[s]);
+    if (map_search_index(&index, path) == -1) {
+      unindexed++;
+      continue;
+    }
+    if (stat(segments[s].c_str(), &info) == 0 && (uint64_t)info.st_size != index.header.segment_len) {
+      stale++;
+    }
+    matched += query_segment(&query, segments[s], &index, query.limit - matched);
+    unmap_search_index(&index);
+    searched++;
+  }
+  if (query.count_only) {
+    printf("%llu\n", (unsigned long long)matched);
+  }
+  fflush(stdout);
+
+  fprintf(stderr, "%llu messages matched in %.2f ms over %d segments\n", (unsigned long long)matched,
+          (now_ns() - start) / 1e6, searched);
+  if (unindexed > 0 || stale > 0) {
+    fprintf(stderr, "%d segments have no index and %d have grown since they were indexed; run chat_index\n",
+            unindexed, stale);
+  }
+  return 0;
+}
@@ -0,0 +1,389 @@
+#include "chat_search.h"
+#include "chat_wire.h"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+
+// Output buffer for writing an index
+#define WRITE_BUFFER_SIZE (1024 * 1024)
+
+/**
+ * One key's postings as they are gathered.
+ */
+struct KeyPostings {
+  std::vector<char> deltas;
+  std::vector<struct ChatSearchSkip> skips;
+  uint32_t last;
+  uint32_t count;
+};
+
+static inline bool is_term_byte(unsigned char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+static inline char lower(unsigned char c) {
+  return (char)(c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c);
+}
+
+/**
+ * Append the term starting at text[*i] to term, and move *i past it.
+ */
+static void take_term(const char *text, size_t len, size_t *i, std::string *term) {
+  size_t taken = 0;
+
+  for (; *i < len && is_term_byte(text[*i]); ++*i) {
+    if (taken < CHAT_SEARCH_MAX_TERM) {
+      term->push_back(lower(text[*i]));
+      taken++;
+    }
+  }
+}
+
+std::string search_index_path(const std::string &segment_path) {
+  return segment_path.substr(0, segment_path.size() - 4) + ".six";
+}
+
+std::vector<std::string> search_terms(const char *text, size_t len) {
+  std::vector<std::string> terms;
+  std::string term;
+  size_t i = 0;
+
+  while (i < len) {
+    if (!is_term_byte(text[i])) {
+      i++;
+      continue;
+    }
+    term.clear();
+    take_term(text, len, &i, &term);
+    terms.push_back(term);
+  }
+  return terms;
+}
+
+static void put_varint(std::vector<char> *out, uint32_t value) {
+  while (value >= 0x80) {
+    out->push_back((char)(value | 0x80));
+    value >>= 7;
+  }
+  out->push_back((char)value);
+}
+
+static void add_posting(std::unordered_map<std::string, struct KeyPostings> *keys, const std::string &key,
+                        uint32_t offset) {
+  struct KeyPostings *postings = &(*keys)[key];
+
+  // A word twice in one message
+  if (postings->count > 0 && postings->last == offset) {
+    return;
+  }
+  if (postings->count % CHAT_SEARCH_BLOCK == 0) {
+    postings->skips.push_back({offset, (uint32_t)postings->deltas.size()});
+  } else {
+    put_varint(&postings->deltas, offset - postings->last);
+  }
+  postings->last = offset;
+  postings->count++;
+}
+
+static bool by_key(const std::pair<const std::string, struct KeyPostings> *a,
+                   const std::pair<const std::string, struct KeyPostings> *b) {
+  return a->first < b->first;
+}
+
+int build_search_index(const struct ChatArchiveSegment *segment, const std::string &path,
+                       struct ChatSearchHeader *header) {
+  std::unordered_map<std::string, struct KeyPostings> keys;
+  std::vector<const std::pair<const std::string, struct KeyPostings> *> sorted;
+  struct ChatArchiveSegment reader = *segment;
+  struct ChatArchiveRecord record;
+  struct ArchivedMessage message;
+  struct ChatSearchKey entry;
+  const char *frame;
+  std::string key;
+  std::string to_key = "t:" + std::string(segment->nickname, segment->nickname_len);
+  char fixed[ChatSearchKeyCodec::wire_size]; // the largest of header, key and skip
+  std::string tmp_path = path + ".tmp";
+  std::vector<char> buf;
+  uint64_t text_offset = 0;
+  uint64_t postings_offset;
+  uint32_t offset;
+  size_t i;
+  FILE *out;
+  int saved_errno;
+
+  memcpy(header->magic, CHAT_SEARCH_MAGIC, sizeof(header->magic));
+  header->segment_len = segment->len;
+  header->messages = 0;
+
+  for (;;) {
+    offset = (uint32_t)reader.offset;
+    if (!next_archive_record(&reader, &record, &frame)) {
+      break;
+    }
+    if (!decode_archived_message(frame, record.frame_len, &message)) {
+      continue;
+    }
+    header->messages++;
+
+    key.assign("f:", 2);
+    key.append(message.nickname, message.nickname_len);
+    add_posting(&keys, key, offset);
+    if (message.type == MON_DIRECT_MESSAGE && segment->nickname_len > 0) {
+      add_posting(&keys, to_key, offset);
+    }
+    // The terms go straight into key rather than through search_terms()
+    i = 0;
+    while (i < message.data_len) {
+      if (!is_term_byte(message.data[i])) {
+        i++;
+        continue;
+      }
+      key.resize(2);
+      key[0] = 'w';
+      take_term(message.data, message.data_len, &i, &key);
+      add_posting(&keys, key, offset);
+    }
+  }
+
+  sorted.reserve(keys.size());
+  for (auto it = keys.begin(); it != keys.end(); ++it) {
+    sorted.push_back(&*it);
+  }
+  std::sort(sorted.begin(), sorted.end(), by_key);
+  header->keys = (uint32_t)sorted.size();
+
+  out = fopen(tmp_path.c_str(), "wb");
+  if (out == NULL) {
+    return -1;
+  }
+  buf.resize(WRITE_BUFFER_SIZE);
+  setvbuf(out, buf.data(), _IOFBF, buf.size());
+
+  // The postings start after the header, keys and key text
+  postings_offset = ChatSearchHeaderCodec::wire_size + (uint64_t)sorted.size() * ChatSearchKeyCodec::wire_size;
+  for (i = 0; i < sorted.size(); ++i) {
+    postings_offset += sorted[i]->first.size();
+  }
+
+  ChatSearchHeaderCodec::encode(*header, fixed, sizeof(fixed));
+  fwrite(fixed, 1, ChatSearchHeaderCodec::wire_size, out);
+  for (i = 0; i < sorted.size(); ++i) {
+    const struct KeyPostings *postings = &sorted[i]->second;
+
+    entry.text_offset = (uint32_t)text_offset;
+    entry.text_len = (uint32_t)sorted[i]->first.size();
+    entry.count = postings->count;
+    entry.reserved = 0;
+    entry.postings_offset = postings_offset;
+    ChatSearchKeyCodec::encode(entry, fixed, sizeof(fixed));
+    fwrite(fixed, 1, sizeof(fixed), out);
+    text_offset += entry.text_len;
+    postings_offset += postings->skips.size() * ChatSearchSkipCodec::wire_size + postings->deltas.size();
+  }
+  for (i = 0; i < sorted.size(); ++i) {
+    fwrite(sorted[i]->first.data(), 1, sorted[i]->first.size(), out);
+  }
+  for (i = 0; i < sorted.size(); ++i) {
+    const struct KeyPostings *postings = &sorted[i]->second;
+
+    for (size_t s = 0; s < postings->skips.size(); ++s) {
+      ChatSearchSkipCodec::encode(postings->skips[s], fixed, sizeof(fixed));
+      fwrite(fixed, 1, ChatSearchSkipCodec::wire_size, out);
+    }
+    fwrite(postings->deltas.data(), 1, postings->deltas.size(), out);
+  }
+
+  // Swapped in whole, so a query never sees half an index
+  if (fflush(out) != 0 || ferror(out) || fsync(fileno(out)) == -1) {
+    saved_errno = errno;
+    fclose(out);
+    unlink(tmp_path.c_str());
+    errno = saved_errno;
+    return -1;
+  }
+  fclose(out);
+  if (rename(tmp_path.c_str(), path.c_str()) == -1) {
+    saved_errno = errno;
+    unlink(tmp_path.c_str());
+    errno = saved_errno;
+    return -1;
+  }
+  return 0;
+}
+
+int map_search_index(struct ChatSearchIndex *index, const std::string &path) {
+  struct stat info;
+  void *data;
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+  index->data = NULL;
+  if (fd == -1) {
+    return -1;
+  }
+  if (fstat(fd, &info) == -1) {
+    close(fd);
+    return -1;
+  }
+  data = info.st_size > 0 ? mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (data == MAP_FAILED) {
+    if (info.st_size == 0) {
+      errno = EINVAL;
+    }
+    return -1;
+  }
+  index->data = (const char *)data;
+  index->len = info.st_size;
+  if (!ChatSearchHeaderCodec::decode(index->data, index->len, index->header) ||
+      memcmp(index->header.magic, CHAT_SEARCH_MAGIC, sizeof(index->header.magic)) != 0 ||
+      (uint64_t)index->header.keys * ChatSearchKeyCodec::wire_size > index->len - ChatSearchHeaderCodec::wire_size) {
+    unmap_search_index(index);
+    errno = EINVAL;
+    return -1;
+  }
+  // Lookups jump about
+  madvise(data, index->len, MADV_RANDOM);
+  index->keys = index->data + ChatSearchHeaderCodec::wire_size;
+  index->text = index->keys + (size_t)index->header.keys * ChatSearchKeyCodec::wire_size;
+  return 0;
+}
+
+void unmap_search_index(struct ChatSearchIndex *index) {
+  if (index->data != NULL) {
+    munmap((void *)index->data, index->len);
+  }
+  index->data = NULL;
+}
+
+static int compare_key(const struct ChatSearchIndex *index, const struct ChatSearchKey *entry, const std::string &key) {
+  size_t len = std::min((size_t)entry->text_len, key.size());
+  int ret = memcmp(index->text + entry->text_offset, key.data(), len);
+
+  if (ret != 0) {
+    return ret;
+  }
+  return entry->text_len < key.size() ? -1 : entry->text_len > key.size();
+}
+
+/**
+ * Start on a block: its first posting from its skip.
+ */
+static void load_block(struct ChatPostings *postings, uint32_t block) {
+  struct ChatSearchSkip skip;
+
+  ChatSearchSkipCodec::decode(&postings->skips[(size_t)block * ChatSearchSkipCodec::wire_size],
+                              ChatSearchSkipCodec::wire_size, skip);
+  postings->block = block;
+  postings->offset = skip.first;
+  postings->next = postings->deltas + skip.deltas_offset;
+  postings->left = std::min((uint32_t)CHAT_SEARCH_BLOCK, postings->count - block * CHAT_SEARCH_BLOCK) - 1;
+}
+
+static uint32_t block_first(const struct ChatPostings *postings, uint32_t block) {
+  struct ChatSearchSkip skip;
+
+  ChatSearchSkipCodec::decode(&postings->skips[(size_t)block * ChatSearchSkipCodec::wire_size],
+                              ChatSearchSkipCodec::wire_size, skip);
+  return skip.first;
+}
+
+bool find_search_key(const struct ChatSearchIndex *index, const std::string &key, struct ChatPostings *postings) {
+  struct ChatSearchKey entry;
+  uint32_t low = 0;
+  uint32_t high = index->header.keys;
+  uint32_t middle;
+  int ret;
+
+  while (low < high) {
+    middle = low + (high - low) / 2;
+    ChatSearchKeyCodec::decode(&index->keys[(size_t)middle * ChatSearchKeyCodec::wire_size],
+                               ChatSearchKeyCodec::wire_size, entry);
+    if (entry.text_offset + (uint64_t)entry.text_len > (uint64_t)(index->data + index->len - index->text)) {
+      return false;
+    }
+    ret = compare_key(index, &entry, key);
+    if (ret == 0) {
+      break;
+    }
+    if (ret < 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  if (low >= high || entry.count == 0) {
+    return false;
+  }
+
+  postings->count = entry.count;
+  postings->blocks = (entry.count + CHAT_SEARCH_BLOCK - 1) / CHAT_SEARCH_BLOCK;
+  postings->end = index->data + index->len;
+  if (entry.postings_offset + (uint64_t)postings->blocks * ChatSearchSkipCodec::wire_size > index->len) {
+    return false;
+  }
+  postings->skips = index->data + entry.postings_offset;
+  postings->deltas = postings->skips + (size_t)postings->blocks * ChatSearchSkipCodec::wire_size;
+  postings->done = false;
+  load_block(postings, 0);
+  return true;
+}
+
+/**
+ * Move to the next posting.
+ */
+static void next_posting(struct ChatPostings *postings) {
+  uint32_t delta = 0;
+  int shift = 0;
+
+  if (postings->left == 0) {
+    if (postings->block + 1 < postings->blocks) {
+      load_block(postings, postings->block + 1);
+    } else {
+      postings->done = true;
+    }
+    return;
+  }
+  do {
+    if (postings->next >= postings->end || shift > 28) {
+      postings->done = true;
+      return;
+    }
+    delta |= (uint32_t)(*postings->next & 0x7F) << shift;
+    shift += 7;
+  } while (*postings->next++ & 0x80);
+  postings->offset += delta;
+  postings->left--;
+}
+
+void seek_postings(struct ChatPostings *postings, uint32_t offset) {
+  uint32_t low;
+  uint32_t high;
+  uint32_t middle;
+
+  if (postings->done || postings->offset >= offset) {
+    return;
+  }
+  // Skip to the last block starting at or before offset, if it is not this one
+  if (postings->block + 1 < postings->blocks && block_first(postings, postings->block + 1) <= offset) {
+    low = postings->block + 1;
+    high = postings->blocks;
+    while (high - low > 1) {
+      middle = low + (high - low) / 2;
+      if (block_first(postings, middle) <= offset) {
+        low = middle;
+      } else {
+        high = middle;
+      }
+    }
+    load_block(postings, low);
+  }
+  while (!postings->done && postings->offset < offset) {
+    next_posting(postings);
+  }
+}
@@ -0,0 +1,151 @@
+//
+// Inverted index over an archive (chat_archive.h), built by chat_index
+// and queried by chat_query, for finding messages by sender, recipient
+// or the words in them without reading the archive through.
+//
+// Each segment NNNNNN.seg gets its own index, NNNNNN.six, so a closed
+// segment is indexed once and a query over hundreds of millions of
+// messages is a few lookups in each of a few dozen mapped files. The
+// keys are
+//
+//   f:NICKNAME  messages from NICKNAME
+//   t:NICKNAME  direct messages to NICKNAME (the monitor's nickname)
+//   w:TERM      messages with TERM in them
+//
+// where a term is a run of letters, digits or non-ASCII bytes, lower
+// cased and cut at CHAT_SEARCH_MAX_TERM bytes.
+//
+// An index is a ChatSearchHeader, the ChatSearchKey entries in key
+// order, the key text they point into, then each key's postings: the
+// offsets in the segment of the records it is in, ascending. Postings
+// come in blocks of CHAT_SEARCH_BLOCK, each with a ChatSearchSkip
+// holding its first offset and where the rest start, as varint deltas
+// from the one before. The skips let a query jump to an offset, to
+// line up several keys or start at a receive time, decoding only the
+// block it lands in. Fixed size integers are big endian, as on the
+// wire.
+//
+
+#ifndef TCP_CHAT_CHAT_SEARCH_H
+#define TCP_CHAT_CHAT_SEARCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "chat_archive.h"
+#include "wire_codec.h"
+
+#define CHAT_SEARCH_MAGIC "CHATSIX1"
+
+// Postings per skip entry
+#define CHAT_SEARCH_BLOCK 128
+
+// Longest term indexed; longer ones are cut to this
+#define CHAT_SEARCH_MAX_TERM 32
+
+struct ChatSearchHeader {
+  char magic[8]; // CHAT_SEARCH_MAGIC
+  uint64_t segment_len; // bytes of segment indexed
+  uint32_t messages;
+  uint32_t keys;
+};
+
+struct ChatSearchKey {
+  uint32_t text_offset; // from the start of the key text
+  uint32_t text_len;
+  uint32_t count; // postings
+  uint32_t reserved;
+  uint64_t postings_offset; // from the start of the file, skips first
+};
+
+struct ChatSearchSkip {
+  uint32_t first; // offset of the block's first record
+  uint32_t deltas_offset; // of the block's deltas, from the end of the skips
+};
+
+using ChatSearchHeaderCodec = wire::Codec<ChatSearchHeader,
+                                          wire::Bytes<&ChatSearchHeader::magic>,
+                                          wire::Field<&ChatSearchHeader::segment_len>,
+                                          wire::Field<&ChatSearchHeader::messages>,
+                                          wire::Field<&ChatSearchHeader::keys> >;
+
+using ChatSearchKeyCodec = wire::Codec<ChatSearchKey,
+                                       wire::Field<&ChatSearchKey::text_offset>,
+                                       wire::Field<&ChatSearchKey::text_len>,
+                                       wire::Field<&ChatSearchKey::count>,
+                                       wire::Field<&ChatSearchKey::reserved>,
+                                       wire::Field<&ChatSearchKey::postings_offset> >;
+
+using ChatSearchSkipCodec = wire::Codec<ChatSearchSkip,
+                                        wire::Field<&ChatSearchSkip::first>,
+                                        wire::Field<&ChatSearchSkip::deltas_offset> >;
+
+/**
+ * @return the index file of a segment file
+ */
+std::string search_index_path(const std::string &segment_path);
+
+/**
+ * The terms text is indexed under, in order, repeats and all.
+ */
+std::vector<std::string> search_terms(const char *text, size_t len);
+
+/**
+ * Index a mapped segment into path, replacing any index there.
+ *
+ * @return 0 on success, -1 on failure (see errno)
+ */
+int build_search_index(const struct ChatArchiveSegment *segment, const std::string &path, struct ChatSearchHeader *header);
+
+/**
+ * A segment's index, mapped into memory.
+ */
+struct ChatSearchIndex {
+  const char *data;
+  size_t len;
+  struct ChatSearchHeader header;
+  const char *keys;
+  const char *text;
+};
+
+/**
+ * Map an index and check its header.
+ *
+ * @return 0 on success, -1 on failure (see errno)
+ */
+int map_search_index(struct ChatSearchIndex *index, const std::string &path);
+
+void unmap_search_index(struct ChatSearchIndex *index);
+
+/**
+ * Where one key's postings have got to.
+ */
+struct ChatPostings {
+  const char *skips;
+  const char *deltas;
+  uint32_t count;
+  uint32_t blocks;
+  uint32_t block;
+  uint32_t left; // postings after this one in the block
+  const char *next; // the next delta
+  const char *end; // of the index
+  uint32_t offset; // the current posting
+  bool done;
+};
+
+/**
+ * Look a key up and start at its first posting.
+ *
+ * @return false if the segment has no such key
+ */
+bool find_search_key(const struct ChatSearchIndex *index, const std::string &key, struct ChatPostings *postings);
+
+/**
+ * Move to the first posting at or after offset, or set done if there
+ * is none. Never moves back.
+ */
+void seek_postings(struct ChatPostings *postings, uint32_t offset);
+
+#endif //TCP_CHAT_CHAT_SEARCH_H
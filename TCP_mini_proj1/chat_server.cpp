@@ -0,0 +1,1780 @@
+#include "chat_server.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chat_wire.h"
+#include "tcp_utils.h"
+
+// epoll data of a worker's wake_fd; connections carry their id
+#define WAKE_TAG UINT64_MAX
+
+// Nickname that GET_MEMBERS replies come from
+static const char server_nickname[] = "server";
+#define SERVER_NICKNAME_LEN (sizeof(server_nickname) - 1)
+
+/**
+ * One message off a connection, pointing into the receive buffer.
+ */
+struct ChatFrame {
+  uint16_t type;
+  const char *nickname;
+  uint16_t nickname_len;
+  const char *data;
+  uint16_t data_len;
+  uint64_t send_ns;
+  uint64_t token; // session messages only
+  uint64_t seq;
+};
+
+static uint64_t monotonic_ms() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static uint32_t monotonic_us() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return (uint32_t)((uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000);
+}
+
+static uint64_t thread_cpu_ns() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static uint64_t sum_stat(const void *arg) {
+  const struct ChatStatGauge *gauge = (const struct ChatStatGauge *)arg;
+  uint64_t total = 0;
+
+  for (int w = 0; w < gauge->group->num_workers; ++w) {
+    total += gauge->group->workers[w]->stats[gauge->stat].load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+uint64_t process_rss_bytes(const void *arg) {
+  unsigned long long size;
+  unsigned long long resident = 0;
+  FILE *statm = fopen("/proc/self/statm", "r");
+
+  (void)arg;
+  if (statm == NULL) {
+    return 0;
+  }
+  if (fscanf(statm, "%llu %llu", &size, &resident) != 2) {
+    resident = 0;
+  }
+  fclose(statm);
+  return resident * (uint64_t)sysconf(_SC_PAGESIZE);
+}
+
+static void register_server_metrics(struct ChatWorkerGroup *group, struct MetricsRegistry *registry,
+                                    struct ChatServerMetricIds *ids) {
+  static const char *stat_names[NUM_CHAT_STATS] = {"chat.connections", "chat.monitors", "chat.members",
+                                                   "chat.slab_bytes", "chat.chunks_in_use", "chat.chunk_bytes",
+                                                   "chat.sessions", "chat.detached_sessions"};
+
+  ids->closes = metrics_counter(registry, "chat.closes");
+  ids->bytes_in = metrics_counter(registry, "chat.bytes_in");
+  ids->bytes_out = metrics_counter(registry, "chat.bytes_out");
+  ids->frames_in = metrics_counter(registry, "chat.frames_in");
+  ids->frames_out = metrics_counter(registry, "chat.frames_out");
+  ids->error_replies = metrics_counter(registry, "chat.error_replies");
+  ids->slow_consumers = metrics_counter(registry, "chat.slow_consumers");
+  ids->handoffs = metrics_counter(registry, "chat.handoffs");
+  ids->relayed = metrics_counter(registry, "chat.relayed");
+  ids->relay_drops = metrics_counter(registry, "chat.relay_drops");
+  ids->fanout = metrics_histogram(registry, "chat.fanout");
+  ids->sessions_started = metrics_counter(registry, "chat.sessions_started");
+  ids->resumes = metrics_counter(registry, "chat.resumes");
+  ids->resume_misses = metrics_counter(registry, "chat.resume_misses");
+  ids->replayed = metrics_counter(registry, "chat.replayed");
+  ids->sessions_expired = metrics_counter(registry, "chat.sessions_expired");
+  ids->idle_reaped = metrics_counter(registry, "chat.idle_reaped");
+  ids->throttled = metrics_counter(registry, "chat.throttled");
+  ids->admission_denied = metrics_counter(registry, "chat.admission_denied");
+  ids->compress_batches = metrics_counter(registry, "chat.compress_batches");
+  ids->compress_raw_bytes = metrics_counter(registry, "chat.compress_raw_bytes");
+  ids->compress_bytes = metrics_counter(registry, "chat.compress_bytes");
+  ids->compress_ns = metrics_counter(registry, "chat.compress_ns");
+  ids->member_deltas = metrics_counter(registry, "chat.member_deltas");
+  ids->member_snapshots = metrics_counter(registry, "chat.member_snapshots");
+
+  for (int i = 0; i < NUM_CHAT_STATS; ++i) {
+    group->gauges[i].group = group;
+    group->gauges[i].stat = i;
+    metrics_gauge(registry, stat_names[i], sum_stat, &group->gauges[i]);
+  }
+  metrics_gauge(registry, "process.rss_bytes", process_rss_bytes, NULL);
+}
+
+static void publish_stats(struct ChatServer *server) {
+  std::atomic<uint64_t> *stats = server->stats;
+
+  stats[STAT_CONNECTIONS].store(server->conns.used, std::memory_order_relaxed);
+  stats[STAT_MONITORS].store(server->monitors.size(), std::memory_order_relaxed);
+  stats[STAT_MEMBERS].store(server->members.size(), std::memory_order_relaxed);
+  stats[STAT_SLAB_BYTES].store(connection_slab_bytes(&server->conns), std::memory_order_relaxed);
+  stats[STAT_CHUNKS_IN_USE].store(server->chunks.in_use, std::memory_order_relaxed);
+  stats[STAT_CHUNK_BYTES].store((uint64_t)server->chunks.allocated * CHAT_CHUNK_SIZE, std::memory_order_relaxed);
+  stats[STAT_SESSIONS].store(server->sessions.by_conn.size(), std::memory_order_relaxed);
+  stats[STAT_DETACHED].store(server->sessions.num_detached, std::memory_order_relaxed);
+}
+
+static int init_worker(struct ChatServer *server, struct ChatWorkerGroup *group, int worker_id,
+                       struct MetricsRegistry *registry) {
+  const struct ChatServerConfig *config = group->config;
+  uint32_t share = 0;
+  struct epoll_event event;
+
+  server->worker_id = worker_id;
+  server->config = config;
+  server->group = group;
+  server->wake_peers = 0;
+  // Set by init_chat_federation(), if the server is federated
+  server->to_federation = NULL;
+  server->from_federation = NULL;
+  server->wake_federation = false;
+  server->federation_backlog_bytes = 0;
+  init_fd_ring(&server->handoff);
+  init_session_table(&server->sessions, worker_id, config->max_history_bytes);
+  init_timer_wheel(&server->timers, monotonic_ms());
+  server->idle_ticks = config->idle_timeout_ms > 0 ? timer_ticks(config->idle_timeout_ms) : 0;
+  server->session_ticks = timer_ticks(config->session_timeout_ms);
+  server->now_us = monotonic_us();
+  init_rate_limit(&server->message_limit, config->message_rate, config->message_burst);
+  // Every message must fit in a full bucket
+  init_rate_limit(&server->byte_limit, config->byte_rate,
+                  config->byte_burst > CHAT_MAX_FRAME ? config->byte_burst : CHAT_MAX_FRAME);
+  if (config->global_rate > 0) {
+    share = (config->global_rate + group->num_workers - 1) / group->num_workers;
+  }
+  init_rate_limit(&server->admission, share, (uint32_t)((uint64_t)share * CHAT_ADMISSION_BURST_MS / 1000));
+  server->admission_full_at = server->now_us;
+  init_connection_slab(&server->conns);
+  init_chunk_pool(&server->chunks);
+  if (init_nick_table(&server->monitor_nicks, 1024) < 0) {
+    return -1;
+  }
+  for (int w = 0; w < group->num_workers; ++w) {
+    server->inbox[w] = NULL;
+    if (w != worker_id) {
+      server->inbox[w] = new RelayRing;
+      init_relay_ring(server->inbox[w]);
+    }
+  }
+  server->recv_buf = (char *)malloc(CHAT_MAX_FRAME + CHAT_RECV_SIZE);
+  server->frame_buf = (char *)malloc(CHAT_MAX_FRAME);
+  if (server->recv_buf == NULL || server->frame_buf == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  // Compressors are only set up for levels monitors ask for
+  for (int level = 0; level < CHAT_LZ_MAX_LEVEL; ++level) {
+    server->compress[level].ready = false;
+    server->compress[level].monitors = 0;
+  }
+  server->presence_monitors = 0;
+  server->presence_version = 0;
+
+  server->metrics = metrics_shard(registry);
+  if (server->metrics == NULL) {
+    errno = ENOSPC;
+    return -1;
+  }
+  publish_stats(server);
+
+  server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  server->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (server->epoll_fd < 0 || server->wake_fd < 0) {
+    return -1;
+  }
+  event.events = EPOLLIN;
+  event.data.u64 = WAKE_TAG;
+  return epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->wake_fd, &event);
+}
+
+int init_chat_workers(struct ChatWorkerGroup *group, const struct ChatServerConfig *config,
+                      struct MetricsRegistry *registry) {
+  struct ChatServerMetricIds ids;
+
+  if (config->num_workers < 1 || config->num_workers > CHAT_MAX_WORKERS) {
+    errno = EINVAL;
+    return -1;
+  }
+  group->config = config;
+  group->num_workers = config->num_workers;
+  group->federation_wake_fd = -1;
+  // A new id each run, so versions from before a restart are not taken for this one's
+  init_member_log(&group->member_log, realtime_ns() | 1, CHAT_MEMBER_LOG_BYTES);
+  group->member_version.store(0);
+  group->presence_workers.store(0);
+  for (int w = 0; w < group->num_workers; ++w) {
+    group->workers[w] = new ChatServer();
+  }
+  register_server_metrics(group, registry, &ids);
+  for (int w = 0; w < group->num_workers; ++w) {
+    group->workers[w]->ids = ids;
+    if (init_worker(group->workers[w], group, w, registry) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+bool hand_off_socket(struct ChatServer *worker, int fd) {
+  return fd_ring_push(&worker->handoff, fd);
+}
+
+static void wake_eventfd(int fd) {
+  uint64_t one = 1;
+
+  if (write(fd, &one, sizeof(one)) < 0) {
+    // The counter is already nonzero; the thread will wake anyway
+  }
+}
+
+void wake_chat_worker(struct ChatServer *worker) {
+  wake_eventfd(worker->wake_fd);
+}
+
+uint64_t log_member_change(struct ChatWorkerGroup *group, bool joined, const char *nickname, uint16_t nickname_len) {
+  std::lock_guard<std::mutex> lock(group->member_lock);
+  bool changed = joined ? member_log_join(&group->member_log, nickname, nickname_len)
+                        : member_log_leave(&group->member_log, nickname, nickname_len);
+
+  if (!changed) {
+    return 0;
+  }
+  group->member_version.store(group->member_log.version, std::memory_order_release);
+  return group->presence_workers.load(std::memory_order_relaxed);
+}
+
+/**
+ * Log a member's nickname coming or going, waking the other workers
+ * with presence monitors after this pass.
+ */
+static void log_member(struct ChatServer *server, bool joined, const struct ChatNickname *nickname) {
+  uint64_t wake = log_member_change(server->group, joined, nickname_data(nickname), nickname->len);
+
+  server->wake_peers |= wake & ~(1ull << server->worker_id);
+}
+
+/**
+ * Stop sending a monitor MON_PRESENCE.
+ */
+static void unsubscribe_presence(struct ChatServer *server, struct ChatConnection *conn) {
+  if (!(conn->flags & CONN_PRESENCE)) {
+    return;
+  }
+  conn->flags &= ~CONN_PRESENCE;
+  if (--server->presence_monitors == 0) {
+    server->group->presence_workers.fetch_and(~(1ull << server->worker_id));
+  }
+}
+
+/**
+ * Take a connection off a monitor or member list, moving the list's
+ * last entry into its place.
+ */
+static void remove_from_list(struct ChatServer *server, std::vector<uint32_t> &list, uint32_t index) {
+  uint32_t last = list.back();
+
+  list[index] = last;
+  connection_at(&server->conns, last)->list_index = index;
+  list.pop_back();
+}
+
+/**
+ * False once a connection is closed or detached from its session.
+ */
+static bool is_live(const struct ChatConnection *conn) {
+  return conn->kind != CONN_FREE && !(conn->flags & CONN_DETACHED);
+}
+
+/**
+ * Stop a monitor getting MON_COMPRESSED batches.
+ */
+static void leave_compress_group(struct ChatServer *server, struct ChatConnection *conn) {
+  if (conn->compress_level > 0) {
+    server->compress[conn->compress_level - 1].monitors--;
+    conn->compress_level = 0;
+  }
+}
+
+/**
+ * Hand a record to the federation, to be woken after this pass. While
+ * the ring is full records wait, in order, in the backlog; a message
+ * that would take the backlog past CHAT_FEDERATION_BACKLOG is dropped,
+ * but a nickname coming or going never is.
+ *
+ * @return false if it was dropped
+ */
+static bool push_to_federation(struct ChatServer *server, uint16_t kind, const char *target, uint16_t target_len,
+                               const char *frame, uint32_t frame_len) {
+  if (server->federation_backlog.empty() &&
+      relay_push(server->to_federation, kind, target, target_len, frame, frame_len)) {
+    server->wake_federation = true;
+    return true;
+  }
+  if (frame_len > 0 && server->federation_backlog_bytes + frame_len > CHAT_FEDERATION_BACKLOG) {
+    return false;
+  }
+  server->federation_backlog.push_back({kind, std::string(target, target_len), std::string(frame, frame_len)});
+  server->federation_backlog_bytes += frame_len;
+  return true;
+}
+
+/**
+ * Tell the federation, if the server is federated, that a nickname
+ * came or went.
+ */
+static void tell_federation(struct ChatServer *server, uint16_t kind, const struct ChatNickname *nickname) {
+  if (server->to_federation == NULL || nickname->len == 0) {
+    return;
+  }
+  push_to_federation(server, kind, nickname_data(nickname), nickname->len, NULL, 0);
+}
+
+/**
+ * Push what the backlog has room for; once per pass through the loop.
+ */
+static void flush_federation_backlog(struct ChatServer *server) {
+  std::deque<struct ChatFederationRecord> &backlog = server->federation_backlog;
+  bool sent = false;
+
+  while (!backlog.empty() && relay_push(server->to_federation, backlog.front().kind, backlog.front().target.data(),
+                                        (uint16_t)backlog.front().target.size(), backlog.front().frame.data(),
+                                        (uint32_t)backlog.front().frame.size())) {
+    server->federation_backlog_bytes -= backlog.front().frame.size();
+    backlog.pop_front();
+    sent = true;
+  }
+  server->wake_federation |= sent;
+}
+
+/**
+ * Drop everything a connection holds apart from its socket. The record
+ * itself is freed after the current batch of events, so a later event
+ * for the same id in the batch finds CONN_FREE instead of a new
+ * connection.
+ */
+static void forget_connection(struct ChatServer *server, uint32_t id) {
+  struct ChatConnection *conn = connection_at(&server->conns, id);
+
+  timer_cancel(&server->timers, &server->conns, id);
+  if (conn->kind == CONN_MONITOR) {
+    leave_compress_group(server, conn);
+    unsubscribe_presence(server, conn);
+    remove_from_list(server, server->monitors, conn->list_index);
+    if (conn->nickname.len > 0) {
+      nick_table_remove(&server->monitor_nicks, nickname_hash(nickname_data(&conn->nickname), conn->nickname.len), id);
+      tell_federation(server, RELAY_MONITOR_LEAVE, &conn->nickname);
+    }
+  } else if (conn->flags & CONN_MEMBER) {
+    remove_from_list(server, server->members, conn->list_index);
+    log_member(server, false, &conn->nickname);
+    tell_federation(server, RELAY_MEMBER_LEAVE, &conn->nickname);
+  }
+  clear_nickname(&conn->nickname);
+  return_chunks(&server->chunks, conn->recv_chunk);
+  return_chunks(&server->chunks, conn->send_head);
+  conn->recv_chunk = CHAT_NO_CHUNK;
+  conn->send_head = CHAT_NO_CHUNK;
+  conn->send_tail = CHAT_NO_CHUNK;
+  conn->kind = CONN_FREE;
+  server->closed.push_back(id);
+}
+
+/**
+ * Close a session's socket but keep its record, and its place on the
+ * monitor or member list, for the peer to resume.
+ */
+static void detach_connection(struct ChatServer *server, uint32_t id) {
+  struct ChatConnection *conn = connection_at(&server->conns, id);
+
+  close(conn->fd);
+  conn->fd = -1;
+  conn->flags = (conn->flags | CONN_DETACHED) & ~CONN_WANT_WRITE;
+  // Its monitor asks again when it resumes, missing nothing
+  unsubscribe_presence(server, conn);
+  return_chunks(&server->chunks, conn->recv_chunk);
+  return_chunks(&server->chunks, conn->send_head);
+  conn->recv_chunk = CHAT_NO_CHUNK;
+  conn->send_head = CHAT_NO_CHUNK;
+  conn->send_tail = CHAT_NO_CHUNK;
+  conn->send_chunks = 0;
+  conn->deadline = server->timers.now_tick + server->session_ticks;
+  timer_schedule(&server->timers, &server->conns, id);
+  server->sessions.num_detached++;
+  metrics_add(server->metrics, server->ids.closes, 1);
+}
+
+/**
+ * Close a connection for good, ending its session if it has one.
+ */
+static void end_connection(struct ChatServer *server, uint32_t id) {
+  struct ChatConnection *conn = connection_at(&server->conns, id);
+
+  if (conn->kind == CONN_FREE) {
+    return;
+  }
+  if (conn->flags & CONN_SESSION) {
+    end_session(&server->sessions, &server->chunks, id);
+    if (conn->flags & CONN_DETACHED) {
+      server->sessions.num_detached--;
+    }
+  }
+  if (!(conn->flags & CONN_DETACHED)) {
+    close(conn->fd);
+    metrics_add(server->metrics, server->ids.closes, 1);
+  }
+  forget_connection(server, id);
+}
+
+/**
+ * Close a connection whose socket failed or hung up. One with a
+ * session is only detached.
+ */
+static void close_connection(struct ChatServer *server, uint32_t id) {
+  struct ChatConnection *conn = connection_at(&server->conns, id);
+
+  if (!is_live(conn)) {
+    return;
+  }
+  if (conn->flags & CONN_SESSION) {
+    detach_connection(server, id);
+  } else {
+    end_connection(server, id);
+  }
+}
+
+/**
+ * Give a live connection idle_timeout_ms from now to hear from its
+ * peer, or take it out of the wheel if idle connections are kept.
+ */
+static void start_idle_timer(struct ChatServer *server, uint32_t id) {
+  struct ChatConnection *conn = connection_at(&server->conns, id);
+
+  if (server->idle_ticks == 0) {
+    timer_cancel(&server->timers, &server->conns, id);
+    return;
+  }
+  conn->deadline = server->timers.now_tick + server->idle_ticks;
+  timer_schedule(&server->timers, &server->conns, id);
+}
+
+static void update_events(struct ChatServer *server, uint32_t id, struct ChatConnection *conn) {
+  struct epoll_event event;
+
+  event.events = EPOLLIN | ((conn->flags & CONN_WANT_WRITE) ? (uint32_t)EPOLLOUT : 0u);
+  event.data.u64 = id;
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+/**
+ * Send bytes to a connection, queueing whatever the socket will not
+ * take right now in borrowed chunks. A connection already queueing
+ * max_send_chunks is closed instead: one stalled monitor must not
+ * hold the whole room's traffic.
+ */
+static void queue_send(struct ChatServer *server, uint32_t id, const char *data, size_t len) {
+  struct ChatConnection *conn = connection_at(&server->conns, id);
+  struct ChatChunk *tail;
+  uint32_t handle;
+  size_t n;
+  ssize_t ret;
+
+  if (!is_live(conn)) {
+    return;
+  }
+  metrics_add(server->metrics, server->ids.frames_out, 1);
+  if (conn->send_head == CHAT_NO_CHUNK) {
+    ret = send(conn->fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (ret < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        close_connection(server, id);
+        return;
+      }
+      ret = 0;
+    }
+    metrics_add(server->metrics, server->ids.bytes_out, ret);
+    if ((size_t)ret == len) {
+      return;
+    }
+    data += ret;
+    len -= ret;
+  }
+
+  tail = conn->send_tail == CHAT_NO_CHUNK ? NULL : chunk_at(&server->chunks, conn->send_tail);
+  while (len > 0) {
+    if (tail == NULL || tail->end == CHAT_CHUNK_DATA) {
+      if (conn->send_chunks >= server->config->max_send_chunks) {
+        metrics_add(server->metrics, server->ids.slow_consumers, 1);
+        close_connection(server, id);
+        return;
+      }
+      handle = borrow_chunk(&server->chunks);
+      if (handle == CHAT_NO_CHUNK) {
+        close_connection(server, id);
+        return;
+      }
+      if (tail == NULL) {
+        conn->send_head = handle;
+      } else {
+        tail->next = handle;
+      }
+      conn->send_tail = handle;
+      conn->send_chunks++;
+      tail = chunk_at(&server->chunks, handle);
+    }
+    n = len < (size_t)(CHAT_CHUNK_DATA - tail->end) ? len : (size_t)(CHAT_CHUNK_DATA - tail->end);
+    memcpy(&tail->data[tail->end], data, n);
+    tail->end += n;
+    data += n;
+    len -= n;
+  }
+
+  if (!(conn->flags & CONN_WANT_WRITE)) {
+    conn->flags |= CONN_WANT_WRITE;
+    update_events(server, id, conn);
+  }
+}
+
+/**
+ * Send queued chunks until the socket is full or the queue is empty,
+ * handing each chunk back to the pool as soon as it is sent.
+ */
+static void handle_writable(struct ChatServer *server, uint32_t id) {
+  struct ChatConnection *conn = connection_at(&server->conns, id);
+  struct ChatChunk *chunk;
+  uint32_t next;
+  ssize_t ret;
+
+  while (conn->send_head != CHAT_NO_CHUNK) {
+    chunk = chunk_at(&server->chunks, conn->send_head);
+    ret = send(conn->fd, &chunk->data[chunk->start], chunk->end - chunk->start, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (ret < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        close_connection(server, id);
+      }
+      return;
+    }
+    metrics_add(server->metrics, server->ids.bytes_out, ret);
+    chunk->start += ret;
+    if (chunk->start < chunk->end) {
+      continue;
+    }
+    next = chunk->next;
+    chunk->next = CHAT_NO_CHUNK;
+    return_chunks(&server->chunks, conn->send_head);
+    conn->send_head = next;
+    conn->send_chunks--;
+  }
+
+  conn->send_tail = CHAT_NO_CHUNK;
+  conn->flags &= ~CONN_WANT_WRITE;
+  update_events(server, id, conn);
+}
+
+static void send_error(struct ChatServer *server, uint32_t id, uint16_t error_type) {
+  struct ServerErrorMessage error;
+  char buf[ServerErrorCodec::wire_size];
+
+  error.error_type = error_type;
+  ServerErrorCodec::encode(error, buf, sizeof(buf));
+  metrics_add(server->metrics, server->ids.error_replies, 1);
+  queue_send(server, id, buf, sizeof(buf));
+}
+
+/**
+ * Build a monitor message in frame_buf.
+ *
+ * @param send_ns if not 0, the message is a ChatTimedMonMsg
+ * @return the message's length
+ */
+static size_t build_mon_message(struct ChatServer *server, uint16_t type, const char *nickname, uint16_t nickname_len,
+                                const char *data, uint16_t data_len, uint64_t send_ns) {
+  struct ChatMonMsg message;
+  struct ChatTimedMonMsg timed_message;
+  size_t len;
+
+  if (type == MON_TIMED_MESSAGE) {
+    timed_message.type = type;
+    timed_message.nickname_len = nickname_len;
+    timed_message.data_len = data_len;
+    timed_message.send_ns = send_ns;
+    len = ChatTimedMonCodec::encode(timed_message, server->frame_buf, CHAT_MAX_FRAME);
+  } else {
+    message.type = type;
+    message.nickname_len = nickname_len;
+    message.data_len = data_len;
+    len = ChatMonCodec::encode(message, server->frame_buf, CHAT_MAX_FRAME);
+  }
+  memcpy(&server->frame_buf[len], nickname, nickname_len);
+  len += nickname_len;
+  // GET_MEMBERS replies build their data in place
+  if (&server->frame_buf[len] != data) {
+    memmove(&server->frame_buf[len], data, data_len);
+  }
+  return len + data_len;
+}
+
+/**
+ * Compress a level's batch and queue it to every live monitor at that
+ * level. A batch that would not get any smaller goes as it is.
+ */
+static void flush_batch(struct ChatServer *server, int level) {
+  struct ChatCompressGroup *group = &server->compress[level - 1];
+  struct ChatCompressedMonMsg message;
+  char *data = &group->out[ChatCompressedMonCodec::wire_size];
+  uint64_t start;
+  size_t data_len;
+
+  if (group->batch_len == 0) {
+    return;
+  }
+  message.type = MON_COMPRESSED;
+  message.flags = 0;
+  if (group->reset) {
+    reset_lz_encoder(&group->encoder);
+    group->reset = false;
+    message.flags |= CHAT_BATCH_RESET;
+  }
+  start = thread_cpu_ns();
+  data_len = lz_compress(&group->encoder, group->batch, group->batch_len, data, group->batch_len - 1);
+  metrics_add(server->metrics, server->ids.compress_ns, thread_cpu_ns() - start);
+  if (data_len == 0) {
+    memcpy(data, group->batch, group->batch_len);
+    data_len = group->batch_len;
+    message.flags |= CHAT_BATCH_STORED;
+  }
+  message.raw_len = (uint16_t)group->batch_len;
+  message.data_len = (uint16_t)data_len;
+  ChatCompressedMonCodec::encode(message, group->out, ChatCompressedMonCodec::wire_size);
+  metrics_add(server->metrics, server->ids.compress_batches, 1);
+  metrics_add(server->metrics, server->ids.compress_raw_bytes, group->batch_len);
+  metrics_add(server->metrics, server->ids.compress_bytes, data_len);
+  group->batch_len = 0;
+
+  // Backwards, as broadcast()
+  for (size_t i = server->monitors.size(); i-- > 0;) {
+    if (i < server->monitors.size() && connection_at(&server->conns, server->monitors[i])->compress_level == level) {
+      queue_send(server, server->monitors[i], group->out, ChatCompressedMonCodec::wire_size + data_len);
+    }
+  }
+}
+
+/**
+ * Add frame_buf to a level's batch, sending the batch first if it
+ * would not fit.
+ */
+static void batch_frame(struct ChatServer *server, int level, size_t len) {
+  struct ChatCompressGroup *group = &server->compress[level - 1];
+
+  if (group->batch_len + len > CHAT_MAX_BATCH) {
+    flush_batch(server, level);
+  }
+  memcpy(&group->batch[group->batch_len], server->frame_buf, len);
+  group->batch_len += len;
+}
+
+/**
+ * Send every level's batch; once per pass through the loop.
+ */
+static void flush_batches(struct ChatServer *server) {
+  for (int level = 1; level <= CHAT_LZ_MAX_LEVEL; ++level) {
+    if (server->compress[level - 1].ready) {
+      flush_batch(server, level);
+    }
+  }
+}
+
+/**
+ * Send frame_buf to a monitor, numbering it and keeping a copy first
+ * if the monitor has a session. A detached monitor only gets the copy.
+ *
+ * @param batched true if frame_buf is already in the batch of every
+ *                level, for a compressed monitor to get it from
+ */
+static void deliver(struct ChatServer *server, uint32_t id, size_t len, bool batched) {
+  struct ChatConnection *conn = connection_at(&server->conns, id);
+
+  if (conn->flags & CONN_SESSION) {
+    history_append(&server->sessions, &server->chunks, session_of(&server->sessions, id), server->frame_buf, len);
+    if (conn->flags & CONN_DETACHED) {
+      return;
+    }
+  }
+  if (conn->compress_level > 0) {
+    if (batched) {
+      return;
+    }
+    // Behind the broadcasts that came before it
+    flush_batch(server, conn->compress_level);
+  }
+  queue_send(server, id, server->frame_buf, len);
+}
+
+/**
+ * Pass a message on to every other worker, and the federation, to be
+ * woken after this pass.
+ */
+static void relay_to_peers(struct ChatServer *server, uint16_t kind, const char *target, uint16_t target_len,
+                           const char *frame, uint32_t frame_len) {
+  struct ChatWorkerGroup *group = server->group;
+
+  for (int w = 0; w < group->num_workers; ++w) {
+    if (w == server->worker_id) {
+      continue;
+    }
+    if (relay_push(group->workers[w]->inbox[server->worker_id], kind, target, target_len, frame, frame_len)) {
+      metrics_add(server->metrics, server->ids.relayed, 1);
+      server->wake_peers |= 1ull << w;
+    } else {
+      metrics_add(server->metrics, server->ids.relay_drops, 1);
+    }
+  }
+  if (server->to_federation != NULL) {
+    if (push_to_federation(server, kind, target, target_len, frame, frame_len)) {
+      metrics_add(server->metrics, server->ids.relayed, 1);
+    } else {
+      metrics_add(server->metrics, server->ids.relay_drops, 1);
+    }
+  }
+}
+
+/**
+ * Send frame_buf to every monitor on this worker, and to the other
+ * workers' monitors too if relay is set.
+ */
+static void broadcast(struct ChatServer *server, size_t len, bool relay) {
+  if (relay) {
+    relay_to_peers(server, RELAY_BROADCAST, NULL, 0, server->frame_buf, len);
+  }
+  metrics_record(server->metrics, server->ids.fanout, server->monitors.size());
+  // Compressed once per level, however many monitors share it
+  for (int level = 1; level <= CHAT_LZ_MAX_LEVEL; ++level) {
+    if (server->compress[level - 1].monitors == 0) {
+      continue;
+    }
+    if (len <= CHAT_MAX_BATCH) {
+      batch_frame(server, level, len);
+    } else {
+      flush_batch(server, level);
+    }
+  }
+  // Backwards, so a slow monitor dropped along the way only moves an
+  // already visited one into its place
+  for (size_t i = server->monitors.size(); i-- > 0;) {
+    if (i < server->monitors.size()) {
+      deliver(server, server->monitors[i], len, len <= CHAT_MAX_BATCH);
+    }
+  }
+}
+
+/**
+ * Send frame_buf to every monitor connected with a nickname, on this
+ * worker and, if relay is set, the others.
+ */
+static void send_to_nickname(struct ChatServer *server, const char *nickname, uint16_t nickname_len, size_t len,
+                             bool relay) {
+  uint32_t hash = nickname_hash(nickname, nickname_len);
+  uint32_t pos = 0;
+  uint32_t id;
+  int sent = 0;
+
+  if (relay) {
+    relay_to_peers(server, RELAY_DIRECT, nickname, nickname_len, server->frame_buf, len);
+  }
+
+  while (nick_table_next(&server->monitor_nicks, hash, &pos, &id)) {
+    if (nickname_equals(&connection_at(&server->conns, id)->nickname, nickname, nickname_len)) {
+      deliver(server, id, len, false);
+      sent++;
+    }
+  }
+  metrics_record(server->metrics, server->ids.fanout, sent);
+}
+
+/**
+ * Answer CLIENT_GET_MEMBERS with the nickname of every member, on any
+ * worker or node, from the member log, so each is listed once. The
+ * list is comma separated and cut short if it would not fit in a
+ * message.
+ *
+ * @param requester nickname of the client that asked
+ */
+static void send_members(struct ChatServer *server, const char *requester, uint16_t requester_len) {
+  struct ChatWorkerGroup *group = server->group;
+  char *data = &server->frame_buf[ChatMonCodec::wire_size + SERVER_NICKNAME_LEN];
+  size_t used = 0;
+  size_t len;
+
+  {
+    std::lock_guard<std::mutex> lock(group->member_lock);
+    for (auto it = group->member_log.holders.begin(); it != group->member_log.holders.end(); ++it) {
+      if (used + 2 + it->first.size() > UINT16_MAX) {
+        break;
+      }
+      if (used > 0) {
+        memcpy(&data[used], ", ", 2);
+        used += 2;
+      }
+      memcpy(&data[used], it->first.data(), it->first.size());
+      used += it->first.size();
+    }
+  }
+
+  len = build_mon_message(server, MON_DIRECT_MESSAGE, server_nickname, SERVER_NICKNAME_LEN, data, used, 0);
+  // The asker's monitors may be on any worker, or any node
+  send_to_nickname(server, requester, requester_len, len, true);
+}
+
+/**
+ * Most bytes of changes in one answer from the member log: half of
+ * what a connection may queue, so the answer never closes it as a
+ * slow consumer.
+ */
+static size_t member_answer_limit(struct ChatServer *server) {
+  return (size_t)server->config->max_send_chunks * CHAT_CHUNK_DATA / 2;
+}
+
+/**
+ * Answer a versioned CLIENT_GET_MEMBERS with CLIENT_MEMBERS: the
+ * changes since the version the client saw, or every member.
+ */
+static void send_member_changes(struct ChatServer *server, uint32_t id, const struct ChatFrame *frame) {
+  struct ChatWorkerGroup *group = server->group;
+  uint64_t log_id = wire::load_be<uint64_t>((const uint8_t *)frame->data);
+  uint64_t since = wire::load_be<uint64_t>((const uint8_t *)&frame->data[8]);
+  bool snapshot;
+
+  server->members_out.clear();
+  {
+    std::lock_guard<std::mutex> lock(group->member_lock);
+    snapshot = member_log_answer(&group->member_log, CLIENT_MEMBERS, log_id, since, member_answer_limit(server),
+                                 &server->members_out);
+  }
+  metrics_add(server->metrics, snapshot ? server->ids.member_snapshots : server->ids.member_deltas, 1);
+  queue_send(server, id, server->members_out.data(), server->members_out.size());
+}
+
+/**
+ * Send the presence monitors the changes since they were last sent
+ * any and, if subscriber is not UINT32_MAX, subscribe that monitor and
+ * send it every member. Both are built under one lock, so the new
+ * monitor's list is at the version the others are brought up to.
+ */
+static void send_presence(struct ChatServer *server, uint32_t subscriber) {
+  struct ChatWorkerGroup *group = server->group;
+  struct ChatConnection *conn;
+  std::vector<char> &out = server->members_out;
+  size_t changes_len;
+
+  out.clear();
+  {
+    std::lock_guard<std::mutex> lock(group->member_lock);
+    if (server->presence_monitors > 0 && server->presence_version != group->member_log.version &&
+        member_log_answer(&group->member_log, MON_PRESENCE, group->member_log.id, server->presence_version,
+                          member_answer_limit(server), &out)) {
+      metrics_add(server->metrics, server->ids.member_snapshots, 1);
+    } else if (!out.empty()) {
+      metrics_add(server->metrics, server->ids.member_deltas, 1);
+    }
+    changes_len = out.size();
+    if (subscriber != UINT32_MAX) {
+      member_log_answer(&group->member_log, MON_PRESENCE, 0, 0, member_answer_limit(server), &out);
+      metrics_add(server->metrics, server->ids.member_snapshots, 1);
+    }
+    server->presence_version = group->member_log.version;
+  }
+
+  // Backwards, as broadcast()
+  for (size_t i = server->monitors.size(); changes_len > 0 && i-- > 0;) {
+    if (i < server->monitors.size() && (connection_at(&server->conns, server->monitors[i])->flags & CONN_PRESENCE)) {
+      queue_send(server, server->monitors[i], out.data(), changes_len);
+    }
+  }
+  if (subscriber == UINT32_MAX) {
+    return;
+  }
+  conn = connection_at(&server->conns, subscriber);
+  if (!is_live(conn)) {
+    return;
+  }
+  if (!(conn->flags & CONN_PRESENCE)) {
+    conn->flags |= CONN_PRESENCE;
+    if (server->presence_monitors++ == 0) {
+      group->presence_workers.fetch_or(1ull << server->worker_id);
+    }
+  }
+  queue_send(server, subscriber, &out[changes_len], out.size() - changes_len);
+}
+
+static void set_client_nickname(struct ChatServer *server, uint32_t id, struct ChatConnection *conn,
+                                const char *nickname, uint16_t nickname_len) {
+  if (conn->flags & CONN_MEMBER) {
+    if (nickname_equals(&conn->nickname, nickname, nickname_len)) {
+      return;
+    }
+    log_member(server, false, &conn->nickname);
+    tell_federation(server, RELAY_MEMBER_LEAVE, &conn->nickname);
+  }
+  set_nickname(&conn->nickname, nickname, nickname_len);
+  if (!(conn->flags & CONN_MEMBER)) {
+    conn->flags |= CONN_MEMBER;
+    conn->list_index = server->members.size();
+    server->members.push_back(id);
+  }
+  log_member(server, true, &conn->nickname);
+  tell_federation(server, RELAY_MEMBER_JOIN, &conn->nickname);
+}
+
+static void add_monitor(struct ChatServer *server, uint32_t id, struct ChatConnection *conn,
+                        const char *nickname, uint16_t nickname_len) {
+  conn->kind = CONN_MONITOR;
+  conn->list_index = server->monitors.size();
+  server->monitors.push_back(id);
+  if (nickname_len > 0) {
+    set_nickname(&conn->nickname, nickname, nickname_len);
+    nick_table_add(&server->monitor_nicks, nickname_hash(nickname, nickname_len), id);
+    tell_federation(server, RELAY_MONITOR_JOIN, &conn->nickname);
+  }
+}
+
+/**
+ * Set up the batch and compressor of a level, the first time a monitor
+ * asks for it.
+ *
+ * @return 0 on success, -1 if out of memory
+ */
+static int init_compress_group(struct ChatCompressGroup *group, int level) {
+  if (init_lz_encoder(&group->encoder, CHAT_MAX_BATCH, level) < 0) {
+    return -1;
+  }
+  group->batch = (char *)malloc(CHAT_MAX_BATCH);
+  // Never more than the batch: one that would not shrink goes as it is
+  group->out = (char *)malloc(ChatCompressedMonCodec::wire_size + CHAT_MAX_BATCH);
+  if (group->batch == NULL || group->out == NULL) {
+    free(group->batch);
+    free(group->out);
+    free_lz_encoder(&group->encoder);
+    return -1;
+  }
+  group->batch_len = 0;
+  group->reset = true;
+  group->monitors = 0;
+  group->ready = true;
+  return 0;
+}
+
+/**
+ * Handle MON_COMPRESS: move a monitor over to the batches of the level
+ * it asks for, or the highest the server allows, and tell it which.
+ * The level's window starts over with the next batch so the monitor
+ * can follow it.
+ */
+static void set_compression(struct ChatServer *server, uint32_t id, struct ChatConnection *conn,
+                            const struct ChatFrame *frame) {
+  struct ChatMonMsg message;
+  char buf[ChatMonCodec::wire_size + 2];
+  int max_level = server->config->max_compress_level < CHAT_LZ_MAX_LEVEL ? server->config->max_compress_level
+                                                                            : CHAT_LZ_MAX_LEVEL;
+  int level = 0;
+
+  if (frame->data_len != 2) {
+    send_error(server, id, INCORRECT_SIZE);
+    return;
+  }
+  if ((uint8_t)frame->data[0] == CHAT_CODEC_LZ) {
+    level = (uint8_t)frame->data[1] < max_level ? (uint8_t)frame->data[1] : max_level;
+  }
+  if (conn->compress_level > 0) {
+    // What was batched before this arrives in the old form
+    flush_batch(server, conn->compress_level);
+    if (!is_live(conn)) {
+      return;
+    }
+    leave_compress_group(server, conn);
+  }
+  if (level > 0 && !server->compress[level - 1].ready && init_compress_group(&server->compress[level - 1], level) < 0) {
+    level = 0;
+  }
+  if (level > 0) {
+    flush_batch(server, level);
+    server->compress[level - 1].reset = true;
+    server->compress[level - 1].monitors++;
+    conn->compress_level = (uint8_t)level;
+  }
+
+  message.type = MON_COMPRESS;
+  message.nickname_len = 0;
+  message.data_len = 2;
+  ChatMonCodec::encode(message, buf, sizeof(buf));
+  buf[ChatMonCodec::wire_size] = CHAT_CODEC_LZ;
+  buf[ChatMonCodec::wire_size + 1] = (char)level;
+  queue_send(server, id, buf, sizeof(buf));
+}
+
+static bool is_client_type(uint16_t type) {
+  return type >= CLIENT_CONNECT && type <= CLIENT_HEARTBEAT;
+}
+
+static bool is_monitor_type(uint16_t type) {
+  return (type >= MON_CONNECT && type <= MON_COMPRESS) || type == MON_PRESENCE;
+}
+
+static bool is_session_type(uint16_t type) {
+  return type == CLIENT_RESUME || type == CLIENT_ACK || type == MON_RESUME;
+}
+
+static void send_session_message(struct ChatServer *server, uint32_t id, uint16_t type, uint64_t token,
+                                 uint64_t seq) {
+  struct ChatSessionMsg message;
+  char buf[ChatSessionCodec::wire_size];
+
+  message.type = type;
+  message.token = token;
+  message.seq = seq;
+  ChatSessionCodec::encode(message, buf, sizeof(buf));
+  queue_send(server, id, buf, sizeof(buf));
+}
+
+/**
+ * Tell a client with a session how many of its messages are handled,
+ * if that has changed since it was last told.
+ */
+static void ack_client(struct ChatServer *server, uint32_t id) {
+  struct ChatSession *session = session_of(&server->sessions, id);
+
+  if (session->acked != session->seq) {
+    session->acked = session->seq;
+    send_session_message(server, id, CLIENT_ACK, session->token, session->seq);
+  }
+}
+
+/**
+ * Send a resuming monitor MON_RESUME, then every message it missed
+ * that is still in the session's history.
+ *
+ * @param seen messages the monitor says it has seen
+ */
+static void replay_history(struct ChatServer *server, uint32_t id, struct ChatSession *session, uint64_t seen) {
+  struct ChatConnection *conn = connection_at(&server->conns, id);
+  struct HistoryCursor cursor;
+  uint64_t next = seen;
+  uint32_t len;
+
+  if (next < session->first_seq) {
+    next = session->first_seq;
+  } else if (next > session->seq) {
+    next = session->seq;
+  }
+  send_session_message(server, id, MON_RESUME, session->token, next);
+  history_seek(&server->chunks, session, next, &cursor);
+  while (is_live(conn) && (len = history_next(&server->chunks, session, &cursor, server->frame_buf)) > 0) {
+    queue_send(server, id, server->frame_buf, len);
+    metrics_add(server->metrics, server->ids.replayed, 1);
+  }
+}
+
+/**
+ * Handle CLIENT_RESUME or MON_RESUME from a connection with no session
+ * yet. A token this worker knows moves the socket over to the
+ * session's record, detaching whatever connection the session had; the
+ * new record is dropped. Anything else starts a new session.
+ *
+ * @return the id of the record that now has the socket
+ */
+static uint32_t resume_session(struct ChatServer *server, uint32_t id, const struct ChatFrame *frame) {
+  struct ChatConnection *conn = connection_at(&server->conns, id);
+  struct ChatConnection *resumed;
+  struct ChatSession *session;
+  struct epoll_event event;
+  uint32_t resumed_id = UINT32_MAX;
+  uint16_t reply_type = conn->kind == CONN_MONITOR ? (uint16_t)MON_RESUME : (uint16_t)CLIENT_RESUME;
+
+  if (conn->flags & CONN_SESSION) {
+    session = session_of(&server->sessions, id);
+    send_session_message(server, id, reply_type, session->token, session->seq);
+    return id;
+  }
+  if (frame->token != 0) {
+    resumed_id = find_session(&server->sessions, frame->token);
+    // A client's token is no good to a monitor, nor the other way round
+    if (resumed_id != UINT32_MAX && connection_at(&server->conns, resumed_id)->kind != conn->kind) {
+      resumed_id = UINT32_MAX;
+    }
+    if (resumed_id == UINT32_MAX) {
+      metrics_add(server->metrics, server->ids.resume_misses, 1);
+    }
+  }
+  if (resumed_id == UINT32_MAX) {
+    session = start_session(&server->sessions, id);
+    conn->flags |= CONN_SESSION;
+    metrics_add(server->metrics, server->ids.sessions_started, 1);
+    send_session_message(server, id, reply_type, session->token, 0);
+    return id;
+  }
+
+  resumed = connection_at(&server->conns, resumed_id);
+  session = session_of(&server->sessions, resumed_id);
+  // The old connection may be dead without having noticed yet
+  if (!(resumed->flags & CONN_DETACHED)) {
+    detach_connection(server, resumed_id);
+  }
+  resumed->fd = conn->fd;
+  resumed->flags &= ~CONN_DETACHED;
+  // The new socket has no window to follow the level's batches with;
+  // its monitor asks again if it wants them
+  leave_compress_group(server, resumed);
+  server->sessions.num_detached--;
+  start_idle_timer(server, resumed_id);
+  forget_connection(server, id);
+  event.events = EPOLLIN;
+  event.data.u64 = resumed_id;
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, resumed->fd, &event);
+  metrics_add(server->metrics, server->ids.resumes, 1);
+
+  if (resumed->kind == CONN_MONITOR) {
+    replay_history(server, resumed_id, session, frame->seq);
+  } else {
+    session->acked = session->seq;
+    send_session_message(server, resumed_id, CLIENT_RESUME, session->token, session->seq);
+  }
+  return resumed_id;
+}
+
+/**
+ * Charge a message to its client's rate limits and then to the
+ * worker's share of the global one. A client is told it is throttled
+ * once, when its first message is dropped, rather than for each.
+ *
+ * @return false if the message is to be dropped
+ */
+static bool admit_message(struct ChatServer *server, uint32_t id, struct ChatConnection *conn,
+                          const struct ChatFrame *frame) {
+  uint32_t message_full_at;
+  uint32_t byte_full_at;
+  uint32_t admission_full_at;
+  bool client_ok;
+
+  // & rather than &&, so every check runs and there is one branch
+  client_ok = rate_limit_check(conn->message_full_at, server->now_us, &server->message_limit, 1, &message_full_at) &
+              rate_limit_check(conn->byte_full_at, server->now_us, &server->byte_limit,
+                               (uint32_t)frame->nickname_len + frame->data_len, &byte_full_at);
+  if (!(client_ok &
+        rate_limit_check(server->admission_full_at, server->now_us, &server->admission, 1, &admission_full_at))) {
+    metrics_add(server->metrics, client_ok ? server->ids.admission_denied : server->ids.throttled, 1);
+    if (!(conn->flags & CONN_THROTTLED)) {
+      conn->flags |= CONN_THROTTLED;
+      send_error(server, id, THROTTLED);
+    }
+    return false;
+  }
+  conn->message_full_at = message_full_at;
+  conn->byte_full_at = byte_full_at;
+  server->admission_full_at = admission_full_at;
+  conn->flags &= ~CONN_THROTTLED;
+  return true;
+}
+
+/**
+ * @return the id of the record that has the socket afterwards, which
+ *         only a resume changes
+ */
+static uint32_t handle_client_frame(struct ChatServer *server, uint32_t id, struct ChatConnection *conn,
+                                    const struct ChatFrame *frame) {
+  size_t len;
+
+  // A session counts every message after its CLIENT_RESUME but heartbeats
+  if ((conn->flags & CONN_SESSION) && frame->type != CLIENT_CONNECT && frame->type != CLIENT_RESUME &&
+      frame->type != CLIENT_HEARTBEAT) {
+    session_of(&server->sessions, id)->seq++;
+  }
+  switch (frame->type) {
+    case CLIENT_CONNECT:
+    case CLIENT_HEARTBEAT:
+      break;
+    case CLIENT_RESUME:
+      return resume_session(server, id, frame);
+    case CLIENT_DISCONNECT:
+      end_connection(server, id);
+      break;
+    case CLIENT_SET_NICKNAME:
+      // tcp_chat_client sends its nickname as the data
+      if (frame->nickname_len > 0) {
+        set_client_nickname(server, id, conn, frame->nickname, frame->nickname_len);
+      } else if (frame->data_len > 0) {
+        set_client_nickname(server, id, conn, frame->data, frame->data_len);
+      } else {
+        send_error(server, id, INCORRECT_SIZE);
+      }
+      break;
+    case CLIENT_SEND_MESSAGE:
+    case CLIENT_SEND_TIMED_MESSAGE:
+      if (!admit_message(server, id, conn, frame)) {
+        break;
+      }
+      len = build_mon_message(server, frame->type == CLIENT_SEND_MESSAGE ? MON_MESSAGE : MON_TIMED_MESSAGE,
+                              nickname_data(&conn->nickname), conn->nickname.len, frame->data, frame->data_len,
+                              frame->send_ns);
+      broadcast(server, len, true);
+      break;
+    case CLIENT_SEND_DIRECT_MESSAGE:
+      if (frame->nickname_len == 0) {
+        send_error(server, id, INCORRECT_SIZE);
+        break;
+      }
+      if (!admit_message(server, id, conn, frame)) {
+        break;
+      }
+      len = build_mon_message(server, MON_DIRECT_MESSAGE, nickname_data(&conn->nickname), conn->nickname.len,
+                              frame->data, frame->data_len, 0);
+      send_to_nickname(server, frame->nickname, frame->nickname_len, len, true);
+      break;
+    case CLIENT_GET_MEMBERS:
+      if (!admit_message(server, id, conn, frame)) {
+        break;
+      }
+      if (frame->data_len == CHAT_MEMBERS_SINCE_LEN) {
+        send_member_changes(server, id, frame);
+        break;
+      }
+      send_members(server, nickname_data(&conn->nickname), conn->nickname.len);
+      break;
+    default:
+      send_error(server, id, is_monitor_type(frame->type) ? WRONG_TYPE_FOR_CLIENT : UNKNOWN_TYPE);
+      break;
+  }
+  return id;
+}
+
+static uint32_t handle_monitor_frame(struct ChatServer *server, uint32_t id, const struct ChatFrame *frame) {
+  switch (frame->type) {
+    case MON_CONNECT:
+    case MON_HEARTBEAT:
+      break;
+    case MON_RESUME:
+      return resume_session(server, id, frame);
+    case MON_DISCONNECT:
+      end_connection(server, id);
+      break;
+    case MON_COMPRESS:
+      set_compression(server, id, connection_at(&server->conns, id), frame);
+      break;
+    case MON_PRESENCE:
+      send_presence(server, id);
+      break;
+    default:
+      send_error(server, id, is_client_type(frame->type) ? WRONG_TYPE_FOR_MONITOR : UNKNOWN_TYPE);
+      break;
+  }
+  return id;
+}
+
+/**
+ * @return the id of the record that has the socket afterwards
+ */
+static uint32_t handle_frame(struct ChatServer *server, uint32_t id, const struct ChatFrame *frame) {
+  struct ChatConnection *conn = connection_at(&server->conns, id);
+
+  metrics_add(server->metrics, server->ids.frames_in, 1);
+  switch (conn->kind) {
+    case CONN_NEW:
+      // The first message says whether this is a client or a monitor
+      if (frame->type == CLIENT_CONNECT) {
+        conn->kind = CONN_CLIENT;
+      } else if (frame->type == MON_CONNECT) {
+        add_monitor(server, id, conn, frame->nickname, frame->nickname_len);
+      } else {
+        send_error(server, id,
+                   is_client_type(frame->type) || is_monitor_type(frame->type) ? NOT_CONNECTED : UNKNOWN_TYPE);
+      }
+      break;
+    case CONN_CLIENT:
+      return handle_client_frame(server, id, conn, frame);
+    case CONN_MONITOR:
+      return handle_monitor_frame(server, id, frame);
+  }
+  return id;
+}
+
+/**
+ * Find the next whole message in buf. Client and monitor messages share
+ * the 6 byte header; only CLIENT_SEND_TIMED_MESSAGE adds to it, and
+ * session messages are a ChatSessionMsg instead.
+ *
+ * @return the message's length, or 0 if it has not all arrived
+ */
+static size_t next_frame(const char *buf, size_t len, struct ChatFrame *frame) {
+  struct ChatClientMessage message;
+  struct ChatTimedClientMessage timed_message;
+  struct ChatSessionMsg session_message;
+  size_t header_len;
+
+  if (!ChatClientCodec::decode(buf, len, message)) {
+    return 0;
+  }
+  if (is_session_type(message.type)) {
+    if (!ChatSessionCodec::decode(buf, len, session_message)) {
+      return 0;
+    }
+    frame->type = session_message.type;
+    frame->nickname = NULL;
+    frame->nickname_len = 0;
+    frame->data = NULL;
+    frame->data_len = 0;
+    frame->send_ns = 0;
+    frame->token = session_message.token;
+    frame->seq = session_message.seq;
+    return ChatSessionCodec::wire_size;
+  }
+  if (message.type == CLIENT_SEND_TIMED_MESSAGE) {
+    if (!ChatTimedClientCodec::decode_frame(buf, len, timed_message)) {
+      return 0;
+    }
+    header_len = ChatTimedClientCodec::wire_size;
+    frame->send_ns = timed_message.send_ns;
+  } else {
+    if (!ChatClientCodec::decode_frame(buf, len, message)) {
+      return 0;
+    }
+    header_len = ChatClientCodec::wire_size;
+    frame->send_ns = 0;
+  }
+
+  frame->type = message.type;
+  frame->nickname = buf + header_len;
+  frame->nickname_len = message.nickname_len;
+  frame->data = frame->nickname + message.nickname_len;
+  frame->data_len = message.data_length;
+  return header_len + message.nickname_len + message.data_length;
+}
+
+/**
+ * Park the start of a message that has not all arrived in borrowed
+ * chunks until the rest comes in.
+ */
+static void save_partial(struct ChatServer *server, uint32_t id, const char *data, size_t len) {
+  struct ChatConnection *conn = connection_at(&server->conns, id);
+  struct ChatChunk *chunk = NULL;
+  uint32_t handle;
+  size_t n;
+
+  while (len > 0) {
+    handle = borrow_chunk(&server->chunks);
+    if (handle == CHAT_NO_CHUNK) {
+      close_connection(server, id);
+      return;
+    }
+    if (chunk == NULL) {
+      conn->recv_chunk = handle;
+    } else {
+      chunk->next = handle;
+    }
+    chunk = chunk_at(&server->chunks, handle);
+    n = len < CHAT_CHUNK_DATA ? len : CHAT_CHUNK_DATA;
+    memcpy(chunk->data, data, n);
+    chunk->end = n;
+    data += n;
+    len -= n;
+  }
+}
+
+/**
+ * Copy a parked partial message back so it ends at dest, and give its
+ * chunks back.
+ *
+ * @return its length
+ */
+static size_t restore_partial(struct ChatServer *server, struct ChatConnection *conn, char *dest) {
+  struct ChatChunk *chunk;
+  size_t len = 0;
+
+  for (uint32_t handle = conn->recv_chunk; handle != CHAT_NO_CHUNK; handle = chunk->next) {
+    chunk = chunk_at(&server->chunks, handle);
+    len += chunk->end;
+  }
+  dest -= len;
+  for (uint32_t handle = conn->recv_chunk; handle != CHAT_NO_CHUNK; handle = chunk->next) {
+    chunk = chunk_at(&server->chunks, handle);
+    memcpy(dest, chunk->data, chunk->end);
+    dest += chunk->end;
+  }
+  return_chunks(&server->chunks, conn->recv_chunk);
+  conn->recv_chunk = CHAT_NO_CHUNK;
+  return len;
+}
+
+/**
+ * True for a resume of a session another worker owns, which has to
+ * be handled over there.
+ */
+static bool is_foreign_resume(const struct ChatServer *server, const struct ChatConnection *conn,
+                              const struct ChatFrame *frame) {
+  int owner = token_worker(frame->token);
+
+  return ((frame->type == CLIENT_RESUME && conn->kind == CONN_CLIENT) ||
+          (frame->type == MON_RESUME && conn->kind == CONN_MONITOR)) &&
+         !(conn->flags & CONN_SESSION) && frame->token != 0 && owner != server->worker_id &&
+         owner < server->group->num_workers;
+}
+
+/**
+ * Move a socket to the worker that owns the session it is resuming,
+ * along with everything read from it from the resume on. The peer
+ * waits for the answer to its resume, so that is rarely more than the
+ * resume itself.
+ */
+static void hand_over_socket(struct ChatServer *server, uint32_t id, uint64_t token, const char *data, size_t len) {
+  struct ChatConnection *conn = connection_at(&server->conns, id);
+  int owner = token_worker(token);
+  // The target is the socket, then the nickname the peer connected with
+  char *target = server->frame_buf;
+  size_t target_len = sizeof(conn->fd) + conn->nickname.len;
+
+  if (len > CHAT_RECV_SIZE || target_len > UINT16_MAX) {
+    close_connection(server, id);
+    return;
+  }
+  memcpy(target, &conn->fd, sizeof(conn->fd));
+  memcpy(&target[sizeof(conn->fd)], nickname_data(&conn->nickname), conn->nickname.len);
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+  if (!relay_push(server->group->workers[owner]->inbox[server->worker_id], RELAY_RESUME, target,
+                  (uint16_t)target_len, data, (uint32_t)len)) {
+    metrics_add(server->metrics, server->ids.relay_drops, 1);
+    close_connection(server, id);
+    return;
+  }
+  metrics_add(server->metrics, server->ids.relayed, 1);
+  server->wake_peers |= 1ull << owner;
+  forget_connection(server, id);
+}
+
+/**
+ * Handle len bytes just put at recv_buf + CHAT_MAX_FRAME, behind any
+ * partial message the connection had parked.
+ */
+static void handle_input(struct ChatServer *server, uint32_t id, size_t len) {
+  struct ChatConnection *conn = connection_at(&server->conns, id);
+  struct ChatFrame frame;
+  size_t frame_len;
+  size_t offset;
+  size_t end;
+
+  end = CHAT_MAX_FRAME + len;
+  offset = CHAT_MAX_FRAME;
+  if (conn->recv_chunk != CHAT_NO_CHUNK) {
+    offset -= restore_partial(server, conn, &server->recv_buf[CHAT_MAX_FRAME]);
+  }
+  while (offset < end && is_live(conn) &&
+         (frame_len = next_frame(&server->recv_buf[offset], end - offset, &frame)) > 0) {
+    if (is_foreign_resume(server, conn, &frame)) {
+      hand_over_socket(server, id, frame.token, &server->recv_buf[offset], end - offset);
+      return;
+    }
+    id = handle_frame(server, id, &frame);
+    conn = connection_at(&server->conns, id);
+    offset += frame_len;
+  }
+  if (is_live(conn) && offset < end) {
+    save_partial(server, id, &server->recv_buf[offset], end - offset);
+  }
+  if (is_live(conn) && conn->kind == CONN_CLIENT && (conn->flags & CONN_SESSION)) {
+    ack_client(server, id);
+  }
+}
+
+static void handle_readable(struct ChatServer *server, uint32_t id) {
+  struct ChatConnection *conn = connection_at(&server->conns, id);
+  // New bytes land after room for the largest partial message, which is
+  // copied back in front of them
+  char *fresh = &server->recv_buf[CHAT_MAX_FRAME];
+  ssize_t ret;
+
+  ret = recv(conn->fd, fresh, CHAT_RECV_SIZE, MSG_DONTWAIT);
+  if (ret <= 0) {
+    if (ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+      close_connection(server, id);
+    }
+    return;
+  }
+  metrics_add(server->metrics, server->ids.bytes_in, ret);
+  // Just push the deadline back; the wheel moves the timer when the old one comes due
+  if (conn->flags & CONN_TIMER) {
+    conn->deadline = server->timers.now_tick + server->idle_ticks;
+  }
+  handle_input(server, id, ret);
+}
+
+/**
+ * Take on the sockets the acceptor has handed over. With
+ * TCP_DEFER_ACCEPT their first message has normally arrived already,
+ * so each is read straight away rather than after another epoll_wait.
+ */
+static void adopt_sockets(struct ChatServer *server) {
+  struct ChatConnection *conn;
+  struct epoll_event event;
+  uint32_t id;
+  int one = 1;
+  int fd;
+
+  while (fd_ring_pop(&server->handoff, &fd)) {
+    conn = alloc_connection(&server->conns, &id);
+    if (conn == NULL) {
+      close(fd);
+      continue;
+    }
+    conn->fd = fd;
+    conn->message_full_at = server->now_us;
+    conn->byte_full_at = server->now_us;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    event.events = EPOLLIN;
+    event.data.u64 = id;
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+      close(fd);
+      free_connection(&server->conns, id);
+      continue;
+    }
+    metrics_add(server->metrics, server->ids.handoffs, 1);
+    start_idle_timer(server, id);
+    handle_readable(server, id);
+  }
+}
+
+/**
+ * Take on a socket another worker handed over because it resumes a
+ * session of this one, and handle what it had read from it.
+ */
+static void adopt_resumed_socket(struct ChatServer *server, const struct RelayRecord *record) {
+  struct ChatConnection *conn;
+  struct ChatClientMessage message;
+  struct epoll_event event;
+  const char *nickname = relay_target(record) + sizeof(int);
+  uint16_t nickname_len = record->target_len - sizeof(int);
+  uint32_t id;
+  int fd;
+
+  memcpy(&fd, relay_target(record), sizeof(fd));
+  conn = alloc_connection(&server->conns, &id);
+  if (conn == NULL) {
+    close(fd);
+    return;
+  }
+  conn->fd = fd;
+  conn->message_full_at = server->now_us;
+  conn->byte_full_at = server->now_us;
+  event.events = EPOLLIN;
+  event.data.u64 = id;
+  if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+    close(fd);
+    free_connection(&server->conns, id);
+    return;
+  }
+  start_idle_timer(server, id);
+  // Set up as it was on the other worker, in case the session is gone
+  if (ChatClientCodec::decode(relay_frame(record), record->frame_len, message) && message.type == MON_RESUME) {
+    add_monitor(server, id, conn, nickname, nickname_len);
+  } else {
+    conn->kind = CONN_CLIENT;
+    if (nickname_len > 0) {
+      set_client_nickname(server, id, conn, nickname, nickname_len);
+    }
+  }
+  memcpy(&server->recv_buf[CHAT_MAX_FRAME], relay_frame(record), record->frame_len);
+  handle_input(server, id, record->frame_len);
+}
+
+static void drain_ring(struct ChatServer *server, struct RelayRing *ring) {
+  const struct RelayRecord *record;
+  size_t len;
+
+  while ((record = relay_peek(ring)) != NULL) {
+    len = record->frame_len;
+    if (record->kind == RELAY_RESUME) {
+      adopt_resumed_socket(server, record);
+    } else {
+      memcpy(server->frame_buf, relay_frame(record), len);
+      if (record->kind == RELAY_BROADCAST) {
+        broadcast(server, len, false);
+      } else {
+        send_to_nickname(server, relay_target(record), record->target_len, len, false);
+      }
+    }
+    relay_pop(ring, record);
+  }
+}
+
+/**
+ * Deliver what the other workers, and other servers through the
+ * federation, relayed to this worker's monitors.
+ */
+static void drain_inbox(struct ChatServer *server) {
+  for (int w = 0; w < server->group->num_workers; ++w) {
+    if (server->inbox[w] != NULL) {
+      drain_ring(server, server->inbox[w]);
+    }
+  }
+  if (server->from_federation != NULL) {
+    drain_ring(server, server->from_federation);
+  }
+}
+
+/**
+ * Reap the connections that have been silent for idle_timeout_ms, and
+ * end the sessions whose peers have been gone for session_timeout_ms.
+ */
+static void expire_timers(struct ChatServer *server) {
+  struct ChatConnection *conn;
+  uint32_t id;
+
+  timer_advance(&server->timers, &server->conns, monotonic_ms(), &server->due);
+  for (size_t i = 0; i < server->due.size(); ++i) {
+    id = server->due[i];
+    conn = connection_at(&server->conns, id);
+    if (conn->flags & CONN_DETACHED) {
+      end_connection(server, id);
+      metrics_add(server->metrics, server->ids.sessions_expired, 1);
+    } else if (is_live(conn)) {
+      // A session is only detached, and gets its own timer
+      close_connection(server, id);
+      metrics_add(server->metrics, server->ids.idle_reaped, 1);
+    }
+  }
+  server->due.clear();
+}
+
+/**
+ * A worker's loop, until stop is set. Checked at least once a second.
+ */
+static void run_worker(struct ChatServer *server, const std::atomic<bool> *stop) {
+  struct epoll_event events[CHAT_MAX_EVENTS];
+  struct ChatConnection *conn;
+  uint64_t wakes;
+  uint32_t id;
+  int num_events;
+
+  while (!stop->load()) {
+    // Nothing says when the federation has room again, so look soon
+    num_events = epoll_wait(server->epoll_fd, events, CHAT_MAX_EVENTS, server->federation_backlog.empty() ? 1000 : 1);
+    if (num_events < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      handle_error("epoll_wait");
+      return;
+    }
+    server->now_us = monotonic_us();
+
+    for (int i = 0; i < num_events; ++i) {
+      if (events[i].data.u64 == WAKE_TAG) {
+        // Reset the counter before looking, so nothing pushed after is missed
+        if (read(server->wake_fd, &wakes, sizeof(wakes)) < 0) {
+          wakes = 0;
+        }
+        adopt_sockets(server);
+        drain_inbox(server);
+        continue;
+      }
+      id = (uint32_t)events[i].data.u64;
+      conn = connection_at(&server->conns, id);
+      if (is_live(conn) && (events[i].events & EPOLLOUT)) {
+        handle_writable(server, id);
+      }
+      if (is_live(conn) && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        handle_readable(server, id);
+      }
+    }
+    expire_timers(server);
+    flush_batches(server);
+    if (server->presence_monitors > 0 &&
+        server->group->member_version.load(std::memory_order_acquire) != server->presence_version) {
+      send_presence(server, UINT32_MAX);
+    }
+
+    for (size_t i = 0; i < server->closed.size(); ++i) {
+      free_connection(&server->conns, server->closed[i]);
+    }
+    server->closed.clear();
+    // One wakeup per peer per pass, however much was relayed to it
+    for (int w = 0; server->wake_peers != 0; ++w) {
+      if (server->wake_peers & (1ull << w)) {
+        wake_chat_worker(server->group->workers[w]);
+        server->wake_peers &= ~(1ull << w);
+      }
+    }
+    if (!server->federation_backlog.empty()) {
+      flush_federation_backlog(server);
+    }
+    if (server->wake_federation) {
+      wake_eventfd(server->group->federation_wake_fd);
+      server->wake_federation = false;
+    }
+    publish_stats(server);
+  }
+}
+
+void start_chat_workers(struct ChatWorkerGroup *group, const std::atomic<bool> *stop) {
+  for (int w = 0; w < group->num_workers; ++w) {
+    group->threads.push_back(std::thread(run_worker, group->workers[w], stop));
+  }
+}
+
+void free_chat_workers(struct ChatWorkerGroup *group) {
+  struct ChatServer *server;
+  int fd;
+
+  for (size_t i = 0; i < group->threads.size(); ++i) {
+    group->threads[i].join();
+  }
+  group->threads.clear();
+
+  for (int w = 0; w < group->num_workers; ++w) {
+    server = group->workers[w];
+    while (fd_ring_pop(&server->handoff, &fd)) {
+      close(fd);
+    }
+    for (size_t s = 0; s < server->conns.slabs.size(); ++s) {
+      for (uint32_t i = 0; i < CHAT_SLAB_RECORDS; ++i) {
+        end_connection(server, (uint32_t)(s << CHAT_SLAB_SHIFT) + i);
+      }
+    }
+    server->closed.clear();
+    close(server->epoll_fd);
+    close(server->wake_fd);
+    free_connection_slab(&server->conns);
+    free_chunk_pool(&server->chunks);
+    free_nick_table(&server->monitor_nicks);
+    for (int level = 0; level < CHAT_LZ_MAX_LEVEL; ++level) {
+      if (server->compress[level].ready) {
+        free_lz_encoder(&server->compress[level].encoder);
+        free(server->compress[level].batch);
+        free(server->compress[level].out);
+      }
+    }
+    for (int peer = 0; peer < group->num_workers; ++peer) {
+      delete server->inbox[peer];
+    }
+    free(server->recv_buf);
+    free(server->frame_buf);
+    delete server;
+  }
+  group->num_workers = 0;
+}
@@ -0,0 +1,324 @@
+//
+// The chat server: clients and monitors from tcp_chat.h spread over
+// worker threads, each with its own epoll loop and its connections'
+// state in the compact records of chat_connections.h. Messages from
+// clients are relayed to monitors:
+//
+//   CLIENT_SEND_MESSAGE         -> MON_MESSAGE to every monitor
+//   CLIENT_SEND_TIMED_MESSAGE   -> MON_TIMED_MESSAGE to every monitor
+//   CLIENT_SEND_DIRECT_MESSAGE  -> MON_DIRECT_MESSAGE to the monitors
+//                                  connected with the named nickname
+//   CLIENT_GET_MEMBERS          -> MON_DIRECT_MESSAGE from "server",
+//                                  listing client nicknames, each once,
+//                                  to the monitors with the asking
+//                                  client's nickname
+//   CLIENT_GET_MEMBERS, with    -> CLIENT_MEMBERS back to the client: who
+//   the version last seen          joined and left since that version
+//
+// Anything else gets a ServerErrorMessage back.
+//
+// A client or monitor that starts a session (chat_sessions.h) can
+// resume it after its connection drops: a monitor gets the messages it
+// missed, a client learns which of its messages were handled. Client
+// sessions are acknowledged with CLIENT_ACK after every read that
+// handled some of their messages.
+//
+// Sockets come from the acceptor (chat_accept.h) through each worker's
+// FdRing. A message for monitors on other workers is pushed onto their
+// RelayRings and they are woken once per pass through the loop.
+//
+// Every connection has one timer in its worker's wheel (chat_timers.h):
+// a live one is reaped after idle_timeout_ms without a byte from its
+// peer, which sends CLIENT_HEARTBEAT or MON_HEARTBEAT when it has
+// nothing else to say; a detached one ends its session after
+// session_timeout_ms.
+//
+// Clients that send faster than their rate limits (chat_limits.h), or
+// than the whole server is allowed to take in, have their messages
+// dropped and are told so with one THROTTLED error, sent again only
+// after one of their messages got through. Throttled messages still
+// count as handled for a session, so they are not sent again.
+//
+// A monitor that sends MON_COMPRESS gets its broadcasts in
+// MON_COMPRESSED batches (chat_lz.h). The monitors on a worker that
+// asked for the same level share one compressor: what a pass
+// broadcasts is batched, compressed once when the pass ends, and the
+// same bytes are queued to each of them. A monitor joining a level
+// starts a batch with CHAT_BATCH_RESET, so every monitor at that level
+// shares the window from then on. Messages for one monitor alone are
+// sent as they are, after flushing the batch before them.
+//
+// Who joined and left is kept in one log for all the workers
+// (chat_members.h), behind a mutex: nicknames come and go far less
+// often than messages, and an answer from the log is the whole chat's
+// at one version, where each worker answering for its own members
+// would not be. Plain member lists come from it too, as one message
+// with each nickname once however many workers and nodes have it.
+//
+// A monitor that sends MON_PRESENCE is sent every member, then at the
+// end of each pass the changes its worker has not yet passed on; the
+// worker that logs a change wakes the workers with such monitors.
+// These go straight to the monitor, outside its session and its
+// compressed batches, and a resumed monitor asks again.
+//
+// A federated server (chat_federation.h) has one more thread, which
+// the workers treat as one more peer: what they relay to each other
+// also goes to it, along with every nickname a client takes or gives
+// up and every monitor's nickname, and what it hears from other
+// servers comes back through a ring into each worker. What a pass
+// relays to it can be more than its ring holds, so the rest waits in
+// a backlog of up to CHAT_FEDERATION_BACKLOG.
+//
+
+#ifndef TCP_CHAT_CHAT_SERVER_H
+#define TCP_CHAT_CHAT_SERVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "chat_connections.h"
+#include "chat_handoff.h"
+#include "chat_limits.h"
+#include "chat_lz.h"
+#include "chat_members.h"
+#include "chat_sessions.h"
+#include "chat_timers.h"
+#include "metrics.h"
+
+// Bytes read from a socket per recv(), on top of a pending partial frame
+#define CHAT_RECV_SIZE (64 * 1024)
+
+// Default chunks (of CHAT_CHUNK_DATA bytes) a monitor may fall behind
+// by before it is dropped as a slow consumer
+#define CHAT_DEFAULT_MAX_SEND_CHUNKS 256
+
+// Default bytes of recent messages kept for each monitor session
+#define CHAT_DEFAULT_HISTORY_BYTES (64 * 1024)
+
+// Default time a session waits for its peer to come back
+#define CHAT_DEFAULT_SESSION_TIMEOUT_MS 30000
+
+// Default silence after which a connection is reaped: four heartbeat
+// intervals (CHAT_HEARTBEAT_INTERVAL_MS)
+#define CHAT_DEFAULT_IDLE_TIMEOUT_MS 60000
+
+// How much of global_rate may come in at once, in ms of it
+#define CHAT_ADMISSION_BURST_MS 100
+
+// Events taken per epoll_wait()
+#define CHAT_MAX_EVENTS 256
+
+// Most worker threads; wakeups are tracked in a 64 bit mask
+#define CHAT_MAX_WORKERS 64
+
+// Bytes of messages a worker holds for the federation while the ring to
+// it is full, before it drops them
+#define CHAT_FEDERATION_BACKLOG (16 * 1024 * 1024)
+
+struct ChatServerMetricIds {
+  int closes;
+  int bytes_in;
+  int bytes_out;
+  int frames_in;
+  int frames_out;
+  int error_replies;
+  int slow_consumers;
+  int handoffs;
+  int relayed;
+  int relay_drops;
+  int fanout;
+  int sessions_started;
+  int resumes;
+  int resume_misses;
+  int replayed;
+  int sessions_expired;
+  int idle_reaped;
+  int throttled;
+  int admission_denied;
+  int compress_batches;
+  int compress_raw_bytes; // raw / compressed bytes is the compression ratio
+  int compress_bytes;
+  int compress_ns; // thread CPU time spent compressing, over raw bytes for the cost per MB
+  int member_deltas; // CLIENT_MEMBERS and MON_PRESENCE answers of changes
+  int member_snapshots; // and of every member
+};
+
+/**
+ * Server settings shared by every worker.
+ */
+struct ChatServerConfig {
+  int num_workers;
+  /* chunks (of CHAT_CHUNK_DATA bytes) a monitor may fall behind by */
+  uint32_t max_send_chunks;
+  /* bytes of recent messages each monitor session keeps for a resume */
+  uint32_t max_history_bytes;
+  /* how long a session outlives its connection */
+  uint32_t session_timeout_ms;
+  /* silence after which a connection is reaped, 0 for never */
+  uint32_t idle_timeout_ms;
+  /* each client's messages a second, and how many may come at once; a 0 rate is unlimited */
+  uint32_t message_rate;
+  uint32_t message_burst;
+  /* each client's bytes a second, and how many may come at once */
+  uint32_t byte_rate;
+  uint32_t byte_burst;
+  /* messages a second taken from all clients together, 0 for unlimited */
+  uint32_t global_rate;
+  /* highest MON_COMPRESS level granted, 0 to refuse compression */
+  int max_compress_level;
+};
+
+/**
+ * Totals each worker publishes once per pass, for the stats thread.
+ */
+enum ChatStat {
+  STAT_CONNECTIONS,
+  STAT_MONITORS,
+  STAT_MEMBERS,
+  STAT_SLAB_BYTES,
+  STAT_CHUNKS_IN_USE,
+  STAT_CHUNK_BYTES,
+  STAT_SESSIONS,
+  STAT_DETACHED,
+  NUM_CHAT_STATS
+};
+
+/**
+ * Batch and compressor shared by a worker's monitors at one level.
+ */
+struct ChatCompressGroup {
+  bool ready; // encoder and buffers allocated
+  bool reset; // next batch starts the window over
+  uint32_t monitors;
+  struct LzEncoder encoder;
+  char *batch; // messages waiting for the end of the pass, CHAT_MAX_BATCH
+  size_t batch_len;
+  char *out; // the MON_COMPRESSED being sent
+};
+
+/**
+ * A record for the federation that did not fit in the ring to it.
+ */
+struct ChatFederationRecord {
+  uint16_t kind; // RELAY_BROADCAST, RELAY_MEMBER_JOIN and so on
+  std::string target;
+  std::string frame;
+};
+
+struct ChatWorkerGroup;
+
+/**
+ * One worker: an epoll loop and the connections handed to it.
+ */
+struct ChatServer {
+  int worker_id;
+  const struct ChatServerConfig *config;
+  int epoll_fd;
+  int wake_fd; // eventfd, written when sockets or relayed messages arrive
+  struct ChatWorkerGroup *group;
+  struct FdRing handoff; // sockets from the acceptor
+  struct RelayRing *inbox[CHAT_MAX_WORKERS]; // messages from each other worker
+  uint64_t wake_peers; // workers relayed to this pass
+  struct RelayRing *to_federation; // NULL if the server is not federated
+  struct RelayRing *from_federation;
+  bool wake_federation; // pushed to it this pass
+  std::deque<struct ChatFederationRecord> federation_backlog; // the ring to it was full
+  size_t federation_backlog_bytes; // of the frames in it
+  struct ConnectionSlab conns;
+  struct ChunkPool chunks;
+  struct NickTable monitor_nicks; // nickname -> monitors connected with it
+  struct ChatSessionTable sessions;
+  struct TimerWheel timers;
+  uint32_t idle_ticks; // idle_timeout_ms in wheel ticks, 0 if never reaped
+  uint32_t session_ticks;
+  uint32_t now_us; // coarse clock for rate limits, read once per pass
+  struct RateLimit message_limit;
+  struct RateLimit byte_limit;
+  struct RateLimit admission; // this worker's share of global_rate
+  uint32_t admission_full_at;
+  std::vector<uint32_t> monitors; // every monitor, for broadcasts
+  std::vector<uint32_t> members; // every client with a nickname
+  std::vector<uint32_t> closed; // closed this pass, freed once events are done
+  std::vector<uint32_t> due; // timers that fired this pass
+  char *recv_buf; // a whole partial frame plus CHAT_RECV_SIZE
+  char *frame_buf; // outgoing message being built
+  struct ChatCompressGroup compress[CHAT_LZ_MAX_LEVEL]; // by level - 1
+  uint32_t presence_monitors; // monitors that sent MON_PRESENCE
+  uint64_t presence_version; // of the group's member log, as they were last sent it
+  std::vector<char> members_out; // CLIENT_MEMBERS or MON_PRESENCE being sent
+  struct MetricsShard *metrics;
+  struct ChatServerMetricIds ids;
+  std::atomic<uint64_t> stats[NUM_CHAT_STATS];
+};
+
+/**
+ * A stat summed over every worker, served as a gauge.
+ */
+struct ChatStatGauge {
+  const struct ChatWorkerGroup *group;
+  int stat;
+};
+
+struct ChatWorkerGroup {
+  const struct ChatServerConfig *config;
+  int num_workers;
+  struct ChatServer *workers[CHAT_MAX_WORKERS];
+  struct ChatStatGauge gauges[NUM_CHAT_STATS];
+  std::vector<std::thread> threads;
+  int federation_wake_fd; // eventfd of the federation thread, -1 if there is none
+  std::mutex member_lock;
+  struct ChatMemberLog member_log; // every worker's members, and the federation's
+  std::atomic<uint64_t> member_version; // of member_log, to look at without the lock
+  std::atomic<uint64_t> presence_workers; // workers with presence_monitors
+};
+
+/**
+ * Set up config->num_workers workers and register their metrics.
+ *
+ * @param config server settings, kept until free_chat_workers()
+ * @return 0 on success, -1 on failure (see errno)
+ */
+int init_chat_workers(struct ChatWorkerGroup *group, const struct ChatServerConfig *config,
+                      struct MetricsRegistry *registry);
+
+/**
+ * Start a thread per worker, serving until stop is set.
+ */
+void start_chat_workers(struct ChatWorkerGroup *group, const std::atomic<bool> *stop);
+
+/**
+ * Wait for the workers to stop, then close every connection and free
+ * everything.
+ */
+void free_chat_workers(struct ChatWorkerGroup *group);
+
+/**
+ * Give an accepted socket to a worker. Only the acceptor thread may
+ * call this; call wake_chat_worker() once a batch is handed over.
+ *
+ * @return false if the worker already has CHAT_HANDOFF_SLOTS waiting
+ */
+bool hand_off_socket(struct ChatServer *worker, int fd);
+
+void wake_chat_worker(struct ChatServer *worker);
+
+/**
+ * Log a client nickname coming to the chat or going, from any thread.
+ *
+ * @return the workers to wake so their presence monitors hear of it,
+ *         0 if the log did not change
+ */
+uint64_t log_member_change(struct ChatWorkerGroup *group, bool joined, const char *nickname, uint16_t nickname_len);
+
+/**
+ * Resident set size of this process, from /proc/self/statm.
+ */
+uint64_t process_rss_bytes(const void *arg);
+
+#endif //TCP_CHAT_CHAT_SERVER_H
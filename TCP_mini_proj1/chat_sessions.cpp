@@ -0,0 +1,217 @@
+#include "chat_sessions.h"
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+
+// Low 56 bits of a token; the top byte is the owning worker
+#define TOKEN_RANDOM_MASK ((1ull << 56) - 1)
+
+void init_session_table(struct ChatSessionTable *table, int worker_id, uint32_t max_history_bytes) {
+  table->worker_id = worker_id;
+  table->max_history_bytes = max_history_bytes;
+  table->num_detached = 0;
+}
+
+static uint64_t new_token(const struct ChatSessionTable *table) {
+  struct timespec now;
+  uint64_t random;
+  uint64_t token;
+
+  do {
+    if (getrandom(&random, sizeof(random), GRND_NONBLOCK) != sizeof(random)) {
+      // Only guessable tokens until the entropy pool is ready
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      random = ((uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec) * 0x9E3779B97F4A7C15ull;
+    }
+    token = ((uint64_t)table->worker_id << 56) | (random & TOKEN_RANDOM_MASK);
+  } while ((token & TOKEN_RANDOM_MASK) == 0 || table->by_token.count(token) > 0);
+  return token;
+}
+
+struct ChatSession *start_session(struct ChatSessionTable *table, uint32_t conn_id) {
+  struct ChatSession *session = &table->by_conn[conn_id];
+
+  memset(session, 0, sizeof(*session));
+  session->token = new_token(table);
+  table->by_token[session->token] = conn_id;
+  return session;
+}
+
+struct ChatSession *session_of(struct ChatSessionTable *table, uint32_t conn_id) {
+  auto found = table->by_conn.find(conn_id);
+
+  return found == table->by_conn.end() ? NULL : &found->second;
+}
+
+uint32_t find_session(const struct ChatSessionTable *table, uint64_t token) {
+  auto found = table->by_token.find(token);
+
+  return found == table->by_token.end() ? UINT32_MAX : found->second;
+}
+
+void end_session(struct ChatSessionTable *table, struct ChunkPool *pool, uint32_t conn_id) {
+  auto found = table->by_conn.find(conn_id);
+
+  if (found == table->by_conn.end()) {
+    return;
+  }
+  return_chunks(pool, found->second.history_head);
+  table->by_token.erase(found->second.token);
+  table->by_conn.erase(found);
+}
+
+/**
+ * Copy n bytes of history starting at (chunk, offset) to dest, or
+ * skip them if dest is NULL, and move past them.
+ */
+static void read_history(const struct ChunkPool *pool, uint32_t *chunk, uint32_t *offset, char *dest, size_t n) {
+  const struct ChatChunk *current;
+  size_t take;
+
+  while (n > 0) {
+    current = chunk_at(pool, *chunk);
+    if (*offset == current->end) {
+      *chunk = current->next;
+      *offset = 0;
+      continue;
+    }
+    take = n < (size_t)(current->end - *offset) ? n : (size_t)(current->end - *offset);
+    if (dest != NULL) {
+      memcpy(dest, &current->data[*offset], take);
+      dest += take;
+    }
+    *offset += take;
+    n -= take;
+  }
+}
+
+/**
+ * Append n bytes to a chain whose chunks after *chunk are already
+ * borrowed and empty.
+ */
+static void write_history(struct ChunkPool *pool, uint32_t *chunk, const char *src, size_t n) {
+  struct ChatChunk *current;
+  size_t take;
+
+  while (n > 0) {
+    current = chunk_at(pool, *chunk);
+    if (current->end == CHAT_CHUNK_DATA) {
+      *chunk = current->next;
+      continue;
+    }
+    take = n < (size_t)(CHAT_CHUNK_DATA - current->end) ? n : (size_t)(CHAT_CHUNK_DATA - current->end);
+    memcpy(&current->data[current->end], src, take);
+    current->end += take;
+    src += take;
+    n -= take;
+  }
+}
+
+static void forget_history(struct ChunkPool *pool, struct ChatSession *session) {
+  return_chunks(pool, session->history_head);
+  session->history_head = CHAT_NO_CHUNK;
+  session->history_tail = CHAT_NO_CHUNK;
+  session->history_bytes = 0;
+  session->first_seq = session->seq;
+}
+
+/**
+ * Forget the oldest message, handing back the chunks it leaves empty.
+ */
+static void drop_oldest(struct ChunkPool *pool, struct ChatSession *session) {
+  uint32_t chunk = session->history_head;
+  uint32_t offset = chunk_at(pool, chunk)->start;
+  uint32_t len;
+  uint32_t next;
+
+  read_history(pool, &chunk, &offset, (char *)&len, sizeof(len));
+  read_history(pool, &chunk, &offset, NULL, len);
+  session->history_bytes -= sizeof(len) + len;
+  session->first_seq++;
+  if (session->history_bytes == 0) {
+    forget_history(pool, session);
+    return;
+  }
+  while (session->history_head != chunk) {
+    next = chunk_at(pool, session->history_head)->next;
+    chunk_at(pool, session->history_head)->next = CHAT_NO_CHUNK;
+    return_chunks(pool, session->history_head);
+    session->history_head = next;
+  }
+  chunk_at(pool, chunk)->start = offset;
+}
+
+uint64_t history_append(struct ChatSessionTable *table, struct ChunkPool *pool, struct ChatSession *session,
+                        const char *frame, uint32_t len) {
+  uint64_t seq = session->seq++;
+  uint32_t need = sizeof(len) + len;
+  uint32_t room = 0;
+  uint32_t chain = CHAT_NO_CHUNK;
+  uint32_t last = CHAT_NO_CHUNK;
+  uint32_t handle;
+
+  if (session->history_tail != CHAT_NO_CHUNK) {
+    room = CHAT_CHUNK_DATA - chunk_at(pool, session->history_tail)->end;
+  }
+  // Borrow everything up front, so running out never leaves half a message
+  for (uint32_t have = room; have < need; have += CHAT_CHUNK_DATA) {
+    handle = borrow_chunk(pool);
+    if (handle == CHAT_NO_CHUNK) {
+      return_chunks(pool, chain);
+      forget_history(pool, session);
+      return seq;
+    }
+    if (chain == CHAT_NO_CHUNK) {
+      chain = handle;
+    } else {
+      chunk_at(pool, last)->next = handle;
+    }
+    last = handle;
+  }
+
+  if (session->history_tail == CHAT_NO_CHUNK) {
+    session->history_head = chain;
+    handle = chain;
+  } else {
+    chunk_at(pool, session->history_tail)->next = chain;
+    handle = session->history_tail;
+  }
+  if (last != CHAT_NO_CHUNK) {
+    session->history_tail = last;
+  }
+  write_history(pool, &handle, (const char *)&len, sizeof(len));
+  write_history(pool, &handle, frame, len);
+  session->history_bytes += need;
+
+  while (session->history_bytes > table->max_history_bytes) {
+    drop_oldest(pool, session);
+  }
+  return seq;
+}
+
+void history_seek(const struct ChunkPool *pool, const struct ChatSession *session, uint64_t seq,
+                  struct HistoryCursor *cursor) {
+  uint32_t len;
+
+  cursor->chunk = session->history_head;
+  cursor->offset = session->history_head == CHAT_NO_CHUNK ? 0 : chunk_at(pool, session->history_head)->start;
+  cursor->seq = session->first_seq;
+  while (cursor->seq < seq) {
+    read_history(pool, &cursor->chunk, &cursor->offset, (char *)&len, sizeof(len));
+    read_history(pool, &cursor->chunk, &cursor->offset, NULL, len);
+    cursor->seq++;
+  }
+}
+
+uint32_t history_next(const struct ChunkPool *pool, const struct ChatSession *session, struct HistoryCursor *cursor,
+                      char *dest) {
+  uint32_t len;
+
+  if (cursor->seq >= session->seq) {
+    return 0;
+  }
+  read_history(pool, &cursor->chunk, &cursor->offset, (char *)&len, sizeof(len));
+  read_history(pool, &cursor->chunk, &cursor->offset, dest, len);
+  cursor->seq++;
+  return len;
+}
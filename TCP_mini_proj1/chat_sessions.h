@@ -0,0 +1,108 @@
+//
+// Sessions for the chat server (ChatSessionMsg in tcp_chat.h). A
+// session belongs to a connection record. When the connection drops,
+// the record is only detached: it stays on the monitor and member
+// lists, so a monitor's session goes on collecting what is sent to it
+// until the peer resumes or the session times out.
+//
+// A monitor session keeps its latest messages in pool chunks, each one
+// preceded by its length, up to a byte limit. A resume replays the gap
+// from there. A client session only counts the messages handled, so
+// the client knows which of its unacknowledged messages to send again.
+//
+// A token's top byte is the worker that owns the session, so a resume
+// that lands on another worker knows where to send the socket.
+//
+
+#ifndef TCP_CHAT_CHAT_SESSIONS_H
+#define TCP_CHAT_CHAT_SESSIONS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <unordered_map>
+
+#include "chat_connections.h"
+
+struct ChatSession {
+  uint64_t token;
+  uint64_t seq; // client: messages handled; monitor: number of the next message
+  uint64_t acked; // client: seq last sent back in a CLIENT_ACK
+  uint64_t first_seq; // monitor: number of the oldest message in history
+  uint32_t history_head; // monitor: chunk chain of recent messages
+  uint32_t history_tail;
+  uint32_t history_bytes; // length prefixes included
+};
+
+/**
+ * One worker's sessions.
+ */
+struct ChatSessionTable {
+  int worker_id;
+  uint32_t max_history_bytes;
+  uint32_t num_detached;
+  std::unordered_map<uint32_t, struct ChatSession> by_conn; // connection id -> session
+  std::unordered_map<uint64_t, uint32_t> by_token; // token -> connection id
+};
+
+/**
+ * A place in a session's history.
+ */
+struct HistoryCursor {
+  uint32_t chunk;
+  uint32_t offset;
+  uint64_t seq; // number of the message starting here
+};
+
+void init_session_table(struct ChatSessionTable *table, int worker_id, uint32_t max_history_bytes);
+
+/**
+ * Give a connection a new session with a fresh token.
+ */
+struct ChatSession *start_session(struct ChatSessionTable *table, uint32_t conn_id);
+
+/**
+ * @return the connection's session, or NULL if it has none
+ */
+struct ChatSession *session_of(struct ChatSessionTable *table, uint32_t conn_id);
+
+/**
+ * @return the id of the connection the token's session belongs to, or
+ *         UINT32_MAX if there is no such session (any more)
+ */
+uint32_t find_session(const struct ChatSessionTable *table, uint64_t token);
+
+/**
+ * Drop a connection's session and give its history back to the pool.
+ */
+void end_session(struct ChatSessionTable *table, struct ChunkPool *pool, uint32_t conn_id);
+
+static inline int token_worker(uint64_t token) {
+  return (int)(token >> 56);
+}
+
+/**
+ * Number the next message for a monitor session and keep a copy,
+ * forgetting the oldest messages past max_history_bytes.
+ *
+ * @return the message's number
+ */
+uint64_t history_append(struct ChatSessionTable *table, struct ChunkPool *pool, struct ChatSession *session,
+                        const char *frame, uint32_t len);
+
+/**
+ * Point a cursor at message seq, which must be between
+ * session->first_seq and session->seq.
+ */
+void history_seek(const struct ChunkPool *pool, const struct ChatSession *session, uint64_t seq,
+                  struct HistoryCursor *cursor);
+
+/**
+ * Copy the message at the cursor to dest (CHAT_MAX_FRAME bytes) and
+ * move past it.
+ *
+ * @return its length, or 0 at the end of the history
+ */
+uint32_t history_next(const struct ChunkPool *pool, const struct ChatSession *session, struct HistoryCursor *cursor,
+                      char *dest);
+
+#endif //TCP_CHAT_CHAT_SESSIONS_H
@@ -0,0 +1,254 @@
+//
+// Reconnect storm against tcpchatserver: N peers connect at once, as
+// they would right after a server restart, each sending CLIENT_CONNECT
+// plus CLIENT_SET_NICKNAME (or, for a share of them, MON_CONNECT with a
+// nickname) the moment its connection is up. Reports how long it takes
+// until the server, asked over its stats socket, counts every one of
+// them as a member or monitor.
+//
+// Connects are non-blocking and all in flight together, spread over
+// 127.1.0.0/16 source addresses like chat_conn_bench.
+//
+// e.g., ./tcpchatserver 127.0.0.1 8888 --stats /tmp/tcpchatserver.stats &
+//       ./chat_storm_bench 127.0.0.1 8888 /tmp/tcpchatserver.stats --clients 10000 --monitors 10
+//
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "chat_wire.h"
+#include "metrics.h"
+#include "tcp_utils.h"
+
+// Connections per loopback source address, well inside the ephemeral range
+#define CONNECTIONS_PER_SOURCE 20000
+
+// Descriptors kept back for stdio, epoll, the stats socket and so on
+#define SPARE_FDS 64
+
+static uint64_t now_us() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * The server's count of peers past their handshake.
+ */
+static int read_joined(const char *stats_path, uint64_t *joined) {
+  uint64_t members;
+  uint64_t monitors;
+
+  if (metrics_query(stats_path, "chat.members", &members) == -1 ||
+      metrics_query(stats_path, "chat.monitors", &monitors) == -1) {
+    return -1;
+  }
+  *joined = members + monitors;
+  return 0;
+}
+
+/**
+ * Start a non-blocking connect from source address number source.
+ *
+ * @return the socket, or -1 on failure
+ */
+static int start_connect(const struct sockaddr_in *server_addr, uint32_t source) {
+  struct sockaddr_in source_addr;
+  int one = 1;
+  int peer_socket;
+
+  peer_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+  if (peer_socket < 0) {
+    return -1;
+  }
+  setsockopt(peer_socket, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+  memset(&source_addr, 0, sizeof(source_addr));
+  source_addr.sin_family = AF_INET;
+  source_addr.sin_addr.s_addr = htonl(0x7F010000u + 1 + source);
+  if (bind(peer_socket, (struct sockaddr *)&source_addr, sizeof(source_addr)) == -1 ||
+      (connect(peer_socket, (const struct sockaddr *)server_addr, sizeof(*server_addr)) == -1 &&
+       errno != EINPROGRESS)) {
+    close(peer_socket);
+    return -1;
+  }
+  return peer_socket;
+}
+
+/**
+ * Send a peer's handshake in one write: a client's CLIENT_CONNECT and
+ * CLIENT_SET_NICKNAME, or a monitor's MON_CONNECT.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int send_handshake(int peer_socket, bool monitor, uint32_t number) {
+  char buf[64];
+  char nickname[16];
+  struct ChatClientMessage client_message;
+  struct ChatMonMsg mon_message;
+  size_t len;
+  int nickname_len;
+
+  nickname_len = snprintf(nickname, sizeof(nickname), "user%u", number);
+  if (monitor) {
+    mon_message.type = MON_CONNECT;
+    mon_message.nickname_len = nickname_len;
+    mon_message.data_len = 0;
+    len = ChatMonCodec::encode(mon_message, buf, sizeof(buf));
+  } else {
+    client_message.type = CLIENT_CONNECT;
+    client_message.nickname_len = 0;
+    client_message.data_length = 0;
+    len = ChatClientCodec::encode(client_message, buf, sizeof(buf));
+    client_message.type = CLIENT_SET_NICKNAME;
+    client_message.data_length = nickname_len;
+    len += ChatClientCodec::encode(client_message, &buf[len], sizeof(buf) - len);
+  }
+  memcpy(&buf[len], nickname, nickname_len);
+  len += nickname_len;
+  return send(peer_socket, buf, len, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+}
+
+/**
+ *
+ * Reads in IP PORT STATS_SOCKET [--clients N] [--monitors PERCENT] [--rounds R]
+ *
+ * @param argc count of arguments on the command line
+ * @param argv array of command line arguments
+ * @return 0 on success, non-zero if an error occurred
+ */
+int main(int argc, char *argv[]) {
+  struct sockaddr_in server_addr;
+  struct epoll_event event;
+  std::vector<struct epoll_event> events;
+  std::vector<int> sockets;
+  const char *stats_path;
+  uint64_t clients = 10000;
+  uint64_t monitor_percent = 0;
+  int rounds = 3;
+  uint64_t fd_limit;
+  uint64_t base_joined;
+  uint64_t joined;
+  uint64_t start_us;
+  uint64_t connected_us;
+  uint64_t joined_us;
+  uint64_t deadline_us;
+  uint64_t pending;
+  uint64_t failed;
+  uint64_t first_source;
+  int epoll_fd;
+  int num_events;
+  int error;
+  socklen_t error_len;
+
+  if (argc < 4) {
+    fprintf(stderr, "Usage: %s IP PORT STATS_SOCKET [--clients N] [--monitors PERCENT] [--rounds R]\n", argv[0]);
+    return 1;
+  }
+  for (int i = 4; i < argc; ++i) {
+    if (strcmp(argv[i], "--clients") == 0 && i + 1 < argc) {
+      clients = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--monitors") == 0 && i + 1 < argc) {
+      monitor_percent = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--rounds") == 0 && i + 1 < argc) {
+      rounds = atoi(argv[++i]);
+    } else {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+  stats_path = argv[3];
+  if (convert_ip_port_to_sockaddr_in(argv[1], argv[2], &server_addr) == -1) {
+    fprintf(stderr, "Invalid IP/port %s %s\n", argv[1], argv[2]);
+    return 1;
+  }
+
+  fd_limit = raise_fd_limit();
+  if (clients + SPARE_FDS > fd_limit) {
+    fprintf(stderr, "Open file limit is %llu, using %llu clients\n", (unsigned long long)fd_limit,
+            (unsigned long long)(fd_limit - SPARE_FDS));
+    clients = fd_limit - SPARE_FDS;
+  }
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  events.resize(clients);
+  for (int round = 0; round < rounds; ++round) {
+    if (read_joined(stats_path, &base_joined) == -1) {
+      fprintf(stderr, "Could not read stats from %s\n", stats_path);
+      return 1;
+    }
+
+    // Every peer starts connecting before any handshake is sent. Each
+    // round gets fresh source addresses, so no connect runs into the last
+    // round's TIME_WAIT and waits out a SYN retransmit.
+    failed = 0;
+    first_source = round * ((clients + CONNECTIONS_PER_SOURCE - 1) / CONNECTIONS_PER_SOURCE);
+    start_us = now_us();
+    for (uint64_t i = 0; i < clients; ++i) {
+      int fd = start_connect(&server_addr, (uint32_t)(first_source + i / CONNECTIONS_PER_SOURCE));
+      if (fd < 0) {
+        failed++;
+        continue;
+      }
+      event.events = EPOLLOUT;
+      event.data.u64 = ((uint64_t)i << 32) | (uint32_t)fd;
+      epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+      sockets.push_back(fd);
+    }
+
+    // Handshake on each as soon as its connect completes
+    pending = sockets.size();
+    deadline_us = start_us + 30000000;
+    while (pending > 0 && now_us() < deadline_us) {
+      num_events = epoll_wait(epoll_fd, events.data(), (int)events.size(), 100);
+      for (int e = 0; e < num_events; ++e) {
+        int fd = (int)(uint32_t)events[e].data.u64;
+        uint32_t number = (uint32_t)(events[e].data.u64 >> 32);
+        error = 0;
+        error_len = sizeof(error);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len);
+        if (error != 0 || send_handshake(fd, number % 100 < monitor_percent, number) == -1) {
+          failed++;
+        }
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        pending--;
+      }
+    }
+    connected_us = now_us();
+
+    joined = base_joined;
+    // Peers that never got to send their handshake will not join
+    while (joined < base_joined + clients - failed && now_us() < deadline_us) {
+      if (read_joined(stats_path, &joined) == -1) {
+        break;
+      }
+      usleep(500);
+    }
+    joined_us = now_us();
+
+    printf("round %d: %llu peers, %llu failed, connected in %.1f ms, all joined in %.1f ms (%.0f handshakes/s)\n",
+           round, (unsigned long long)clients, (unsigned long long)failed, (connected_us - start_us) / 1000.0,
+           (joined_us - start_us) / 1000.0, (double)(joined - base_joined) * 1e6 / (double)(joined_us - start_us));
+
+    // Hang up and let the server see everyone leave before the next round
+    for (size_t i = 0; i < sockets.size(); ++i) {
+      close(sockets[i]);
+    }
+    sockets.clear();
+    deadline_us = now_us() + 10000000;
+    while (read_joined(stats_path, &joined) == 0 && joined > base_joined && now_us() < deadline_us) {
+      usleep(1000);
+    }
+  }
+  close(epoll_fd);
+  return 0;
+}
@@ -0,0 +1,232 @@
+//
+// Checks and times tcpchatserver's timer wheel (chat_timers.h) on a
+// fake clock. --timers connections are scheduled at random ticks over
+// the first half of --span-ms, each for a deadline up to --span-ms
+// later; before it comes due, some have their deadline pushed back the
+// way the server does on incoming data (just stored in the record),
+// some are scheduled again at a new deadline, earlier or later, and
+// some are cancelled.
+//
+// The clock moves one tick at a time, so every timer must come out of
+// timer_advance() at exactly its last deadline tick, once, and no
+// cancelled one at all; any that does not is reported and the exit
+// status is 1. It then prints the CPU time (thread CPU time) per call,
+// less that of reading the clock around it.
+//
+// e.g., ./chat_timer_bench --timers 20000
+//       ./chat_timer_bench --timers 1000000 --span-ms 3600000
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include "chat_connections.h"
+#include "chat_timers.h"
+
+static uint64_t cpu_ns() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static uint32_t next_random(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return (uint32_t)(*state >> 32);
+}
+
+enum TimerAction {
+  ACTION_SCHEDULE = 0,
+  ACTION_PUSH_BACK,
+  ACTION_RESCHEDULE,
+  ACTION_CANCEL,
+  ACTION_NONE
+};
+
+struct Timer {
+  uint32_t id;
+  uint32_t deadline; // tick it must fire at
+  uint8_t action; // what happens to it before then, a TimerAction
+  bool cancelled;
+  uint32_t fired;
+};
+
+struct Cost {
+  uint64_t calls;
+  uint64_t ns;
+};
+
+// What reading the clock twice costs, taken off every call timed
+static uint64_t clock_ns;
+
+static void calibrate_clock() {
+  uint64_t start = cpu_ns();
+
+  for (int i = 0; i < 1000; ++i) {
+    cpu_ns();
+  }
+  clock_ns = (cpu_ns() - start) / 1000;
+}
+
+static void count(struct Cost *cost, uint64_t start) {
+  uint64_t ns = cpu_ns() - start;
+
+  cost->ns += ns > clock_ns ? ns - clock_ns : 0;
+  cost->calls++;
+}
+
+static void print_cost(const char *name, const struct Cost *cost) {
+  printf("%-14s %10llu  %8.1f\n", name, (unsigned long long)cost->calls,
+         cost->calls > 0 ? (double)cost->ns / cost->calls : 0.0);
+}
+
+int main(int argc, char *argv[]) {
+  struct ConnectionSlab slab;
+  struct TimerWheel wheel;
+  struct ChatConnection *conn;
+  std::vector<struct Timer> timers;
+  std::vector<uint32_t> by_id;
+  std::vector<std::vector<uint32_t> > events; // timers with something to do, by tick
+  std::vector<uint32_t> due;
+  struct Cost schedules = {0, 0};
+  struct Cost push_backs = {0, 0};
+  struct Cost cancels = {0, 0};
+  struct Cost advances = {0, 0};
+  uint64_t state = 88172645463325252ull;
+  uint64_t start_ms = 1000000;
+  uint64_t start;
+  uint32_t span_ms = 600000;
+  uint32_t span;
+  uint32_t last_tick = 0;
+  uint32_t at;
+  size_t timers_wanted = 20000;
+  size_t wrong = 0;
+  size_t fired = 0;
+  size_t cancelled = 0;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--timers") == 0 && i + 1 < argc) {
+      timers_wanted = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--span-ms") == 0 && i + 1 < argc) {
+      span_ms = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else {
+      fprintf(stderr, "Usage: %s [--timers N] [--span-ms MS]\n", argv[0]);
+      return 1;
+    }
+  }
+  span = span_ms / CHAT_WHEEL_TICK_MS;
+  if (timers_wanted == 0 || span < 4) {
+    fprintf(stderr, "--timers must be at least 1 and --span-ms at least %d\n", 4 * CHAT_WHEEL_TICK_MS);
+    return 1;
+  }
+
+  calibrate_clock();
+  init_connection_slab(&slab);
+  init_timer_wheel(&wheel, start_ms);
+  events.resize(span / 2 + 1);
+  for (size_t i = 0; i < timers_wanted; ++i) {
+    struct Timer timer;
+
+    if (alloc_connection(&slab, &timer.id) == NULL) {
+      fprintf(stderr, "Out of memory after %zu connections\n", i);
+      return 1;
+    }
+    at = next_random(&state) % (span / 2);
+    timer.deadline = at + 1 + next_random(&state) % span;
+    timer.action = ACTION_SCHEDULE;
+    timer.cancelled = false;
+    timer.fired = 0;
+    if (timer.id >= by_id.size()) {
+      by_id.resize(timer.id + 1);
+    }
+    by_id[timer.id] = (uint32_t)timers.size();
+    events[at].push_back((uint32_t)timers.size());
+    timers.push_back(timer);
+  }
+
+  for (uint32_t tick = 0; tick < events.size() || wheel.count > 0; ++tick) {
+    for (size_t e = 0; tick < events.size() && e < events[tick].size(); ++e) {
+      struct Timer *timer = &timers[events[tick][e]];
+
+      conn = connection_at(&slab, timer->id);
+      switch (timer->action) {
+        case ACTION_SCHEDULE:
+          conn->deadline = timer->deadline;
+          start = cpu_ns();
+          timer_schedule(&wheel, &slab, timer->id);
+          count(&schedules, start);
+          // One in two also has something done to it later, before it is due
+          timer->action = (uint8_t)(ACTION_PUSH_BACK + next_random(&state) % 6);
+          if (timer->action < ACTION_NONE) {
+            at = tick + next_random(&state) % (timer->deadline - tick);
+            if (at >= events.size()) {
+              events.resize(at + 1);
+            }
+            events[at].push_back(events[tick][e]);
+          }
+          break;
+        case ACTION_PUSH_BACK:
+          timer->deadline += 1 + next_random(&state) % span;
+          start = cpu_ns();
+          conn->deadline = timer->deadline;
+          count(&push_backs, start);
+          break;
+        case ACTION_RESCHEDULE:
+          timer->deadline = tick + 1 + next_random(&state) % span;
+          conn->deadline = timer->deadline;
+          start = cpu_ns();
+          timer_schedule(&wheel, &slab, timer->id);
+          count(&schedules, start);
+          break;
+        case ACTION_CANCEL:
+          timer->cancelled = true;
+          start = cpu_ns();
+          timer_cancel(&wheel, &slab, timer->id);
+          count(&cancels, start);
+          break;
+      }
+    }
+
+    due.clear();
+    start = cpu_ns();
+    timer_advance(&wheel, &slab, start_ms + (uint64_t)(tick + 1) * CHAT_WHEEL_TICK_MS, &due);
+    count(&advances, start);
+    for (size_t d = 0; d < due.size(); ++d) {
+      struct Timer *timer = &timers[by_id[due[d]]];
+
+      timer->fired++;
+      if (timer->cancelled || timer->fired > 1 || timer->deadline != wheel.now_tick) {
+        fprintf(stderr, "Connection %u fired at tick %u, due at %u%s\n", timer->id, wheel.now_tick, timer->deadline,
+                timer->cancelled ? ", cancelled" : "");
+        wrong++;
+      }
+    }
+    last_tick = wheel.now_tick;
+  }
+
+  for (size_t i = 0; i < timers.size(); ++i) {
+    if (timers[i].cancelled) {
+      cancelled++;
+    } else if (timers[i].fired == 1) {
+      fired++;
+    } else if (timers[i].fired == 0) {
+      fprintf(stderr, "Connection %u never fired, due at %u\n", timers[i].id, timers[i].deadline);
+      wrong++;
+    }
+  }
+
+  printf("%zu timers over %u ticks of %d ms: %zu fired on time, %zu cancelled, %zu wrong\n", timers.size(),
+         last_tick, CHAT_WHEEL_TICK_MS, fired, cancelled, wrong);
+  printf("call                calls  ns/call\n");
+  print_cost("timer_schedule", &schedules);
+  print_cost("push back", &push_backs);
+  print_cost("timer_cancel", &cancels);
+  print_cost("timer_advance", &advances);
+  free_connection_slab(&slab);
+  return wrong == 0 ? 0 : 1;
+}
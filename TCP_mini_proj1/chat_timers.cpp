@@ -0,0 +1,157 @@
+#include "chat_timers.h"
+#include <string.h>
+
+void init_timer_wheel(struct TimerWheel *wheel, uint64_t now_ms) {
+  wheel->start_ms = now_ms;
+  wheel->now_tick = 0;
+  wheel->count = 0;
+  memset(wheel->slots, 0xFF, sizeof(wheel->slots));
+}
+
+uint32_t timer_ticks(uint32_t ms) {
+  uint32_t ticks = (ms + CHAT_WHEEL_TICK_MS - 1) / CHAT_WHEEL_TICK_MS;
+
+  return ticks > 0 ? ticks : 1;
+}
+
+static uint32_t *slot_head(struct TimerWheel *wheel, uint16_t timer_slot) {
+  return &wheel->slots[timer_slot >> CHAT_WHEEL_BITS][timer_slot & (CHAT_WHEEL_SLOTS - 1)];
+}
+
+/**
+ * Put a connection into the slot for its deadline.
+ */
+static void wheel_link(struct TimerWheel *wheel, const struct ConnectionSlab *slab, uint32_t id) {
+  struct ChatConnection *conn = connection_at(slab, id);
+  uint32_t deadline = conn->deadline;
+  uint32_t delta;
+  uint32_t *head;
+  int level;
+
+  if ((int32_t)(deadline - wheel->now_tick) < 0) {
+    deadline = wheel->now_tick;
+  }
+  delta = deadline - wheel->now_tick;
+
+  if (delta >= (1u << (CHAT_WHEEL_BITS * CHAT_WHEEL_LEVELS))) {
+    delta = (1u << (CHAT_WHEEL_BITS * CHAT_WHEEL_LEVELS)) - 1;
+    deadline = wheel->now_tick + delta;
+  }
+
+  for (level = 0; level < CHAT_WHEEL_LEVELS - 1; ++level) {
+    if (delta < (1u << (CHAT_WHEEL_BITS * (level + 1)))) {
+      break;
+    }
+  }
+
+  conn->timer_slot =
+      (uint16_t)((level << CHAT_WHEEL_BITS) | ((deadline >> (CHAT_WHEEL_BITS * level)) & (CHAT_WHEEL_SLOTS - 1)));
+  head = slot_head(wheel, conn->timer_slot);
+  conn->timer_prev = CHAT_NO_TIMER;
+  conn->timer_next = *head;
+  if (*head != CHAT_NO_TIMER) {
+    connection_at(slab, *head)->timer_prev = id;
+  }
+  *head = id;
+}
+
+static void wheel_unlink(struct TimerWheel *wheel, const struct ConnectionSlab *slab, uint32_t id) {
+  struct ChatConnection *conn = connection_at(slab, id);
+
+  if (conn->timer_prev != CHAT_NO_TIMER) {
+    connection_at(slab, conn->timer_prev)->timer_next = conn->timer_next;
+  } else {
+    *slot_head(wheel, conn->timer_slot) = conn->timer_next;
+  }
+  if (conn->timer_next != CHAT_NO_TIMER) {
+    connection_at(slab, conn->timer_next)->timer_prev = conn->timer_prev;
+  }
+}
+
+void timer_schedule(struct TimerWheel *wheel, const struct ConnectionSlab *slab, uint32_t id) {
+  struct ChatConnection *conn = connection_at(slab, id);
+
+  if (conn->flags & CONN_TIMER) {
+    wheel_unlink(wheel, slab, id);
+  } else {
+    conn->flags |= CONN_TIMER;
+    wheel->count++;
+  }
+  // The current tick's slot has already been handled
+  if ((int32_t)(conn->deadline - wheel->now_tick) <= 0) {
+    conn->deadline = wheel->now_tick + 1;
+  }
+  wheel_link(wheel, slab, id);
+}
+
+void timer_cancel(struct TimerWheel *wheel, const struct ConnectionSlab *slab, uint32_t id) {
+  struct ChatConnection *conn = connection_at(slab, id);
+
+  if (conn->flags & CONN_TIMER) {
+    wheel_unlink(wheel, slab, id);
+    conn->flags &= ~CONN_TIMER;
+    wheel->count--;
+  }
+}
+
+/**
+ * Move every connection of a higher level slot down to the slot that
+ * now matches its remaining time.
+ *
+ * @return the slot index that was cascaded
+ */
+static uint32_t cascade(struct TimerWheel *wheel, const struct ConnectionSlab *slab, int level) {
+  uint32_t slot = (wheel->now_tick >> (CHAT_WHEEL_BITS * level)) & (CHAT_WHEEL_SLOTS - 1);
+  uint32_t id = wheel->slots[level][slot];
+  uint32_t next;
+
+  wheel->slots[level][slot] = CHAT_NO_TIMER;
+  while (id != CHAT_NO_TIMER) {
+    next = connection_at(slab, id)->timer_next;
+    wheel_link(wheel, slab, id);
+    id = next;
+  }
+  return slot;
+}
+
+void timer_advance(struct TimerWheel *wheel, const struct ConnectionSlab *slab, uint64_t now_ms,
+                   std::vector<uint32_t> *due) {
+  uint32_t target = (uint32_t)((now_ms - wheel->start_ms) / CHAT_WHEEL_TICK_MS);
+  struct ChatConnection *conn;
+  uint32_t *head;
+  uint32_t id;
+
+  // Nothing to fire, so just catch the clock up
+  if (wheel->count == 0) {
+    if ((int32_t)(target - wheel->now_tick) > 0) {
+      wheel->now_tick = target;
+    }
+    return;
+  }
+
+  while ((int32_t)(target - wheel->now_tick) > 0) {
+    wheel->now_tick++;
+
+    // Each time a level wraps, pull the next slot of the level above down
+    for (int level = 1; level < CHAT_WHEEL_LEVELS; ++level) {
+      if ((wheel->now_tick & ((1u << (CHAT_WHEEL_BITS * level)) - 1)) != 0 || cascade(wheel, slab, level) != 0) {
+        break;
+      }
+    }
+
+    head = &wheel->slots[0][wheel->now_tick & (CHAT_WHEEL_SLOTS - 1)];
+    while (*head != CHAT_NO_TIMER) {
+      id = *head;
+      conn = connection_at(slab, id);
+      wheel_unlink(wheel, slab, id);
+      if ((int32_t)(conn->deadline - wheel->now_tick) > 0) {
+        // Pushed back since it was linked
+        wheel_link(wheel, slab, id);
+        continue;
+      }
+      conn->flags &= ~CONN_TIMER;
+      wheel->count--;
+      due->push_back(id);
+    }
+  }
+}
@@ -0,0 +1,64 @@
+//
+// Per-connection deadlines for the chat server, kept in a hierarchical
+// timer wheel (as in the UDP server's session table) whose links live
+// in the connection records themselves, so a timer costs no memory or
+// syscall of its own.
+//
+// A deadline may be pushed later at any time just by storing it in the
+// record: the wheel finds out when the old slot comes due and links the
+// connection again further on. Busy connections therefore cost one
+// relink per timeout, not one per message.
+//
+
+#ifndef TCP_CHAT_CHAT_TIMERS_H
+#define TCP_CHAT_CHAT_TIMERS_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "chat_connections.h"
+
+// Number of slots per timer wheel level, and number of levels.
+// 64^4 ticks of 100ms cover about 19 days, well past any timeout.
+#define CHAT_WHEEL_BITS 6
+#define CHAT_WHEEL_SLOTS (1 << CHAT_WHEEL_BITS)
+#define CHAT_WHEEL_LEVELS 4
+#define CHAT_WHEEL_TICK_MS 100
+
+// Marks the end of a wheel slot list
+#define CHAT_NO_TIMER 0xFFFFFFFFu
+
+struct TimerWheel {
+  uint64_t start_ms;
+  uint32_t now_tick;
+  uint32_t count; // connections linked into the wheel
+  uint32_t slots[CHAT_WHEEL_LEVELS][CHAT_WHEEL_SLOTS];
+};
+
+void init_timer_wheel(struct TimerWheel *wheel, uint64_t now_ms);
+
+/**
+ * @return ms in wheel ticks, rounded up and at least one
+ */
+uint32_t timer_ticks(uint32_t ms);
+
+/**
+ * Link a connection in at its deadline, which must be after the
+ * wheel's now_tick, taking it out of its old slot first if it has one.
+ */
+void timer_schedule(struct TimerWheel *wheel, const struct ConnectionSlab *slab, uint32_t id);
+
+/**
+ * Take a connection out of the wheel, if it is in it.
+ */
+void timer_cancel(struct TimerWheel *wheel, const struct ConnectionSlab *slab, uint32_t id);
+
+/**
+ * Move the wheel forward to now_ms. Connections whose deadline has
+ * passed are taken out of the wheel and added to due; those whose
+ * deadline was pushed back since they were linked are linked again.
+ */
+void timer_advance(struct TimerWheel *wheel, const struct ConnectionSlab *slab, uint64_t now_ms,
+                   std::vector<uint32_t> *due);
+
+#endif //TCP_CHAT_CHAT_TIMERS_H
@@ -0,0 +1,84 @@
+//
+// Wire formats of the chat messages in tcp_chat.h, described once for
+// wire_codec.h. The nickname and data that follow a message are
+// covered by the Length fields, so decode_frame only succeeds once a
+// whole message has arrived.
+//
+
+#ifndef TCP_CHAT_CHAT_WIRE_H
+#define TCP_CHAT_CHAT_WIRE_H
+
+#include <stdint.h>
+
+#include "tcp_chat.h"
+#include "wire_codec.h"
+
+using ChatMonCodec = wire::Codec<ChatMonMsg,
+                                 wire::Field<&ChatMonMsg::type>,
+                                 wire::Length<&ChatMonMsg::nickname_len>,
+                                 wire::Length<&ChatMonMsg::data_len> >;
+
+using ChatClientCodec = wire::Codec<ChatClientMessage,
+                                    wire::Field<&ChatClientMessage::type>,
+                                    wire::Length<&ChatClientMessage::nickname_len>,
+                                    wire::Length<&ChatClientMessage::data_length> >;
+
+using ChatTimedMonCodec = wire::Codec<ChatTimedMonMsg,
+                                      wire::Field<&ChatTimedMonMsg::type>,
+                                      wire::Length<&ChatTimedMonMsg::nickname_len>,
+                                      wire::Length<&ChatTimedMonMsg::data_len>,
+                                      wire::Field<&ChatTimedMonMsg::send_ns> >;
+
+using ChatTimedClientCodec = wire::Codec<ChatTimedClientMessage,
+                                         wire::Field<&ChatTimedClientMessage::type>,
+                                         wire::Length<&ChatTimedClientMessage::nickname_len>,
+                                         wire::Length<&ChatTimedClientMessage::data_length>,
+                                         wire::Field<&ChatTimedClientMessage::send_ns> >;
+
+using ChatSessionCodec = wire::Codec<ChatSessionMsg,
+                                     wire::Field<&ChatSessionMsg::type>,
+                                     wire::Field<&ChatSessionMsg::token>,
+                                     wire::Field<&ChatSessionMsg::seq> >;
+
+using ChatCompressedMonCodec = wire::Codec<ChatCompressedMonMsg,
+                                           wire::Field<&ChatCompressedMonMsg::type>,
+                                           wire::Field<&ChatCompressedMonMsg::flags>,
+                                           wire::Field<&ChatCompressedMonMsg::raw_len>,
+                                           wire::Length<&ChatCompressedMonMsg::data_len> >;
+
+using ChatNodeCodec = wire::Codec<ChatNodeMsg,
+                                  wire::Field<&ChatNodeMsg::type>,
+                                  wire::Field<&ChatNodeMsg::flags>,
+                                  wire::Field<&ChatNodeMsg::origin>,
+                                  wire::Field<&ChatNodeMsg::seq>,
+                                  wire::Field<&ChatNodeMsg::hops>,
+                                  wire::Length<&ChatNodeMsg::target_len>,
+                                  wire::Length<&ChatNodeMsg::frame_len> >;
+
+using ChatMembersCodec = wire::Codec<ChatMembersMsg,
+                                     wire::Field<&ChatMembersMsg::type>,
+                                     wire::Field<&ChatMembersMsg::flags>,
+                                     wire::Length<&ChatMembersMsg::data_len>,
+                                     wire::Field<&ChatMembersMsg::log>,
+                                     wire::Field<&ChatMembersMsg::version> >;
+
+using ServerErrorCodec = wire::Codec<ServerErrorMessage,
+                                     wire::Field<&ServerErrorMessage::error_type> >;
+
+// Largest possible message: the biggest header plus a full nickname and data
+#define CHAT_MAX_FRAME (14 + 2 * UINT16_MAX)
+
+// Largest batch of messages in a MON_COMPRESSED; raw_len and data_len
+// are 16 bits
+#define CHAT_MAX_BATCH (60 * 1024)
+
+static_assert(ChatMonCodec::wire_size == 6, "ChatMonMsg layout");
+static_assert(ChatClientCodec::wire_size == 6, "ChatClientMessage layout");
+static_assert(ChatTimedMonCodec::wire_size == 14, "ChatTimedMonMsg layout");
+static_assert(ChatTimedClientCodec::wire_size == 14, "ChatTimedClientMessage layout");
+static_assert(ChatSessionCodec::wire_size == 18, "ChatSessionMsg layout");
+static_assert(ChatCompressedMonCodec::wire_size == 8, "ChatCompressedMonMsg layout");
+static_assert(ChatNodeCodec::wire_size == 24, "ChatNodeMsg layout");
+static_assert(ChatMembersCodec::wire_size == 24, "ChatMembersMsg layout");
+
+#endif //TCP_CHAT_CHAT_WIRE_H
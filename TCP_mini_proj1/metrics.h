@@ -0,0 +1,189 @@
+//
+// Counters, gauges and latency histograms for the servers and tools.
+// Every thread that updates metrics takes its own MetricsShard and is
+// the only writer of it, so an update is a plain load and store with
+// no locked instruction and no shared cache line. Readers add the
+// shards up when asked, which makes reading slow and writing cheap.
+//
+// Histograms are HDR style: values are filed in log-linear buckets,
+// 16 per power of two, so any value up to 2^48 is kept to within 1/16.
+//
+// A stats socket serves the whole registry as text, one metric per
+// line, to anything that connects:
+//
+//   name value
+//   name count N mean X p50 X p90 X p99 X p999 X max X
+//
+// e.g., socat - UNIX-CONNECT:/tmp/udpserver.stats
+//
+
+#ifndef IN_CLASS_UDP_EXAMPLE_METRICS_H
+#define IN_CLASS_UDP_EXAMPLE_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+
+#define METRICS_MAX_COUNTERS 64
+#define METRICS_MAX_GAUGES 16
+#define METRICS_MAX_HISTOGRAMS 8
+#define METRICS_MAX_SHARDS 64
+#define METRICS_NAME_LEN 48
+
+// Sub-buckets per power of two is 1 << METRICS_SUB_BITS
+#define METRICS_SUB_BITS 4
+// Values are clamped below 1 << METRICS_MAX_BITS
+#define METRICS_MAX_BITS 48
+#define METRICS_HIST_BUCKETS ((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS)
+
+/**
+ * Reads a gauge's current value, e.g. a socket's queue length. Called
+ * from the stats thread, so it must be safe to call from any thread.
+ */
+typedef uint64_t (*MetricsGaugeFn)(const void *arg);
+
+/**
+ * One thread's share of every counter and histogram.
+ */
+struct MetricsShard {
+  std::atomic<uint64_t> counters[METRICS_MAX_COUNTERS];
+  std::atomic<uint64_t> sums[METRICS_MAX_HISTOGRAMS];
+  std::atomic<uint64_t> buckets[METRICS_MAX_HISTOGRAMS][METRICS_HIST_BUCKETS];
+};
+
+/**
+ * Names of every metric plus the shards holding their values. Metrics
+ * are registered before any thread starts updating them; shards can be
+ * taken at any time.
+ */
+struct MetricsRegistry {
+  char counter_names[METRICS_MAX_COUNTERS][METRICS_NAME_LEN];
+  int num_counters;
+  char gauge_names[METRICS_MAX_GAUGES][METRICS_NAME_LEN];
+  MetricsGaugeFn gauge_fns[METRICS_MAX_GAUGES];
+  const void *gauge_args[METRICS_MAX_GAUGES];
+  int num_gauges;
+  char histogram_names[METRICS_MAX_HISTOGRAMS][METRICS_NAME_LEN];
+  int num_histograms;
+  std::atomic<int> num_shards;
+  std::atomic<struct MetricsShard *> shards[METRICS_MAX_SHARDS];
+  uint64_t start_ms;
+};
+
+/**
+ * Serves a registry on a Unix domain stream socket from its own thread.
+ */
+struct StatsServer {
+  const struct MetricsRegistry *registry;
+  int listen_socket;
+  char path[108];
+  std::atomic<bool> stop;
+  std::thread thread;
+};
+
+/**
+ * @param registry the registry to set up
+ */
+void init_metrics_registry(struct MetricsRegistry *registry);
+
+/**
+ * Free every shard. Nothing may use the registry afterwards.
+ */
+void free_metrics_registry(struct MetricsRegistry *registry);
+
+/**
+ * Register a counter.
+ *
+ * @return the counter's id, or -1 if there is no room left
+ */
+int metrics_counter(struct MetricsRegistry *registry, const char *name);
+
+/**
+ * Register a gauge, read by calling fn(arg) whenever stats are served.
+ *
+ * @return 0 on success, -1 if there is no room left
+ */
+int metrics_gauge(struct MetricsRegistry *registry, const char *name, MetricsGaugeFn fn, const void *arg);
+
+/**
+ * Register a histogram.
+ *
+ * @return the histogram's id, or -1 if there is no room left
+ */
+int metrics_histogram(struct MetricsRegistry *registry, const char *name);
+
+/**
+ * Take a zeroed shard for the calling thread. Safe from several
+ * threads; the shard stays part of the totals after the thread exits.
+ *
+ * @return the shard, or NULL if METRICS_MAX_SHARDS are taken
+ */
+struct MetricsShard *metrics_shard(struct MetricsRegistry *registry);
+
+/**
+ * Write every metric, summed over all shards, in the text format above.
+ *
+ * @return number of bytes written (output is cut off at cap)
+ */
+size_t metrics_format(const struct MetricsRegistry *registry, char *buf, size_t cap);
+
+/**
+ * Listen on path and answer every connection with metrics_format().
+ * Any stale socket file at path is replaced.
+ *
+ * @return 0 on success, -1 if the socket could not be set up (see errno)
+ */
+int start_stats_server(struct StatsServer *server, const struct MetricsRegistry *registry, const char *path);
+
+/**
+ * Stop the stats thread and remove the socket file.
+ */
+void stop_stats_server(struct StatsServer *server);
+
+/**
+ * Ask the stats socket at path for one counter or gauge, as a tool
+ * watching a server would.
+ *
+ * @return 0 on success, -1 if the socket or metric is missing
+ */
+int metrics_query(const char *path, const char *name, uint64_t *value);
+
+/**
+ * Add n to a counter. Only the shard's own thread may call this.
+ */
+static inline void metrics_add(struct MetricsShard *shard, int counter, uint64_t n) {
+  std::atomic<uint64_t> &value = shard->counters[counter];
+  value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+/**
+ * Bucket a value falls in: exact below 16, then 16 buckets for each
+ * power of two.
+ */
+static inline int metrics_bucket(uint64_t value) {
+  int top;
+
+  if (value < (1u << METRICS_SUB_BITS)) {
+    return (int)value;
+  }
+  if (value >= (1ull << METRICS_MAX_BITS)) {
+    value = (1ull << METRICS_MAX_BITS) - 1;
+  }
+  top = 63 - __builtin_clzll(value);
+  return ((top - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS) +
+         (int)((value >> (top - METRICS_SUB_BITS)) - (1u << METRICS_SUB_BITS));
+}
+
+/**
+ * Add a value to a histogram. Only the shard's own thread may call this.
+ */
+static inline void metrics_record(struct MetricsShard *shard, int histogram, uint64_t value) {
+  std::atomic<uint64_t> &bucket = shard->buckets[histogram][metrics_bucket(value)];
+  std::atomic<uint64_t> &sum = shard->sums[histogram];
+
+  bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  sum.store(sum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+#endif //IN_CLASS_UDP_EXAMPLE_METRICS_H
@@ -11,7 +11,13 @@ enum ChatMonType {
 	MON_CONNECT = 675,
 	MON_DISCONNECT,
 	MON_DIRECT_MESSAGE,
-	MON_MESSAGE
+	MON_MESSAGE,
+	MON_TIMED_MESSAGE,
+	MON_RESUME,
+	MON_HEARTBEAT,
+	MON_COMPRESS,
+	MON_COMPRESSED,
+	MON_PRESENCE
 };
 
 // Message sent from the chat monitor to the server
@@ -22,6 +28,15 @@ struct ChatMonMsg {
 	uint16_t data_len; // Length of string message data
 };
 
+// A MON_MESSAGE that also carries the time the sending client handed it
+// to send(), relayed from a CLIENT_SEND_TIMED_MESSAGE
+struct ChatTimedMonMsg {
+	uint16_t type; // MON_TIMED_MESSAGE
+	uint16_t nickname_len; // Length of the sender's nickname
+	uint16_t data_len; // Length of string message data
+	uint64_t send_ns; // Sender's CLOCK_REALTIME in nanoseconds, as in SO_TIMESTAMPING
+};
+
 // Types of messages sent from chat client to chat server
 enum ChatClientType {
 	CLIENT_CONNECT = 10,
@@ -29,15 +44,132 @@ enum ChatClientType {
 	CLIENT_SET_NICKNAME,
 	CLIENT_SEND_MESSAGE,
 	CLIENT_SEND_DIRECT_MESSAGE,
-	CLIENT_GET_MEMBERS
+	CLIENT_GET_MEMBERS,
+	CLIENT_SEND_TIMED_MESSAGE,
+	CLIENT_RESUME,
+	CLIENT_ACK,
+	CLIENT_HEARTBEAT,
+	CLIENT_MEMBERS
 };
 
+// CLIENT_HEARTBEAT and MON_HEARTBEAT are a bare header (no nickname or
+// data) a peer sends when it has sent nothing else for this long, so
+// the server can tell a quiet peer from a dead one. The server reaps
+// connections that stay silent for several intervals.
+#define CHAT_HEARTBEAT_INTERVAL_MS 15000
+
 struct ChatClientMessage {
 	uint16_t type; // A ChatClientType
 	uint16_t nickname_len; // Length of nickname appended to client message
 	uint16_t data_length; // If additional data belongs to message, how long is it?
 };
 
+// A CLIENT_SEND_MESSAGE stamped with the time it was sent
+struct ChatTimedClientMessage {
+	uint16_t type; // CLIENT_SEND_TIMED_MESSAGE
+	uint16_t nickname_len; // Always 0, the server knows the sender's nickname
+	uint16_t data_length; // Length of the message data
+	uint64_t send_ns; // CLOCK_REALTIME in nanoseconds just before send()
+};
+
+// Starts or resumes a session, sent by a client right after
+// CLIENT_CONNECT or a monitor right after MON_CONNECT; the server
+// answers with the same type. Sessions outlive their connection for a
+// while, so a peer that reconnects and resumes picks up where it left
+// off. seq means:
+//   CLIENT_RESUME from the client: unused, 0
+//   CLIENT_RESUME and CLIENT_ACK from the server: how many of the
+//     client's messages (after CLIENT_RESUME) it has handled
+//   MON_RESUME from the monitor: how many session messages it has seen
+//   MON_RESUME from the server: number of the next message it sends,
+//     more than the monitor's count if some were lost for good
+struct ChatSessionMsg {
+	uint16_t type; // CLIENT_RESUME, CLIENT_ACK or MON_RESUME
+	uint64_t token; // 0 asks for a new session
+	uint64_t seq;
+};
+
+// MON_COMPRESS, a ChatMonMsg with two bytes of data, asks for the
+// monitor's messages to come compressed: the codec (CHAT_CODEC_LZ) and
+// its level. The server answers with the same type and the level it
+// will use, 0 if none; after that broadcasts arrive in MON_COMPRESSED
+// batches, while anything for this monitor alone still comes as is.
+#define CHAT_CODEC_LZ 1
+
+// A batch of monitor messages, compressed as chat_lz.h describes.
+// Decompressed, it is raw_len bytes of whole messages, as each would
+// have been sent on its own. Each batch may refer back into the ones
+// before it on the connection, unless it has CHAT_BATCH_RESET.
+struct ChatCompressedMonMsg {
+	uint16_t type; // MON_COMPRESSED
+	uint16_t flags; // CHAT_BATCH_*
+	uint16_t raw_len; // Length of the messages in the batch
+	uint16_t data_len; // Length of compressed data that follows
+};
+
+#define CHAT_BATCH_RESET 0x1 // Starts with an empty window
+#define CHAT_BATCH_STORED 0x2 // Data is the messages as they are
+
+// CLIENT_GET_MEMBERS with no data has every member's nickname sent to
+// the asker's monitors as text, in one MON_DIRECT_MESSAGE from
+// "server" with each nickname once, cut short at UINT16_MAX bytes.
+// With CHAT_MEMBERS_SINCE_LEN bytes of data, the log and version of
+// the last CLIENT_MEMBERS the client saw (big endian, both 0 if none),
+// the answer comes back to the client itself as CLIENT_MEMBERS: only
+// who joined and left since then, or every member if the server has
+// not kept that far back or the log is not the one the client saw,
+// e.g. after a reconnect.
+//
+// A monitor that sends MON_PRESENCE (a bare header) gets MON_PRESENCE
+// messages from then on: every member, then who joined and left, as
+// it happens.
+#define CHAT_MEMBERS_SINCE_LEN 16
+
+// CLIENT_MEMBERS or MON_PRESENCE, followed by data_len bytes of
+// changes, each a CHAT_MEMBER_JOINED or CHAT_MEMBER_LEFT byte, the
+// nickname's length (2 bytes, big endian) and the nickname. An answer
+// too long for one message is split; all but the last have
+// CHAT_MEMBERS_MORE, and every part has the same log and version.
+struct ChatMembersMsg {
+	uint16_t type; // CLIENT_MEMBERS or MON_PRESENCE
+	uint16_t flags; // CHAT_MEMBERS_*
+	uint32_t data_len;
+	uint64_t log; // Which membership log the version is of
+	uint64_t version; // Changes in the log up to the end of this answer
+};
+
+#define CHAT_MEMBERS_SNAPSHOT 0x1 // Every member, as joins; forget what came before
+#define CHAT_MEMBERS_MORE 0x2 // More of the same answer follows
+#define CHAT_MEMBERS_PARTIAL 0x4 // A snapshot cut short to fit the server's send limit
+
+#define CHAT_MEMBER_JOINED '+'
+#define CHAT_MEMBER_LEFT '-'
+
+// Types of messages between federated chat servers (chat_federation.h),
+// on their own node port
+enum ChatNodeType {
+	NODE_HELLO = 900, // First message on a link: who is on the other end
+	NODE_ANNOUNCE, // A node is still up; its epoch follows, as 8 bytes
+	NODE_JOIN, // A nickname is present on a node
+	NODE_LEAVE, // ... and no longer is
+	NODE_BROADCAST, // A monitor message for every monitor
+	NODE_DIRECT // A monitor message for the monitors with the target nickname
+};
+
+// Message from one chat server to another, followed by the target
+// nickname and then the monitor message it carries, if any.
+struct ChatNodeMsg {
+	uint16_t type; // A ChatNodeType
+	uint16_t flags; // CHAT_NODE_MONITOR on a JOIN or LEAVE of a monitor's nickname
+	uint32_t origin; // Node the message started from
+	uint64_t seq; // HELLO: the origin's epoch; others: the origin's number for the message
+	uint16_t hops; // Links crossed so far
+	uint16_t target_len; // Length of the nickname that follows
+	uint32_t frame_len; // Length of the monitor message (or epoch) after it
+};
+
+#define CHAT_NODE_MONITOR 0x1
+
 struct ServerErrorMessage {
 	uint16_t error_type;
 };
@@ -47,7 +179,8 @@ enum ErrorMessageTypes {
 	INCORRECT_SIZE,
 	WRONG_TYPE_FOR_CLIENT,
 	WRONG_TYPE_FOR_MONITOR,
-	NOT_CONNECTED
+	NOT_CONNECTED,
+	THROTTLED // Client is sending too fast; its messages are dropped until it slows down
 };
 
 #endif //TCP_CHAT_TCP_CHAT_H
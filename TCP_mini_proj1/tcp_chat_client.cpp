@@ -14,12 +14,129 @@
 #include <sys/types.h>
 #include <signal.h>
 #include <netdb.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <set>
+#include <vector>
 
 #include "tcp_chat.h"
+#include "chat_wire.h"
 #include "tcp_utils.h"
+#include "metrics.h"
 
 bool quit = false;
 
+/**
+ * Ids of the client's metrics, plus the main thread's shard.
+ */
+struct ClientMetrics {
+	struct MetricsShard *shard;
+	int messages_sent;
+	int bytes_out;
+	int send_errors;
+	/* histogram of nanoseconds spent in send() */
+	int send_ns;
+	/* histogram of nanoseconds from send() to the kernel's transmit timestamp */
+	int tx_delay_ns;
+	int reconnects;
+	/* messages sent again after a reconnect */
+	int resent;
+	/* unacknowledged messages forgotten because too many piled up */
+	int unacked_dropped;
+};
+
+static struct ClientMetrics metrics;
+
+// Most sends still waiting for their transmit timestamp
+#define PENDING_TX_MAX 64
+
+/**
+ * Sends made since transmit timestamps were turned on, oldest first,
+ * so each timestamp can be matched to the send it belongs to.
+ */
+struct TxTracker {
+	bool enabled;
+	/* bytes sent since timestamps were turned on */
+	uint32_t bytes_sent;
+	/* ring of stream offset of each send's last byte and its realtime_ns() */
+	uint32_t last_byte[PENDING_TX_MAX];
+	uint64_t send_ns[PENDING_TX_MAX];
+	int head;
+	int count;
+};
+
+static struct TxTracker tx_tracker;
+
+// Most unacknowledged messages kept for sending again
+#define UNACKED_MAX 4096
+
+// Acknowledged bytes left at the front of ClientSession::unacked
+// before the rest is moved down over them
+#define UNACKED_COMPACT_BYTES (64 * 1024)
+
+// How long to wait for the server to answer CLIENT_RESUME
+#define RESUME_TIMEOUT_MS 2000
+
+/**
+ * The client's session (see ChatSessionMsg): its token, and every
+ * message sent since the last one the server acknowledged, to send
+ * again if the connection drops.
+ */
+struct ClientSession {
+	bool enabled;
+	uint64_t token;
+	/* messages the server has acknowledged */
+	uint64_t acked;
+	/*
+	 * messages not yet acknowledged, back to back in unacked from
+	 * unacked_start on, and a ring of where each one ends; one slot
+	 * spare for the nickname a new session puts in front
+	 */
+	char *unacked;
+	size_t unacked_len;
+	size_t unacked_capacity;
+	size_t unacked_start;
+	size_t unacked_end[UNACKED_MAX + 1];
+	int unacked_head;
+	int unacked_count;
+	/* set when the server turned down CLIENT_RESUME as an unknown type */
+	bool refused;
+	/* server messages not yet complete; a member list can be long */
+	char recv_buf[CHAT_MAX_FRAME];
+	int buffered;
+};
+
+static struct ClientSession session;
+
+/**
+ * The members as of the last CLIENT_MEMBERS. LIST sends the version
+ * they are at, so the server only sends who joined and left since.
+ */
+struct MemberList {
+	/* log and version of names, both 0 until a whole list has arrived */
+	uint64_t log;
+	uint64_t version;
+	std::set<std::string> names;
+	/* LISTs not yet answered; another sent meanwhile asks for every member */
+	int pending;
+	/* an answer that comes in several messages has started */
+	bool in_answer;
+	std::vector<std::string> joined;
+	std::vector<std::string> left;
+};
+
+static struct MemberList members;
+
+// now_ns() of the last successful send, for heartbeats
+static uint64_t last_send_ns;
+
+static uint64_t now_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
 std::string get_nickname() {
 	std::string nickname;
 	std::cout << "Enter chat nickname: ";
@@ -27,14 +144,848 @@ std::string get_nickname() {
 	return nickname;
 }
 
-std::string get_message() {
+/**
+ * Match every transmit timestamp the kernel has queued so far to its
+ * send. Sends the kernel coalesced into one segment only get one
+ * timestamp, for the last of them, and are skipped.
+ */
+static void drain_tx_timestamps(int client_socket) {
+	uint64_t tx_ns;
+	uint32_t last_byte;
+
+	while (read_tx_timestamp(client_socket, &tx_ns, &last_byte) == 0) {
+		while (tx_tracker.count > 0) {
+			int oldest = tx_tracker.head;
+			tx_tracker.head = (tx_tracker.head + 1) % PENDING_TX_MAX;
+			tx_tracker.count--;
+			if (tx_tracker.last_byte[oldest] == last_byte) {
+				if (tx_ns >= tx_tracker.send_ns[oldest]) {
+					metrics_record(metrics.shard, metrics.tx_delay_ns, tx_ns - tx_tracker.send_ns[oldest]);
+				}
+				break;
+			}
+		}
+	}
+}
+
+/**
+ * Send encoded messages, counting them and, with timestamps on,
+ * remembering when they were sent.
+ *
+ * @param client_socket connected socket to the chat server
+ * @param buf the messages, back to back
+ * @param len their total length
+ * @param messages how many there are
+ * @param send_ns realtime_ns() just before this call
+ * @return result of send()
+ */
+static int send_frames(int client_socket, const char *buf, int len, int messages, uint64_t send_ns) {
+	uint64_t start_ns = now_ns();
+	int ret = send(client_socket, buf, len, 0);
+
+	metrics_record(metrics.shard, metrics.send_ns, now_ns() - start_ns);
+	if (ret <= 0) {
+		metrics_add(metrics.shard, metrics.send_errors, 1);
+		return ret;
+	}
+	metrics_add(metrics.shard, metrics.messages_sent, messages);
+	metrics_add(metrics.shard, metrics.bytes_out, ret);
+	last_send_ns = start_ns;
+
+	if (tx_tracker.enabled) {
+		tx_tracker.bytes_sent += ret;
+		if (tx_tracker.count == PENDING_TX_MAX) {
+			// Never stamped; forget the oldest
+			tx_tracker.head = (tx_tracker.head + 1) % PENDING_TX_MAX;
+			tx_tracker.count--;
+		}
+		int slot = (tx_tracker.head + tx_tracker.count) % PENDING_TX_MAX;
+		tx_tracker.last_byte[slot] = tx_tracker.bytes_sent - 1;
+		tx_tracker.send_ns[slot] = send_ns;
+		tx_tracker.count++;
+		drain_tx_timestamps(client_socket);
+	}
+	return ret;
+}
+
+static int send_frame(int client_socket, const char *buf, int len, uint64_t send_ns) {
+	return send_frames(client_socket, buf, len, 1, send_ns);
+}
+
+/**
+ * Where the i-th unacknowledged message is, and how long it is.
+ */
+static const char *unacked_message(int i, size_t *len) {
+	size_t start = i == 0 ? session.unacked_start
+	                      : session.unacked_end[(session.unacked_head + i - 1) % (UNACKED_MAX + 1)];
+
+	*len = session.unacked_end[(session.unacked_head + i) % (UNACKED_MAX + 1)] - start;
+	return &session.unacked[start];
+}
+
+static void clear_unacked() {
+	session.unacked_len = 0;
+	session.unacked_start = 0;
+	session.unacked_head = 0;
+	session.unacked_count = 0;
+}
+
+/**
+ * Forget the oldest unacknowledged message.
+ */
+static void pop_unacked() {
+	if (session.unacked_count == 1) {
+		// Keeps the buffer's memory for the messages to come
+		clear_unacked();
+		return;
+	}
+	session.unacked_start = session.unacked_end[session.unacked_head];
+	session.unacked_head = (session.unacked_head + 1) % (UNACKED_MAX + 1);
+	session.unacked_count--;
+}
+
+/**
+ * Move the unacknowledged messages to the front of the buffer, once
+ * more of it is behind them than in them.
+ */
+static void compact_unacked() {
+	size_t start = session.unacked_start;
+
+	if (start < UNACKED_COMPACT_BYTES || start < session.unacked_len - start) {
+		return;
+	}
+	memmove(session.unacked, &session.unacked[start], session.unacked_len - start);
+	session.unacked_len -= start;
+	for (int i = 0; i < session.unacked_count; ++i) {
+		session.unacked_end[(session.unacked_head + i) % (UNACKED_MAX + 1)] -= start;
+	}
+	session.unacked_start = 0;
+}
+
+/**
+ * Make room for len more bytes at the end of the unacknowledged messages.
+ */
+static void reserve_unacked(size_t len) {
+	size_t capacity = session.unacked_capacity > 0 ? session.unacked_capacity : UNACKED_COMPACT_BYTES;
+
+	while (capacity < session.unacked_len + len) {
+		capacity *= 2;
+	}
+	if (capacity == session.unacked_capacity) {
+		return;
+	}
+	session.unacked = (char *)realloc(session.unacked, capacity);
+	if (session.unacked == NULL) {
+		perror("realloc");
+		exit(1);
+	}
+	session.unacked_capacity = capacity;
+}
+
+/**
+ * Keep a message until the server acknowledges it, if there is a session.
+ */
+static void remember_message(const char *buf, int len) {
+	if (!session.enabled) {
+		return;
+	}
+	while (session.unacked_count >= UNACKED_MAX) {
+		// Can no longer be sent again
+		pop_unacked();
+		session.acked++;
+		metrics_add(metrics.shard, metrics.unacked_dropped, 1);
+	}
+	compact_unacked();
+	reserve_unacked(len);
+	memcpy(&session.unacked[session.unacked_len], buf, len);
+	session.unacked_len += len;
+	session.unacked_end[(session.unacked_head + session.unacked_count) % (UNACKED_MAX + 1)] = session.unacked_len;
+	session.unacked_count++;
+}
+
+/**
+ * Put a message in front of the unacknowledged ones, to be sent first.
+ */
+static void remember_first(const char *buf, size_t len) {
+	size_t start = session.unacked_start;
+
+	reserve_unacked(len);
+	memmove(&session.unacked[start + len], &session.unacked[start], session.unacked_len - start);
+	memcpy(&session.unacked[start], buf, len);
+	session.unacked_len += len;
+	for (int i = 0; i < session.unacked_count; ++i) {
+		session.unacked_end[(session.unacked_head + i) % (UNACKED_MAX + 1)] += len;
+	}
+	session.unacked_head = (session.unacked_head + UNACKED_MAX) % (UNACKED_MAX + 1);
+	session.unacked_end[session.unacked_head] = session.unacked_start + len;
+	session.unacked_count++;
+}
+
+/**
+ * Build a ChatClientMessage followed by its nickname and data, and send it.
+ *
+ * @param client_socket connected socket to the chat server
+ * @param type a ChatClientType
+ * @param nickname nickname to append (may be empty)
+ * @param data message data to append after the nickname (may be empty)
+ * @return result of send(), or -1 if the nickname or data is too long to encode
+ */
+int send_client_message(int client_socket, uint16_t type, const std::string &nickname, const std::string &data) {
+	static char send_buf[CHAT_MAX_FRAME];
+	struct ChatClientMessage client_message;
+	int offset;
+
+	if ((nickname.size() > UINT16_MAX) || (data.size() > UINT16_MAX)) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	client_message.type = type;
+	client_message.nickname_len = nickname.size();
+	client_message.data_length = data.size();
+
+	offset = ChatClientCodec::encode(client_message, send_buf, sizeof(send_buf));
+	memcpy(&send_buf[offset], nickname.data(), nickname.size());
+	offset += nickname.size();
+	memcpy(&send_buf[offset], data.data(), data.size());
+	offset += data.size();
+
+	if (type != CLIENT_CONNECT && type != CLIENT_HEARTBEAT) {
+		remember_message(send_buf, offset);
+	}
+	return send_frame(client_socket, send_buf, offset, realtime_ns());
+}
+
+/**
+ * Send a chat message stamped with the time it is sent, so a monitor
+ * can tell how long it took to arrive.
+ *
+ * @param client_socket connected socket to the chat server
+ * @param data message data
+ * @return result of send(), or -1 if data is too long to encode
+ */
+int send_timed_message(int client_socket, const std::string &data) {
+	static char send_buf[CHAT_MAX_FRAME];
+	struct ChatTimedClientMessage client_message;
+	int offset;
+
+	if (data.size() > UINT16_MAX) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	client_message.type = CLIENT_SEND_TIMED_MESSAGE;
+	client_message.nickname_len = 0;
+	client_message.data_length = data.size();
+
+	offset = ChatTimedClientCodec::wire_size;
+	memcpy(&send_buf[offset], data.data(), data.size());
+	offset += data.size();
+
+	// Stamp as late as possible, with everything else already built
+	client_message.send_ns = realtime_ns();
+	ChatTimedClientCodec::encode(client_message, send_buf, sizeof(send_buf));
+	remember_message(send_buf, offset);
+	return send_frame(client_socket, send_buf, offset, client_message.send_ns);
+}
+
+/**
+ * The data of a LIST's CLIENT_GET_MEMBERS: the log and version the
+ * member list is at.
+ */
+static std::string members_since() {
+	char data[CHAT_MEMBERS_SINCE_LEN];
+	bool known = members.pending == 0 && members.log != 0;
+
+	wire::store_be<uint64_t>((uint8_t *)data, known ? members.log : 0);
+	wire::store_be<uint64_t>((uint8_t *)&data[8], known ? members.version : 0);
+	members.pending++;
+	return std::string(data, sizeof(data));
+}
+
+static void print_names(const char *label, const std::vector<std::string> &names) {
+	std::cout << label;
+	for (size_t i = 0; i < names.size(); ++i) {
+		std::cout << (i == 0 ? " " : ", ") << names[i];
+	}
+}
+
+/**
+ * Apply a CLIENT_MEMBERS to the member list, and print the list or
+ * what changed once the whole answer is in.
+ */
+static void take_members(const struct ChatMembersMsg &message, const char *data) {
+	const char *end = data + message.data_len;
+	uint16_t len;
+
+	if (!members.in_answer) {
+		members.in_answer = true;
+		members.joined.clear();
+		members.left.clear();
+		if (message.flags & CHAT_MEMBERS_SNAPSHOT) {
+			members.names.clear();
+		}
+	}
+	while (end - data >= 3) {
+		len = wire::load_be<uint16_t>((const uint8_t *)&data[1]);
+		if (end - data - 3 < len) {
+			break;
+		}
+		std::string name(&data[3], len);
+		if (data[0] == CHAT_MEMBER_LEFT) {
+			members.names.erase(name);
+			members.left.push_back(name);
+		} else {
+			members.names.insert(name);
+			members.joined.push_back(name);
+		}
+		data += 3 + len;
+	}
+	if (message.flags & CHAT_MEMBERS_MORE) {
+		return;
+	}
+	members.in_answer = false;
+	members.pending -= members.pending > 0 ? 1 : 0;
+	// A list cut short cannot be brought up to date
+	members.log = (message.flags & CHAT_MEMBERS_PARTIAL) ? 0 : message.log;
+	members.version = message.version;
+
+	std::cout << members.names.size() << " members";
+	if (message.flags & CHAT_MEMBERS_SNAPSHOT) {
+		print_names(":", std::vector<std::string>(members.names.begin(), members.names.end()));
+		if (message.flags & CHAT_MEMBERS_PARTIAL) {
+			std::cout << " and more";
+		}
+	} else if (members.joined.empty() && members.left.empty()) {
+		std::cout << ", no change";
+	} else {
+		if (!members.joined.empty()) {
+			print_names(", joined:", members.joined);
+		}
+		if (!members.left.empty()) {
+			print_names(members.joined.empty() ? ", left:" : "; left:", members.left);
+		}
+	}
+	std::cout << std::endl;
+}
+
+/**
+ * Note that the server has handled acked messages of this session.
+ */
+static void drop_acked(uint64_t acked) {
+	while (session.acked < acked && session.unacked_count > 0) {
+		pop_unacked();
+		session.acked++;
+	}
+	session.acked = acked;
+}
+
+/**
+ * Read whatever the server has sent: acknowledgements, the answer to
+ * CLIENT_RESUME, member lists and ServerErrorMessages, which are bare
+ * error codes.
+ *
+ * @param client_socket connected socket to the chat server
+ * @param timeout_ms how long to wait for something to arrive, 0 to only look
+ * @param reply set to the answer to CLIENT_RESUME, if one arrived
+ * @return 1 if the answer to CLIENT_RESUME arrived, 0 if not, -1 if the
+ *         connection is gone
+ */
+static int read_server_messages(int client_socket, int timeout_ms, struct ChatSessionMsg *reply) {
+	struct pollfd pfd = {client_socket, POLLIN, 0};
+	struct ServerErrorMessage error;
+	struct ChatSessionMsg message;
+	struct ChatMembersMsg members_message;
+	int offset;
+	int found = 0;
+	int ret;
+
+	if (poll(&pfd, 1, timeout_ms) <= 0) {
+		return 0;
+	}
+	ret = recv(client_socket, &session.recv_buf[session.buffered], sizeof(session.recv_buf) - session.buffered,
+	           MSG_DONTWAIT);
+	if (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+		return -1;
+	}
+	if (ret > 0) {
+		session.buffered += ret;
+	}
+
+	offset = 0;
+	while (session.buffered - offset >= (int)ServerErrorCodec::wire_size) {
+		ServerErrorCodec::decode(&session.recv_buf[offset], session.buffered - offset, error);
+		if (error.error_type == CLIENT_RESUME || error.error_type == CLIENT_ACK) {
+			if (!ChatSessionCodec::decode(&session.recv_buf[offset], session.buffered - offset, message)) {
+				break;
+			}
+			offset += ChatSessionCodec::wire_size;
+			if (message.type == CLIENT_ACK) {
+				drop_acked(message.seq);
+			} else if (reply != NULL) {
+				*reply = message;
+				found = 1;
+			}
+		} else if (error.error_type == CLIENT_MEMBERS) {
+			if (!ChatMembersCodec::decode_frame(&session.recv_buf[offset], session.buffered - offset,
+			                                    members_message)) {
+				break;
+			}
+			offset += ChatMembersCodec::wire_size;
+			take_members(members_message, &session.recv_buf[offset]);
+			offset += members_message.data_len;
+		} else {
+			offset += ServerErrorCodec::wire_size;
+			if (error.error_type == UNKNOWN_TYPE && session.token == 0) {
+				// A server from before sessions
+				session.refused = true;
+			} else if (error.error_type == THROTTLED) {
+				std::cerr << "Sending too fast, the server is dropping messages" << std::endl;
+			} else {
+				std::cerr << "Server error " << error.error_type << std::endl;
+			}
+		}
+	}
+	memmove(session.recv_buf, &session.recv_buf[offset], session.buffered - offset);
+	session.buffered -= offset;
+	return found;
+}
+
+/**
+ * Start or resume the session on a new connection, then send again
+ * every message the server has not handled. A session the server no
+ * longer knows is started over, nickname first, and everything not
+ * acknowledged is sent again, so some messages may arrive twice.
+ *
+ * @param client_socket newly connected socket to the chat server
+ * @param nickname the client's nickname
+ * @return 0 on success, -1 if the connection failed
+ */
+static int open_session(int client_socket, const std::string &nickname) {
+	char buf[ChatClientCodec::wire_size + ChatSessionCodec::wire_size];
+	struct ChatClientMessage connect_message = {CLIENT_CONNECT, 0, 0};
+	struct ChatSessionMsg resume = {CLIENT_RESUME, session.token, 0};
+	struct ChatSessionMsg reply;
+	std::string nickname_message;
+	const char *message;
+	size_t message_len;
+	int len;
+	int ret = 0;
+
+	len = ChatClientCodec::encode(connect_message, buf, sizeof(buf));
+	len += ChatSessionCodec::encode(resume, &buf[len], sizeof(buf) - len);
+	session.buffered = 0;
+	session.refused = false;
+	if (send_frame(client_socket, buf, len, realtime_ns()) <= 0) {
+		return -1;
+	}
+	for (int waited = 0; ret == 0 && !session.refused && waited < RESUME_TIMEOUT_MS; waited += 100) {
+		ret = read_server_messages(client_socket, 100, &reply);
+	}
+	if (session.refused) {
+		std::cout << "Server has no sessions, carrying on without them" << std::endl;
+		session.enabled = false;
+		clear_unacked();
+		return send_client_message(client_socket, CLIENT_SET_NICKNAME, "", nickname) > 0 ? 0 : -1;
+	}
+	if (ret != 1) {
+		return -1;
+	}
+
+	if (reply.token == session.token) {
+		drop_acked(reply.seq);
+	} else {
+		if (session.token != 0) {
+			std::cout << "Session expired, starting over" << std::endl;
+		}
+		// Nothing is known to have arrived; the nickname has to go first again
+		session.token = reply.token;
+		session.acked = 0;
+		struct ChatClientMessage set_nickname = {CLIENT_SET_NICKNAME, 0, (uint16_t)nickname.size()};
+		len = ChatClientCodec::encode(set_nickname, buf, sizeof(buf));
+		nickname_message.assign(buf, len);
+		nickname_message += nickname;
+		remember_first(nickname_message.data(), nickname_message.size());
+	}
+	for (int i = 0; i < session.unacked_count; ++i) {
+		message = unacked_message(i, &message_len);
+		if (send_frame(client_socket, message, (int)message_len, realtime_ns()) <= 0) {
+			return -1;
+		}
+		metrics_add(metrics.shard, metrics.resent, 1);
+	}
+	return 0;
+}
+
+/**
+ * Reconnect after the connection to the server failed, backing off
+ * with jitter between attempts, and resume the session.
+ *
+ * @return the new socket, or -1 if the user quit first
+ */
+static int reconnect(int client_socket, const char *host, const char *port, const std::string &nickname) {
+	uint32_t delay_ms;
+
+	close(client_socket);
+	for (uint32_t attempt = 0; !quit; ++attempt) {
+		delay_ms = reconnect_delay_ms(attempt, RECONNECT_BASE_MS, RECONNECT_MAX_MS);
+		std::cout << "Lost the server, reconnecting in " << delay_ms << " ms" << std::endl;
+		usleep(delay_ms * 1000);
+		client_socket = connect_to_host(host, port);
+		if (client_socket == -1) {
+			continue;
+		}
+		metrics_add(metrics.shard, metrics.reconnects, 1);
+		if (tx_tracker.enabled) {
+			// Stream offsets start over on the new connection
+			tx_tracker.bytes_sent = 0;
+			tx_tracker.count = 0;
+			if (enable_software_timestamps(client_socket, false, true) == -1) {
+				tx_tracker.enabled = false;
+			}
+		}
+		// Answers that were on the way are lost; the next LIST asks for every member
+		members.log = 0;
+		members.pending = 0;
+		members.in_answer = false;
+		if (open_session(client_socket, nickname) == 0) {
+			std::cout << "Reconnected, sent " << session.unacked_count << " unacknowledged messages again"
+			          << std::endl;
+			return client_socket;
+		}
+		close(client_socket);
+	}
+	return -1;
+}
+
+/**
+ * Wait for input, sending CLIENT_HEARTBEAT whenever nothing has gone
+ * to the server for heartbeat_ms (0 for never), so a user who is
+ * thinking is not taken for a dead client. It also takes in what the
+ * server sends, acknowledgements and member lists, and notices if the
+ * server goes away.
+ *
+ * @param input_fd where lines come from, normally stdin
+ * @return 1 once input is ready (or closed), 0 on ctrl+c, -1 if the
+ *         connection failed
+ */
+static int wait_for_line(int client_socket, int input_fd, uint32_t heartbeat_ms) {
+	struct pollfd pfds[2] = {{input_fd, POLLIN, 0}, {client_socket, POLLIN, 0}};
+	uint64_t quiet_ms;
+	int timeout_ms;
+	int ret;
+
+	while (!quit) {
+		timeout_ms = -1;
+		if (heartbeat_ms > 0) {
+			quiet_ms = (now_ns() - last_send_ns) / 1000000;
+			if (quiet_ms >= heartbeat_ms) {
+				if (send_client_message(client_socket, CLIENT_HEARTBEAT, "", "") <= 0) {
+					return -1;
+				}
+				continue;
+			}
+			timeout_ms = (int)(heartbeat_ms - quiet_ms);
+		}
+		ret = poll(pfds, 2, timeout_ms);
+		if (ret < 0 && errno != EINTR) {
+			return 1;
+		}
+		if (ret > 0 && pfds[0].revents != 0) {
+			return 1;
+		}
+		if (ret > 0 && pfds[1].revents != 0 && read_server_messages(client_socket, 0, NULL) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Prompt for the next message and wait for it, keeping the connection
+ * alive meanwhile and, with a session, reconnecting if it drops.
+ *
+ * @param client_socket the connection to the server; replaced on a
+ *        reconnect, -1 if the user quit while reconnecting
+ * @return the message, "quit" once stdin is closed
+ */
+std::string get_message(int *client_socket, const char *host, const char *port, const std::string &nickname,
+                        uint32_t heartbeat_ms) {
 	std::string msg;
-	std::cout << "Enter chat message to send, or quit to quit: ";
-	std::getline(std::cin, msg);
+	std::cout << "Enter chat message to send, or quit to quit: " << std::flush;
+	while (wait_for_line(*client_socket, STDIN_FILENO, heartbeat_ms) == -1) {
+		if (!session.enabled) {
+			// The next send reports the failure
+			break;
+		}
+		*client_socket = reconnect(*client_socket, host, port, nickname);
+		if (*client_socket == -1) {
+			return msg;
+		}
+	}
+	if (!quit && !std::getline(std::cin, msg)) {
+		msg = "quit";
+	}
 	//std::cerr << "Got input " << msg << " from user" << std::endl;
 	return msg;
 }
 
+// Headless mode reads input STREAM_READ_SIZE at a time and sends
+// messages STREAM_BATCH_SIZE at a time
+#define STREAM_READ_SIZE (1024 * 1024)
+#define STREAM_BATCH_SIZE (64 * 1024)
+
+// Longest line that fits in a message's data
+#define STREAM_MAX_LINE UINT16_MAX
+
+/**
+ * Headless input: lines read a block at a time, and the messages
+ * encoded straight from them, waiting to be sent together.
+ */
+struct LineStream {
+	int fd;
+	/* a partial line carried over from the last block, then the next block */
+	char *buf;
+	/* first byte not yet parsed, and end of what has been read */
+	size_t start;
+	size_t end;
+	/* dropping the rest of a line too long to send */
+	bool skipping;
+	char *batch;
+	int batch_len;
+	int batch_messages;
+	uint64_t lines_sent;
+	uint64_t lines_skipped;
+};
+
+/**
+ * Read the next block of input in after the partial line left over.
+ * At the end of input a last line without a newline is given one.
+ *
+ * @return result of read()
+ */
+static ssize_t fill_lines(struct LineStream *stream) {
+	size_t partial = stream->end - stream->start;
+	ssize_t got;
+
+	if (!stream->skipping && partial > STREAM_MAX_LINE) {
+		stream->skipping = true;
+		stream->lines_skipped++;
+	}
+	if (stream->skipping) {
+		partial = 0;
+	}
+	memmove(stream->buf, &stream->buf[stream->start], partial);
+	stream->start = 0;
+	stream->end = partial;
+	got = read(stream->fd, &stream->buf[partial], STREAM_READ_SIZE);
+	if (got > 0) {
+		stream->end += got;
+	} else if (got == 0 && partial > 0) {
+		stream->buf[stream->end++] = '\n';
+	}
+	return got;
+}
+
+/**
+ * Find the next whole line of the block with memchr(), which looks at
+ * a vector register's worth of bytes at a time.
+ *
+ * @return false once only a partial line is left
+ */
+static bool next_line(struct LineStream *stream, const char **line, size_t *len) {
+	char *begin;
+	char *newline;
+
+	while (stream->start < stream->end) {
+		begin = &stream->buf[stream->start];
+		newline = (char *)memchr(begin, '\n', stream->end - stream->start);
+		if (newline == NULL) {
+			return false;
+		}
+		stream->start = newline + 1 - stream->buf;
+		if (stream->skipping) {
+			stream->skipping = false;
+			continue;
+		}
+		*line = begin;
+		*len = newline - begin;
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Encode a line as the interactive loop would send it: "/nick/..." is
+ * a direct message to nick, LIST asks for the members who joined and
+ * left since the last list and anything else goes to everyone.
+ *
+ * @param dest room for the largest message
+ * @return the message's length
+ */
+static int encode_line(char *dest, const char *line, size_t len, bool timestamps) {
+	struct ChatClientMessage message = {CLIENT_SEND_MESSAGE, 0, (uint16_t)len};
+	struct ChatTimedClientMessage timed_message;
+	const char *slash;
+	int offset;
+
+	if (len == 4 && memcmp(line, "LIST", 4) == 0) {
+		message.type = CLIENT_GET_MEMBERS;
+		message.data_length = CHAT_MEMBERS_SINCE_LEN;
+		offset = ChatClientCodec::encode(message, dest, ChatClientCodec::wire_size);
+		memcpy(&dest[offset], members_since().data(), CHAT_MEMBERS_SINCE_LEN);
+		return offset + CHAT_MEMBERS_SINCE_LEN;
+	}
+	if (len > 0 && line[0] == '/') {
+		// The nickname runs to the next '/', or the end of the line
+		slash = (const char *)memchr(line + 1, '/', len - 1);
+		message.type = CLIENT_SEND_DIRECT_MESSAGE;
+		message.nickname_len = (uint16_t)((slash != NULL ? slash : line + len) - (line + 1));
+		offset = ChatClientCodec::encode(message, dest, ChatClientCodec::wire_size);
+		memcpy(&dest[offset], line + 1, message.nickname_len);
+		offset += message.nickname_len;
+	} else if (timestamps) {
+		timed_message.type = CLIENT_SEND_TIMED_MESSAGE;
+		timed_message.nickname_len = 0;
+		timed_message.data_length = (uint16_t)len;
+		timed_message.send_ns = realtime_ns();
+		offset = ChatTimedClientCodec::encode(timed_message, dest, ChatTimedClientCodec::wire_size);
+	} else {
+		offset = ChatClientCodec::encode(message, dest, ChatClientCodec::wire_size);
+	}
+	memcpy(&dest[offset], line, len);
+	return offset + len;
+}
+
+/**
+ * Send the batch in one go, then take in what the server sent. With a
+ * session its messages are already kept, so if the connection drops
+ * they go again once the session is resumed.
+ *
+ * @return 0 on success, -1 if the connection failed for good
+ */
+static int flush_batch(struct LineStream *stream, int *client_socket, const char *host, const char *port,
+                       const std::string &nickname) {
+	int sent = 0;
+	int ret = 0;
+
+	while (sent < stream->batch_len) {
+		ret = send_frames(*client_socket, &stream->batch[sent], stream->batch_len - sent,
+		                  sent == 0 ? stream->batch_messages : 0, realtime_ns());
+		if (ret <= 0 && errno != EINTR) {
+			break;
+		}
+		sent += ret > 0 ? ret : 0;
+	}
+	stream->batch_len = 0;
+	stream->batch_messages = 0;
+	if (ret > 0) {
+		ret = read_server_messages(*client_socket, 0, NULL) == -1 ? -1 : 1;
+	}
+	if (ret >= 0) {
+		return 0;
+	}
+	if (!session.enabled) {
+		return -1;
+	}
+	*client_socket = reconnect(*client_socket, host, port, nickname);
+	return *client_socket == -1 ? -1 : 0;
+}
+
+/**
+ * Headless mode: send every line of input_fd without prompts, until
+ * it runs out, a line says quit or ctrl+c. Messages are encoded
+ * straight out of the input block, with no copy per line, and sent
+ * STREAM_BATCH_SIZE at a time, or whenever the input has to be waited
+ * for.
+ *
+ * @param client_socket the connection to the server; replaced on a
+ *        reconnect, -1 if the user quit while reconnecting
+ * @return 0 on success, -1 if the connection failed
+ */
+static int stream_messages(int *client_socket, int input_fd, const char *host, const char *port,
+                           const std::string &nickname, bool timestamps, uint32_t heartbeat_ms) {
+	struct LineStream stream;
+	uint64_t start_ns = now_ns();
+	const char *line;
+	size_t len;
+	ssize_t got = 1;
+	int frame_len;
+	int ret = 0;
+
+	memset(&stream, 0, sizeof(stream));
+	stream.fd = input_fd;
+	stream.buf = (char *)malloc(STREAM_MAX_LINE + STREAM_READ_SIZE + 1);
+	stream.batch = (char *)malloc(STREAM_BATCH_SIZE + CHAT_MAX_FRAME);
+	if (stream.buf == NULL || stream.batch == NULL) {
+		free(stream.buf);
+		free(stream.batch);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	while (got != 0 && !quit && ret == 0) {
+		// Everything parsed so far goes out before waiting for more
+		if (flush_batch(&stream, client_socket, host, port, nickname) == -1) {
+			ret = -1;
+			break;
+		}
+		ret = wait_for_line(*client_socket, input_fd, heartbeat_ms);
+		if (ret == -1) {
+			if (!session.enabled) {
+				// Nothing to resume; the caller reports the failure
+				errno = ECONNRESET;
+				break;
+			}
+			*client_socket = reconnect(*client_socket, host, port, nickname);
+			ret = *client_socket == -1 ? -1 : 0;
+			continue;
+		}
+		if (ret == 0) {
+			break;
+		}
+		ret = 0;
+		got = fill_lines(&stream);
+		if (got < 0) {
+			if (errno != EINTR) {
+				perror("read");
+				break;
+			}
+			continue;
+		}
+		while (next_line(&stream, &line, &len)) {
+			if (len == 4 && memcmp(line, "quit", 4) == 0) {
+				got = 0;
+				break;
+			}
+			if (len > STREAM_MAX_LINE) {
+				stream.lines_skipped++;
+				continue;
+			}
+			frame_len = encode_line(&stream.batch[stream.batch_len], line, len, timestamps);
+			remember_message(&stream.batch[stream.batch_len], frame_len);
+			stream.batch_len += frame_len;
+			stream.batch_messages++;
+			stream.lines_sent++;
+			if (stream.batch_len >= STREAM_BATCH_SIZE &&
+			    flush_batch(&stream, client_socket, host, port, nickname) == -1) {
+				ret = -1;
+				break;
+			}
+		}
+	}
+	if (ret == 0 && flush_batch(&stream, client_socket, host, port, nickname) == -1) {
+		ret = -1;
+	}
+
+	std::cout << "Sent " << stream.lines_sent << " lines in " << (now_ns() - start_ns) / 1000000 << " ms";
+	if (stream.lines_skipped > 0) {
+		std::cout << ", skipped " << stream.lines_skipped << " longer than " << STREAM_MAX_LINE << " bytes";
+	}
+	std::cout << std::endl;
+	free(stream.buf);
+	free(stream.batch);
+	return ret;
+}
+
 // Handler for when ctrl+c is pressed.
 // Just set the global 'stop' to true to shut down the server.
 void handle_ctrl_c(int the_signal) {
@@ -44,9 +995,32 @@ void handle_ctrl_c(int the_signal) {
 
 /**
  *
- * Chat client example. Reads in HOST PORT
+ * Chat client example. Reads in HOST PORT [--stats SOCKET] [--timestamps] [--no-resume]
+ *                            [--heartbeat SECONDS] [--nickname NAME [--input FILE]]
+ *
+ * With --timestamps, chat messages go out as CLIENT_SEND_TIMED_MESSAGE
+ * and kernel transmit timestamps measure how long each send waited in
+ * this host's stack (chat.tx_delay_ns).
+ *
+ * The client opens a session (CLIENT_RESUME) and keeps every message
+ * until the server acknowledges it. If the connection drops, it
+ * reconnects with jittered backoff, resumes the session and sends again
+ * only what the server never handled. --no-resume turns this off.
+ *
+ * While waiting for input the client sends CLIENT_HEARTBEAT every
+ * --heartbeat seconds (default 15, 0 for never) that it has sent
+ * nothing else, so the server does not reap it as idle.
+ *
+ * With --nickname the client runs headless, for scripts and traffic
+ * injection: no prompts, and every line of --input (default stdin) is
+ * sent as if typed, until the input ends or a line says quit. Lines
+ * are parsed in place out of large blocks and sent in batches, so
+ * what holds it back is the server's per-client rate limits
+ * (tcpchatserver --rate and --byte-rate, 0 to lift them).
  *
  * e.g., ./tcpchatclient 127.0.0.1 8888
+ *       ./tcpchatclient 127.0.0.1 8888 --stats /tmp/tcpchatcli.stats --timestamps
+ *       ./tcpchatclient 127.0.0.1 8888 --nickname bot --input messages.txt
  *
  * @param argc count of arguments on the command line
  * @param argv array of command line arguments
@@ -63,18 +1037,77 @@ int main(int argc, char *argv[]) {
 	// Variable used to check return codes from various functions
 	int ret;
 
-	char send_buf[2048];
-
 	std::string nickname;
 
+	// Counts sends; served on a Unix socket if --stats is given. Both live
+	// until exit, so the stats thread can outlast an early return.
+	struct MetricsRegistry *registry = new MetricsRegistry;
+	struct StatsServer *stats_server = nullptr;
+	const char *stats_path = nullptr;
+	bool timestamps = false;
+	bool resume = true;
+	uint32_t heartbeat_ms = CHAT_HEARTBEAT_INTERVAL_MS;
+	// Headless mode: nickname from the command line, lines from input_fd
+	const char *headless_nickname = nullptr;
+	const char *input_path = nullptr;
+	int input_fd = -1;
+
 	// Note: this needs to be 3, because the program name counts as an argument!
 	if (argc < 3) {
-		std::cerr << "Please specify HOST PORT as first two arguments." << std::endl;
+		std::cerr << "Please specify HOST PORT as first two arguments, then optionally --stats SOCKET,"
+		          << " --timestamps, --no-resume, --heartbeat SECONDS, --nickname NAME and --input FILE." << std::endl;
 		return 1;
 	}
 	// Set up variables "aliases"
 	ip_string = argv[1];
 	port_string = argv[2];
+	for (int i = 3; i < argc; ++i) {
+		if ((strcmp(argv[i], "--stats") == 0) && (i + 1 < argc)) {
+			stats_path = argv[++i];
+		} else if (strcmp(argv[i], "--timestamps") == 0) {
+			timestamps = true;
+		} else if (strcmp(argv[i], "--no-resume") == 0) {
+			resume = false;
+		} else if ((strcmp(argv[i], "--heartbeat") == 0) && (i + 1 < argc)) {
+			heartbeat_ms = (uint32_t)strtoul(argv[++i], nullptr, 10) * 1000;
+		} else if ((strcmp(argv[i], "--nickname") == 0) && (i + 1 < argc)) {
+			headless_nickname = argv[++i];
+		} else if ((strcmp(argv[i], "--input") == 0) && (i + 1 < argc)) {
+			input_path = argv[++i];
+		} else {
+			std::cerr << "Unknown option " << argv[i] << std::endl;
+			return 1;
+		}
+	}
+	if (input_path != nullptr && headless_nickname == nullptr) {
+		std::cerr << "--input needs --nickname" << std::endl;
+		return 1;
+	}
+	if (headless_nickname != nullptr) {
+		input_fd = input_path != nullptr ? open(input_path, O_RDONLY) : STDIN_FILENO;
+		if (input_fd == -1) {
+			perror(input_path);
+			return 1;
+		}
+	}
+
+	init_metrics_registry(registry);
+	metrics.messages_sent = metrics_counter(registry, "chat.messages_sent");
+	metrics.bytes_out = metrics_counter(registry, "chat.bytes_out");
+	metrics.send_errors = metrics_counter(registry, "chat.send_errors");
+	metrics.send_ns = metrics_histogram(registry, "chat.send_ns");
+	metrics.tx_delay_ns = metrics_histogram(registry, "chat.tx_delay_ns");
+	metrics.reconnects = metrics_counter(registry, "chat.reconnects");
+	metrics.resent = metrics_counter(registry, "chat.resent");
+	metrics.unacked_dropped = metrics_counter(registry, "chat.unacked_dropped");
+	metrics.shard = metrics_shard(registry);
+	if (stats_path != nullptr) {
+		stats_server = new StatsServer;
+		if (start_stats_server(stats_server, registry, stats_path) == -1) {
+			handle_error("could not create stats socket");
+			return 1;
+		}
+	}
 
 	// Signal handler setup, done for you! This allows you to hit ctrl+c when running from the command line
 	// This will set the global quit variable to true and allow you to cleanly shut down from the program
@@ -84,6 +1117,10 @@ int main(int argc, char *argv[]) {
 	sigemptyset(&ctrl_c_handler.sa_mask);
 	ctrl_c_handler.sa_flags = 0;
 	sigaction(SIGINT, &ctrl_c_handler, NULL);
+	// A send on a dropped connection should fail, so the client can reconnect
+	signal(SIGPIPE, SIG_IGN);
+	// Read stdin a byte at a time, so no typed lines hide in a buffer poll() cannot see
+	setvbuf(stdin, NULL, _IONBF, 0);
 
 	// Create the TCP socket.
 	// AF_INET is the address family used for IPv4 addresses
@@ -114,7 +1151,7 @@ int main(int argc, char *argv[]) {
 	}
 
 
-	nickname = get_nickname();
+	nickname = headless_nickname != nullptr ? headless_nickname : get_nickname();
 	// TODO: Connect to TCP Chat Server using connect()
 	results_it = results;
 	ret = -1;
@@ -142,53 +1179,67 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
-	struct ChatClientMessage *client_message;
-	client_message = (struct ChatClientMessage *) malloc(sizeof(ChatClientMessage));
-	int client_message_size = 0;
-	memset(client_message, 0, sizeof(struct ChatClientMessage));
-	client_message_size += sizeof(struct ChatClientMessage);
-
-	// TODO: Send connect message
-	// Fill in client_message and send to the server
-	client_message->type = htons(CLIENT_CONNECT);
-
-	ret = send(client_socket, client_message, client_message_size, 0);
-
-	if (ret <= 0) {
-		handle_error("Connect send to server failed.");
-		close(client_socket);
-		return 1;
+	if (timestamps) {
+		if (enable_software_timestamps(client_socket, false, true) == 0) {
+			tx_tracker.enabled = true;
+		} else {
+			handle_error("SO_TIMESTAMPING failed, sending timed messages without transmit timestamps");
+		}
 	}
 
-	// TODO: Send nickname message
-	struct ChatClientMessage *client_nickname;
-	client_nickname = (struct ChatClientMessage *) malloc(sizeof(ChatClientMessage) + nickname.size());
-	memset(client_nickname, 0, sizeof(struct ChatClientMessage));
-	int nick_name_msg_size = 0;
-	nick_name_msg_size += sizeof(ChatClientMessage);
-	nick_name_msg_size += nickname.size();
-
-	client_nickname->type = htons(CLIENT_SET_NICKNAME);
-	client_nickname->data_length = htons(nickname.size());
+	session.enabled = resume;
+	if (session.enabled) {
+		// Connects, then sends the nickname once the session is open
+		if (open_session(client_socket, nickname) == -1) {
+			handle_error("Opening session with server failed.");
+			close(client_socket);
+			return 1;
+		}
+	} else {
+		// TODO: Send connect message
+		// Fill in client_message and send to the server
+		ret = send_client_message(client_socket, CLIENT_CONNECT, "", "");
 
-	int offset = 0;
-	memcpy(&send_buf[offset], client_nickname, sizeof(struct ChatClientMessage));
-	offset += sizeof(struct ChatClientMessage);
-	memcpy(&send_buf[offset], nickname.c_str(), nickname.size());
+		if (ret <= 0) {
+			handle_error("Connect send to server failed.");
+			close(client_socket);
+			return 1;
+		}
 
-	ret = send(client_socket, send_buf, nick_name_msg_size, 0);
+		// TODO: Send nickname message
+		ret = send_client_message(client_socket, CLIENT_SET_NICKNAME, "", nickname);
 
-	if (ret <= 0) {
-		handle_error("Nickname message failed.");
-		close(client_socket);
-		return 1;
+		if (ret <= 0) {
+			handle_error("Nickname message failed.");
+			close(client_socket);
+			return 1;
+		}
 	}
 	// Now enter a loop to send the chat messages from this client to the server
 	std::string next_message;
-	next_message = get_message();
+	if (input_fd != -1) {
+		if (stream_messages(&client_socket, input_fd, ip_string, port_string, nickname, timestamps, heartbeat_ms) == -1 &&
+		    client_socket != -1) {
+			handle_error("Streaming messages failed.");
+			close(client_socket);
+			return 1;
+		}
+		// Straight on to disconnecting
+		next_message = "quit";
+	} else {
+		next_message = get_message(&client_socket, ip_string, port_string, nickname, heartbeat_ms);
+	}
 
 	while ((next_message != "quit") && (quit == false)) {
 
+		// Take in acknowledgements, and notice a dropped connection before sending into it
+		if (session.enabled && read_server_messages(client_socket, 0, NULL) == -1) {
+			client_socket = reconnect(client_socket, ip_string, port_string, nickname);
+			if (client_socket == -1) {
+				break;
+			}
+		}
+
 		std::cout << "Sending message " << next_message << std::endl;
 		// TODO: parse command from next_message, either a regular message, a direct message, or a LIST message
 		//       then send to the server the correct message type and data based on that
@@ -205,63 +1256,30 @@ int main(int argc, char *argv[]) {
 			}
 			std::cout << direct_nickname << std::endl;
 			// Send direct message; append name to message
-			struct ChatClientMessage *client_direct_message;
-			client_direct_message = (struct ChatClientMessage *) malloc(sizeof(struct ChatClientMessage));
-			memset(client_direct_message, 0, sizeof(struct ChatClientMessage));
-			int client_direct_message_size = 0;
-			client_direct_message_size +=
-					sizeof(struct ChatClientMessage) + next_message.size() + direct_nickname.size();
-
-			client_direct_message->type = htons(CLIENT_SEND_DIRECT_MESSAGE);
-			client_direct_message->data_length = htons(next_message.size());
-			client_direct_message->nickname_len = htons(direct_nickname.size());
-
-			int offset = 0;
-			char *client_direct_message_ptr = (char *) client_direct_message;
-			offset += sizeof(struct ChatClientMessage);
-			memcpy(&client_direct_message_ptr[offset], direct_nickname.c_str(), direct_nickname.size());
-			offset += direct_nickname.size();
-			memcpy(&client_direct_message_ptr[offset], next_message.c_str(), next_message.size());
-
-			ret = send(client_socket, client_direct_message, client_direct_message_size, 0);
+			ret = send_client_message(client_socket, CLIENT_SEND_DIRECT_MESSAGE, direct_nickname, next_message);
 
 			if (ret <= 0) {
 				handle_error("Client Direct Message failed.");
 			}
+			ret = ret <= 0 && errno == EMSGSIZE ? 1 : ret;
 		} else if (next_message == "LIST") {
-			struct ChatClientMessage *client_list_message;
-			client_list_message = (struct ChatClientMessage *) malloc(sizeof(ChatClientMessage));
-			memset(client_message, 0, sizeof(struct ChatClientMessage));
+			// Only who joined and left since the last LIST comes back
+			ret = send_client_message(client_socket, CLIENT_GET_MEMBERS, "", members_since());
 
-			client_list_message->type = htons(CLIENT_GET_MEMBERS);
-
-			ret = send(client_socket, client_list_message, sizeof(struct ChatClientMessage), 0);
-
-			if (ret <= 0) {
+			if (ret <= 0 && !session.enabled) {
 				handle_error("Client LIST message failed.");
 				close(client_socket);
 				return 1;
 			}
 
 		} else {
-			struct ChatClientMessage *client_normal_message;
-			client_normal_message = (struct ChatClientMessage *) malloc(
-					sizeof(struct ChatClientMessage) + next_message.size());
-			memset(client_message, 0, sizeof(struct ChatClientMessage));
-			int client_normal_message_size = sizeof(struct ChatClientMessage) + next_message.size();
-
-			client_normal_message->type = htons(CLIENT_SEND_MESSAGE);
-			client_normal_message->data_length = htons(next_message.size());
-
-			int offset = 0;
-			char *client_message_ptr = (char *) client_normal_message;
-			memcpy(&send_buf[offset], client_normal_message, sizeof(struct ChatClientMessage));
-			offset += sizeof(struct ChatClientMessage);
-			memcpy(&client_message_ptr[offset], next_message.c_str(), next_message.size());
-
-			ret = send(client_socket, client_message_ptr, client_normal_message_size, 0);
+			if (timestamps) {
+				ret = send_timed_message(client_socket, next_message);
+			} else {
+				ret = send_client_message(client_socket, CLIENT_SEND_MESSAGE, "", next_message);
+			}
 
-			if (ret <= 0) {
+			if (ret <= 0 && (!session.enabled || errno == EMSGSIZE)) {
 				handle_error("Send normal message failed.");
 				close(client_socket);
 				return 1;
@@ -269,21 +1287,41 @@ int main(int argc, char *argv[]) {
 
 		}
 
-		next_message = get_message();
+		if (ret <= 0 && session.enabled) {
+			// The message is kept, and goes again once the session is resumed
+			client_socket = reconnect(client_socket, ip_string, port_string, nickname);
+			if (client_socket == -1) {
+				break;
+			}
+		}
 
-	}
+		if (client_socket == -1) {
+			break;
+		}
+		next_message = get_message(&client_socket, ip_string, port_string, nickname, heartbeat_ms);
 
-	// TODO: build and send a client disconnect message to the server here
+	}
 
-	struct ChatClientMessage *client_quit_message;
-	client_quit_message = (struct ChatClientMessage *) malloc(sizeof(ChatClientMessage));
-	memset(client_quit_message, 0, sizeof(struct ChatClientMessage));
-	int client_quit_message_size = 0;
-	client_quit_message_size += sizeof(struct ChatClientMessage);
+	if (client_socket == -1) {
+		std::cerr << "Quit while reconnecting, " << session.unacked_count << " messages never acknowledged"
+		          << std::endl;
+		return 1;
+	}
+	if (session.enabled) {
+		// Give the server a moment to acknowledge the last messages
+		for (int waited = 0; session.unacked_count > 0 && waited < 1000; waited += 100) {
+			if (read_server_messages(client_socket, 100, NULL) == -1) {
+				break;
+			}
+		}
+		if (session.unacked_count > 0) {
+			std::cerr << session.unacked_count << " messages not acknowledged by the server" << std::endl;
+		}
+	}
 
-	client_quit_message->type = htons(CLIENT_DISCONNECT);
+	// TODO: build and send a client disconnect message to the server here
 
-	ret = send(client_socket, client_quit_message, client_quit_message_size, 0);
+	ret = send_client_message(client_socket, CLIENT_DISCONNECT, "", "");
 
 	if (ret <= 0) {
 		handle_error("Disconnect from server failed.");
@@ -293,6 +1331,18 @@ int main(int argc, char *argv[]) {
 
 	std::cout << nickname << " disconnected from server." << std::endl;
 
+	if (tx_tracker.enabled) {
+		// Give the last sends' timestamps a moment to come back
+		struct pollfd pfd = {client_socket, 0, 0};
+		poll(&pfd, 1, 100);
+		drain_tx_timestamps(client_socket);
+	}
 	close(client_socket);
+	if (stats_server != nullptr) {
+		stop_stats_server(stats_server);
+		delete stats_server;
+	}
+	free_metrics_registry(registry);
+	delete registry;
 	return 0;
 }
@@ -14,9 +14,14 @@
 #include <sys/poll.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <time.h>
 
 #include "tcp_chat.h"
+#include "chat_archive.h"
+#include "chat_lz.h"
+#include "chat_wire.h"
 #include "tcp_utils.h"
+#include "metrics.h"
 
 // Variable used to shut down the monitor when ctrl+c is pressed.
 static bool stop = false;
@@ -28,11 +33,457 @@ void handle_ctrl_c_monitor(int the_signal) {
 	stop = true;
 }
 
+/**
+ * Ids of the monitor's metrics.
+ */
+struct MonitorMetricIds {
+	int recv_calls;
+	int bytes_in;
+	int recv_errors;
+	int messages;
+	int direct_messages;
+	int other_messages;
+	/* histogram of bytes returned by each recv */
+	int recv_bytes;
+	/* histogram of whole messages found after each recv */
+	int messages_per_recv;
+	/* histogram of bytes of partial message left waiting after each recv */
+	int buffered_bytes;
+	/* histograms of timed message latency: sender's send() to printing,
+	   sender's send() to this host's kernel receiving it, and the
+	   kernel receiving it to printing */
+	int delivery_ns;
+	int network_ns;
+	int local_ns;
+	/* how each wait for data ended, in --spin mode */
+	int spin_wakeups;
+	int blocking_wakeups;
+	int reconnects;
+	/* messages the server no longer had when this monitor resumed */
+	int missed;
+	/* messages written to the --archive */
+	int archived;
+	/* MON_COMPRESSED data received, what it decompressed to, and the
+	   CPU time that took */
+	int compressed_bytes;
+	int decompressed_bytes;
+	int decompress_ns;
+};
+
+/**
+ * Settings for --spin, where the monitor polls its socket in a tight
+ * loop instead of sleeping in select().
+ */
+struct SpinConfig {
+	bool enabled;
+	/* CPU to pin to, or -1 to leave the thread where it is */
+	int cpu;
+	/* how long to spin without data before going back to select() */
+	uint32_t idle_us;
+	/* SO_BUSY_POLL time for each receive */
+	int busy_poll_us;
+};
+
+// Spins between checks of stdin, the stop flag and the idle clock
+#define SPIN_CHECK_INTERVAL 1024
+
+/**
+ * The monitor's session (see ChatSessionMsg), so a reconnect picks up
+ * where the lost connection left off.
+ */
+struct MonitorSession {
+	bool enabled;
+	uint64_t token;
+	/* session messages seen */
+	uint64_t seen;
+};
+
+static uint64_t monotonic_us() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static uint64_t cpu_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Spin on the non-blocking socket until data arrives, stdin has input,
+ * or nothing has come for spin->idle_us. Peeking with recv() (rather
+ * than poll()) lets SO_BUSY_POLL poll the device queue on every pass.
+ *
+ * @param read_set set to the descriptors that are ready, as select() would;
+ *        left alone if the spin goes idle
+ * @return true if something is ready, false if the spin went idle
+ */
+static bool spin_until_readable(int monitor_socket, int stdin_fd, const struct SpinConfig *spin, fd_set *read_set) {
+	struct pollfd stdin_pfd = {stdin_fd, POLLIN, 0};
+	uint64_t start_us = monotonic_us();
+	char byte;
+
+	for (uint32_t spins = 1; !stop; ++spins) {
+		// An error or the server closing is left for the real recvmsg to report
+		if (recv(monitor_socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT) != -1 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+			FD_ZERO(read_set);
+			FD_SET(monitor_socket, read_set);
+			return true;
+		}
+		if (spins % SPIN_CHECK_INTERVAL == 0) {
+			if (poll(&stdin_pfd, 1, 0) > 0) {
+				FD_ZERO(read_set);
+				FD_SET(stdin_fd, read_set);
+				return true;
+			}
+			if (monotonic_us() - start_us >= spin->idle_us) {
+				return false;
+			}
+		}
+	}
+	return false;
+}
+
+/**
+ * One message from the server, pointing into the receive buffer.
+ */
+struct MonFrame {
+	uint16_t type;
+	const char *nickname;
+	uint16_t nickname_len;
+	const char *data;
+	uint16_t data_len;
+	/* sender's send time for MON_TIMED_MESSAGE, 0 otherwise */
+	uint64_t send_ns;
+	/* token and seq of MON_RESUME */
+	uint64_t token;
+	uint64_t seq;
+	/* flags and decompressed length of MON_COMPRESSED, whose data is the
+	   batch; MON_PRESENCE has its flags too, and its changes as data */
+	uint16_t flags;
+	uint16_t raw_len;
+};
+
+/**
+ * Decode the message at the start of buf, if all of it has arrived.
+ * MON_TIMED_MESSAGE has a longer header than every other type, MON_RESUME
+ * is a ChatSessionMsg, MON_COMPRESSED a ChatCompressedMonMsg, MON_PRESENCE
+ * a ChatMembersMsg and a ServerErrorMessage is just its error type.
+ *
+ * @return length of the message, or 0 if more data is needed
+ */
+static size_t next_frame(const char *buf, size_t len, struct MonFrame *frame) {
+	struct ChatMonMsg message;
+	struct ChatTimedMonMsg timed_message;
+	struct ChatSessionMsg session_message;
+	struct ChatCompressedMonMsg compressed;
+	struct ChatMembersMsg presence;
+	struct ServerErrorMessage error;
+	size_t header_len;
+
+	if (!ServerErrorCodec::decode(buf, len, error)) {
+		return 0;
+	}
+	if (error.error_type >= UNKNOWN_TYPE && error.error_type <= THROTTLED) {
+		memset(frame, 0, sizeof(*frame));
+		frame->type = error.error_type;
+		return ServerErrorCodec::wire_size;
+	}
+	if (error.error_type == MON_RESUME) {
+		if (!ChatSessionCodec::decode(buf, len, session_message)) {
+			return 0;
+		}
+		memset(frame, 0, sizeof(*frame));
+		frame->type = MON_RESUME;
+		frame->token = session_message.token;
+		frame->seq = session_message.seq;
+		return ChatSessionCodec::wire_size;
+	}
+	if (error.error_type == MON_COMPRESSED) {
+		if (!ChatCompressedMonCodec::decode_frame(buf, len, compressed)) {
+			return 0;
+		}
+		memset(frame, 0, sizeof(*frame));
+		frame->type = MON_COMPRESSED;
+		frame->flags = compressed.flags;
+		frame->raw_len = compressed.raw_len;
+		frame->data = buf + ChatCompressedMonCodec::wire_size;
+		frame->data_len = compressed.data_len;
+		return ChatCompressedMonCodec::wire_size + compressed.data_len;
+	}
+	if (error.error_type == MON_PRESENCE) {
+		if (!ChatMembersCodec::decode_frame(buf, len, presence)) {
+			return 0;
+		}
+		memset(frame, 0, sizeof(*frame));
+		frame->type = MON_PRESENCE;
+		frame->flags = presence.flags;
+		frame->data = buf + ChatMembersCodec::wire_size;
+		frame->data_len = (uint16_t)presence.data_len;
+		return ChatMembersCodec::wire_size + presence.data_len;
+	}
+
+	if (!ChatMonCodec::decode(buf, len, message)) {
+		return 0;
+	}
+	if (message.type == MON_TIMED_MESSAGE) {
+		if (!ChatTimedMonCodec::decode_frame(buf, len, timed_message)) {
+			return 0;
+		}
+		header_len = ChatTimedMonCodec::wire_size;
+		message.nickname_len = timed_message.nickname_len;
+		message.data_len = timed_message.data_len;
+		frame->send_ns = timed_message.send_ns;
+	} else {
+		if (!ChatMonCodec::decode_frame(buf, len, message)) {
+			return 0;
+		}
+		header_len = ChatMonCodec::wire_size;
+		frame->send_ns = 0;
+	}
+
+	frame->type = message.type;
+	frame->nickname = buf + header_len;
+	frame->nickname_len = message.nickname_len;
+	frame->data = frame->nickname + message.nickname_len;
+	frame->data_len = message.data_len;
+	return header_len + message.nickname_len + message.data_len;
+}
+
+/**
+ * Print a MON_PRESENCE: every member, or who joined and left since the
+ * last one.
+ */
+static void print_presence(const struct MonFrame *frame) {
+	const char *data = frame->data;
+	const char *end = frame->data + frame->data_len;
+	uint16_t len;
+
+	if ((frame->flags & CHAT_MEMBERS_SNAPSHOT) && frame->data_len == 0) {
+		std::cout << "[PRESENCE] Nobody is here" << std::endl;
+	}
+	while (end - data >= 3) {
+		len = wire::load_be<uint16_t>((const uint8_t *)&data[1]);
+		if (end - data - 3 < len) {
+			break;
+		}
+		std::cout << "[PRESENCE] ";
+		std::cout.write(&data[3], len);
+		if (frame->flags & CHAT_MEMBERS_SNAPSHOT) {
+			std::cout << " is here" << std::endl;
+		} else {
+			std::cout << (data[0] == CHAT_MEMBER_LEFT ? " left" : " joined") << std::endl;
+		}
+		data += 3 + len;
+	}
+	if ((frame->flags & CHAT_MEMBERS_PARTIAL) && !(frame->flags & CHAT_MEMBERS_MORE)) {
+		std::cout << "[PRESENCE] and more than the server would send" << std::endl;
+	}
+}
+
+static void register_monitor_metrics(struct MetricsRegistry *registry, struct MonitorMetricIds *ids) {
+	ids->recv_calls = metrics_counter(registry, "mon.recv_calls");
+	ids->bytes_in = metrics_counter(registry, "mon.bytes_in");
+	ids->recv_errors = metrics_counter(registry, "mon.recv_errors");
+	ids->messages = metrics_counter(registry, "mon.messages");
+	ids->direct_messages = metrics_counter(registry, "mon.direct_messages");
+	ids->other_messages = metrics_counter(registry, "mon.other_messages");
+	ids->recv_bytes = metrics_histogram(registry, "mon.recv_bytes");
+	ids->messages_per_recv = metrics_histogram(registry, "mon.messages_per_recv");
+	ids->buffered_bytes = metrics_histogram(registry, "mon.buffered_bytes");
+	ids->delivery_ns = metrics_histogram(registry, "mon.delivery_ns");
+	ids->network_ns = metrics_histogram(registry, "mon.network_ns");
+	ids->local_ns = metrics_histogram(registry, "mon.local_ns");
+	ids->spin_wakeups = metrics_counter(registry, "mon.spin_wakeups");
+	ids->blocking_wakeups = metrics_counter(registry, "mon.blocking_wakeups");
+	ids->reconnects = metrics_counter(registry, "mon.reconnects");
+	ids->missed = metrics_counter(registry, "mon.missed");
+	ids->archived = metrics_counter(registry, "mon.archived");
+	ids->compressed_bytes = metrics_counter(registry, "mon.compressed_bytes");
+	ids->decompressed_bytes = metrics_counter(registry, "mon.decompressed_bytes");
+	ids->decompress_ns = metrics_counter(registry, "mon.decompress_ns");
+}
+
+/**
+ * Connect to the chat server and set up the socket for the main loop:
+ * non-blocking, with receive timestamps and busy polling if asked for.
+ *
+ * @return the socket, or -1 if no connection could be made
+ */
+static int open_connection(const char *host, const char *port, bool timestamps, const struct SpinConfig *spin) {
+	int monitor_socket;
+	int flags;
+
+	monitor_socket = connect_to_host(host, port);
+	if (monitor_socket == -1) {
+		return -1;
+	}
+
+	// Set flags to keep socket from blocking
+	flags = fcntl(monitor_socket, F_GETFL, 0);
+	if (flags == -1 || fcntl(monitor_socket, F_SETFL, flags | SOCK_NONBLOCK) == -1) {
+		perror("fcntl");
+		close(monitor_socket);
+		return -1;
+	}
+
+	if (timestamps && (enable_software_timestamps(monitor_socket, true, false) == -1)) {
+		handle_error("SO_TIMESTAMPING failed, latencies will not be split");
+	}
+	if (spin->enabled && (enable_busy_poll(monitor_socket, spin->busy_poll_us) == -1)) {
+		handle_error("SO_BUSY_POLL failed, spinning without it");
+	}
+	return monitor_socket;
+}
+
+/**
+ * Send MON_CONNECT, with the nickname if there is one, followed by
+ * MON_RESUME if sessions are on, MON_COMPRESS if compress_level is
+ * not 0 and MON_PRESENCE if presence is set.
+ *
+ * @return 0 on success, -1 if the send failed
+ */
+static int send_mon_connect(int monitor_socket, const char *nickname, const struct MonitorSession *session,
+                            int compress_level, bool presence) {
+	char send_buf[2049 + ChatSessionCodec::wire_size + 2 * ChatMonCodec::wire_size + 2];
+	struct ChatMonMsg mon_connect;
+	struct ChatSessionMsg resume;
+	struct ChatMonMsg compress = {MON_COMPRESS, 0, 2};
+	struct ChatMonMsg presence_message = {MON_PRESENCE, 0, 0};
+	int mon_connect_size;
+
+	// TODO: build a chat client message of type MON_CONNECT
+	//       if a nickname was provided, include that in the message as well
+	mon_connect.type = MON_CONNECT;
+	mon_connect.nickname_len = 0;
+	mon_connect.data_len = 0;
+	if (nickname != nullptr) {
+		mon_connect.nickname_len = strnlen(nickname, 2049 - ChatMonCodec::wire_size);
+	}
+
+	mon_connect_size = ChatMonCodec::encode(mon_connect, send_buf, sizeof(send_buf));
+	if (nickname != nullptr) {
+		memcpy(&send_buf[mon_connect_size], nickname, mon_connect.nickname_len);
+		mon_connect_size += mon_connect.nickname_len;
+	}
+	if (session->enabled) {
+		resume.type = MON_RESUME;
+		resume.token = session->token;
+		resume.seq = session->seen;
+		mon_connect_size += ChatSessionCodec::encode(resume, &send_buf[mon_connect_size],
+		                                             sizeof(send_buf) - mon_connect_size);
+	}
+	if (compress_level > 0) {
+		mon_connect_size += ChatMonCodec::encode(compress, &send_buf[mon_connect_size],
+		                                         sizeof(send_buf) - mon_connect_size);
+		send_buf[mon_connect_size++] = CHAT_CODEC_LZ;
+		send_buf[mon_connect_size++] = (char)compress_level;
+	}
+	if (presence) {
+		// Every member again on a reconnect, as a presence list is not part of the session
+		mon_connect_size += ChatMonCodec::encode(presence_message, &send_buf[mon_connect_size],
+		                                         sizeof(send_buf) - mon_connect_size);
+	}
+
+	// TODO: send the MON_CONNECT message to the server
+	return send(monitor_socket, send_buf, mon_connect_size, MSG_NOSIGNAL) == mon_connect_size ? 0 : -1;
+}
+
+/**
+ * Send MON_HEARTBEAT, so the server knows a monitor that only listens
+ * is still there.
+ */
+static void send_heartbeat(int monitor_socket) {
+	char buf[ChatMonCodec::wire_size];
+	struct ChatMonMsg heartbeat = {MON_HEARTBEAT, 0, 0};
+
+	// A failure shows up as the connection dropping
+	send(monitor_socket, buf, ChatMonCodec::encode(heartbeat, buf, sizeof(buf)), MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+/**
+ * Reconnect after losing the server, backing off with jitter between
+ * attempts, and resume the session.
+ *
+ * @return the new socket, or -1 if the monitor was stopped first
+ */
+static int reconnect(int monitor_socket, const char *host, const char *port, const char *nickname,
+                     const struct MonitorSession *session, int compress_level, bool presence, bool timestamps,
+                     const struct SpinConfig *spin) {
+	uint32_t delay_ms;
+
+	close(monitor_socket);
+	for (uint32_t attempt = 0; !stop; ++attempt) {
+		delay_ms = reconnect_delay_ms(attempt, RECONNECT_BASE_MS, RECONNECT_MAX_MS);
+		std::cout << "Lost the server, reconnecting in " << delay_ms << " ms" << std::endl;
+		// In slices, so ctrl+c is not kept waiting
+		for (uint32_t slept = 0; slept < delay_ms && !stop; slept += 100) {
+			usleep((delay_ms - slept < 100 ? delay_ms - slept : 100) * 1000);
+		}
+		if (stop) {
+			break;
+		}
+		monitor_socket = open_connection(host, port, timestamps, spin);
+		if (monitor_socket == -1) {
+			continue;
+		}
+		if (send_mon_connect(monitor_socket, nickname, session, compress_level, presence) == 0) {
+			return monitor_socket;
+		}
+		close(monitor_socket);
+	}
+	return -1;
+}
+
 /**
  * TCP chat monitor. Connects to a chat server and
  * simply prints out data to the client until it quits.
  *
  * e.g., ./tcpchatmon 127.0.0.1 8888
+ *       ./tcpchatmon 127.0.0.1 8888 mynick --stats /tmp/tcpchatmon.stats --timestamps
+ *
+ * With --timestamps, kernel receive timestamps split the latency of
+ * each MON_TIMED_MESSAGE into the trip to this host's kernel (network
+ * and server) and the time spent here before it was printed. Sender
+ * and monitor clocks must agree, e.g. both on one host or both synced
+ * by PTP, for the first part to mean anything.
+ *
+ * With --spin [CPU], the monitor pins itself to CPU, turns on busy
+ * polling and spins on the socket instead of sleeping, going back to
+ * select() once nothing has arrived for --spin-idle-us (default 50000).
+ * This trades a whole core for shorter, steadier wakeups; on a machine
+ * with fewer free cores than busy threads it makes latency worse.
+ *
+ * e.g., ./tcpchatmon 127.0.0.1 8888 --timestamps --spin 3 --spin-idle-us 200000
+ *
+ * The monitor opens a session (MON_RESUME) and counts the messages it
+ * sees. If the connection drops, it reconnects with jittered backoff
+ * and the server sends only the messages it missed, or says how many
+ * it no longer has. --no-resume turns this off, and the monitor stops
+ * when the connection drops.
+ *
+ * The monitor sends MON_HEARTBEAT every --heartbeat seconds (default
+ * 15, 0 for never), so the server does not reap it as idle.
+ *
+ * With --archive DIR, chat messages are not printed but recorded as
+ * they arrived, with their receive times (the kernel's, with
+ * --timestamps), in a binary archive (chat_archive.h) of --segment-mb
+ * (default 256, at most 4095) segments, written with O_DIRECT if --direct is given.
+ * chat_archive prints it back out or filters it.
+ *
+ * e.g., ./tcpchatmon 127.0.0.1 8888 --archive /var/tmp/chat --direct
+ *
+ * With --compress [LEVEL], the monitor asks the server to send its
+ * messages in compressed batches (MON_COMPRESSED, chat_lz.h) at LEVEL,
+ * 1 to 9 (default CHAT_LZ_DEFAULT_LEVEL), which is worth it when the
+ * link to the server, not the CPU, is what limits the monitor. It
+ * carries on uncompressed if the server will not.
+ *
+ * With --presence, the monitor asks for MON_PRESENCE and prints who is
+ * in the chat, then who joins and leaves as they do.
+ *
+ * e.g., ./tcpchatmon 127.0.0.1 8888 --presence
  *
  * @param argc count of arguments on the command line
  * @param argv array of command line arguments
@@ -55,8 +506,15 @@ int main(int argc, char *argv[]) {
 	// IPv4 structure representing and IP address and port of the destination
 	struct sockaddr_in dest_addr;
 	socklen_t dest_addr_len;
-	char recv_buf[2048];
+	// Large enough for the biggest possible message, which may arrive over several recv calls
+	static char recv_buf[CHAT_MAX_FRAME];
+	// Bytes of recv_buf holding data not yet printed
+	int buffered = 0;
 	char send_buf[2049];
+	char stdin_buf[2048];
+	struct MonitorSession session = {true, 0, 0};
+	uint32_t heartbeat_ms = CHAT_HEARTBEAT_INTERVAL_MS;
+	uint64_t last_send_us;
 
 	fd_set read_set; // fds to read from
 	fd_set write_set; // fds to write to
@@ -66,6 +524,53 @@ int main(int argc, char *argv[]) {
 	select_timeout.tv_sec = 2;
 	select_timeout.tv_usec = 0;
 
+	// Counts what arrives; served on a Unix socket if --stats is given. Both
+	// live until exit, so the stats thread can outlast an early return.
+	struct MetricsRegistry *registry = new MetricsRegistry;
+	struct MonitorMetricIds ids;
+	struct MetricsShard *metrics;
+	struct StatsServer *stats_server = nullptr;
+	const char *stats_path = nullptr;
+	int messages;
+
+	// Kernel receive timestamps, if --timestamps is given
+	bool timestamps = false;
+	struct msghdr recv_msg;
+	struct iovec recv_iov;
+	char recv_control[256];
+	uint64_t rx_ns;
+	uint64_t printed_ns;
+	struct MonFrame frame;
+	size_t frame_len;
+
+	// Spin mode, if --spin is given
+	struct SpinConfig spin = {false, -1, 50000, 50};
+
+	// Archive mode, if --archive is given
+	const char *archive_dir = nullptr;
+	uint64_t segment_bytes = CHAT_ARCHIVE_DEFAULT_SEGMENT_BYTES;
+	bool direct = false;
+	struct ChatArchiveWriter archive;
+	uint64_t recv_ns;
+
+	// Compression, if --compress is given
+	int compress_level = 0;
+	bool compress_pending = false;
+	struct LzDecoder decoder;
+	// Batch a MON_COMPRESSED unpacked to, and how far through it we are
+	const char *batch = nullptr;
+	size_t batch_len = 0;
+	size_t batch_offset = 0;
+	const char *at;
+	bool in_batch;
+	uint64_t decompress_start_ns;
+	uint64_t compressed_total = 0;
+	uint64_t decompressed_total = 0;
+
+	// Presence, if --presence is given
+	bool presence = false;
+	bool presence_pending = false;
+
 	// Set dest_addr to all zeroes, just to make sure it's not filled with junk
 	// Note we could also make it a static variable, which will be zeroed before execution
 	memset(&dest_addr, 0, sizeof(struct sockaddr_in));
@@ -79,119 +584,124 @@ int main(int argc, char *argv[]) {
 
 	// Note: this needs to be 3, because the program name counts as an argument!
 	if (argc < 3) {
-		std::cerr << "Please specify server HOST PORT [NICKNAME] as arguments." << std::endl;
+		std::cerr << "Please specify server HOST PORT [NICKNAME] [--stats SOCKET] [--timestamps]"
+		          << " [--spin [CPU]] [--spin-idle-us US] [--no-resume] [--heartbeat SECONDS]"
+		          << " [--archive DIR [--segment-mb MB] [--direct]] [--compress [LEVEL]] [--presence] as arguments."
+		          << std::endl;
 		return 1;
 	}
 
+	for (int i = 3; i < argc; ++i) {
+		if ((strcmp(argv[i], "--stats") == 0) && (i + 1 < argc)) {
+			stats_path = argv[++i];
+		} else if (strcmp(argv[i], "--timestamps") == 0) {
+			timestamps = true;
+		} else if (strcmp(argv[i], "--spin") == 0) {
+			spin.enabled = true;
+			// The CPU is optional
+			if ((i + 1 < argc) && (argv[i + 1][0] >= '0') && (argv[i + 1][0] <= '9')) {
+				spin.cpu = atoi(argv[++i]);
+			}
+		} else if ((strcmp(argv[i], "--spin-idle-us") == 0) && (i + 1 < argc)) {
+			spin.idle_us = strtoul(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "--no-resume") == 0) {
+			session.enabled = false;
+		} else if ((strcmp(argv[i], "--heartbeat") == 0) && (i + 1 < argc)) {
+			heartbeat_ms = (uint32_t)strtoul(argv[++i], NULL, 10) * 1000;
+		} else if ((strcmp(argv[i], "--archive") == 0) && (i + 1 < argc)) {
+			archive_dir = argv[++i];
+		} else if ((strcmp(argv[i], "--segment-mb") == 0) && (i + 1 < argc)) {
+			segment_bytes = strtoull(argv[++i], NULL, 10);
+			if (segment_bytes < 1 || segment_bytes > CHAT_ARCHIVE_MAX_SEGMENT_BYTES / (1024 * 1024)) {
+				std::cerr << "--segment-mb MB must be 1 to " << CHAT_ARCHIVE_MAX_SEGMENT_BYTES / (1024 * 1024) << std::endl;
+				return 1;
+			}
+			segment_bytes *= 1024 * 1024;
+		} else if (strcmp(argv[i], "--direct") == 0) {
+			direct = true;
+		} else if (strcmp(argv[i], "--compress") == 0) {
+			compress_level = CHAT_LZ_DEFAULT_LEVEL;
+			// The level is optional
+			if ((i + 1 < argc) && (argv[i + 1][0] >= '0') && (argv[i + 1][0] <= '9')) {
+				compress_level = atoi(argv[++i]);
+			}
+			if (compress_level < 1 || compress_level > CHAT_LZ_MAX_LEVEL) {
+				std::cerr << "--compress LEVEL must be 1 to " << CHAT_LZ_MAX_LEVEL << std::endl;
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--presence") == 0) {
+			presence = true;
+		} else {
+			// Indicates that a nickname was provided for the monitor (for direct messages)
+			nickname = argv[i];
+		}
+	}
 
-	// Indicates that a nickname was provided for the monitor (for direct messages)
-	if (argc == 4) {
-		nickname = argv[3];
+	init_metrics_registry(registry);
+	register_monitor_metrics(registry, &ids);
+	metrics = metrics_shard(registry);
+	if (stats_path != nullptr) {
+		stats_server = new StatsServer;
+		if (start_stats_server(stats_server, registry, stats_path) == -1) {
+			handle_error("could not create stats socket");
+			return 1;
+		}
 	}
 
 	// Set up les variables "aliases"
 	ip_string = argv[1];
 	port_string = argv[2];
 
-	// Create le socket
-	monitor_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-
-	if (monitor_socket < 0) {
-		perror("socket");
-		return -1;
-	}
-
-	// 2. Connect to chat server
-	struct addrinfo hints;
-	struct addrinfo *results;
-	struct addrinfo *results_it;
-	memset(&hints, 0, sizeof(struct addrinfo));
-	hints.ai_family = AF_INET;
-	hints.ai_protocol = 0;
-	hints.ai_flags = AI_PASSIVE;
-	hints.ai_socktype = SOCK_STREAM;
-	ret = getaddrinfo(ip_string, port_string, &hints, &results);
-
-	if (ret != 0) {
-		perror("getaddrinfo");
-		return -1;
-	}
-
-	results_it = results;
-	ret = -1;
-	while (results_it != NULL) {
-		std::cout << "Attempting to connect to " <<
-		          printable_address((struct sockaddr_storage *) results_it->ai_addr, results_it->ai_addrlen)
-		          << std::endl;
-		ret = connect(monitor_socket, results_it->ai_addr, results_it->ai_addrlen);
-		if (ret == 0) {
-			break;
-		}
-		ret = -1;
-		perror("bind");
-		results_it = results_it->ai_next;
+	if (compress_level > 0 && init_lz_decoder(&decoder, CHAT_MAX_BATCH) == -1) {
+		handle_error("no memory to decompress with");
+		return 1;
 	}
 
-	// Free memory for a free... computer?
-	freeaddrinfo(results);
+	// Connect to chat server
+	monitor_socket = open_connection(ip_string, port_string, timestamps, &spin);
 
-	if (ret == -1) {
+	if (monitor_socket == -1) {
 		handle_error("connect failed");
 		return -1;
 	}
 
-	// Set flags to keep socket from blocking
-	int flags;
-	flags = fcntl(monitor_socket, F_GETFL, 0);
-
-	if (flags == -1) {
-		perror("fcntl");
-		return -1;
-	}
-
-	ret = fcntl(monitor_socket, F_SETFL, flags | SOCK_NONBLOCK);
-	if (ret == -1) {
-		perror("fcntl");
-		return -1;
+	if (spin.enabled) {
+		if ((spin.cpu >= 0) && (pin_thread_to_cpu(spin.cpu) == -1)) {
+			handle_error("could not pin to the spin CPU");
+		}
+		std::cout << "Spinning";
+		if (spin.cpu >= 0) {
+			std::cout << " on CPU " << spin.cpu;
+		}
+		std::cout << ", back to select() after " << spin.idle_us << " us idle" << std::endl;
 	}
 
-	// TODO: build a chat client message of type MON_CONNECT
-	//       if a nickname was provided, include that in the message as well
-	struct ChatMonMsg *mon_connect;
-	mon_connect = (struct ChatMonMsg *) malloc(sizeof(ChatMonMsg));
-	memset(mon_connect, 0, sizeof(ChatMonMsg));
-	int mon_connect_size = 0;
-	int offset = 0;
-
-	mon_connect_size += sizeof(ChatMonMsg);
-
-	// TODO: send the MON_CONNECT message to the server
 	// Check if send worked, clean up and exit if not.
-	mon_connect->type = htons(MON_CONNECT);
-
 	if (nickname != nullptr) {
-		mon_connect->nickname_len = htons(strlen(nickname));
-		mon_connect_size += strlen(nickname);
-
-		memcpy(&send_buf[offset], mon_connect, sizeof(struct ChatMonMsg));
-		offset += sizeof(struct ChatMonMsg);
-		memcpy(&send_buf[offset], nickname, strlen(nickname));
-		ret = send(monitor_socket, send_buf, mon_connect_size, 0);
 		std::cout << "Sent nickname connect." << std::endl;
-	} else {
-		ret = send(monitor_socket, mon_connect, mon_connect_size, 0);
 	}
+	ret = send_mon_connect(monitor_socket, nickname, &session, compress_level, presence);
+	compress_pending = compress_level > 0;
+	presence_pending = presence;
 
-	if (ret <= 0) {
+	if (ret == -1) {
 		handle_error("Connect send to server failed.");
 		close(monitor_socket);
 		return 1;
 	}
 
 	std::cout << "Mon connect message sent." << std::endl;
+	last_send_us = monotonic_us();
+
+	if (archive_dir != nullptr) {
+		if (open_archive(&archive, archive_dir, nickname, segment_bytes, direct) == -1) {
+			handle_error("could not open the archive");
+			close(monitor_socket);
+			return 1;
+		}
+		std::cout << "Archiving to " << archive_dir << "/" << (archive.direct ? " with O_DIRECT" : "") << std::endl;
+	}
 
-	// Placeholder for messages received from the server
-	struct ChatMonMsg server_message;
 	// After sending the connect monitor message, the monitor will just
 	// sit and wait for messages to output.
 	while (stop == false) {
@@ -206,13 +716,39 @@ int main(int argc, char *argv[]) {
 		FD_SET(stdin_fd, &read_set);
 
 
-		select_timeout.tv_sec = 2;
-		select_timeout.tv_usec = 0;
-		ret = select(max_fds, &read_set, NULL, NULL, &select_timeout);
+		if (spin.enabled && spin_until_readable(monitor_socket, stdin_fd, &spin, &read_set)) {
+			metrics_add(metrics, ids.spin_wakeups, 1);
+		} else {
+			select_timeout.tv_sec = 2;
+			select_timeout.tv_usec = 0;
+			// Wake in time for the next heartbeat
+			if (heartbeat_ms > 0) {
+				uint64_t heartbeat_due_us = last_send_us + (uint64_t)heartbeat_ms * 1000;
+				uint64_t wait_us = heartbeat_due_us > monotonic_us() ? heartbeat_due_us - monotonic_us() : 0;
+				if (wait_us < 2000000) {
+					select_timeout.tv_sec = 0;
+					select_timeout.tv_usec = wait_us;
+				}
+			}
+			ret = select(max_fds, &read_set, NULL, NULL, &select_timeout);
 
-		if (ret < 0) {
-			perror("select");
-			break;
+			if (ret < 0) {
+				perror("select");
+				break;
+			}
+			if (spin.enabled && ret > 0) {
+				metrics_add(metrics, ids.blocking_wakeups, 1);
+			}
+			// A quiet spell is a good time to get the archive onto disk
+			if (ret == 0 && archive_dir != nullptr && archive_sync(&archive) == -1) {
+				handle_error("archive write failed");
+				break;
+			}
+		}
+
+		if (heartbeat_ms > 0 && monotonic_us() - last_send_us >= (uint64_t)heartbeat_ms * 1000) {
+			send_heartbeat(monitor_socket);
+			last_send_us = monotonic_us();
 		}
 
 		// TODO: receive messages from the server
@@ -221,63 +757,196 @@ int main(int argc, char *argv[]) {
 
 		if (FD_ISSET(monitor_socket, &read_set)) {
 
-			ret = recv(monitor_socket, recv_buf, 2047, 0);
-
+			// recvmsg rather than recv, for the receive timestamp
+			recv_iov.iov_base = &recv_buf[buffered];
+			recv_iov.iov_len = sizeof(recv_buf) - buffered;
+			memset(&recv_msg, 0, sizeof(recv_msg));
+			recv_msg.msg_iov = &recv_iov;
+			recv_msg.msg_iovlen = 1;
+			recv_msg.msg_control = recv_control;
+			recv_msg.msg_controllen = sizeof(recv_control);
+			ret = recvmsg(monitor_socket, &recv_msg, 0);
+			rx_ns = timestamps ? rx_timestamp(&recv_msg) : 0;
+			recv_ns = rx_ns != 0 || archive_dir == nullptr ? rx_ns : realtime_ns();
+			metrics_add(metrics, ids.recv_calls, 1);
+
+			if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+				continue;
+			}
 			if (ret <= 0) {
-				handle_error("recv failed for some reason");
+				metrics_add(metrics, ids.recv_errors, 1);
+				if (ret == 0) {
+					std::cerr << "Server closed the connection" << std::endl;
+				} else {
+					handle_error("recv failed for some reason");
+				}
+				if (!session.enabled) {
+					break;
+				}
+				// Whatever was half received is sent again after the resume
+				buffered = 0;
+				monitor_socket = reconnect(monitor_socket, ip_string, port_string, nickname, &session, compress_level,
+				                           presence, timestamps, &spin);
+				if (monitor_socket == -1) {
+					break;
+				}
+				compress_pending = compress_level > 0;
+				presence_pending = presence;
+				metrics_add(metrics, ids.reconnects, 1);
+				last_send_us = monotonic_us();
 				continue;
 			}
+			buffered += ret;
+			metrics_add(metrics, ids.bytes_in, ret);
+			metrics_record(metrics, ids.recv_bytes, ret);
+			messages = 0;
+
+			// Print every complete message; next_frame checks the nickname and
+			// data the header announces have actually arrived before we touch them.
+			// A MON_COMPRESSED is unpacked and the messages in it handled first.
+			int offset = 0;
+			for (;;) {
+				if (batch_offset < batch_len) {
+					frame_len = next_frame(&batch[batch_offset], batch_len - batch_offset, &frame);
+					if (frame_len == 0) {
+						handle_error("compressed batch ends part way through a message");
+						batch_len = 0;
+						stop = true;
+						break;
+					}
+					at = &batch[batch_offset];
+					batch_offset += frame_len;
+					in_batch = true;
+				} else {
+					frame_len = next_frame(&recv_buf[offset], buffered - offset, &frame);
+					if (frame_len == 0) {
+						break;
+					}
+					at = &recv_buf[offset];
+					offset += frame_len;
+					in_batch = false;
+				}
 
-			if (ret >= sizeof(struct ChatMonMsg)) {
-				memcpy(&server_message, recv_buf, sizeof(struct ChatMonMsg));
-				server_message.type = ntohs(server_message.type);
-				server_message.data_len = ntohs(server_message.data_len);
-				server_message.nickname_len = ntohs(server_message.nickname_len);
-
-				if (server_message.type == MON_MESSAGE) {
-
-					int offset = 0;
-					offset += sizeof(struct ChatMonMsg);
-					char *temp_data_buf = (char *) malloc(server_message.data_len + 1);
-					char *temp_name_buf = (char *) malloc(server_message.nickname_len + 1);
-					memset(temp_data_buf, 0, server_message.data_len);
-					memset(temp_name_buf, 0, server_message.nickname_len);
-					if (ret >= offset + server_message.nickname_len) {
-						memcpy(temp_name_buf, &recv_buf[offset], server_message.nickname_len);
-						recv_buf[server_message.nickname_len] = '\0';
-						offset += server_message.nickname_len;
-						std::cout << temp_name_buf << " said: ";
-						memcpy(temp_data_buf, &recv_buf[offset], server_message.data_len);
-						std::cout << temp_data_buf << std::endl;
+				if (frame.type == MON_COMPRESSED && !in_batch) {
+					decompress_start_ns = cpu_ns();
+					if (frame.flags & CHAT_BATCH_RESET) {
+						reset_lz_decoder(&decoder);
+					}
+					if (compress_level == 0) {
+						batch = nullptr;
+					} else if (frame.flags & CHAT_BATCH_STORED) {
+						batch = lz_store(&decoder, frame.data, frame.data_len);
+					} else {
+						batch = lz_decompress(&decoder, frame.data, frame.data_len, frame.raw_len);
+					}
+					if (batch == nullptr) {
+						// Everything after it depends on it
+						handle_error("could not decompress a batch of messages");
+						stop = true;
+						break;
 					}
+					batch_len = frame.flags & CHAT_BATCH_STORED ? frame.data_len : frame.raw_len;
+					batch_offset = 0;
+					metrics_add(metrics, ids.decompress_ns, cpu_ns() - decompress_start_ns);
+					metrics_add(metrics, ids.compressed_bytes, frame.data_len);
+					metrics_add(metrics, ids.decompressed_bytes, batch_len);
+					compressed_total += frame.data_len;
+					decompressed_total += batch_len;
+					continue;
 				}
-				if (server_message.type == MON_DIRECT_MESSAGE) {
-
-					int offset = 0;
-					offset += sizeof(struct ChatMonMsg);
-					char *temp_data_buf = (char *) malloc(server_message.data_len + 1);
-					char *temp_name_buf = (char *) malloc(server_message.nickname_len + 1);
-					memset(temp_data_buf, 0, server_message.data_len);
-					memset(temp_name_buf, 0, server_message.nickname_len);
-					if (ret >= offset + server_message.nickname_len) {
-						memcpy(temp_name_buf, &recv_buf[offset], server_message.nickname_len);
-						recv_buf[server_message.nickname_len] = '\0';
-						offset += server_message.nickname_len;
-						std::cout << "[DIRECT] " << temp_name_buf << " said: ";
-						memcpy(temp_data_buf, &recv_buf[offset], server_message.data_len);
-						std::cout << temp_data_buf << std::endl;
 
+				if (session.enabled && (frame.type == MON_MESSAGE || frame.type == MON_DIRECT_MESSAGE ||
+				                        frame.type == MON_TIMED_MESSAGE)) {
+					session.seen++;
+				}
+				if (archive_dir != nullptr && (frame.type == MON_MESSAGE || frame.type == MON_DIRECT_MESSAGE ||
+				                               frame.type == MON_TIMED_MESSAGE)) {
+					// Kept exactly as it arrived, with no formatting
+					metrics_add(metrics, ids.archived, 1);
+					if (archive_append(&archive, recv_ns, at, frame_len) == -1) {
+						handle_error("archive write failed");
+						stop = true;
+					}
+				} else if (frame.type == MON_MESSAGE) {
+					metrics_add(metrics, ids.messages, 1);
+					std::cout.write(frame.nickname, frame.nickname_len) << " said: ";
+					std::cout.write(frame.data, frame.data_len) << std::endl;
+				} else if (frame.type == MON_DIRECT_MESSAGE) {
+					metrics_add(metrics, ids.direct_messages, 1);
+					std::cout << "[DIRECT] ";
+					std::cout.write(frame.nickname, frame.nickname_len) << " said: ";
+					std::cout.write(frame.data, frame.data_len) << std::endl;
+				} else if (frame.type == MON_TIMED_MESSAGE) {
+					metrics_add(metrics, ids.messages, 1);
+					printed_ns = realtime_ns();
+					std::cout.write(frame.nickname, frame.nickname_len) << " said: ";
+					std::cout.write(frame.data, frame.data_len);
+					// Skip anything a clock step or unsynced sender made negative
+					if (printed_ns >= frame.send_ns) {
+						metrics_record(metrics, ids.delivery_ns, printed_ns - frame.send_ns);
+						std::cout << " (" << (printed_ns - frame.send_ns) / 1000 << " us";
+						if (rx_ns >= frame.send_ns && printed_ns >= rx_ns) {
+							metrics_record(metrics, ids.network_ns, rx_ns - frame.send_ns);
+							metrics_record(metrics, ids.local_ns, printed_ns - rx_ns);
+							std::cout << ", " << (rx_ns - frame.send_ns) / 1000 << " us to this host";
+						}
+						std::cout << ")";
 					}
+					std::cout << std::endl;
+				} else if (frame.type == MON_RESUME) {
+					if (frame.token == session.token) {
+						if (frame.seq > session.seen) {
+							metrics_add(metrics, ids.missed, frame.seq - session.seen);
+							std::cout << "Resumed, missed " << frame.seq - session.seen << " messages" << std::endl;
+						} else if (session.token != 0) {
+							std::cout << "Resumed" << std::endl;
+						}
+					} else if (session.token != 0) {
+						std::cout << "Session expired, messages since the connection dropped are lost" << std::endl;
+					}
+					session.token = frame.token;
+					session.seen = frame.seq;
+				} else if (frame.type == MON_COMPRESS && frame.data_len == 2) {
+					compress_pending = false;
+					if (frame.data[1] == 0) {
+						std::cout << "Server will not compress, carrying on without it" << std::endl;
+					} else {
+						std::cout << "Compressed at level " << (int)frame.data[1] << std::endl;
+					}
+				} else if (frame.type == MON_PRESENCE) {
+					presence_pending = false;
+					print_presence(&frame);
+				} else if (frame.type == UNKNOWN_TYPE && session.enabled && session.token == 0) {
+					// A server from before sessions
+					std::cout << "Server has no sessions, carrying on without them" << std::endl;
+					session.enabled = false;
+				} else if (frame.type == UNKNOWN_TYPE && compress_pending) {
+					// A server from before compression
+					std::cout << "Server cannot compress, carrying on without it" << std::endl;
+					compress_pending = false;
+				} else if (frame.type == UNKNOWN_TYPE && presence_pending) {
+					// A server from before presence
+					std::cout << "Server has no presence, carrying on without it" << std::endl;
+					presence_pending = false;
+				} else {
+					metrics_add(metrics, ids.other_messages, 1);
 				}
+				messages++;
 			}
+			metrics_record(metrics, ids.messages_per_recv, messages);
+			metrics_record(metrics, ids.buffered_bytes, buffered - offset);
+
+			// Keep any partial message for the next recv
+			memmove(recv_buf, &recv_buf[offset], buffered - offset);
+			buffered -= offset;
 		}
 			// TODO: read from stdin, in case the user types 'quit'
 			if (FD_ISSET(stdin_fd, &read_set)) {
 				std::cout << "Have data incoming on stdin" << std::endl;
-				ret = read(stdin_fd, recv_buf, 2047);
+				ret = read(stdin_fd, stdin_buf, sizeof(stdin_buf) - 1);
 				if (ret > 0) {
-					recv_buf[ret] = '\0';
-					if (strncmp(recv_buf, "quit", 6)) {
+					stdin_buf[ret] = '\0';
+					if (strncmp(stdin_buf, "quit", 6)) {
 						stop = true;
 					}
 				}
@@ -285,13 +954,9 @@ int main(int argc, char *argv[]) {
 		}
 
 	// TODO: build and send a MON_DISCONNECT message to let the server know this monitor has gone away
-	struct ChatMonMsg *mon_disconnect;
-	mon_disconnect= (struct ChatMonMsg*) malloc(sizeof(struct ChatMonMsg));
-	memset(mon_disconnect, 0, sizeof(struct ChatMonMsg));
+	struct ChatMonMsg mon_disconnect = {MON_DISCONNECT, 0, 0};
 
-	mon_disconnect->type = htons(MON_DISCONNECT);
-
-	ret = send(monitor_socket, mon_disconnect, sizeof(struct ChatMonMsg), 0);
+	ret = send(monitor_socket, send_buf, ChatMonCodec::encode(mon_disconnect, send_buf, sizeof(send_buf)), 0);
 
 	if (ret <= 0) {
 		perror("disconnect failed.");
@@ -300,6 +965,25 @@ int main(int argc, char *argv[]) {
 	std::cout << "Shut down message sent to server, exiting!\n";
 
 	close(monitor_socket);
+	if (archive_dir != nullptr) {
+		if (close_archive(&archive) == -1) {
+			handle_error("archive write failed");
+		}
+		std::cout << "Archived " << archive.records << " messages" << std::endl;
+	}
+	if (compress_level > 0) {
+		if (compressed_total > 0) {
+			std::cout << "Received " << decompressed_total << " bytes of messages in " << compressed_total
+			          << " compressed, " << (double)decompressed_total / compressed_total << " to 1" << std::endl;
+		}
+		free_lz_decoder(&decoder);
+	}
+	if (stats_server != nullptr) {
+		stop_stats_server(stats_server);
+		delete stats_server;
+	}
+	free_metrics_registry(registry);
+	delete registry;
 	return 0;
 
 }
@@ -0,0 +1,278 @@
+#include <iostream>
+#include <sys/socket.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <atomic>
+
+#include "chat_accept.h"
+#include "chat_federation.h"
+#include "chat_server.h"
+#include "tcp_utils.h"
+#include "metrics.h"
+
+std::atomic<bool> stop(false);
+
+// Handler for when ctrl+c is pressed.
+// Just set the global 'stop' to true to shut down the server.
+void handle_ctrl_c(int the_signal) {
+	stop.store(true);
+}
+
+/**
+ *
+ * Chat server. Reads in IP PORT [--stats SOCKET] [--max-send-kb KB] [--workers N]
+ *                        [--defer-accept SECONDS] [--history-kb KB] [--session-timeout SECONDS]
+ *                        [--idle-timeout SECONDS] [--user-timeout SECONDS]
+ *                        [--rate N] [--burst N] [--byte-rate KB] [--byte-burst KB] [--global-rate N]
+ *                        [--max-compress-level N] [--node ID] [--node-port PORT] [--peer HOST:PORT]...
+ *
+ * Relays chat messages from tcp_chat_client to every tcp_chat_monitor
+ * (see chat_server.h). Connections are kept small enough that a
+ * million idle ones fit in well under a gigabyte; the open file limit
+ * is raised as far as the process is allowed to.
+ *
+ * --max-send-kb is how far a monitor may fall behind before it is
+ * dropped (default 1MB).
+ *
+ * The main thread accepts connections and hands them to --workers
+ * worker threads (default 1). --defer-accept sets TCP_DEFER_ACCEPT
+ * (default 5 seconds, 0 turns it off).
+ *
+ * Sessions wait --session-timeout (default 30 seconds) for their peer
+ * to resume, and each monitor session keeps its last --history-kb of
+ * messages (default 64) to replay the gap from.
+ *
+ * A connection that sends nothing, not even a heartbeat, for
+ * --idle-timeout (default 60 seconds, 0 keeps idle connections) is
+ * reaped. --user-timeout (default 120 seconds, 0 turns it off) sets
+ * TCP_USER_TIMEOUT and keepalive, so the kernel also drops peers that
+ * have vanished, whether or not they heartbeat.
+ *
+ * Each client may send --rate messages a second (default 1000, 0 for
+ * no limit), --burst of them at once (default 2000), and --byte-rate
+ * KB a second (default 4096), --byte-burst KB at once (default 1024).
+ * --global-rate caps the messages a second taken from all clients
+ * together (default 0, no cap). Messages past a limit are dropped and
+ * the client gets a THROTTLED error.
+ *
+ * Monitors that ask get their messages compressed, at the level they
+ * ask for up to --max-compress-level (default 9, the highest; 0 turns
+ * compression off). The chat.compress_* metrics give the ratio and
+ * the CPU time it costs.
+ *
+ * With --node ID (nonzero, unique among them) servers federate (see
+ * chat_federation.h): each listens for other servers on --node-port,
+ * on the same IP as for clients, and links to every --peer, so
+ * messages reach monitors on any of them. Only one end of each link
+ * needs to name the other.
+ *
+ * e.g., ./tcpchatserver 127.0.0.1 8888
+ *       ./tcpchatserver 0.0.0.0 8888 --stats /tmp/tcpchatserver.stats --workers 4
+ *       ./tcpchatserver 0.0.0.0 8888 --node 2 --node-port 9888 --peer 10.0.0.1:9888
+ *
+ * @param argc count of arguments on the command line
+ * @param argv array of command line arguments
+ * @return 0 on success, non-zero if an error occurred
+ */
+int main(int argc, char *argv[]) {
+	// Alias for argv[1] for convenience
+	char *ip_string;
+	// Alias for argv[2] for convenience
+	char *port_string;
+
+	// The socket clients and monitors connect to
+	int listen_socket;
+	struct sockaddr_in listen_address;
+	// Variable used to check return codes from various functions
+	int ret;
+	int reuse = 1;
+	uint64_t fd_limit;
+
+	// Both live until exit, so the stats thread can outlast an early return
+	struct MetricsRegistry *registry = new MetricsRegistry;
+	struct StatsServer *stats_server = nullptr;
+	const char *stats_path = nullptr;
+	struct ChatWorkerGroup *workers = new ChatWorkerGroup();
+	struct ChatAcceptor acceptor;
+	struct ChatServerConfig config;
+	struct ChatFederationConfig federation_config;
+	struct ChatFederation *federation = nullptr;
+	int defer_accept = CHAT_DEFAULT_DEFER_ACCEPT;
+	uint32_t user_timeout_ms = CHAT_DEFAULT_USER_TIMEOUT_MS;
+
+	config.num_workers = 1;
+	config.max_send_chunks = CHAT_DEFAULT_MAX_SEND_CHUNKS;
+	config.max_history_bytes = CHAT_DEFAULT_HISTORY_BYTES;
+	config.session_timeout_ms = CHAT_DEFAULT_SESSION_TIMEOUT_MS;
+	config.idle_timeout_ms = CHAT_DEFAULT_IDLE_TIMEOUT_MS;
+	config.message_rate = CHAT_DEFAULT_MESSAGE_RATE;
+	config.message_burst = CHAT_DEFAULT_MESSAGE_BURST;
+	config.byte_rate = CHAT_DEFAULT_BYTE_RATE;
+	config.byte_burst = CHAT_DEFAULT_BYTE_BURST;
+	config.global_rate = 0;
+	config.max_compress_level = CHAT_LZ_MAX_LEVEL;
+	federation_config.node_id = 0;
+	federation_config.listen_port = nullptr;
+
+	// Note: this needs to be 3, because the program name counts as an argument!
+	if (argc < 3) {
+		std::cerr << "Please specify IP PORT as first two arguments, then optionally --stats SOCKET"
+		          << ", --max-send-kb KB, --workers N, --defer-accept SECONDS, --history-kb KB"
+		          << ", --session-timeout SECONDS, --idle-timeout SECONDS, --user-timeout SECONDS, --rate N, --burst N"
+		          << ", --byte-rate KB, --byte-burst KB, --global-rate N, --max-compress-level N, --node ID"
+		          << ", --node-port PORT and --peer HOST:PORT." << std::endl;
+		return 1;
+	}
+	// Set up variables "aliases"
+	ip_string = argv[1];
+	port_string = argv[2];
+	federation_config.listen_ip = ip_string;
+	for (int i = 3; i < argc; ++i) {
+		if ((strcmp(argv[i], "--stats") == 0) && (i + 1 < argc)) {
+			stats_path = argv[++i];
+		} else if ((strcmp(argv[i], "--max-send-kb") == 0) && (i + 1 < argc)) {
+			config.max_send_chunks = (uint32_t)(strtoul(argv[++i], nullptr, 10) * 1024 / CHAT_CHUNK_DATA) + 1;
+		} else if ((strcmp(argv[i], "--workers") == 0) && (i + 1 < argc)) {
+			config.num_workers = atoi(argv[++i]);
+		} else if ((strcmp(argv[i], "--defer-accept") == 0) && (i + 1 < argc)) {
+			defer_accept = atoi(argv[++i]);
+		} else if ((strcmp(argv[i], "--history-kb") == 0) && (i + 1 < argc)) {
+			config.max_history_bytes = (uint32_t)strtoul(argv[++i], nullptr, 10) * 1024;
+		} else if ((strcmp(argv[i], "--session-timeout") == 0) && (i + 1 < argc)) {
+			config.session_timeout_ms = (uint32_t)strtoul(argv[++i], nullptr, 10) * 1000;
+		} else if ((strcmp(argv[i], "--idle-timeout") == 0) && (i + 1 < argc)) {
+			config.idle_timeout_ms = (uint32_t)strtoul(argv[++i], nullptr, 10) * 1000;
+		} else if ((strcmp(argv[i], "--user-timeout") == 0) && (i + 1 < argc)) {
+			user_timeout_ms = (uint32_t)strtoul(argv[++i], nullptr, 10) * 1000;
+		} else if ((strcmp(argv[i], "--rate") == 0) && (i + 1 < argc)) {
+			config.message_rate = (uint32_t)strtoul(argv[++i], nullptr, 10);
+		} else if ((strcmp(argv[i], "--burst") == 0) && (i + 1 < argc)) {
+			config.message_burst = (uint32_t)strtoul(argv[++i], nullptr, 10);
+		} else if ((strcmp(argv[i], "--byte-rate") == 0) && (i + 1 < argc)) {
+			config.byte_rate = (uint32_t)strtoul(argv[++i], nullptr, 10) * 1024;
+		} else if ((strcmp(argv[i], "--byte-burst") == 0) && (i + 1 < argc)) {
+			config.byte_burst = (uint32_t)strtoul(argv[++i], nullptr, 10) * 1024;
+		} else if ((strcmp(argv[i], "--global-rate") == 0) && (i + 1 < argc)) {
+			config.global_rate = (uint32_t)strtoul(argv[++i], nullptr, 10);
+		} else if ((strcmp(argv[i], "--max-compress-level") == 0) && (i + 1 < argc)) {
+			config.max_compress_level = atoi(argv[++i]);
+			if (config.max_compress_level < 0 || config.max_compress_level > CHAT_LZ_MAX_LEVEL) {
+				std::cerr << "--max-compress-level must be 0 to " << CHAT_LZ_MAX_LEVEL << std::endl;
+				return 1;
+			}
+		} else if ((strcmp(argv[i], "--node") == 0) && (i + 1 < argc)) {
+			federation_config.node_id = (uint32_t)strtoul(argv[++i], nullptr, 10);
+		} else if ((strcmp(argv[i], "--node-port") == 0) && (i + 1 < argc)) {
+			federation_config.listen_port = argv[++i];
+		} else if ((strcmp(argv[i], "--peer") == 0) && (i + 1 < argc)) {
+			federation_config.peers.push_back(argv[++i]);
+		} else {
+			std::cerr << "Unknown option " << argv[i] << std::endl;
+			return 1;
+		}
+	}
+
+	if (federation_config.node_id == 0 &&
+	    (federation_config.listen_port != nullptr || !federation_config.peers.empty())) {
+		std::cerr << "--node-port and --peer need a nonzero --node ID" << std::endl;
+		return 1;
+	}
+
+	fd_limit = raise_fd_limit();
+	std::cout << "Open file limit " << fd_limit << std::endl;
+
+	struct sigaction ctrl_c_handler;
+	ctrl_c_handler.sa_handler = handle_ctrl_c;
+	sigemptyset(&ctrl_c_handler.sa_mask);
+	ctrl_c_handler.sa_flags = 0;
+	sigaction(SIGINT, &ctrl_c_handler, NULL);
+	sigaction(SIGTERM, &ctrl_c_handler, NULL);
+
+	if (convert_ip_port_to_sockaddr_in(ip_string, port_string, &listen_address) == -1) {
+		std::cerr << "Invalid IP/port " << ip_string << " " << port_string << std::endl;
+		return 1;
+	}
+
+	listen_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (listen_socket == -1) {
+		handle_error("socket");
+		return 1;
+	}
+	setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+	ret = bind(listen_socket, (struct sockaddr *) &listen_address, sizeof(listen_address));
+	if (ret == -1) {
+		handle_error("bind");
+		close(listen_socket);
+		return 1;
+	}
+	// The kernel caps this at net.core.somaxconn
+	ret = listen(listen_socket, 65535);
+	if (ret == -1) {
+		handle_error("listen");
+		close(listen_socket);
+		return 1;
+	}
+	if (defer_accept > 0 && enable_defer_accept(listen_socket, defer_accept) == -1) {
+		handle_error("TCP_DEFER_ACCEPT failed, accepting connections before they send anything");
+	}
+	if (user_timeout_ms > 0 && enable_keepalive(listen_socket, user_timeout_ms) == -1) {
+		handle_error("keepalive failed, leaving vanished peers to the idle timeout");
+	}
+
+	init_metrics_registry(registry);
+	if (init_chat_workers(workers, &config, registry) == -1 ||
+	    init_chat_acceptor(&acceptor, listen_socket, workers, registry) == -1) {
+		handle_error("could not set up the workers");
+		close(listen_socket);
+		return 1;
+	}
+	if (federation_config.node_id != 0) {
+		federation = new ChatFederation();
+		if (init_chat_federation(federation, &federation_config, workers, registry) == -1) {
+			handle_error("could not set up the federation");
+			close(listen_socket);
+			return 1;
+		}
+	}
+	if (stats_path != nullptr) {
+		stats_server = new StatsServer;
+		if (start_stats_server(stats_server, registry, stats_path) == -1) {
+			handle_error("could not create stats socket");
+			return 1;
+		}
+	}
+
+	std::cout << "Chat server listening on " << ip_string << ":" << port_string << " with " << config.num_workers
+	          << " workers" << std::endl;
+	if (federation != nullptr) {
+		std::cout << "Node " << federation_config.node_id << " linking to " << federation_config.peers.size()
+		          << " peers" << (federation_config.listen_port != nullptr ? " and listening on port " : "")
+		          << (federation_config.listen_port != nullptr ? federation_config.listen_port : "") << std::endl;
+	}
+	start_chat_workers(workers, &stop);
+	if (federation != nullptr) {
+		start_chat_federation(federation, &stop);
+	}
+	run_chat_acceptor(&acceptor, &stop);
+
+	// The federation wakes the workers, but the workers push to its rings until they stop
+	if (federation != nullptr) {
+		join_chat_federation(federation);
+	}
+	free_chat_workers(workers);
+	if (federation != nullptr) {
+		free_chat_federation(federation);
+	}
+	if (stats_server != nullptr) {
+		stop_stats_server(stats_server);
+	}
+	close(listen_socket);
+	return 0;
+}
@@ -1,9 +1,17 @@
 #include "tcp_utils.h"
 #include <arpa/inet.h>
+#include <netinet/in.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <iostream>
 
 /**
@@ -71,4 +79,162 @@ const char *printable_address(struct sockaddr_storage *client_addr, socklen_t cl
   strncpy(&print_buf[strlen(host_buf) + 1], port_buf, NI_MAXSERV);
 
   return print_buf;
-}
\ No newline at end of file
+}
+uint64_t realtime_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+int enable_software_timestamps(int tcp_socket, bool rx, bool tx) {
+  int flags = SOF_TIMESTAMPING_SOFTWARE;
+
+  if (rx) {
+    flags |= SOF_TIMESTAMPING_RX_SOFTWARE;
+  }
+  if (tx) {
+    // TSONLY: the error queue gets just the timestamp, not a copy of the data
+    flags |= SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+  }
+  return setsockopt(tcp_socket, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+}
+
+uint64_t rx_timestamp(struct msghdr *msg) {
+  struct cmsghdr *cmsg;
+  struct scm_timestamping stamps;
+
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_TIMESTAMPING)) {
+      memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+      // Software timestamps are in the first slot
+      return (uint64_t)stamps.ts[0].tv_sec * 1000000000ull + stamps.ts[0].tv_nsec;
+    }
+  }
+  return 0;
+}
+
+int read_tx_timestamp(int tcp_socket, uint64_t *tx_ns, uint32_t *last_byte) {
+  char control[256];
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct sock_extended_err err;
+  int ret;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ret = recvmsg(tcp_socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+  if (ret < 0) {
+    return -1;
+  }
+
+  *tx_ns = rx_timestamp(&msg);
+  *last_byte = 0;
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    // OPT_ID puts the stamped byte's offset in the extended error
+    if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+        (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+      memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+      if (err.ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+        *last_byte = err.ee_data;
+      }
+    }
+  }
+  return *tx_ns == 0 ? -1 : 0;
+}
+
+int enable_busy_poll(int tcp_socket, int usecs) {
+  if (setsockopt(tcp_socket, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) == -1) {
+    return -1;
+  }
+#ifdef SO_PREFER_BUSY_POLL
+  // Only a hint, and missing before Linux 5.11
+  int prefer = 1;
+  setsockopt(tcp_socket, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+#endif
+  return 0;
+}
+
+int pin_thread_to_cpu(int cpu) {
+  cpu_set_t target;
+
+  CPU_ZERO(&target);
+  CPU_SET(cpu, &target);
+  return sched_setaffinity(0, sizeof(target), &target);
+}
+
+uint64_t raise_fd_limit() {
+  struct rlimit limit;
+  unsigned long long nr_open = 0;
+  FILE *nr_open_file;
+
+  if (getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+    return 0;
+  }
+  nr_open_file = fopen("/proc/sys/fs/nr_open", "r");
+  if (nr_open_file != NULL) {
+    if (fscanf(nr_open_file, "%llu", &nr_open) != 1) {
+      nr_open = 0;
+    }
+    fclose(nr_open_file);
+  }
+
+  if (nr_open > limit.rlim_max) {
+    struct rlimit raised = {(rlim_t)nr_open, (rlim_t)nr_open};
+    if (setrlimit(RLIMIT_NOFILE, &raised) == 0) {
+      return nr_open;
+    }
+  }
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+  getrlimit(RLIMIT_NOFILE, &limit);
+  return limit.rlim_cur;
+}
+
+int connect_to_host(const char *host, const char *port) {
+  struct addrinfo hints;
+  struct addrinfo *results;
+  struct addrinfo *results_it;
+  int tcp_socket = -1;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &results) != 0) {
+    return -1;
+  }
+
+  for (results_it = results; results_it != NULL; results_it = results_it->ai_next) {
+    std::cout << "Attempting to connect to "
+              << printable_address((struct sockaddr_storage *)results_it->ai_addr, results_it->ai_addrlen)
+              << std::endl;
+    tcp_socket = socket(results_it->ai_family, results_it->ai_socktype, results_it->ai_protocol);
+    if (tcp_socket == -1) {
+      continue;
+    }
+    if (connect(tcp_socket, results_it->ai_addr, results_it->ai_addrlen) == 0) {
+      break;
+    }
+    handle_error("connect");
+    close(tcp_socket);
+    tcp_socket = -1;
+  }
+  freeaddrinfo(results);
+  return tcp_socket;
+}
+
+uint32_t reconnect_delay_ms(uint32_t attempt, uint32_t base_ms, uint32_t max_ms) {
+  static unsigned int seed = 0;
+  uint64_t delay = base_ms;
+
+  if (seed == 0) {
+    seed = (unsigned int)(realtime_ns() ^ ((uint64_t)getpid() << 16));
+  }
+  for (uint32_t i = 0; i < attempt && delay < max_ms; ++i) {
+    delay *= 2;
+  }
+  if (delay > max_ms) {
+    delay = max_ms;
+  }
+  return (uint32_t)(delay / 2 + (uint64_t)rand_r(&seed) % (delay / 2 + 1));
+}
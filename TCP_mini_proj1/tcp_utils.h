@@ -15,4 +15,92 @@ int convert_ip_port_to_sockaddr_in(char *ip_str, char *port_str, struct sockaddr
 
 const char *printable_address(struct sockaddr_storage *client_addr, socklen_t client_addr_len);
 
+/**
+ * Nanoseconds from CLOCK_REALTIME, the clock SO_TIMESTAMPING software
+ * timestamps are taken from.
+ */
+uint64_t realtime_ns();
+
+/**
+ * Turn on SO_TIMESTAMPING software timestamps.
+ *
+ * @param tcp_socket the socket
+ * @param rx stamp data as it arrives, read back with rx_timestamp()
+ * @param tx stamp data as it leaves, read back with read_tx_timestamp()
+ * @return 0 on success, -1 if the kernel refused
+ */
+int enable_software_timestamps(int tcp_socket, bool rx, bool tx);
+
+/**
+ * Find the receive timestamp in the control data of a recvmsg() on a
+ * socket with rx timestamps on. On TCP this is when the most recent
+ * segment read by the call arrived.
+ *
+ * @param msg the msghdr recvmsg() filled in
+ * @return the timestamp in realtime_ns() terms, or 0 if there was none
+ */
+uint64_t rx_timestamp(struct msghdr *msg);
+
+/**
+ * Read the next transmit timestamp off the socket's error queue,
+ * without blocking.
+ *
+ * @param tcp_socket socket with tx timestamps on
+ * @param tx_ns set to when the kernel handed the data to the device
+ * @param last_byte set to the stream offset (counted from when tx
+ *        timestamps were turned on) of the last byte of the send stamped
+ * @return 0 if a timestamp was read, -1 if none is queued yet
+ */
+int read_tx_timestamp(int tcp_socket, uint64_t *tx_ns, uint32_t *last_byte);
+
+/**
+ * Ask the kernel to busy poll the device queue for this socket's data
+ * (SO_BUSY_POLL) instead of waiting for an interrupt, and to keep
+ * interrupts deferred while the application is polling
+ * (SO_PREFER_BUSY_POLL, where the kernel has it).
+ *
+ * @param tcp_socket the socket
+ * @param usecs how long each receive may busy poll for
+ * @return 0 on success, -1 if SO_BUSY_POLL was refused (raising it
+ *         above net.core.busy_read needs CAP_NET_ADMIN)
+ */
+int enable_busy_poll(int tcp_socket, int usecs);
+
+/**
+ * Pin the calling thread to one CPU, ideally one kept free of other
+ * work with isolcpus.
+ *
+ * @return 0 on success, -1 if the CPU is not allowed
+ */
+int pin_thread_to_cpu(int cpu);
+
+/**
+ * Raise the open file limit as far as this process may: to
+ * fs.nr_open if it can raise the hard limit (root), otherwise to the
+ * hard limit. A million connections need a million descriptors.
+ *
+ * @return the soft limit now in force
+ */
+uint64_t raise_fd_limit();
+
+// Default reconnect backoff: the first wait, and the most it grows to
+#define RECONNECT_BASE_MS 100
+#define RECONNECT_MAX_MS 10000
+
+/**
+ * Connect a TCP socket to host:port, trying each IPv4 address the
+ * name resolves to in turn.
+ *
+ * @return the connected socket, or -1 if none of them worked
+ */
+int connect_to_host(const char *host, const char *port);
+
+/**
+ * How long to wait before reconnect attempt number attempt (counting
+ * from 0): base_ms doubled each attempt up to max_ms, then a random
+ * point in the upper half of that, so that peers dropped together do
+ * not all come back in the same instant.
+ */
+uint32_t reconnect_delay_ms(uint32_t attempt, uint32_t base_ms, uint32_t max_ms);
+
 #endif //IN_CLASS_UDP_EXAMPLE_UDP_UTILS_H
\ No newline at end of file
@@ -0,0 +1,304 @@
+//
+// Compile time generated encoders/decoders for the packed protocol
+// structs. Each message is described once as a list of its fields in
+// wire order; the description generates bounds checked encode/decode
+// functions (with the network byte order swaps) and zero-copy views
+// that read single fields straight out of a receive buffer.
+//
+// e.g.,
+//   using GetGameCodec = wire::Codec<GetGameMessage,
+//                                    wire::Nested<&GetGameMessage::hdr, TTTMessageCodec>,
+//                                    wire::Field<&GetGameMessage::client_id>>;
+//
+//   struct GetGameMessage request;
+//   if (GetGameCodec::decode(recv_buf, recv_len, request)) { /* host order */ }
+//
+
+#ifndef WIRE_CODEC_H
+#define WIRE_CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+#include <tuple>
+
+namespace wire {
+
+/**
+ * Read a big endian integer from p, which need not be aligned.
+ */
+template <typename T>
+inline T load_be(const uint8_t *p) {
+  static_assert(std::is_integral<T>::value, "wire fields must be integers");
+  T value;
+  memcpy(&value, p, sizeof(T));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  if constexpr (sizeof(T) == 2) {
+    value = (T)__builtin_bswap16((uint16_t)value);
+  } else if constexpr (sizeof(T) == 4) {
+    value = (T)__builtin_bswap32((uint32_t)value);
+  } else if constexpr (sizeof(T) == 8) {
+    value = (T)__builtin_bswap64((uint64_t)value);
+  }
+#endif
+  return value;
+}
+
+/**
+ * Write value to p as a big endian integer, p need not be aligned.
+ */
+template <typename T>
+inline void store_be(uint8_t *p, T value) {
+  static_assert(std::is_integral<T>::value, "wire fields must be integers");
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  if constexpr (sizeof(T) == 2) {
+    value = (T)__builtin_bswap16((uint16_t)value);
+  } else if constexpr (sizeof(T) == 4) {
+    value = (T)__builtin_bswap32((uint32_t)value);
+  } else if constexpr (sizeof(T) == 8) {
+    value = (T)__builtin_bswap64((uint64_t)value);
+  }
+#endif
+  memcpy(p, &value, sizeof(T));
+}
+
+/**
+ * True if two member pointers (possibly of different types) are the
+ * same member.
+ */
+template <auto A, auto B>
+constexpr bool same_member() {
+  if constexpr (std::is_same<decltype(A), decltype(B)>::value) {
+    return A == B;
+  } else {
+    return false;
+  }
+}
+
+/**
+ * An integer member, sent in network byte order.
+ */
+template <auto Member>
+struct Field;
+
+template <typename S, typename T, T S::*Member>
+struct Field<Member> {
+  using value_type = T;
+  static constexpr size_t size = sizeof(T);
+
+  static void decode(const uint8_t *p, S &s) { s.*Member = load_be<T>(p); }
+  static void encode(const S &s, uint8_t *p) { store_be<T>(p, s.*Member); }
+  static size_t payload(const S &) { return 0; }
+  template <auto M>
+  static constexpr bool matches() { return same_member<M, Member>(); }
+};
+
+/**
+ * An integer member giving the length of data that follows the fixed
+ * part of the message (a nickname or message text). Decoded like a
+ * Field, and also counted by Codec::decode_frame's bounds check.
+ */
+template <auto Member>
+struct Length : Field<Member> {
+  template <typename S>
+  static size_t payload(const S &s) { return s.*Member; }
+};
+
+/**
+ * A fixed size byte array member, copied as is.
+ */
+template <auto Member>
+struct Bytes;
+
+template <typename S, typename T, size_t N, T (S::*Member)[N]>
+struct Bytes<Member> {
+  static_assert(sizeof(T) == 1, "Bytes fields must be byte arrays");
+  using value_type = const uint8_t *;
+  static constexpr size_t size = N;
+
+  static void decode(const uint8_t *p, S &s) { memcpy(s.*Member, p, N); }
+  static void encode(const S &s, uint8_t *p) { memcpy(p, s.*Member, N); }
+  static size_t payload(const S &) { return 0; }
+  template <auto M>
+  static constexpr bool matches() { return same_member<M, Member>(); }
+};
+
+/**
+ * A struct member (such as every message's TTTMessage hdr) that has
+ * its own codec.
+ */
+template <auto Member, typename SubCodec>
+struct Nested;
+
+template <typename S, typename T, T S::*Member, typename SubCodec>
+struct Nested<Member, SubCodec> {
+  using codec = SubCodec;
+  static constexpr size_t size = SubCodec::wire_size;
+
+  static void decode(const uint8_t *p, S &s) { SubCodec::decode_unchecked(p, s.*Member); }
+  static void encode(const S &s, uint8_t *p) { SubCodec::encode_unchecked(s.*Member, p); }
+  static size_t payload(const S &s) { return SubCodec::payload_size(s.*Member); }
+  template <auto M>
+  static constexpr bool matches() { return same_member<M, Member>(); }
+};
+
+/**
+ * The wire format of struct S: Fields in the order they are sent.
+ * Everything here is resolved at compile time; encode and decode
+ * compile down to straight line loads, swaps and stores.
+ */
+template <typename S, typename... Fields>
+struct Codec {
+  using struct_type = S;
+  static constexpr size_t wire_size = (Fields::size + ... + 0);
+  static constexpr size_t num_fields = sizeof...(Fields);
+
+  template <size_t I>
+  using field = typename std::tuple_element<I, std::tuple<Fields...> >::type;
+
+  /**
+   * Index in Fields of the field describing Member.
+   */
+  template <auto Member>
+  static constexpr size_t index_of() {
+    constexpr bool matches[] = {Fields::template matches<Member>()...};
+    for (size_t i = 0; i < sizeof...(Fields); ++i) {
+      if (matches[i]) {
+        return i;
+      }
+    }
+    return sizeof...(Fields);
+  }
+
+  /**
+   * Byte offset on the wire of the I'th field.
+   */
+  template <size_t I>
+  static constexpr size_t offset_of() {
+    constexpr size_t sizes[] = {Fields::size...};
+    size_t offset = 0;
+    for (size_t i = 0; i < I; ++i) {
+      offset += sizes[i];
+    }
+    return offset;
+  }
+
+  static void decode_unchecked(const uint8_t *p, S &out) {
+    size_t offset = 0;
+    ((Fields::decode(p + offset, out), offset += Fields::size), ...);
+  }
+
+  static void encode_unchecked(const S &in, uint8_t *p) {
+    size_t offset = 0;
+    ((Fields::encode(in, p + offset), offset += Fields::size), ...);
+  }
+
+  /**
+   * Decode the fixed part of a message into host byte order.
+   *
+   * @return false if len is too short to hold the message
+   */
+  static bool decode(const void *buf, size_t len, S &out) {
+    if (len < wire_size) {
+      return false;
+    }
+    decode_unchecked(static_cast<const uint8_t *>(buf), out);
+    return true;
+  }
+
+  /**
+   * Decode a message and check that the variable length data its
+   * Length fields announce has also arrived.
+   *
+   * @return false if len is too short for the message plus its data
+   */
+  static bool decode_frame(const void *buf, size_t len, S &out) {
+    return decode(buf, len, out) && (len - wire_size >= payload_size(out));
+  }
+
+  /**
+   * Encode a message given in host byte order.
+   *
+   * @return bytes written, or 0 if cap is too small
+   */
+  static size_t encode(const S &in, void *buf, size_t cap) {
+    if (cap < wire_size) {
+      return 0;
+    }
+    encode_unchecked(in, static_cast<uint8_t *>(buf));
+    return wire_size;
+  }
+
+  /**
+   * Total length of the data announced by the Length fields.
+   */
+  static size_t payload_size(const S &s) {
+    return (Fields::payload(s) + ... + (size_t)0);
+  }
+};
+
+/**
+ * Read-only view of a message still sitting in a receive buffer.
+ * Fields are read (and byte swapped) on access, nothing is copied.
+ */
+template <typename C>
+class View {
+ public:
+  /**
+   * View the start of buf as a C message.
+   *
+   * @return a view that tests false if len is too short
+   */
+  static View over(const void *buf, size_t len) {
+    return View(len >= C::wire_size ? static_cast<const uint8_t *>(buf) : nullptr);
+  }
+
+  explicit operator bool() const { return p_ != nullptr; }
+
+  /**
+   * Value of an integer member, in host byte order.
+   */
+  template <auto Member>
+  auto get() const {
+    constexpr size_t index = C::template index_of<Member>();
+    static_assert(index < C::num_fields, "member is not part of this message");
+    using F = typename C::template field<index>;
+    return load_be<typename F::value_type>(p_ + C::template offset_of<index>());
+  }
+
+  /**
+   * View of a Nested member.
+   */
+  template <auto Member>
+  auto sub() const {
+    constexpr size_t index = C::template index_of<Member>();
+    static_assert(index < C::num_fields, "member is not part of this message");
+    using F = typename C::template field<index>;
+    return View<typename F::codec>(p_ + C::template offset_of<index>());
+  }
+
+  /**
+   * Pointer to a Bytes member inside the buffer.
+   */
+  template <auto Member>
+  const uint8_t *bytes() const {
+    constexpr size_t index = C::template index_of<Member>();
+    static_assert(index < C::num_fields, "member is not part of this message");
+    return p_ + C::template offset_of<index>();
+  }
+
+  /**
+   * Start of the variable length data following the fixed part.
+   */
+  const char *payload() const { return reinterpret_cast<const char *>(p_ + C::wire_size); }
+
+  explicit View(const uint8_t *p) : p_(p) {}
+
+ private:
+  const uint8_t *p_;
+};
+
+}  // namespace wire
+
+#endif //WIRE_CODEC_H
@@ -0,0 +1,148 @@
+#include "board_gen.h"
+#include <stdlib.h>
+#include <vector>
+
+/**
+ * Every board a client can be handed, by ResultType.
+ */
+struct BoardTables {
+  std::vector<uint32_t> boards[NUM_RESULT_TYPES];
+};
+
+static uint32_t pack_board(uint16_t x_positions, uint16_t o_positions) {
+  return (uint32_t)x_positions | ((uint32_t)o_positions << 16);
+}
+
+/**
+ * Walk every game from the empty board, X moving first, stopping at a
+ * win or a full board. Boards still in play count as CATS_GAME, the
+ * answer board_result() expects for a board without a winner.
+ */
+static void add_reachable(struct BoardTables *tables, std::vector<bool> &seen, uint16_t x_positions,
+                          uint16_t o_positions, bool x_to_move) {
+  uint32_t key = x_positions | ((uint32_t)o_positions << 9);
+  ResultType result;
+
+  if (seen[key]) {
+    return;
+  }
+  seen[key] = true;
+  result = board_result(x_positions, o_positions);
+  tables->boards[result - X_WIN].push_back(pack_board(x_positions, o_positions));
+  if (result != CATS_GAME) {
+    return;
+  }
+
+  for (int i = 0; i < 9; ++i) {
+    uint16_t bit = 1 << i;
+    if ((x_positions | o_positions) & bit) {
+      continue;
+    }
+    if (x_to_move) {
+      add_reachable(tables, seen, x_positions | bit, o_positions, false);
+    } else {
+      add_reachable(tables, seen, x_positions, o_positions | bit, true);
+    }
+  }
+}
+
+static struct BoardTables *build_board_tables() {
+  struct BoardTables *tables = new BoardTables;
+  std::vector<bool> seen(1 << 18, false);
+
+  add_reachable(tables, seen, 0, 0, true);
+
+  // Deliberately invalid: X and O sharing a square, or both winning
+  for (uint32_t x_positions = 0; x_positions < 512; ++x_positions) {
+    for (uint32_t o_positions = 0; o_positions < 512; ++o_positions) {
+      if (board_result(x_positions, o_positions) == INVALID_BOARD) {
+        tables->boards[INVALID_BOARD - X_WIN].push_back(pack_board(x_positions, o_positions));
+      }
+    }
+  }
+  return tables;
+}
+
+static const struct BoardTables *board_tables() {
+  // Built on first use; the C++ runtime makes this safe across threads
+  static const struct BoardTables *tables = build_board_tables();
+  return tables;
+}
+
+void seed_board_rng(struct BoardRng *rng, uint64_t seed) {
+  // splitmix64 spreads the seed over the state, never all zero
+  for (int i = 0; i < 4; ++i) {
+    uint64_t z = (seed += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    rng->s[i] = z ^ (z >> 31);
+  }
+}
+
+int parse_board_mix(const char *text, struct BoardMix *mix) {
+  uint32_t total = 0;
+  char *end;
+
+  for (int i = 0; i < NUM_RESULT_TYPES; ++i) {
+    mix->weight[i] = strtoul(text, &end, 10);
+    if (end == text || (i < NUM_RESULT_TYPES - 1 && *end != ',') || (i == NUM_RESULT_TYPES - 1 && *end != '\0')) {
+      return -1;
+    }
+    total += mix->weight[i];
+    text = end + 1;
+  }
+  return total == 0 ? -1 : 0;
+}
+
+uint32_t board_table_size(ResultType result) {
+  return board_tables()->boards[result - X_WIN].size();
+}
+
+int init_board_picker(struct BoardPicker *picker, const struct BoardMix *mix, uint64_t seed) {
+  const struct BoardTables *tables = board_tables();
+  uint64_t total = 0;
+  uint32_t slots[NUM_RESULT_TYPES];
+  bool rounded_up[NUM_RESULT_TYPES] = {false, false, false, false};
+  uint32_t assigned = 0;
+  int slot = 0;
+
+  for (int i = 0; i < NUM_RESULT_TYPES; ++i) {
+    total += mix->weight[i];
+    picker->boards[i] = tables->boards[i].data();
+    picker->counts[i] = tables->boards[i].size();
+  }
+  if (total == 0) {
+    return -1;
+  }
+
+  // Largest remainder rounding of the weights onto the slots
+  for (int i = 0; i < NUM_RESULT_TYPES; ++i) {
+    slots[i] = (uint32_t)((uint64_t)mix->weight[i] * BOARD_MIX_SLOTS / total);
+    assigned += slots[i];
+  }
+  while (assigned < BOARD_MIX_SLOTS) {
+    int best = -1;
+    uint64_t best_remainder = 0;
+    for (int i = 0; i < NUM_RESULT_TYPES; ++i) {
+      if (rounded_up[i]) {
+        continue;
+      }
+      uint64_t remainder = (uint64_t)mix->weight[i] * BOARD_MIX_SLOTS - (uint64_t)slots[i] * total;
+      if (best == -1 || remainder > best_remainder) {
+        best = i;
+        best_remainder = remainder;
+      }
+    }
+    slots[best]++;
+    rounded_up[best] = true;
+    assigned++;
+  }
+
+  for (int i = 0; i < NUM_RESULT_TYPES; ++i) {
+    for (uint32_t j = 0; j < slots[i]; ++j) {
+      picker->slot_type[slot++] = (uint8_t)i;
+    }
+  }
+  seed_board_rng(&picker->rng, seed);
+  return 0;
+}
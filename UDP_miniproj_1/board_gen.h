@@ -0,0 +1,109 @@
+//
+// Precomputed board tables for handing out games with a chosen mix of
+// answers. Every reachable board and every invalid board (in the
+// x_positions/o_positions bit layout of tictactoe.h) is enumerated
+// once, filed under its ResultType, and boards are then drawn with a
+// per-thread xoshiro256** generator in constant time.
+//
+
+#ifndef IN_CLASS_UDP_EXAMPLE_BOARD_GEN_H
+#define IN_CLASS_UDP_EXAMPLE_BOARD_GEN_H
+
+#include <stdint.h>
+
+#include "tictactoe.h"
+
+// Resolution of a BoardMix: the result type is picked from this many
+// slots, so weights are honoured to within 1/256
+#define BOARD_MIX_SLOTS 256
+
+// Number of ResultType values, X_WIN through INVALID_BOARD
+#define NUM_RESULT_TYPES 4
+
+/**
+ * xoshiro256** state. Not thread safe; each thread keeps its own.
+ */
+struct BoardRng {
+  uint64_t s[4];
+};
+
+/**
+ * Relative weight of each ResultType among the boards handed out,
+ * indexed by result - X_WIN. e.g., {30, 30, 30, 10}.
+ */
+struct BoardMix {
+  uint32_t weight[NUM_RESULT_TYPES];
+};
+
+/**
+ * Draws boards for one thread. The tables it points at are shared and
+ * never change once built.
+ */
+struct BoardPicker {
+  /* index into boards/counts for each mix slot */
+  uint8_t slot_type[BOARD_MIX_SLOTS];
+  /* boards packed as x_positions | o_positions << 16 */
+  const uint32_t *boards[NUM_RESULT_TYPES];
+  uint32_t counts[NUM_RESULT_TYPES];
+  struct BoardRng rng;
+};
+
+/**
+ * Seed a generator; any seed (including 0) gives a usable state.
+ */
+void seed_board_rng(struct BoardRng *rng, uint64_t seed);
+
+static inline uint64_t board_rng_next(struct BoardRng *rng) {
+  uint64_t *s = rng->s;
+  uint64_t x = s[1] * 5;
+  uint64_t result = ((x << 7) | (x >> 57)) * 9;
+  uint64_t t = s[1] << 17;
+
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = (s[3] << 45) | (s[3] >> 19);
+  return result;
+}
+
+/**
+ * Parse a mix given as "X,O,CATS,INVALID" weights, e.g. "30,30,30,10".
+ *
+ * @return 0 on success, -1 if the string is malformed or all weights are 0
+ */
+int parse_board_mix(const char *text, struct BoardMix *mix);
+
+/**
+ * Number of boards of a result type in the shared tables, building
+ * them first if this is the first use.
+ */
+uint32_t board_table_size(ResultType result);
+
+/**
+ * Set up a picker for one thread. The first call also builds the
+ * shared tables (a few milliseconds); it is safe from several threads.
+ *
+ * @param picker the picker to set up
+ * @param mix share of each result type to hand out
+ * @param seed seed for this thread's generator
+ * @return 0 on success, -1 if every weight is 0
+ */
+int init_board_picker(struct BoardPicker *picker, const struct BoardMix *mix, uint64_t seed);
+
+/**
+ * Draw a board: one generator step, one mix slot, one table read.
+ */
+static inline void pick_board(struct BoardPicker *picker, uint16_t *x_positions, uint16_t *o_positions) {
+  uint64_t bits = board_rng_next(&picker->rng);
+  int type = picker->slot_type[bits & (BOARD_MIX_SLOTS - 1)];
+  // Scale the high 32 bits onto the table (multiply-shift, no division)
+  uint32_t index = (uint32_t)(((bits >> 32) * picker->counts[type]) >> 32);
+  uint32_t board = picker->boards[type][index];
+
+  *x_positions = (uint16_t)board;
+  *o_positions = (uint16_t)(board >> 16);
+}
+
+#endif //IN_CLASS_UDP_EXAMPLE_BOARD_GEN_H
@@ -0,0 +1,281 @@
+#include "game_sessions.h"
+#include <stdlib.h>
+#include <string.h>
+
+static uint32_t session_hash(const struct SessionTable *table, uint32_t addr, uint16_t port, uint16_t game_id) {
+  uint64_t k = ((uint64_t)addr << 32) | ((uint64_t)port << 16) | game_id;
+
+  // murmur3 finalizer, then map onto [0, capacity) without a modulo
+  k ^= table->seed;
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return (uint32_t)(((k & 0xFFFFFFFFu) * table->capacity) >> 32);
+}
+
+static inline uint32_t next_index(const struct SessionTable *table, uint32_t index) {
+  return (index + 1 == table->capacity) ? 0 : index + 1;
+}
+
+static uint32_t *wheel_head(struct SessionTable *table, uint16_t wheel_slot) {
+  return &table->wheel[wheel_slot >> WHEEL_BITS][wheel_slot & (WHEEL_SLOTS - 1)];
+}
+
+/**
+ * Put an entry into the timer wheel slot for its expiry tick.
+ */
+static void wheel_link(struct SessionTable *table, uint32_t index) {
+  struct GameSession *entry = &table->entries[index];
+  uint32_t expires = entry->expires;
+  uint32_t delta;
+  uint32_t *head;
+  int level;
+
+  if ((int32_t)(expires - table->now_tick) < 0) {
+    expires = table->now_tick;
+  }
+  delta = expires - table->now_tick;
+
+  if (delta >= (1u << (WHEEL_BITS * WHEEL_LEVELS))) {
+    delta = (1u << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    expires = table->now_tick + delta;
+  }
+
+  for (level = 0; level < WHEEL_LEVELS - 1; ++level) {
+    if (delta < (1u << (WHEEL_BITS * (level + 1)))) {
+      break;
+    }
+  }
+
+  entry->wheel_slot = (uint16_t)((level << WHEEL_BITS) | ((expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)));
+  head = wheel_head(table, entry->wheel_slot);
+  entry->wheel_prev = SESSION_NIL;
+  entry->wheel_next = *head;
+  if (*head != SESSION_NIL) {
+    table->entries[*head].wheel_prev = index;
+  }
+  *head = index;
+}
+
+static void wheel_unlink(struct SessionTable *table, uint32_t index) {
+  struct GameSession *entry = &table->entries[index];
+
+  if (entry->wheel_prev != SESSION_NIL) {
+    table->entries[entry->wheel_prev].wheel_next = entry->wheel_next;
+  } else {
+    *wheel_head(table, entry->wheel_slot) = entry->wheel_next;
+  }
+  if (entry->wheel_next != SESSION_NIL) {
+    table->entries[entry->wheel_next].wheel_prev = entry->wheel_prev;
+  }
+}
+
+/**
+ * Remove the entry at index, shifting later entries of the probe
+ * sequence back so lookups never need tombstones. Entries that move
+ * have their wheel neighbours pointed at their new index.
+ */
+static void remove_at(struct SessionTable *table, uint32_t index) {
+  struct GameSession *entries = table->entries;
+  uint32_t hole = index;
+  uint32_t j = index;
+
+  wheel_unlink(table, index);
+
+  for (;;) {
+    j = next_index(table, j);
+    if (entries[j].expires == 0) {
+      break;
+    }
+
+    // Leave entries whose home lies cyclically in (hole, j]
+    uint32_t home = entries[j].home;
+    bool stays = (hole <= j) ? (home > hole && home <= j) : (home > hole || home <= j);
+    if (stays) {
+      continue;
+    }
+
+    entries[hole] = entries[j];
+    if (entries[hole].wheel_prev != SESSION_NIL) {
+      entries[entries[hole].wheel_prev].wheel_next = hole;
+    } else {
+      *wheel_head(table, entries[hole].wheel_slot) = hole;
+    }
+    if (entries[hole].wheel_next != SESSION_NIL) {
+      entries[entries[hole].wheel_next].wheel_prev = hole;
+    }
+    hole = j;
+  }
+
+  memset(&entries[hole], 0, sizeof(struct GameSession));
+  table->count--;
+}
+
+/**
+ * Evict the session that would expire soonest. Only called when the
+ * table is full; scans at most WHEEL_LEVELS * WHEEL_SLOTS list heads.
+ */
+static void evict_soonest(struct SessionTable *table) {
+  for (int level = 0; level < WHEEL_LEVELS; ++level) {
+    uint32_t start = (table->now_tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    for (int i = 0; i < WHEEL_SLOTS; ++i) {
+      uint32_t head = table->wheel[level][(start + i) & (WHEEL_SLOTS - 1)];
+      if (head != SESSION_NIL) {
+        remove_at(table, head);
+        table->evicted++;
+        return;
+      }
+    }
+  }
+}
+
+int init_session_table(struct SessionTable *table, uint32_t max_sessions, uint32_t ttl_ms, uint64_t now_ms) {
+  memset(table, 0, sizeof(struct SessionTable));
+
+  if (max_sessions == 0) {
+    return -1;
+  }
+
+  // Keep the load factor at or below 7/8 so linear probes stay short
+  table->capacity = max_sessions + max_sessions / 7 + 1;
+  table->max_sessions = max_sessions;
+  table->ttl_ticks = (ttl_ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+  if (table->ttl_ticks == 0) {
+    table->ttl_ticks = 1;
+  }
+  // Tick 0 marks empty entries, so time starts at tick 1
+  table->now_tick = 1;
+  table->start_ms = now_ms;
+  table->seed = (uint32_t)(uintptr_t)table ^ (uint32_t)now_ms;
+
+  // calloc'd pages are only backed by memory once they are written to
+  table->entries = (struct GameSession *)calloc(table->capacity, sizeof(struct GameSession));
+  if (table->entries == nullptr) {
+    return -1;
+  }
+
+  memset(table->wheel, 0xFF, sizeof(table->wheel));
+  return 0;
+}
+
+void free_session_table(struct SessionTable *table) {
+  free(table->entries);
+  table->entries = nullptr;
+  table->capacity = 0;
+  table->count = 0;
+}
+
+size_t session_table_memory(const struct SessionTable *table) {
+  return sizeof(struct SessionTable) + (size_t)table->capacity * sizeof(struct GameSession);
+}
+
+struct GameSession *session_find(struct SessionTable *table, uint32_t addr, uint16_t port, uint16_t game_id) {
+  uint32_t index = session_hash(table, addr, port, game_id);
+  struct GameSession *entry;
+
+  for (;;) {
+    entry = &table->entries[index];
+    if (entry->expires == 0) {
+      return nullptr;
+    }
+    if (entry->game_id == game_id && entry->addr == addr && entry->port == port) {
+      return entry;
+    }
+    index = next_index(table, index);
+  }
+}
+
+struct GameSession *session_insert(struct SessionTable *table, uint32_t addr, uint16_t port, uint16_t game_id,
+                                   uint16_t client_id, uint16_t x_positions, uint16_t o_positions) {
+  struct GameSession *entry;
+  uint32_t home;
+  uint32_t index;
+
+  entry = session_find(table, addr, port, game_id);
+  if (entry != nullptr) {
+    index = (uint32_t)(entry - table->entries);
+    wheel_unlink(table, index);
+  } else {
+    if (table->count >= table->max_sessions) {
+      evict_soonest(table);
+    }
+
+    home = session_hash(table, addr, port, game_id);
+    index = home;
+    while (table->entries[index].expires != 0) {
+      index = next_index(table, index);
+    }
+
+    entry = &table->entries[index];
+    entry->addr = addr;
+    entry->port = port;
+    entry->game_id = game_id;
+    entry->home = home;
+    table->count++;
+  }
+
+  entry->client_id = client_id;
+  entry->x_positions = x_positions;
+  entry->o_positions = o_positions;
+  entry->expires = table->now_tick + table->ttl_ticks;
+  wheel_link(table, index);
+  return entry;
+}
+
+void session_remove(struct SessionTable *table, struct GameSession *session) {
+  remove_at(table, (uint32_t)(session - table->entries));
+}
+
+/**
+ * Move every entry of a higher level wheel slot down to the slot that
+ * now matches its remaining time.
+ *
+ * @return the slot index that was cascaded
+ */
+static uint32_t cascade(struct SessionTable *table, int level) {
+  uint32_t slot = (table->now_tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+  uint32_t index = table->wheel[level][slot];
+
+  table->wheel[level][slot] = SESSION_NIL;
+  while (index != SESSION_NIL) {
+    uint32_t next = table->entries[index].wheel_next;
+    wheel_link(table, index);
+    index = next;
+  }
+  return slot;
+}
+
+uint32_t session_table_advance(struct SessionTable *table, uint64_t now_ms) {
+  uint32_t target = (uint32_t)((now_ms - table->start_ms) / WHEEL_TICK_MS) + 1;
+  uint32_t expired = 0;
+
+  // Nothing to expire, so just catch the clock up
+  if (table->count == 0) {
+    if ((int32_t)(target - table->now_tick) > 0) {
+      table->now_tick = target;
+    }
+    return 0;
+  }
+
+  while ((int32_t)(target - table->now_tick) > 0) {
+    table->now_tick++;
+
+    // Each time a level wraps, pull the next slot of the level above down
+    for (int level = 1; level < WHEEL_LEVELS; ++level) {
+      if ((table->now_tick & ((1u << (WHEEL_BITS * level)) - 1)) != 0 || cascade(table, level) != 0) {
+        break;
+      }
+    }
+
+    uint32_t *head = &table->wheel[0][table->now_tick & (WHEEL_SLOTS - 1)];
+    while (*head != SESSION_NIL) {
+      remove_at(table, *head);
+      expired++;
+    }
+  }
+
+  table->expired += expired;
+  return expired;
+}
@@ -0,0 +1,109 @@
+//
+// Session table remembering which games a server shard has handed out.
+//
+
+#ifndef IN_CLASS_UDP_EXAMPLE_GAME_SESSIONS_H
+#define IN_CLASS_UDP_EXAMPLE_GAME_SESSIONS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Number of slots per timer wheel level, and number of levels.
+// 64^4 ticks of 100ms cover about 19 days, well past any session ttl.
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+#define WHEEL_TICK_MS 100
+
+// Marks the end of a wheel slot list
+#define SESSION_NIL 0xFFFFFFFFu
+
+/**
+ * One live game. Entries are stored inline in the open addressing
+ * table (two per 64 byte cache line), and are also linked into the
+ * timer wheel slot that holds their expiry time.
+ *
+ * The key is (addr, port, game_id). GameResultMessage does not carry
+ * the client_id, so it is stored with the entry rather than hashed.
+ */
+struct GameSession {
+  uint32_t addr;         // client IPv4 address, network order
+  uint16_t port;         // client port, network order
+  uint16_t game_id;
+  uint16_t client_id;
+  uint16_t x_positions;
+  uint16_t o_positions;
+  uint16_t wheel_slot;   // level * WHEEL_SLOTS + slot
+  uint32_t expires;      // tick the session expires at, 0 if the entry is unused
+  uint32_t wheel_next;   // next entry in the same wheel slot
+  uint32_t wheel_prev;   // previous entry in the same wheel slot
+  uint32_t home;         // table index the key hashes to
+};
+
+/**
+ * Fixed capacity session table. All memory is allocated up front by
+ * init_session_table, so memory use is bounded by max_sessions no
+ * matter how many clients never send their GameResultMessage.
+ */
+struct SessionTable {
+  struct GameSession *entries;
+  uint32_t capacity;
+  uint32_t count;
+  uint32_t max_sessions;
+  uint32_t ttl_ticks;
+  uint32_t now_tick;
+  uint32_t seed;
+  uint64_t start_ms;
+  uint64_t expired;       // sessions removed by the timer wheel
+  uint64_t evicted;       // sessions removed to make room for new ones
+  uint32_t wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+/**
+ * Allocate a table that holds at most max_sessions games, each of
+ * which expires ttl_ms after it was inserted.
+ *
+ * @return 0 on success, -1 if memory could not be allocated
+ */
+int init_session_table(struct SessionTable *table, uint32_t max_sessions, uint32_t ttl_ms, uint64_t now_ms);
+
+/**
+ * Free the memory held by a session table.
+ */
+void free_session_table(struct SessionTable *table);
+
+/**
+ * Bytes of memory held by the table, for reporting.
+ */
+size_t session_table_memory(const struct SessionTable *table);
+
+/**
+ * Insert (or replace) a session. If the table is full, the session
+ * closest to expiring is evicted to make room.
+ *
+ * @return the stored session
+ */
+struct GameSession *session_insert(struct SessionTable *table, uint32_t addr, uint16_t port, uint16_t game_id,
+                                   uint16_t client_id, uint16_t x_positions, uint16_t o_positions);
+
+/**
+ * Find a session, or nullptr if there is none (never issued, already
+ * graded, or expired). Pointers returned by session_find and
+ * session_insert are only valid until the next insert or removal.
+ */
+struct GameSession *session_find(struct SessionTable *table, uint32_t addr, uint16_t port, uint16_t game_id);
+
+/**
+ * Remove a session previously returned by session_find/session_insert.
+ */
+void session_remove(struct SessionTable *table, struct GameSession *session);
+
+/**
+ * Move the timer wheel forward to now_ms, removing every session that
+ * has expired. Cheap to call on every received datagram.
+ *
+ * @return number of sessions expired
+ */
+uint32_t session_table_advance(struct SessionTable *table, uint64_t now_ms);
+
+#endif //IN_CLASS_UDP_EXAMPLE_GAME_SESSIONS_H
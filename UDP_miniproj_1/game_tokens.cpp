@@ -0,0 +1,112 @@
+#include "game_tokens.h"
+#include <string.h>
+
+static inline void put_be16(uint8_t *p, uint16_t v) {
+  p[0] = (uint8_t)(v >> 8);
+  p[1] = (uint8_t)v;
+}
+
+static inline uint16_t get_be16(const uint8_t *p) {
+  return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+/**
+ * MAC over the 8 cleartext token bytes plus the game and client
+ * address, which are not stored in the token.
+ */
+static uint64_t token_mac(const uint8_t key[SIPHASH_KEY_LEN], const uint8_t *fields, uint32_t addr,
+                          uint16_t port, uint16_t game_id) {
+  uint8_t input[16];
+
+  memcpy(input, fields, 8);
+  put_be16(&input[8], game_id);
+  memcpy(&input[10], &addr, 4);
+  memcpy(&input[14], &port, 2);
+  return siphash24(key, input, sizeof(input));
+}
+
+uint16_t token_epoch(uint64_t now_ms) {
+  return (uint16_t)(now_ms / TOKEN_EPOCH_MS);
+}
+
+void make_game_token(const uint8_t key[SIPHASH_KEY_LEN], uint16_t epoch, uint32_t addr, uint16_t port,
+                     uint16_t client_id, uint16_t game_id, uint16_t x_positions, uint16_t o_positions,
+                     uint8_t token[GAME_TOKEN_LEN]) {
+  uint64_t mac;
+
+  put_be16(&token[0], x_positions);
+  put_be16(&token[2], o_positions);
+  put_be16(&token[4], client_id);
+  put_be16(&token[6], epoch);
+  mac = token_mac(key, token, addr, port, game_id);
+  memcpy(&token[8], &mac, sizeof(mac));
+}
+
+int open_game_token(const uint8_t key[SIPHASH_KEY_LEN], uint16_t epoch, uint32_t addr, uint16_t port,
+                    uint16_t game_id, const uint8_t token[GAME_TOKEN_LEN], uint16_t *x_positions,
+                    uint16_t *o_positions) {
+  uint64_t expected;
+  uint64_t received;
+  uint16_t age;
+
+  // Only the current and previous epoch are fresh
+  age = (uint16_t)(epoch - get_be16(&token[6]));
+  if (age > 1) {
+    return -1;
+  }
+
+  expected = token_mac(key, token, addr, port, game_id);
+  memcpy(&received, &token[8], sizeof(received));
+  if ((expected ^ received) != 0) {
+    return -1;
+  }
+
+  *x_positions = get_be16(&token[0]);
+  *o_positions = get_be16(&token[2]);
+  return 0;
+}
+
+/**
+ * MAC over the token's epoch, the game and client address and the
+ * echoed board.
+ */
+static uint64_t board_token_mac(const uint8_t key[SIPHASH_KEY_LEN], const uint8_t *fields, uint32_t addr,
+                                uint16_t port, uint16_t game_id, const uint8_t *board, size_t board_len) {
+  uint8_t input[16 + 6 + 4 * LARGE_BOARD_MAX_ROWS];
+
+  if (board_len > sizeof(input) - 16) {
+    board_len = sizeof(input) - 16;
+  }
+  memcpy(input, fields, 8);
+  put_be16(&input[8], game_id);
+  memcpy(&input[10], &addr, 4);
+  memcpy(&input[14], &port, 2);
+  memcpy(&input[16], board, board_len);
+  return siphash24(key, input, 16 + board_len);
+}
+
+void make_board_token(const uint8_t key[SIPHASH_KEY_LEN], uint16_t epoch, uint32_t addr, uint16_t port,
+                      uint16_t game_id, const uint8_t *board, size_t board_len, uint8_t token[GAME_TOKEN_LEN]) {
+  uint64_t mac;
+
+  memset(token, 0, 6);
+  put_be16(&token[6], epoch);
+  mac = board_token_mac(key, token, addr, port, game_id, board, board_len);
+  memcpy(&token[8], &mac, sizeof(mac));
+}
+
+int open_board_token(const uint8_t key[SIPHASH_KEY_LEN], uint16_t epoch, uint32_t addr, uint16_t port,
+                     uint16_t game_id, const uint8_t *board, size_t board_len, const uint8_t token[GAME_TOKEN_LEN]) {
+  uint64_t expected;
+  uint64_t received;
+  uint16_t age;
+
+  age = (uint16_t)(epoch - get_be16(&token[6]));
+  if (age > 1) {
+    return -1;
+  }
+
+  expected = board_token_mac(key, token, addr, port, game_id, board, board_len);
+  memcpy(&received, &token[8], sizeof(received));
+  return (expected ^ received) != 0 ? -1 : 0;
+}
@@ -0,0 +1,77 @@
+//
+// Authenticated game tokens, so the server can grade a game without
+// storing it.
+//
+
+#ifndef IN_CLASS_UDP_EXAMPLE_GAME_TOKENS_H
+#define IN_CLASS_UDP_EXAMPLE_GAME_TOKENS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tictactoe.h"
+#include "siphash.h"
+
+// How long one token epoch lasts. Tokens from the current and the
+// previous epoch are accepted, so a token lives 1-2 epochs.
+#define TOKEN_EPOCH_MS 30000
+
+/**
+ * Epoch number for a monotonic_ms() time.
+ */
+uint16_t token_epoch(uint64_t now_ms);
+
+/**
+ * Build the token for a game. The token carries the board, client_id
+ * and epoch in the clear, followed by a SipHash-2-4 MAC over those
+ * fields, the game_id and the client address, so it is only valid
+ * when echoed back from the same address for the same game.
+ *
+ * @param key server secret
+ * @param epoch current token_epoch()
+ * @param addr client IPv4 address, network order
+ * @param port client port, network order
+ * @param token output, GAME_TOKEN_LEN bytes
+ */
+void make_game_token(const uint8_t key[SIPHASH_KEY_LEN], uint16_t epoch, uint32_t addr, uint16_t port,
+                     uint16_t client_id, uint16_t game_id, uint16_t x_positions, uint16_t o_positions,
+                     uint8_t token[GAME_TOKEN_LEN]);
+
+/**
+ * Check a token echoed back by a client and recover the board.
+ *
+ * @param key server secret
+ * @param epoch current token_epoch()
+ * @param addr address the token came back from, network order
+ * @param port port the token came back from, network order
+ * @param game_id game_id from the result message
+ * @param token the token from the result message
+ * @param x_positions set to the board's X marks if the token is valid
+ * @param o_positions set to the board's O marks if the token is valid
+ * @return 0 if the token is authentic and fresh, -1 otherwise
+ */
+int open_game_token(const uint8_t key[SIPHASH_KEY_LEN], uint16_t epoch, uint32_t addr, uint16_t port,
+                    uint16_t game_id, const uint8_t token[GAME_TOKEN_LEN], uint16_t *x_positions,
+                    uint16_t *o_positions);
+
+/**
+ * Build the token for a large board game. The board is not stored in
+ * the token (it does not fit); the client echoes it back beside the
+ * token, and the MAC covers it along with the game_id, epoch and
+ * client address.
+ *
+ * @param board the board as sent: width, height, k and the row masks
+ * @param board_len bytes in board
+ */
+void make_board_token(const uint8_t key[SIPHASH_KEY_LEN], uint16_t epoch, uint32_t addr, uint16_t port,
+                      uint16_t game_id, const uint8_t *board, size_t board_len, uint8_t token[GAME_TOKEN_LEN]);
+
+/**
+ * Check a large board token against the board echoed back with it.
+ *
+ * @return 0 if the token is authentic, fresh and matches the board, -1 otherwise
+ */
+int open_board_token(const uint8_t key[SIPHASH_KEY_LEN], uint16_t epoch, uint32_t addr, uint16_t port,
+                     uint16_t game_id, const uint8_t *board, size_t board_len, const uint8_t token[GAME_TOKEN_LEN]);
+
+#endif //IN_CLASS_UDP_EXAMPLE_GAME_TOKENS_H
@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# Run ttt_loadgen against the TTT server through impair_proxy with a few
+# fixed, seeded network profiles, so throughput and tail latency under
+# loss/jitter/reordering can be compared from run to run.
+#
+# e.g., make && ./impair_bench.sh
+#       ./impair_bench.sh --games 50000 --window 64
+#
+# Extra arguments are passed to ttt_loadgen.
+
+SERVER_PORT=${SERVER_PORT:-8890}
+PROXY_PORT=${PROXY_PORT:-9890}
+SEED=${SEED:-42}
+
+# name:proxy options
+PROFILES="clean:
+lan:--delay 0.2 --jitter 0.1
+lossy:--loss 1 --delay 1 --jitter 0.5
+wan:--loss 0.5 --delay 10 --jitter 5 --reorder 1 --duplicate 0.5 --rate-mbit 50"
+
+./udpserver 127.0.0.1 $SERVER_PORT > /dev/null 2>&1 &
+SERVER_PID=$!
+trap 'kill -INT $SERVER_PID 2> /dev/null' EXIT
+sleep 0.5
+
+echo "$PROFILES" | while IFS=: read -r NAME IMPAIRMENTS; do
+  echo "== $NAME: $IMPAIRMENTS"
+  ./impair_proxy 127.0.0.1 $PROXY_PORT 127.0.0.1 $SERVER_PORT --udp --seed $SEED $IMPAIRMENTS > /tmp/impair_proxy.$$ 2>&1 &
+  PROXY_PID=$!
+  sleep 0.3
+  ./ttt_loadgen 127.0.0.1 $PROXY_PORT --games 5000 --window 32 --timeout 40 "$@"
+  kill -INT $PROXY_PID
+  wait $PROXY_PID
+  grep '^udp ' /tmp/impair_proxy.$$
+  rm -f /tmp/impair_proxy.$$
+done
@@ -0,0 +1,757 @@
+/**
+ * Userspace network impairment proxy for loopback testing. Sits between
+ * clients and a UDP and/or TCP server and applies seeded loss, delay
+ * jitter, reordering, duplication and a bandwidth cap (see
+ * impairment.h) to the traffic in both directions.
+ *
+ * Each UDP client address gets its own upstream socket, so the server
+ * still sees one source per client. TCP connections are relayed byte
+ * for byte; delay and rate apply per chunk read, and loss turns into a
+ * retransmission delay of --tcp-rto.
+ *
+ * e.g., ./impair_proxy 127.0.0.1 9000 127.0.0.1 8888 --loss 1 --delay 5 --jitter 2 --seed 7
+ *       ./ttt_loadgen 127.0.0.1 9000 --window 64
+ */
+
+#include <iostream>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <atomic>
+#include <deque>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "udp_utils.h"
+#include "impairment.h"
+
+// Most datagrams handed to one sendmmsg/recvmmsg call
+#define PROXY_BATCH 64
+// Largest datagram relayed
+#define PROXY_DATAGRAM_MAX 2048
+// Most TCP bytes read at once, each read becomes one impaired chunk
+#define TCP_CHUNK_MAX 16384
+// Stop reading a TCP direction while this much is queued in it
+#define TCP_QUEUE_MAX (4 << 20)
+
+// Variable used to shut down the proxy when ctrl+c is pressed.
+static std::atomic<bool> stop(false);
+
+// Handler for when ctrl+c is pressed.
+void handle_ctrl_c(int the_signal) {
+  stop = true;
+}
+
+/**
+ * Options given on the command line after the addresses.
+ */
+struct ProxyOptions {
+  struct ImpairConfig config;
+  bool udp;
+  bool tcp;
+  /* most datagrams held back at once */
+  int queue_limit;
+  /* most UDP client addresses tracked */
+  int max_flows;
+};
+
+/**
+ * What an fd registered with epoll is, stored in epoll_event.data.u64
+ * as kind << 32 | index.
+ */
+enum ProxyFdKind {
+  FD_UDP_LISTEN,
+  FD_UDP_FLOW,
+  FD_TCP_LISTEN,
+  FD_TCP_CLIENT,
+  FD_TCP_SERVER
+};
+
+/**
+ * One UDP client and the socket relaying its datagrams to the server.
+ */
+struct UdpFlow {
+  struct sockaddr_in client;
+  int upstream_fd;
+};
+
+/**
+ * A datagram waiting out its delay.
+ */
+struct QueuedDatagram {
+  int out_fd;
+  /* destination for datagrams to clients; upstream sockets are connected */
+  bool has_dest;
+  struct sockaddr_in dest;
+  int len;
+  char data[PROXY_DATAGRAM_MAX];
+};
+
+struct TcpChunk {
+  uint64_t release_ns;
+  std::string data;
+};
+
+/**
+ * One direction of a relayed TCP connection.
+ */
+struct TcpDirection {
+  int in_fd;
+  int out_fd;
+  bool in_closed;
+  bool out_shut;
+  struct ImpairLink link;
+  /* chunks waiting out their delay, in release order */
+  std::deque<struct TcpChunk> chunks;
+  /* released bytes the out socket has not taken yet */
+  std::string pending;
+  size_t pending_offset;
+  size_t queued_bytes;
+};
+
+/**
+ * A relayed TCP connection. Direction 0 is client to server, 1 is
+ * server to client; side 0 is the client's fd, side 1 the server's.
+ */
+struct TcpConn {
+  bool in_use;
+  int fds[2];
+  struct TcpDirection dirs[2];
+};
+
+/**
+ * Something due at release_ns: a queued datagram, or a TCP chunk.
+ */
+struct ProxyEvent {
+  uint64_t release_ns;
+  uint64_t seq;
+  bool tcp;
+  int index;
+  int dir;
+};
+
+struct EventLater {
+  bool operator()(const struct ProxyEvent &a, const struct ProxyEvent &b) const {
+    return a.release_ns != b.release_ns ? a.release_ns > b.release_ns : a.seq > b.seq;
+  }
+};
+
+struct Proxy {
+  const struct ProxyOptions *options;
+  int epoll_fd;
+  struct sockaddr_in server_addr;
+  int udp_listen_fd;
+  int tcp_listen_fd;
+  /* 0 client to server, 1 server to client, shared by every UDP flow */
+  struct ImpairLink udp_links[2];
+  std::vector<struct UdpFlow> flows;
+  std::unordered_map<uint64_t, int> flow_index;
+  std::vector<struct QueuedDatagram> slots;
+  std::vector<int> free_slots;
+  std::vector<struct TcpConn> conns;
+  std::vector<int> free_conns;
+  std::priority_queue<struct ProxyEvent, std::vector<struct ProxyEvent>, EventLater> events;
+  uint64_t seq;
+  uint64_t tcp_accepted;
+  uint64_t tcp_links_used;
+  struct ImpairStats tcp_stats[2];
+};
+
+static uint64_t now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static uint64_t make_tag(enum ProxyFdKind kind, uint32_t index) {
+  return ((uint64_t)kind << 32) | index;
+}
+
+static void push_event(struct Proxy *proxy, uint64_t release_ns, bool tcp, int index, int dir) {
+  struct ProxyEvent event = {release_ns, proxy->seq++, tcp, index, dir};
+  proxy->events.push(event);
+}
+
+/**
+ * Run a datagram through a link's impairments and queue what survives.
+ */
+static void queue_datagram(struct Proxy *proxy, int link, int out_fd, const struct sockaddr_in *dest,
+                           const char *data, int len, uint64_t now) {
+  uint64_t release_ns[2];
+  int copies = impair_datagram(&proxy->udp_links[link], &proxy->options->config, now, len, release_ns);
+
+  for (int i = 0; i < copies; ++i) {
+    if (proxy->free_slots.empty()) {
+      proxy->udp_links[link].stats.queue_dropped++;
+      continue;
+    }
+    int slot_index = proxy->free_slots.back();
+    struct QueuedDatagram *slot = &proxy->slots[slot_index];
+    proxy->free_slots.pop_back();
+
+    slot->out_fd = out_fd;
+    slot->has_dest = (dest != NULL);
+    if (dest != NULL) {
+      slot->dest = *dest;
+    }
+    slot->len = len;
+    memcpy(slot->data, data, len);
+    push_event(proxy, release_ns[i], false, slot_index, link);
+  }
+}
+
+/**
+ * Find the flow for a client address, opening its upstream socket the
+ * first time the client is seen.
+ *
+ * @return flow index, or -1 if no more flows can be opened
+ */
+static int find_flow(struct Proxy *proxy, const struct sockaddr_in *client) {
+  uint64_t key = ((uint64_t)client->sin_addr.s_addr << 16) | client->sin_port;
+  auto found = proxy->flow_index.find(key);
+  struct epoll_event event;
+  struct UdpFlow flow;
+
+  if (found != proxy->flow_index.end()) {
+    return found->second;
+  }
+  if ((int)proxy->flows.size() >= proxy->options->max_flows) {
+    return -1;
+  }
+
+  flow.client = *client;
+  flow.upstream_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+  if (flow.upstream_fd < 0) {
+    handle_error("upstream socket creation failed");
+    return -1;
+  }
+  if (connect(flow.upstream_fd, (struct sockaddr *)&proxy->server_addr, sizeof(struct sockaddr_in)) == -1) {
+    handle_error("upstream connect failed");
+    close(flow.upstream_fd);
+    return -1;
+  }
+  event.events = EPOLLIN;
+  event.data.u64 = make_tag(FD_UDP_FLOW, proxy->flows.size());
+  epoll_ctl(proxy->epoll_fd, EPOLL_CTL_ADD, flow.upstream_fd, &event);
+
+  proxy->flows.push_back(flow);
+  proxy->flow_index[key] = proxy->flows.size() - 1;
+  return proxy->flows.size() - 1;
+}
+
+/**
+ * Read everything waiting on a UDP socket: from clients on the listen
+ * socket, or from the server on a flow's upstream socket.
+ */
+static void udp_receive(struct Proxy *proxy, int fd, int flow, uint64_t now) {
+  static char buffers[PROXY_BATCH][PROXY_DATAGRAM_MAX];
+  struct mmsghdr msgs[PROXY_BATCH];
+  struct iovec iovs[PROXY_BATCH];
+  struct sockaddr_in addrs[PROXY_BATCH];
+  int ret;
+
+  do {
+    for (int i = 0; i < PROXY_BATCH; ++i) {
+      iovs[i].iov_base = buffers[i];
+      iovs[i].iov_len = PROXY_DATAGRAM_MAX;
+      memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_name = &addrs[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+    ret = recvmmsg(fd, msgs, PROXY_BATCH, MSG_DONTWAIT, NULL);
+    if (ret <= 0) {
+      return;
+    }
+
+    for (int i = 0; i < ret; ++i) {
+      if (flow == -1) {
+        int client_flow = find_flow(proxy, &addrs[i]);
+        if (client_flow != -1) {
+          queue_datagram(proxy, 0, proxy->flows[client_flow].upstream_fd, NULL, buffers[i], msgs[i].msg_len, now);
+        }
+      } else {
+        queue_datagram(proxy, 1, proxy->udp_listen_fd, &proxy->flows[flow].client, buffers[i], msgs[i].msg_len,
+                       now);
+      }
+    }
+  } while (ret == PROXY_BATCH);
+}
+
+/**
+ * Send queued datagrams, runs going to the same fd in one sendmmsg.
+ */
+static void udp_send(struct Proxy *proxy, const int *slot_indices, int count) {
+  struct mmsghdr msgs[PROXY_BATCH];
+  struct iovec iovs[PROXY_BATCH];
+  int start = 0;
+
+  for (int i = 0; i < count; ++i) {
+    struct QueuedDatagram *slot = &proxy->slots[slot_indices[i]];
+    iovs[i].iov_base = slot->data;
+    iovs[i].iov_len = slot->len;
+    memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    if (slot->has_dest) {
+      msgs[i].msg_hdr.msg_name = &slot->dest;
+      msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+  }
+
+  for (int i = 1; i <= count; ++i) {
+    int fd = proxy->slots[slot_indices[start]].out_fd;
+    if (i == count || proxy->slots[slot_indices[i]].out_fd != fd) {
+      // A full socket buffer drops the rest of the run, as a router would
+      sendmmsg(fd, &msgs[start], i - start, MSG_DONTWAIT);
+      start = i;
+    }
+  }
+
+  for (int i = 0; i < count; ++i) {
+    proxy->free_slots.push_back(slot_indices[i]);
+  }
+}
+
+/**
+ * Register what a TCP fd should wait for: readable unless its inbound
+ * direction is closed or backed up, writable if its outbound direction
+ * has bytes the socket would not take.
+ */
+static void update_tcp_interest(struct Proxy *proxy, int conn_index, int side) {
+  struct TcpConn *conn = &proxy->conns[conn_index];
+  struct TcpDirection *in = &conn->dirs[side];
+  struct TcpDirection *out = &conn->dirs[1 - side];
+  struct epoll_event event;
+
+  event.events = 0;
+  if (!in->in_closed && in->queued_bytes < TCP_QUEUE_MAX) {
+    event.events |= EPOLLIN;
+  }
+  if (out->pending_offset < out->pending.size()) {
+    event.events |= EPOLLOUT;
+  }
+  event.data.u64 = make_tag(side == 0 ? FD_TCP_CLIENT : FD_TCP_SERVER, conn_index);
+  epoll_ctl(proxy->epoll_fd, EPOLL_CTL_MOD, conn->fds[side], &event);
+}
+
+static void close_tcp_conn(struct Proxy *proxy, int conn_index) {
+  struct TcpConn *conn = &proxy->conns[conn_index];
+
+  for (int d = 0; d < 2; ++d) {
+    proxy->tcp_stats[d].packets += conn->dirs[d].link.stats.packets;
+    proxy->tcp_stats[d].bytes += conn->dirs[d].link.stats.bytes;
+    proxy->tcp_stats[d].dropped += conn->dirs[d].link.stats.dropped;
+    conn->dirs[d].chunks.clear();
+    conn->dirs[d].pending.clear();
+  }
+  close(conn->fds[0]);
+  close(conn->fds[1]);
+  conn->in_use = false;
+  proxy->free_conns.push_back(conn_index);
+}
+
+/**
+ * Write as much released data as the out socket takes, and pass on
+ * the end of the stream once everything before it is delivered.
+ *
+ * @return false if the connection was closed
+ */
+static bool tcp_flush(struct Proxy *proxy, int conn_index, int dir) {
+  struct TcpConn *conn = &proxy->conns[conn_index];
+  struct TcpDirection *direction = &conn->dirs[dir];
+  ssize_t ret;
+
+  while (direction->pending_offset < direction->pending.size()) {
+    ret = send(direction->out_fd, direction->pending.data() + direction->pending_offset,
+               direction->pending.size() - direction->pending_offset, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (ret < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      close_tcp_conn(proxy, conn_index);
+      return false;
+    }
+    direction->pending_offset += ret;
+    direction->queued_bytes -= ret;
+  }
+  if (direction->pending_offset == direction->pending.size()) {
+    direction->pending.clear();
+    direction->pending_offset = 0;
+  }
+
+  if (direction->in_closed && direction->chunks.empty() && direction->pending.empty() && !direction->out_shut) {
+    shutdown(direction->out_fd, SHUT_WR);
+    direction->out_shut = true;
+  }
+  if (conn->dirs[0].out_shut && conn->dirs[1].out_shut) {
+    close_tcp_conn(proxy, conn_index);
+    return false;
+  }
+
+  update_tcp_interest(proxy, conn_index, 0);
+  update_tcp_interest(proxy, conn_index, 1);
+  return true;
+}
+
+/**
+ * Read from one side of a TCP connection into impaired chunks.
+ */
+static void tcp_read(struct Proxy *proxy, int conn_index, int side, uint64_t now) {
+  static char buf[TCP_CHUNK_MAX];
+  struct TcpConn *conn = &proxy->conns[conn_index];
+  struct TcpDirection *direction = &conn->dirs[side];
+  struct TcpChunk chunk;
+  ssize_t ret;
+
+  ret = recv(direction->in_fd, buf, sizeof(buf), MSG_DONTWAIT);
+  if (ret < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return;
+    }
+    close_tcp_conn(proxy, conn_index);
+    return;
+  }
+  if (ret == 0) {
+    direction->in_closed = true;
+    tcp_flush(proxy, conn_index, side);
+    return;
+  }
+
+  chunk.release_ns = impair_stream(&direction->link, &proxy->options->config, now, ret);
+  chunk.data.assign(buf, ret);
+  direction->queued_bytes += ret;
+  push_event(proxy, chunk.release_ns, true, conn_index, side);
+  direction->chunks.push_back(std::move(chunk));
+  update_tcp_interest(proxy, conn_index, side);
+}
+
+static void tcp_accept(struct Proxy *proxy) {
+  struct epoll_event event;
+  int client_fd;
+  int server_fd;
+  int conn_index;
+  int one = 1;
+
+  while ((client_fd = accept4(proxy->tcp_listen_fd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+    // Loopback connects complete at once, so connect blocking and then switch
+    server_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (server_fd < 0 ||
+        connect(server_fd, (struct sockaddr *)&proxy->server_addr, sizeof(struct sockaddr_in)) == -1) {
+      handle_error("connect to server failed");
+      if (server_fd >= 0) {
+        close(server_fd);
+      }
+      close(client_fd);
+      continue;
+    }
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL, 0) | O_NONBLOCK);
+    // The proxy decides when bytes go out, so don't let Nagle hold them too
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(server_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (proxy->free_conns.empty()) {
+      proxy->conns.emplace_back();
+      conn_index = proxy->conns.size() - 1;
+    } else {
+      conn_index = proxy->free_conns.back();
+      proxy->free_conns.pop_back();
+    }
+    struct TcpConn *conn = &proxy->conns[conn_index];
+    conn->in_use = true;
+    conn->fds[0] = client_fd;
+    conn->fds[1] = server_fd;
+    for (int d = 0; d < 2; ++d) {
+      conn->dirs[d].in_fd = conn->fds[d];
+      conn->dirs[d].out_fd = conn->fds[1 - d];
+      conn->dirs[d].in_closed = false;
+      conn->dirs[d].out_shut = false;
+      conn->dirs[d].pending_offset = 0;
+      conn->dirs[d].queued_bytes = 0;
+      // Links numbered in accept order, so seeded runs repeat
+      init_impair_link(&conn->dirs[d].link, &proxy->options->config, 2 + proxy->tcp_links_used++);
+    }
+
+    event.events = EPOLLIN;
+    event.data.u64 = make_tag(FD_TCP_CLIENT, conn_index);
+    epoll_ctl(proxy->epoll_fd, EPOLL_CTL_ADD, client_fd, &event);
+    event.data.u64 = make_tag(FD_TCP_SERVER, conn_index);
+    epoll_ctl(proxy->epoll_fd, EPOLL_CTL_ADD, server_fd, &event);
+    proxy->tcp_accepted++;
+  }
+}
+
+/**
+ * Deliver everything whose time has come.
+ */
+static void release_due(struct Proxy *proxy, uint64_t now) {
+  int due_slots[PROXY_BATCH];
+  int count = 0;
+
+  while (!proxy->events.empty() && proxy->events.top().release_ns <= now) {
+    struct ProxyEvent event = proxy->events.top();
+    proxy->events.pop();
+
+    if (!event.tcp) {
+      due_slots[count++] = event.index;
+      if (count == PROXY_BATCH) {
+        udp_send(proxy, due_slots, count);
+        count = 0;
+      }
+      continue;
+    }
+
+    // A TCP event may outlive its connection; the front chunk is only due if its time has come
+    struct TcpConn *conn = &proxy->conns[event.index];
+    if (!conn->in_use) {
+      continue;
+    }
+    struct TcpDirection *direction = &conn->dirs[event.dir];
+    while (!direction->chunks.empty() && direction->chunks.front().release_ns <= now) {
+      direction->pending.append(direction->chunks.front().data);
+      direction->chunks.pop_front();
+    }
+    tcp_flush(proxy, event.index, event.dir);
+  }
+  if (count > 0) {
+    udp_send(proxy, due_slots, count);
+  }
+}
+
+/**
+ * Wait for traffic, or until the next queued item is due, to the
+ * microsecond (epoll_pwait2), or the millisecond on older kernels.
+ */
+static int wait_for_events(struct Proxy *proxy, struct epoll_event *events, int max_events) {
+  uint64_t wait_ns = 1000000000ull;
+  struct timespec timeout;
+  int ret;
+
+  if (!proxy->events.empty()) {
+    uint64_t now = now_ns();
+    uint64_t release = proxy->events.top().release_ns;
+    wait_ns = release > now ? release - now : 0;
+  }
+  timeout.tv_sec = wait_ns / 1000000000ull;
+  timeout.tv_nsec = wait_ns % 1000000000ull;
+  ret = epoll_pwait2(proxy->epoll_fd, events, max_events, &timeout, NULL);
+  if (ret == -1 && errno == ENOSYS) {
+    ret = epoll_wait(proxy->epoll_fd, events, max_events, (int)((wait_ns + 999999) / 1000000));
+  }
+  return ret;
+}
+
+static void print_stats(const char *label, const struct ImpairStats *stats) {
+  std::cout << label << ": " << stats->packets << " packets, " << stats->bytes << " bytes, " << stats->dropped
+            << " lost, " << stats->duplicated << " duplicated, " << stats->reordered << " reordered, "
+            << stats->queue_dropped << " queue drops" << std::endl;
+}
+
+/**
+ * Open a socket of the given type bound to addr.
+ */
+static int bind_listen_socket(int type, const struct sockaddr_in *addr) {
+  int fd = socket(AF_INET, type | SOCK_NONBLOCK, 0);
+  int one = 1;
+
+  if (fd < 0) {
+    return -1;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(fd, (struct sockaddr *)addr, sizeof(struct sockaddr_in)) == -1) {
+    close(fd);
+    return -1;
+  }
+  if (type == SOCK_STREAM && listen(fd, 128) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * Entrypoint to the program.
+ *
+ * @param argc count of arguments on command line
+ * @param argv character array of command line arguments
+ *
+ * @return exit code of the program
+ */
+int main(int argc, char *argv[]) {
+  struct ProxyOptions options;
+  struct Proxy proxy;
+  struct sockaddr_in listen_addr;
+  struct epoll_event event;
+  struct epoll_event events[PROXY_BATCH];
+  int rcvbuf = 4 << 20;
+  int ret;
+
+  if (argc < 5) {
+    std::cerr << "Please specify LISTEN_IP LISTEN_PORT SERVER_IP SERVER_PORT [--udp | --tcp] [--loss PCT]"
+              << " [--delay MS] [--jitter MS] [--reorder PCT] [--duplicate PCT] [--rate-mbit N] [--tcp-rto MS]"
+              << " [--seed N] [--queue N] as arguments." << std::endl;
+    return 1;
+  }
+
+  memset(&options.config, 0, sizeof(options.config));
+  options.config.tcp_rto_ns = 200000000ull;
+  options.config.seed = 1;
+  options.udp = true;
+  options.tcp = true;
+  options.queue_limit = 65536;
+  options.max_flows = 4096;
+  for (int i = 5; i < argc; ++i) {
+    if (strcmp(argv[i], "--udp") == 0) {
+      options.tcp = false;
+    } else if (strcmp(argv[i], "--tcp") == 0) {
+      options.udp = false;
+    } else if ((strcmp(argv[i], "--loss") == 0) && (i + 1 < argc)) {
+      options.config.loss = atof(argv[++i]) / 100.0;
+    } else if ((strcmp(argv[i], "--delay") == 0) && (i + 1 < argc)) {
+      options.config.delay_ns = (uint64_t)(atof(argv[++i]) * 1000000.0);
+    } else if ((strcmp(argv[i], "--jitter") == 0) && (i + 1 < argc)) {
+      options.config.jitter_ns = (uint64_t)(atof(argv[++i]) * 1000000.0);
+    } else if ((strcmp(argv[i], "--reorder") == 0) && (i + 1 < argc)) {
+      options.config.reorder = atof(argv[++i]) / 100.0;
+    } else if ((strcmp(argv[i], "--duplicate") == 0) && (i + 1 < argc)) {
+      options.config.duplicate = atof(argv[++i]) / 100.0;
+    } else if ((strcmp(argv[i], "--rate-mbit") == 0) && (i + 1 < argc)) {
+      options.config.rate_bytes_per_sec = (uint64_t)(atof(argv[++i]) * 125000.0);
+    } else if ((strcmp(argv[i], "--tcp-rto") == 0) && (i + 1 < argc)) {
+      options.config.tcp_rto_ns = (uint64_t)(atof(argv[++i]) * 1000000.0);
+    } else if ((strcmp(argv[i], "--seed") == 0) && (i + 1 < argc)) {
+      options.config.seed = strtoull(argv[++i], NULL, 10);
+    } else if ((strcmp(argv[i], "--queue") == 0) && (i + 1 < argc)) {
+      options.queue_limit = atoi(argv[++i]);
+    } else {
+      std::cerr << "Unknown option " << argv[i] << std::endl;
+      return 1;
+    }
+  }
+
+  if (convert_ip_port_to_sockaddr_in(argv[1], argv[2], &listen_addr) == -1 ||
+      convert_ip_port_to_sockaddr_in(argv[3], argv[4], &proxy.server_addr) == -1) {
+    handle_error("ip/port conversion failed");
+    return 1;
+  }
+
+  proxy.options = &options;
+  proxy.seq = 0;
+  proxy.tcp_accepted = 0;
+  proxy.tcp_links_used = 0;
+  memset(proxy.tcp_stats, 0, sizeof(proxy.tcp_stats));
+  init_impair_link(&proxy.udp_links[0], &options.config, 0);
+  init_impair_link(&proxy.udp_links[1], &options.config, 1);
+  proxy.slots.resize(options.queue_limit);
+  for (int i = options.queue_limit - 1; i >= 0; --i) {
+    proxy.free_slots.push_back(i);
+  }
+  proxy.udp_listen_fd = -1;
+  proxy.tcp_listen_fd = -1;
+  proxy.epoll_fd = epoll_create1(0);
+
+  if (options.udp) {
+    proxy.udp_listen_fd = bind_listen_socket(SOCK_DGRAM, &listen_addr);
+    if (proxy.udp_listen_fd == -1) {
+      handle_error("UDP bind failed");
+      return 1;
+    }
+    setsockopt(proxy.udp_listen_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    event.events = EPOLLIN;
+    event.data.u64 = make_tag(FD_UDP_LISTEN, 0);
+    epoll_ctl(proxy.epoll_fd, EPOLL_CTL_ADD, proxy.udp_listen_fd, &event);
+  }
+  if (options.tcp) {
+    proxy.tcp_listen_fd = bind_listen_socket(SOCK_STREAM, &listen_addr);
+    if (proxy.tcp_listen_fd == -1) {
+      handle_error("TCP bind/listen failed");
+      return 1;
+    }
+    event.events = EPOLLIN;
+    event.data.u64 = make_tag(FD_TCP_LISTEN, 0);
+    epoll_ctl(proxy.epoll_fd, EPOLL_CTL_ADD, proxy.tcp_listen_fd, &event);
+  }
+
+  struct sigaction ctrl_c_handler;
+  ctrl_c_handler.sa_handler = handle_ctrl_c;
+  sigemptyset(&ctrl_c_handler.sa_mask);
+  ctrl_c_handler.sa_flags = 0;
+  sigaction(SIGINT, &ctrl_c_handler, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  std::cout << "Proxying " << argv[1] << ":" << argv[2] << " -> " << argv[3] << ":" << argv[4]
+            << (options.udp ? " udp" : "") << (options.tcp ? " tcp" : "") << ", loss "
+            << options.config.loss * 100 << "%, delay " << options.config.delay_ns / 1e6 << " ms +/- "
+            << options.config.jitter_ns / 1e6 << " ms, reorder " << options.config.reorder * 100 << "%, duplicate "
+            << options.config.duplicate * 100 << "%, rate "
+            << (options.config.rate_bytes_per_sec ? options.config.rate_bytes_per_sec / 125000.0 : 0)
+            << " Mbit/s (0 = unlimited), seed " << options.config.seed << std::endl;
+
+  while (!stop) {
+    ret = wait_for_events(&proxy, events, PROXY_BATCH);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      handle_error("epoll_wait failed");
+      break;
+    }
+
+    uint64_t now = now_ns();
+    for (int i = 0; i < ret; ++i) {
+      enum ProxyFdKind kind = (enum ProxyFdKind)(events[i].data.u64 >> 32);
+      int index = (int)(events[i].data.u64 & 0xFFFFFFFF);
+
+      if (kind == FD_UDP_LISTEN) {
+        udp_receive(&proxy, proxy.udp_listen_fd, -1, now);
+      } else if (kind == FD_UDP_FLOW) {
+        udp_receive(&proxy, proxy.flows[index].upstream_fd, index, now);
+      } else if (kind == FD_TCP_LISTEN) {
+        tcp_accept(&proxy);
+      } else {
+        int side = (kind == FD_TCP_CLIENT) ? 0 : 1;
+        if (!proxy.conns[index].in_use) {
+          continue;
+        }
+        if ((events[i].events & EPOLLOUT) && !tcp_flush(&proxy, index, 1 - side)) {
+          continue;
+        }
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+          tcp_read(&proxy, index, side, now);
+        }
+      }
+    }
+
+    release_due(&proxy, now_ns());
+  }
+
+  std::cout << std::endl;
+  if (options.udp) {
+    print_stats("udp client->server", &proxy.udp_links[0].stats);
+    print_stats("udp server->client", &proxy.udp_links[1].stats);
+    std::cout << "udp: " << proxy.flows.size() << " client addresses" << std::endl;
+  }
+  if (options.tcp) {
+    for (size_t c = 0; c < proxy.conns.size(); ++c) {
+      if (proxy.conns[c].in_use) {
+        close_tcp_conn(&proxy, c);
+      }
+    }
+    print_stats("tcp client->server", &proxy.tcp_stats[0]);
+    print_stats("tcp server->client", &proxy.tcp_stats[1]);
+    std::cout << "tcp: " << proxy.tcp_accepted << " connections" << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,101 @@
+#include "impairment.h"
+#include <string.h>
+
+/**
+ * splitmix64, small and fast with a full 64 bit period.
+ */
+static uint64_t next_random(struct ImpairLink *link) {
+  uint64_t z = (link->rng_state += 0x9E3779B97F4A7C15ull);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+/**
+ * Uniform double in [0, 1).
+ */
+static double next_uniform(struct ImpairLink *link) {
+  return (next_random(link) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Time the packet finishes crossing the rate limited link.
+ */
+static uint64_t serialize(struct ImpairLink *link, const struct ImpairConfig *config, uint64_t now_ns, int len) {
+  uint64_t start = (link->link_free_ns > now_ns) ? link->link_free_ns : now_ns;
+
+  if (config->rate_bytes_per_sec == 0) {
+    return now_ns;
+  }
+  link->link_free_ns = start + (uint64_t)len * 1000000000ull / config->rate_bytes_per_sec;
+  return link->link_free_ns;
+}
+
+/**
+ * Delay plus a uniform jitter in [-jitter, +jitter], never negative.
+ */
+static uint64_t pick_delay(struct ImpairLink *link, const struct ImpairConfig *config) {
+  int64_t delay = (int64_t)config->delay_ns;
+
+  if (config->jitter_ns > 0) {
+    delay += (int64_t)(next_uniform(link) * (2 * config->jitter_ns + 1)) - (int64_t)config->jitter_ns;
+  }
+  return delay > 0 ? (uint64_t)delay : 0;
+}
+
+void init_impair_link(struct ImpairLink *link, const struct ImpairConfig *config, uint64_t stream_id) {
+  memset(link, 0, sizeof(struct ImpairLink));
+  link->rng_state = config->seed ^ (stream_id * 0xD1B54A32D192ED03ull);
+}
+
+int impair_datagram(struct ImpairLink *link, const struct ImpairConfig *config, uint64_t now_ns, int len,
+                    uint64_t release_ns[2]) {
+  int copies = 1;
+
+  link->stats.packets++;
+  link->stats.bytes += len;
+
+  // Draw every decision for every packet, so one setting changing
+  // doesn't shift the random stream seen by the others
+  double loss_draw = next_uniform(link);
+  double duplicate_draw = next_uniform(link);
+  double reorder_draw = next_uniform(link);
+
+  if (loss_draw < config->loss) {
+    link->stats.dropped++;
+    return 0;
+  }
+  if (duplicate_draw < config->duplicate) {
+    link->stats.duplicated++;
+    copies = 2;
+  }
+
+  for (int i = 0; i < copies; ++i) {
+    uint64_t departed = serialize(link, config, now_ns, len);
+    if (i == 0 && config->delay_ns > 0 && reorder_draw < config->reorder) {
+      link->stats.reordered++;
+      release_ns[i] = departed;
+    } else {
+      release_ns[i] = departed + pick_delay(link, config);
+    }
+  }
+  return copies;
+}
+
+uint64_t impair_stream(struct ImpairLink *link, const struct ImpairConfig *config, uint64_t now_ns, int len) {
+  uint64_t release;
+
+  link->stats.packets++;
+  link->stats.bytes += len;
+
+  release = serialize(link, config, now_ns, len) + pick_delay(link, config);
+  if (next_uniform(link) < config->loss) {
+    link->stats.dropped++;
+    release += config->tcp_rto_ns;
+  }
+  if (release < link->last_release_ns) {
+    release = link->last_release_ns;
+  }
+  link->last_release_ns = release;
+  return release;
+}
@@ -0,0 +1,85 @@
+//
+// Seeded network impairment model (loss, delay with jitter, reorder,
+// duplication, bandwidth cap) used by impair_proxy. Modelled on Linux
+// netem: a packet is serialized onto a link of the capped rate, then
+// delayed; "reordered" packets skip the delay and so overtake the
+// packets queued ahead of them.
+//
+
+#ifndef IN_CLASS_UDP_EXAMPLE_IMPAIRMENT_H
+#define IN_CLASS_UDP_EXAMPLE_IMPAIRMENT_H
+
+#include <stdint.h>
+
+/**
+ * Impairments applied to each direction of traffic.
+ */
+struct ImpairConfig {
+  /* probabilities, 0..1 */
+  double loss;
+  double duplicate;
+  double reorder;
+  /* one way delay, and the most it varies by either way */
+  uint64_t delay_ns;
+  uint64_t jitter_ns;
+  /* link rate, 0 for unlimited */
+  uint64_t rate_bytes_per_sec;
+  /* extra delay a lost TCP segment costs, since stream bytes can't be dropped */
+  uint64_t tcp_rto_ns;
+  /* same seed and same arrival order give the same impairments */
+  uint64_t seed;
+};
+
+/**
+ * What happened to the traffic on one link, for reporting.
+ */
+struct ImpairStats {
+  uint64_t packets;
+  uint64_t bytes;
+  uint64_t dropped;
+  uint64_t duplicated;
+  uint64_t reordered;
+  /* dropped because the proxy's queue was full */
+  uint64_t queue_dropped;
+};
+
+/**
+ * State of one direction of one path: its own random stream and when
+ * its bandwidth limited link is next free.
+ */
+struct ImpairLink {
+  uint64_t rng_state;
+  uint64_t link_free_ns;
+  /* latest release time handed out, keeps stream data in order */
+  uint64_t last_release_ns;
+  struct ImpairStats stats;
+};
+
+/**
+ * @param link the link to set up
+ * @param config impairment settings
+ * @param stream_id distinguishes links sharing a seed (e.g., 0 upstream, 1 downstream)
+ */
+void init_impair_link(struct ImpairLink *link, const struct ImpairConfig *config, uint64_t stream_id);
+
+/**
+ * Decide the fate of one datagram.
+ *
+ * @param link the link it travels on
+ * @param config impairment settings
+ * @param now_ns time it arrived
+ * @param len its length, for the bandwidth cap
+ * @param release_ns set to when each copy should be delivered
+ * @return number of copies to deliver: 0 (lost), 1, or 2 (duplicated)
+ */
+int impair_datagram(struct ImpairLink *link, const struct ImpairConfig *config, uint64_t now_ns, int len,
+                    uint64_t release_ns[2]);
+
+/**
+ * Release time for a chunk of TCP stream data. Stream data can't be
+ * lost, duplicated or reordered, so loss becomes a retransmission
+ * delay and release times never go backwards.
+ */
+uint64_t impair_stream(struct ImpairLink *link, const struct ImpairConfig *config, uint64_t now_ns, int len);
+
+#endif //IN_CLASS_UDP_EXAMPLE_IMPAIRMENT_H
@@ -9,10 +9,164 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdlib.h>
 #include <bitset>
 
 #include "udp_utils.h"
 #include "tictactoe.h"
+#include "ttt_wire.h"
+
+/**
+ * Ask the server for count games in one GetGameBatchMessage, grade
+ * them all, and report the results back in one ResultBatchMessage.
+ *
+ * @param udp_socket socket to talk to the server on
+ * @param dest_addr address of the server
+ * @param count number of games to ask for
+ * @return 0 on success, 1 on error
+ */
+int play_game_batch(int udp_socket, struct sockaddr_in *dest_addr, int count) {
+	static char send_buf[TTT_MAX_DATAGRAM];
+	static char recv_buf[2048];
+	struct GetGameBatchMessage request;
+	struct GameBatchReplyMessage games_reply;
+	struct ResultBatchMessage results;
+	struct ResultBatchReplyMessage grades_reply;
+	struct BatchGame game;
+	struct BatchResult result;
+	uint16_t grade;
+	int num_correct = 0;
+	int offset;
+	int ret;
+
+	request.hdr = {ClientGetGameBatch, GetGameBatchCodec::wire_size};
+	request.client_id = 837;
+	request.count = count;
+	offset = GetGameBatchCodec::encode(request, send_buf, sizeof(send_buf));
+
+	ret = sendto(udp_socket, send_buf, offset, 0, (struct sockaddr *) dest_addr, sizeof(struct sockaddr_in));
+	if (ret <= 0) {
+		handle_error("Sendto failed");
+		return 1;
+	}
+
+	ret = recv(udp_socket, recv_buf, sizeof(recv_buf), 0);
+	if (!GameBatchReplyCodec::decode(recv_buf, ret < 0 ? 0 : ret, games_reply) ||
+	    (games_reply.hdr.type != ServerGameBatchReply) ||
+	    (ret != (int) (GameBatchReplyCodec::wire_size + games_reply.count * BatchGameCodec::wire_size))) {
+		std::cerr << "Server error returned. You did something stupid." << std::endl;
+		return 1;
+	}
+
+	std::cout << "Received " << games_reply.count << " games in " << ret << " bytes." << std::endl;
+
+	// Grade every game, writing the results straight into the reply
+	offset = ResultBatchCodec::wire_size;
+	for (int i = 0; i < games_reply.count; ++i) {
+		BatchGameCodec::decode_unchecked(
+				(const uint8_t *) &recv_buf[GameBatchReplyCodec::wire_size + i * BatchGameCodec::wire_size], game);
+		result.game_id = game.game_id;
+		result.result = board_result(game.x_positions, game.o_positions);
+		offset += BatchResultCodec::encode(result, &send_buf[offset], sizeof(send_buf) - offset);
+	}
+
+	results.hdr = {ClientResultBatch, (uint16_t) offset};
+	results.count = games_reply.count;
+	ResultBatchCodec::encode(results, send_buf, sizeof(send_buf));
+
+	ret = sendto(udp_socket, send_buf, offset, 0, (struct sockaddr *) dest_addr, sizeof(struct sockaddr_in));
+	if (ret <= 0) {
+		handle_error("Client result batch failed.");
+		return 1;
+	}
+
+	ret = recv(udp_socket, recv_buf, sizeof(recv_buf), 0);
+	if (!ResultBatchReplyCodec::decode(recv_buf, ret < 0 ? 0 : ret, grades_reply) ||
+	    (grades_reply.hdr.type != ServerResultBatchReply) ||
+	    (ret != (int) (ResultBatchReplyCodec::wire_size + grades_reply.count * sizeof(uint16_t)))) {
+		std::cerr << "Server error returned. You did something stupid." << std::endl;
+		return 1;
+	}
+
+	for (int i = 0; i < grades_reply.count; ++i) {
+		grade = wire::load_be<uint16_t>(
+				(const uint8_t *) &recv_buf[ResultBatchReplyCodec::wire_size + i * sizeof(uint16_t)]);
+		if (grade == ServerClientResultCorrect) {
+			num_correct++;
+		}
+	}
+
+	std::cout << "Got " << num_correct << " of " << grades_reply.count << " CORRECT results from server!\n";
+	return 0;
+}
+
+/**
+ * Play a whole game against itself, asking the server for the
+ * perfect-play move every turn, and print the board as it goes.
+ * With both sides playing perfectly it should always be a cats game.
+ *
+ * @param udp_socket socket to talk to the server on
+ * @param dest_addr address of the server
+ * @return 0 on success, 1 on error
+ */
+int play_perfect_game(int udp_socket, struct sockaddr_in *dest_addr) {
+	static char send_buf[TTT_MAX_DATAGRAM];
+	static char recv_buf[2048];
+	struct BestMoveRequestMessage request;
+	struct BestMoveReplyMessage reply;
+	uint16_t x_positions = 0;
+	uint16_t o_positions = 0;
+	bool x_to_move = true;
+	int send_len;
+	int ret;
+
+	while (true) {
+		request.hdr = {ClientGetBestMove, BestMoveRequestCodec::wire_size};
+		request.client_id = 837;
+		request.x_positions = x_positions;
+		request.o_positions = o_positions;
+		send_len = BestMoveRequestCodec::encode(request, send_buf, sizeof(send_buf));
+
+		ret = sendto(udp_socket, send_buf, send_len, 0, (struct sockaddr *) dest_addr, sizeof(struct sockaddr_in));
+		if (ret <= 0) {
+			handle_error("Sendto failed");
+			return 1;
+		}
+
+		ret = recv(udp_socket, recv_buf, sizeof(recv_buf), 0);
+		if (!BestMoveReplyCodec::decode(recv_buf, ret < 0 ? 0 : ret, reply) ||
+		    (reply.hdr.type != ServerBestMoveReply) || (ret != (int) BestMoveReplyCodec::wire_size)) {
+			std::cerr << "Server error returned. You did something stupid." << std::endl;
+			return 1;
+		}
+
+		if (reply.move == 0xFFFF) {
+			break;
+		}
+		if (reply.move > 8 || ((x_positions | o_positions) & (1 << reply.move))) {
+			std::cerr << "Server suggested an impossible move " << reply.move << std::endl;
+			return 1;
+		}
+		std::cout << (x_to_move ? 'X' : 'O') << " plays " << reply.move << std::endl;
+		if (x_to_move) {
+			x_positions |= 1 << reply.move;
+		} else {
+			o_positions |= 1 << reply.move;
+		}
+		x_to_move = !x_to_move;
+	}
+
+	for (int row = 0; row < 3; ++row) {
+		for (int col = 0; col < 3; ++col) {
+			int square = row * 3 + col;
+			std::cout << ((x_positions & (1 << square)) ? 'X' : (o_positions & (1 << square)) ? 'O' : '.');
+		}
+		std::cout << std::endl;
+	}
+	std::cout << "Game over: " << (reply.value == X_WIN ? "X wins" : reply.value == O_WIN ? "O wins" : "cats game")
+	          << std::endl;
+	return 0;
+}
 
 /**
  *
@@ -54,11 +208,26 @@ int main(int argc, char *argv[]) {
 	// Send game result back to server
 	struct GameSummaryMessage get_summary_message;
 
+	// Token game variants, used when --token is given
+	struct TokenGameSummaryMessage token_summary_message;
+	struct TokenGameResultMessage token_result_send;
+	bool use_token = false;
+	bool have_token_game = false;
+
+	// Number of games to play in one batch, 0 for a single regular game
+	int batch_count = 0;
+
+	// Play a game of server suggested moves instead, when --perfect is given
+	bool perfect_game = false;
+
 	// IPv4 structure representing and IP address and port of the destination
 	struct sockaddr_in dest_addr;
 
 	/* buffer to use for receiving data */
 	static char recv_buf[2048];
+	/* buffer to encode outgoing messages into */
+	static char send_buf[TTT_MAX_DATAGRAM];
+	size_t send_len;
 
 	/* recv_addr is the client who is talking to us */
 	struct sockaddr_in recv_addr;
@@ -69,15 +238,28 @@ int main(int argc, char *argv[]) {
 	// Note we could also make it a static variable, which will be zeroed before execution
 	memset(&dest_addr, 0, sizeof(struct sockaddr_in));
 
-	// Note: this needs to be 4, because the program name counts as an argument!
+	// Note: this needs to be 3, because the program name counts as an argument!
 	if (argc < 3) {
-		std::cerr << "Please specify IP PORT DATA as first three arguments." << std::endl;
+		std::cerr << "Please specify IP PORT [--token | --batch N | --perfect] as arguments." << std::endl;
 		return 1;
 	}
 	// Set up variables "aliases"
 	ip_string = argv[1];
 	port_string = argv[2];
 
+	// --token asks for a token game, which the server grades without keeping state
+	// --batch N plays N games with one request and one result datagram
+	// --perfect plays a game against itself using the server's best moves
+	for (int i = 3; i < argc; ++i) {
+		if (strcmp(argv[i], "--token") == 0) {
+			use_token = true;
+		} else if (strcmp(argv[i], "--perfect") == 0) {
+			perfect_game = true;
+		} else if ((strcmp(argv[i], "--batch") == 0) && (i + 1 < argc)) {
+			batch_count = atoi(argv[++i]);
+		}
+	}
+
 	// Create the UDP socket.
 	// AF_INET is the address family used for IPv4 addresses
 	// SOCK_DGRAM indicates creation of a UDP socket
@@ -105,6 +287,18 @@ int main(int argc, char *argv[]) {
 		handle_error("ip/port conversion failed");
 	}
 
+	if (batch_count > 0) {
+		ret = play_game_batch(udp_socket, &dest_addr, batch_count);
+		close(udp_socket);
+		return ret;
+	}
+
+	if (perfect_game) {
+		ret = play_perfect_game(udp_socket, &dest_addr);
+		close(udp_socket);
+		return ret;
+	}
+
 
 	// Send the data to the destination.
 	// Note 1: we are sending strlen(data_string) (don't include the null terminator)
@@ -114,14 +308,13 @@ int main(int argc, char *argv[]) {
 	//ret = sendto(udp_socket, data_string, strlen(data_string), 0,
 	//             (struct sockaddr *)&dest_addr, sizeof(struct sockaddr_in));
 
-	to_send.hdr.type = htons(ClientGetGame);
-	to_send.hdr.len = htons(sizeof(struct GetGameMessage));
-	to_send.client_id = htons(837);
+	to_send.hdr = {(uint16_t) (use_token ? ClientGetTokenGame : ClientGetGame), GetGameCodec::wire_size};
+	to_send.client_id = 837;
+	send_len = GetGameCodec::encode(to_send, send_buf, sizeof(send_buf));
 
 	std::cout << "Will send 'GetGameMessage' via UDP to " << ip_string << ":" << port_string << std::endl;
 	// Now we want to send to_send struct instead
-	ret = sendto(udp_socket, &to_send, sizeof(struct GetGameMessage), 0,
-	             (struct sockaddr *) &dest_addr, sizeof(struct sockaddr_in));
+	ret = sendto(udp_socket, send_buf, send_len, 0, (struct sockaddr *) &dest_addr, sizeof(struct sockaddr_in));
 
 	// Check if send worked, clean up and exit if not.
 	if (ret <= 0) {
@@ -145,27 +338,31 @@ int main(int argc, char *argv[]) {
 	}
 
 	std::cout << "Received " << ret << " bytes from " << ip_string << ":" << port_string << std::endl;
-	if (ret >= sizeof(struct TTTMessage)) {
-		memcpy(&to_receive, recv_buf, sizeof(struct TTTMessage));
-		to_receive.type = ntohs(to_receive.type);
-		to_receive.len = ntohs(to_receive.len);
-
-		if ((to_receive.type == ServerInvalidRequestReply) && (ret >= sizeof(struct TTTMessage))) {
+	if (TTTMessageCodec::decode(recv_buf, ret, to_receive)) {
+		if (to_receive.type == ServerInvalidRequestReply) {
 			std::cout << "Server error returned. You did something stupid.";
-		} else if ((to_receive.type == ServerGameReply) && (ret >= sizeof(struct TTTMessage))) {
-			memcpy(&get_summary_message, recv_buf, sizeof(struct GameSummaryMessage));
-			get_summary_message.hdr.type = ntohs(get_summary_message.hdr.type);
-			get_summary_message.hdr.len = ntohs(get_summary_message.hdr.len);
-			get_summary_message.client_id = ntohs(get_summary_message.client_id);
-			get_summary_message.game_id = ntohs(get_summary_message.game_id);
-			get_summary_message.o_positions = ntohs(get_summary_message.o_positions);
-			get_summary_message.x_positions = ntohs(get_summary_message.x_positions);
+		} else if ((to_receive.type == ServerGameReply) &&
+		           GameSummaryCodec::decode(recv_buf, ret, get_summary_message)) {
 
 			std::cout << "Received game result length " << get_summary_message.hdr.len << " client ID "
 			          << get_summary_message.client_id
 			          << " game ID " << get_summary_message.game_id << "\nX positions:"
 			          << get_summary_message.x_positions << ", "
 			          << " O positions:" << get_summary_message.o_positions << "\n\n";
+		} else if ((to_receive.type == ServerTokenGameReply) &&
+		           TokenGameSummaryCodec::decode(recv_buf, ret, token_summary_message)) {
+			have_token_game = true;
+			get_summary_message.hdr = token_summary_message.hdr;
+			get_summary_message.client_id = token_summary_message.client_id;
+			get_summary_message.game_id = token_summary_message.game_id;
+			get_summary_message.o_positions = token_summary_message.o_positions;
+			get_summary_message.x_positions = token_summary_message.x_positions;
+
+			std::cout << "Received token game length " << get_summary_message.hdr.len << " client ID "
+			          << get_summary_message.client_id
+			          << " game ID " << get_summary_message.game_id << "\nX positions:"
+			          << get_summary_message.x_positions << ", "
+			          << " O positions:" << get_summary_message.o_positions << "\n\n";
 		}
 
 		//Initialize board; I had undefined behavior if I did not initialize it. Probably some memory issues
@@ -274,13 +471,27 @@ int main(int argc, char *argv[]) {
 	//game.result = X_WIN;
 	//std::cout << "Result sent to server: " << game.result << "\n";
 	//Send result to server
-	result_send.hdr.type = htons(ClientResult);
-	result_send.hdr.len = htons(sizeof(struct GameResultMessage));
-	result_send.game_id = htons(get_summary_message.game_id);
-	result_send.result = htons(game.result);
+	if (use_token) {
+		// Without a token there is nothing the server could check the result against
+		if (!have_token_game) {
+			std::cerr << "No token game received, not sending a result." << std::endl;
+			close(udp_socket);
+			return 1;
+		}
+		// Echo the token back untouched so the server can check the result from it alone
+		token_result_send.hdr = {ClientTokenResult, TokenGameResultCodec::wire_size};
+		token_result_send.game_id = get_summary_message.game_id;
+		token_result_send.result = game.result;
+		memcpy(token_result_send.token, token_summary_message.token, GAME_TOKEN_LEN);
+		send_len = TokenGameResultCodec::encode(token_result_send, send_buf, sizeof(send_buf));
+	} else {
+		result_send.hdr = {ClientResult, GameResultCodec::wire_size};
+		result_send.game_id = get_summary_message.game_id;
+		result_send.result = game.result;
+		send_len = GameResultCodec::encode(result_send, send_buf, sizeof(send_buf));
+	}
 
-	ret = sendto(udp_socket, &result_send, sizeof(struct GameResultMessage), 0,
-	             (struct sockaddr *) &dest_addr, sizeof(struct sockaddr_in));
+	ret = sendto(udp_socket, send_buf, send_len, 0, (struct sockaddr *) &dest_addr, sizeof(struct sockaddr_in));
 
 	// Check if send worked, clean up and exit if not.
 	if (ret <= 0) {
@@ -302,11 +513,7 @@ int main(int argc, char *argv[]) {
 	}
 
 	std::cout << "Received " << ret << " bytes from " << ip_string << ":" << port_string << std::endl;
-	if (ret >= sizeof(struct TTTMessage)) {
-		memcpy(&to_receive, recv_buf, sizeof(struct TTTMessage));
-		to_receive.type = ntohs(to_receive.type);
-		to_receive.len = ntohs(to_receive.len);
-
+	if (TTTMessageCodec::decode(recv_buf, ret, to_receive)) {
 		if ((to_receive.type != ServerClientResultIncorrect && to_receive.type != ServerClientResultCorrect)) {
 			std::cerr << "Server error returned. You did something stupid.";
 			return 1;
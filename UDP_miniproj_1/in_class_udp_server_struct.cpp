@@ -6,13 +6,364 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/random.h>
+#include <linux/sock_diag.h>
+#include <atomic>
+#include <thread>
+#include <vector>
 
 #include "udp_utils.h"
 #include "tictactoe.h"
+#include "ttt_server.h"
+#include "udp_batch_io.h"
+#include "packet_trace.h"
+#include "perfect_play.h"
+#include "metrics.h"
+#include "wire_codec.h"
+
+// Variable used to shut down the server when ctrl+c is pressed.
+static std::atomic<bool> stop(false);
+
+// Handler for when ctrl+c is pressed.
+// Just set the global 'stop' to true to shut down the server.
+void handle_ctrl_c(int the_signal) {
+  stop = true;
+}
+
+/**
+ * Ids of the metrics every worker keeps.
+ */
+struct ServerMetricIds {
+  int recv_calls;
+  int datagrams_in;
+  int bytes_in;
+  int send_calls;
+  int replies_out;
+  int bytes_out;
+  int send_errors;
+  /* replies by type: ServerInvalidRequestReply, and the two result replies */
+  int invalid_replies;
+  int correct_replies;
+  int incorrect_replies;
+  /* histogram of datagrams per receive call */
+  int recv_batch;
+  /* histogram of nanoseconds from a receive call returning to its replies being sent */
+  int batch_ns;
+};
+
+/**
+ * Options given on the command line after IP PORT.
+ */
+struct ServerOptions {
+  /* number of worker threads, each with its own SO_REUSEPORT socket */
+  int num_workers;
+  /* steer datagrams to workers by source address with a CBPF program */
+  bool use_cbpf;
+  /* pin each worker thread to its own CPU */
+  bool pin_workers;
+  /* one recvfrom/sendto per datagram instead of recvmmsg/sendmmsg */
+  bool plain_io;
+  /* coalesce replies to the same client with UDP_SEGMENT */
+  bool use_gso;
+  /* accept coalesced requests with UDP_GRO */
+  bool use_gro;
+  /* settings passed on to every shard */
+  struct ServerConfig config;
+  /* every received datagram is appended here if not NULL */
+  struct PacketTrace *trace;
+  /* registry every worker takes a metrics shard from */
+  struct MetricsRegistry *metrics;
+  struct ServerMetricIds metric_ids;
+};
+
+/**
+ * Count a reply by its type, read back from the reply header.
+ */
+static inline void count_reply(struct MetricsShard *metrics, const struct ServerMetricIds *ids, const char *reply_buf,
+                               int reply_len) {
+  uint16_t type = wire::load_be<uint16_t>((const uint8_t *)reply_buf);
+
+  metrics_add(metrics, ids->replies_out, 1);
+  metrics_add(metrics, ids->bytes_out, reply_len);
+  if (type == ServerInvalidRequestReply) {
+    metrics_add(metrics, ids->invalid_replies, 1);
+  } else if (type == ServerClientResultCorrect) {
+    metrics_add(metrics, ids->correct_replies, 1);
+  } else if (type == ServerClientResultIncorrect) {
+    metrics_add(metrics, ids->incorrect_replies, 1);
+  }
+}
+
+/**
+ * Read one field of SO_MEMINFO for every worker socket and add them up.
+ */
+static uint64_t sum_socket_meminfo(const std::vector<int> *sockets, int field) {
+  uint32_t meminfo[SK_MEMINFO_VARS];
+  socklen_t len;
+  uint64_t total = 0;
+
+  for (int udp_socket : *sockets) {
+    len = sizeof(meminfo);
+    memset(meminfo, 0, sizeof(meminfo));
+    if (getsockopt(udp_socket, SOL_SOCKET, SO_MEMINFO, meminfo, &len) == 0) {
+      total += meminfo[field];
+    }
+  }
+  return total;
+}
+
+/**
+ * Bytes waiting in the receive queues of every worker socket.
+ */
+static uint64_t rx_queue_bytes(const void *sockets) {
+  return sum_socket_meminfo((const std::vector<int> *)sockets, SK_MEMINFO_RMEM_ALLOC);
+}
+
+/**
+ * Datagrams the kernel dropped because a worker socket's queue was full.
+ */
+static uint64_t rx_drops(const void *sockets) {
+  return sum_socket_meminfo((const std::vector<int> *)sockets, SK_MEMINFO_DROPS);
+}
+
+/**
+ * Register the server's metrics.
+ *
+ * @return 0 on success, -1 if the registry is full
+ */
+static int register_server_metrics(struct MetricsRegistry *registry, struct ServerMetricIds *ids,
+                                   const std::vector<int> *sockets) {
+  ids->recv_calls = metrics_counter(registry, "udp.recv_calls");
+  ids->datagrams_in = metrics_counter(registry, "udp.datagrams_in");
+  ids->bytes_in = metrics_counter(registry, "udp.bytes_in");
+  ids->send_calls = metrics_counter(registry, "udp.send_calls");
+  ids->replies_out = metrics_counter(registry, "udp.replies_out");
+  ids->bytes_out = metrics_counter(registry, "udp.bytes_out");
+  ids->send_errors = metrics_counter(registry, "udp.send_errors");
+  ids->invalid_replies = metrics_counter(registry, "ttt.reply.invalid_request");
+  ids->correct_replies = metrics_counter(registry, "ttt.reply.result_correct");
+  ids->incorrect_replies = metrics_counter(registry, "ttt.reply.result_incorrect");
+  ids->recv_batch = metrics_histogram(registry, "udp.recv_batch");
+  ids->batch_ns = metrics_histogram(registry, "udp.batch_ns");
+  if (ids->recv_batch == -1 || ids->batch_ns == -1 || ids->incorrect_replies == -1) {
+    return -1;
+  }
+  if (metrics_gauge(registry, "udp.rx_queue_bytes", rx_queue_bytes, sockets) == -1 ||
+      metrics_gauge(registry, "udp.rx_drops", rx_drops, sockets) == -1) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Answer requests one recvfrom/sendto at a time.
+ *
+ * @param udp_socket the reuseport socket owned by this worker
+ * @param shard the worker's shard
+ * @param metrics the worker's metrics shard
+ * @param options server options
+ */
+static void serve_plain(int udp_socket, struct ServerShard *shard, struct MetricsShard *metrics,
+                        const struct ServerOptions *options) {
+  const struct ServerMetricIds *ids = &options->metric_ids;
+  /* buffer to use for receiving data */
+  char recv_buf[2048];
+  /* buffer to use for sending data */
+  char send_buf[2048];
+  /* recv_addr is the client who is talking to us */
+  struct sockaddr_in recv_addr;
+  /* recv_addr_size stores the size of recv_addr */
+  socklen_t recv_addr_size;
+  int reply_len;
+  int ret;
+
+  while (!stop) {
+    recv_addr_size = sizeof(struct sockaddr_in);
+    ret = recvfrom(udp_socket, recv_buf, sizeof(recv_buf), 0, (struct sockaddr *)&recv_addr, &recv_addr_size);
+    server_shard_tick(shard, monotonic_ms());
+
+    if (ret < 0) {
+      // Timed out or interrupted, go back and check stop
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        continue;
+      }
+      handle_error("recvfrom failed for some reason");
+      break;
+    }
+
+    metrics_add(metrics, ids->recv_calls, 1);
+    metrics_add(metrics, ids->datagrams_in, 1);
+    metrics_add(metrics, ids->bytes_in, ret);
+    metrics_record(metrics, ids->recv_batch, 1);
+
+    if (options->trace != NULL) {
+      trace_record(options->trace, trace_now_ns(), &recv_addr, recv_buf, ret);
+    }
+
+    reply_len = handle_ttt_datagram(shard, &recv_addr, recv_buf, ret, send_buf, sizeof(send_buf));
+    if (reply_len <= 0) {
+      continue;
+    }
+
+    count_reply(metrics, ids, send_buf, reply_len);
+    metrics_add(metrics, ids->send_calls, 1);
+    ret = sendto(udp_socket, send_buf, reply_len, 0, (struct sockaddr *)&recv_addr, recv_addr_size);
+    if (ret <= 0) {
+      metrics_add(metrics, ids->send_errors, 1);
+      handle_error("sendto failed for some reason");
+    }
+  }
+}
+
+/**
+ * Answer requests a batch at a time: every datagram ready on the
+ * socket is read with one recvmmsg, and all replies go out with one
+ * sendmmsg, runs of replies to the same client coalesced by GSO.
+ *
+ * @param udp_socket the reuseport socket owned by this worker
+ * @param shard the worker's shard
+ * @param metrics the worker's metrics shard
+ * @param options server options
+ */
+static void serve_batched(int udp_socket, struct ServerShard *shard, struct MetricsShard *metrics,
+                          const struct ServerOptions *options) {
+  const struct ServerMetricIds *ids = &options->metric_ids;
+  struct RecvBatch *recv_batch;
+  struct SendBatch *send_batch;
+  const struct sockaddr_in *from;
+  const char *data;
+  char *reply_buf;
+  int reply_cap;
+  int reply_len;
+  int len;
+  int ret;
+  int datagrams;
+  uint64_t received_ns;
+  uint64_t sent_calls;
+  bool use_gro = options->use_gro && (enable_udp_gro(udp_socket) == 0);
+
+  recv_batch = (struct RecvBatch *)malloc(sizeof(struct RecvBatch));
+  send_batch = (struct SendBatch *)malloc(sizeof(struct SendBatch));
+  if (init_recv_batch(recv_batch, udp_socket, use_gro) == -1) {
+    std::cerr << "Worker " << shard->index << " could not allocate receive buffers." << std::endl;
+    free(recv_batch);
+    free(send_batch);
+    return;
+  }
+  init_send_batch(send_batch, udp_socket, options->use_gso);
+
+  std::cout << "Worker " << shard->index << " using recvmmsg/sendmmsg, GSO "
+            << (send_batch->use_gso ? "on" : "off") << ", GRO " << (use_gro ? "on" : "off") << std::endl;
+
+  while (!stop) {
+    ret = recv_batch_fill(recv_batch, 0);
+    server_shard_tick(shard, monotonic_ms());
+
+    if (ret < 0) {
+      // Timed out or interrupted, go back and check stop
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        continue;
+      }
+      handle_error("recvmmsg failed for some reason");
+      break;
+    }
+
+    // One timestamp per recvmmsg, the datagrams in it arrived together
+    received_ns = trace_now_ns();
+    sent_calls = send_batch->syscalls;
+    datagrams = 0;
+    while (recv_batch_next(recv_batch, &data, &len, &from)) {
+      if (options->trace != NULL) {
+        trace_record(options->trace, received_ns, from, data, len);
+      }
+      datagrams++;
+      metrics_add(metrics, ids->bytes_in, len);
+      reply_buf = send_batch_space(send_batch, &reply_cap);
+      reply_len = handle_ttt_datagram(shard, from, data, len, reply_buf, reply_cap);
+      if (reply_len > 0) {
+        count_reply(metrics, ids, reply_buf, reply_len);
+        send_batch_commit(send_batch, from, reply_len);
+      }
+    }
+
+    if (flush_send_batch(send_batch) == -1) {
+      metrics_add(metrics, ids->send_errors, 1);
+      handle_error("sendmmsg failed for some reason");
+    }
+    metrics_add(metrics, ids->recv_calls, 1);
+    metrics_add(metrics, ids->datagrams_in, datagrams);
+    metrics_add(metrics, ids->send_calls, send_batch->syscalls - sent_calls);
+    metrics_record(metrics, ids->recv_batch, datagrams);
+    metrics_record(metrics, ids->batch_ns, trace_now_ns() - received_ns);
+  }
+
+  std::cout << "Worker " << shard->index << ": " << recv_batch->datagrams << " datagrams in "
+            << recv_batch->syscalls << " receive calls, " << send_batch->datagrams << " replies in "
+            << send_batch->syscalls << " send calls" << std::endl;
+
+  free_recv_batch(recv_batch);
+  free(recv_batch);
+  free(send_batch);
+}
+
+/**
+ * Serve requests on one socket until ctrl+c is pressed.
+ *
+ * @param worker_index index of this worker, used for CPU pinning
+ * @param udp_socket the reuseport socket owned by this worker
+ * @param options server options
+ */
+static void run_worker(int worker_index, int udp_socket, const struct ServerOptions *options) {
+  /* the games this worker has handed out */
+  struct ServerShard *shard;
+  /* this worker's share of the server metrics */
+  struct MetricsShard *metrics;
+  int ret;
+
+  if (options->pin_workers) {
+    ret = pin_thread_to_cpu(worker_index);
+    if (ret == -1) {
+      handle_error("pin_thread_to_cpu failed");
+    } else {
+      std::cout << "Worker " << worker_index << " pinned to CPU " << ret << std::endl;
+    }
+  }
+
+  shard = (struct ServerShard *)malloc(sizeof(struct ServerShard));
+  if (init_server_shard(shard, worker_index, &options->config) == -1) {
+    std::cerr << "Worker " << worker_index << " could not allocate its session table." << std::endl;
+    free(shard);
+    return;
+  }
+
+  metrics = metrics_shard(options->metrics);
+  if (metrics == NULL) {
+    std::cerr << "Worker " << worker_index << " could not get a metrics shard." << std::endl;
+    free_server_shard(shard);
+    free(shard);
+    return;
+  }
+
+  if (options->plain_io) {
+    serve_plain(udp_socket, shard, metrics, options);
+  } else {
+    serve_batched(udp_socket, shard, metrics, options);
+  }
+
+  free_server_shard(shard);
+  free(shard);
+}
 
 /**
  * Entrypoint to the program.
  *
+ * e.g., ./udpserver 127.0.0.1 8888 --workers 4 --cbpf --session-ttl 10000
+ *       ./udpserver 127.0.0.1 8888 --record incident.trace
+ *       ./udpserver 127.0.0.1 8888 --board-mix 25,25,25,25
+ *       ./udpserver 127.0.0.1 8888 --stats /tmp/udpserver.stats
+ *
  * @param argc count of arguments on command line
  * @param argv character array of command line arguments
  *
@@ -23,32 +374,30 @@ int main(int argc, char *argv[]) {
   char *ip_str;
   /* alias for command line argument for port */
   char *port_str;
-  /* udp_socket will be the socket used for sending/receiving */
-  int udp_socket;
-  /* port will be the integer value of the port */
-  unsigned int port;
-
-  struct TTTMessage to_receive;
-
-  struct GetGameMessage get_game_message;
+  /* one reuseport socket per worker */
+  std::vector<int> sockets;
+  /* one thread per worker */
+  std::vector<std::thread> workers;
+  /* options parsed from the command line */
+  struct ServerOptions options;
+  /* file to record received datagrams to, if any */
+  const char *record_path = NULL;
+  size_t record_capacity = TRACE_DEFAULT_CAPACITY;
+  /* Unix socket to serve metrics on, if any */
+  const char *stats_path = NULL;
+  struct StatsServer *stats_server = NULL;
 
   /* Dest contains the IP address and port in binary format for bind() */
   struct sockaddr_in dest;
-
-  /* buffer to use for receiving data */
-  static char recv_buf[2048];
-
-  /* recv_addr is the client who is talking to us */
-  struct sockaddr_in recv_addr;
-  /* recv_addr_size stores the size of recv_addr */
-  socklen_t recv_addr_size;
-  /* buffer to use for sending data */
-  static char send_buf[2048];
+  /* Receive timeout so workers notice ctrl+c */
+  struct timeval recv_timeout;
   /* variable to hold return values from network functions */
   int ret;
 
   if (argc < 3) {
-    std::cerr << "Provide IP PORT as first two arguments." << std::endl;
+    std::cerr << "Provide IP PORT [--workers N] [--cbpf] [--no-pin] [--max-sessions N] [--session-ttl MS]"
+              << " [--stateless] [--board-mix X,O,CATS,INVALID] [--plain-io] [--no-gso] [--no-gro]"
+              << " [--record FILE] [--record-mb N] [--stats SOCKET] as arguments." << std::endl;
     return 1;
   }
   /* assign ip_str to the first command line argument */
@@ -56,78 +405,167 @@ int main(int argc, char *argv[]) {
   /* assign port_str to the second command line argument */
   port_str = argv[2];
 
-  // 1. Create the socket
-  udp_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-
-  // 2. Bind the socket
+  options.num_workers = 1;
+  options.use_cbpf = false;
+  options.pin_workers = true;
+  options.plain_io = false;
+  options.use_gso = true;
+  options.use_gro = true;
+  options.config.max_sessions = 1 << 20;
+  options.config.session_ttl_ms = 30000;
+  options.config.stateless = false;
+  options.config.board_mix = {30, 30, 30, 10};
+  options.trace = NULL;
+  for (int i = 3; i < argc; ++i) {
+    if ((strcmp(argv[i], "--workers") == 0) && (i + 1 < argc)) {
+      options.num_workers = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--cbpf") == 0) {
+      options.use_cbpf = true;
+    } else if (strcmp(argv[i], "--no-pin") == 0) {
+      options.pin_workers = false;
+    } else if ((strcmp(argv[i], "--max-sessions") == 0) && (i + 1 < argc)) {
+      options.config.max_sessions = strtoul(argv[++i], NULL, 10);
+    } else if ((strcmp(argv[i], "--session-ttl") == 0) && (i + 1 < argc)) {
+      options.config.session_ttl_ms = strtoul(argv[++i], NULL, 10);
+    } else if ((strcmp(argv[i], "--board-mix") == 0) && (i + 1 < argc)) {
+      if (parse_board_mix(argv[++i], &options.config.board_mix) == -1) {
+        std::cerr << "--board-mix takes X,O,CATS,INVALID weights, e.g. 30,30,30,10" << std::endl;
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--stateless") == 0) {
+      options.config.stateless = true;
+    } else if (strcmp(argv[i], "--plain-io") == 0) {
+      options.plain_io = true;
+    } else if (strcmp(argv[i], "--no-gso") == 0) {
+      options.use_gso = false;
+    } else if (strcmp(argv[i], "--no-gro") == 0) {
+      options.use_gro = false;
+    } else if ((strcmp(argv[i], "--record") == 0) && (i + 1 < argc)) {
+      record_path = argv[++i];
+    } else if ((strcmp(argv[i], "--record-mb") == 0) && (i + 1 < argc)) {
+      record_capacity = strtoull(argv[++i], NULL, 10) << 20;
+    } else if ((strcmp(argv[i], "--stats") == 0) && (i + 1 < argc)) {
+      stats_path = argv[++i];
+    } else {
+      std::cerr << "Unknown option " << argv[i] << std::endl;
+      return 1;
+    }
+  }
 
-  // 2.1 convert ip address to binary form, store in dest
-  ret = inet_pton(AF_INET, ip_str, &dest.sin_addr);
-  if (ret == -1) {
-    handle_error("inet_pton conversion failed");
+  if (options.num_workers < 1) {
+    std::cerr << "Need at least one worker." << std::endl;
     return 1;
   }
 
-  // 2.2 convert port into binary form, store in dest
-
-  ret = sscanf(port_str, "%u", &port);
-  if (ret != 1) {
-    std::cout << "Failed to convert port properly." << std::endl;
+  // Fresh token key every run, so tokens from a previous run are rejected
+  ret = getrandom(options.config.token_key, sizeof(options.config.token_key), 0);
+  if (ret != sizeof(options.config.token_key)) {
+    handle_error("getrandom failed");
     return 1;
   }
 
-  dest.sin_port = htons(port);
-  // 2.3 set address type of dest
-  dest.sin_family = AF_INET;
+  // Build the board and perfect play tables now rather than on the first request
+  std::cout << "Boards: " << board_table_size(X_WIN) << " X_WIN, " << board_table_size(O_WIN) << " O_WIN, "
+            << board_table_size(CATS_GAME) << " CATS_GAME, " << board_table_size(INVALID_BOARD)
+            << " INVALID_BOARD" << std::endl;
+  std::cout << "Perfect play: " << perfect_play_table_size() << " positions solved" << std::endl;
+
+  if (record_path != NULL) {
+    options.trace = new PacketTrace;
+    if (open_trace_writer(options.trace, record_path, record_capacity) == -1) {
+      handle_error("could not create trace file");
+      return 1;
+    }
+    std::cout << "Recording received datagrams to " << record_path << std::endl;
+  }
 
-  ret = bind(udp_socket, (struct sockaddr *)&dest, sizeof(struct sockaddr_in));
+  struct sigaction ctrl_c_handler;
+  ctrl_c_handler.sa_handler = handle_ctrl_c;
+  sigemptyset(&ctrl_c_handler.sa_mask);
+  ctrl_c_handler.sa_flags = 0;
+  sigaction(SIGINT, &ctrl_c_handler, NULL);
 
+  memset(&dest, 0, sizeof(struct sockaddr_in));
+  ret = convert_ip_port_to_sockaddr_in(ip_str, port_str, &dest);
   if (ret == -1) {
-    handle_error("bind failed");
+    handle_error("ip/port conversion failed");
     return 1;
   }
 
-  // 3. Receive data
-  recv_addr_size = sizeof(struct sockaddr_in);
-  ret = recvfrom(udp_socket, recv_buf, 2047, 0, (struct sockaddr *)&recv_addr, &recv_addr_size);
+  recv_timeout.tv_sec = 1;
+  recv_timeout.tv_usec = 0;
 
-  if (ret <= 0) {
-    handle_error("recvfrom failed for some reason");
-    close(udp_socket);
-    return 1;
+  // 1. Create and bind one socket per worker. They all share the
+  //    address, and the kernel load balances between them.
+  for (int i = 0; i < options.num_workers; ++i) {
+    ret = create_reuseport_udp_socket(&dest);
+    if (ret == -1) {
+      handle_error("bind failed");
+      return 1;
+    }
+    setsockopt(ret, SOL_SOCKET, SO_RCVTIMEO, &recv_timeout, sizeof(recv_timeout));
+    sockets.push_back(ret);
   }
 
-  std::cout << "Received " << ret << " bytes of data." << std::endl;
-  if (ret >= sizeof(struct TTTMessage)) {
-    memcpy(&to_receive, recv_buf, sizeof(struct TTTMessage));
-    to_receive.type = ntohs(to_receive.type);
-    to_receive.len = ntohs(to_receive.len);
-    std::cout << "received message type " << to_receive.type << " length " << to_receive.len << std::endl;
-
-    if ((to_receive.type == ClientGetGame) && (ret >= sizeof(struct GetGameMessage)))
-    {
-      memcpy(&get_game_message, recv_buf, sizeof(struct GetGameMessage));
-      get_game_message.hdr.type = ntohs(get_game_message.hdr.type);
-      get_game_message.hdr.len = ntohs(get_game_message.hdr.len);
-      get_game_message.client_id = ntohs(get_game_message.client_id);
+  // 2. Optionally steer by source address so each client's games
+  //    stay on the shard that issued them.
+  if (options.use_cbpf) {
+    ret = attach_reuseport_cbpf(sockets[0], options.num_workers);
+    if (ret == -1) {
+      handle_error("SO_ATTACH_REUSEPORT_CBPF failed, using kernel hash");
+    }
+  }
 
-      std::cout << "received GetGameMessage, type " << get_game_message.hdr.type << " length "
-                << get_game_message.hdr.len << " client_id " << get_game_message.client_id << std::endl;
+  // 3. Count everything the workers do; the registry outlives them
+  options.metrics = new MetricsRegistry;
+  init_metrics_registry(options.metrics);
+  if (register_server_metrics(options.metrics, &options.metric_ids, &sockets) == -1) {
+    std::cerr << "Too many metrics for the registry." << std::endl;
+    return 1;
+  }
+  if (stats_path != NULL) {
+    stats_server = new StatsServer;
+    if (start_stats_server(stats_server, options.metrics, stats_path) == -1) {
+      handle_error("could not create stats socket");
+      return 1;
     }
+    std::cout << "Serving stats on " << stats_path << std::endl;
   }
-  //recv_buf[ret] = '\0';
-  //std::cout << "Data received was `" << recv_buf << "'" << std::endl;
 
-  // 4. Send back data
-  ret = sendto(udp_socket, recv_buf, ret, 0, (struct sockaddr *)&recv_addr, recv_addr_size);
+  std::cout << "Serving on " << ip_str << ":" << port_str << " with " << options.num_workers
+            << " worker(s)" << std::endl;
 
-  if (ret <= 0) {
-    handle_error("sendto failed for some reason");
-    close(udp_socket);
-    return 1;
+  // 4. Receive and answer requests until ctrl+c
+  for (int i = 0; i < options.num_workers; ++i) {
+    workers.push_back(std::thread(run_worker, i, sockets[i], &options));
+  }
+
+  for (int i = 0; i < options.num_workers; ++i) {
+    workers[i].join();
+  }
+  // The stats thread reads the sockets' queue lengths, so stop it first
+  if (stats_server != NULL) {
+    stop_stats_server(stats_server);
+    delete stats_server;
+  }
+  for (int i = 0; i < options.num_workers; ++i) {
+    close(sockets[i]);
+  }
+  free_metrics_registry(options.metrics);
+  delete options.metrics;
+
+  if (options.trace != NULL) {
+    std::cout << "Recorded " << options.trace->records << " datagrams to " << record_path;
+    if (options.trace->dropped > 0) {
+      std::cout << " (" << options.trace->dropped << " dropped, trace full)";
+    }
+    std::cout << std::endl;
+    if (close_trace_writer(options.trace) == -1) {
+      handle_error("could not finish trace file");
+    }
+    delete options.trace;
   }
 
-  std::cout << "sent " << ret << " bytes to client" << std::endl;
-  close(udp_socket);
+  std::cout << "Server shut down." << std::endl;
   return 0;
 }
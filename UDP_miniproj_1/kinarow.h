@@ -0,0 +1,235 @@
+//
+// k-in-a-row on a W x H board with bitboards. Each side's marks are a
+// bit set with one spare (always empty) column after every row, so a
+// run of marks is found by and-ing the board with itself shifted one
+// step in a direction; the spare column stops runs wrapping between
+// rows. Everything is constexpr and the shifts are compile time
+// constants, so a 15x15 board costs a few dozen word operations.
+//
+// KInARow<3, 3, 3> is TicTacToe on the 9 bit masks of tictactoe.h,
+// answered from a table worked out at compile time.
+//
+
+#ifndef IN_CLASS_UDP_EXAMPLE_KINAROW_H
+#define IN_CLASS_UDP_EXAMPLE_KINAROW_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tictactoe.h"
+
+namespace kinarow {
+
+/**
+ * A set of Words * 64 bits.
+ */
+template <size_t Words>
+struct Bitboard {
+  uint64_t w[Words];
+
+  constexpr Bitboard() : w{} {}
+
+  constexpr Bitboard operator&(const Bitboard &other) const {
+    Bitboard out;
+    for (size_t i = 0; i < Words; ++i) {
+      out.w[i] = w[i] & other.w[i];
+    }
+    return out;
+  }
+
+  constexpr bool any() const {
+    uint64_t bits = 0;
+    for (size_t i = 0; i < Words; ++i) {
+      bits |= w[i];
+    }
+    return bits != 0;
+  }
+
+  /**
+   * This board moved N bits towards bit 0.
+   */
+  template <int N>
+  constexpr Bitboard shr() const {
+    constexpr size_t word_shift = N / 64;
+    constexpr int bit_shift = N % 64;
+    Bitboard out;
+    for (size_t i = 0; i + word_shift < Words; ++i) {
+      out.w[i] = w[i + word_shift] >> bit_shift;
+      if constexpr (bit_shift != 0) {
+        if (i + word_shift + 1 < Words) {
+          out.w[i] |= w[i + word_shift + 1] << (64 - bit_shift);
+        }
+      }
+    }
+    return out;
+  }
+
+  /**
+   * Or value in starting at bit offset.
+   */
+  constexpr void insert(int offset, uint64_t value) {
+    w[offset / 64] |= value << (offset % 64);
+    if ((offset % 64) != 0 && (size_t)(offset / 64 + 1) < Words) {
+      w[offset / 64 + 1] |= value >> (64 - offset % 64);
+    }
+  }
+};
+
+/**
+ * Line detection for any board of up to 16 columns (rows are sent as
+ * uint16_t masks, bit c set for a mark in column c).
+ */
+template <int W, int H, int K>
+struct KInARowEngine {
+  static_assert(W >= 1 && W <= 16 && H >= 1, "rows must fit a uint16_t");
+  static_assert(K >= 1 && (K <= W || K <= H), "a line of K must fit on the board");
+
+  static constexpr int width = W;
+  static constexpr int height = H;
+  static constexpr int k = K;
+  /* bits per row, including the spare column */
+  static constexpr int stride = W + 1;
+  static constexpr size_t words = (stride * H + 63) / 64;
+  using Board = Bitboard<words>;
+  static constexpr uint16_t row_mask = (uint16_t)((1u << W) - 1);
+
+  static constexpr Board from_rows(const uint16_t *rows) {
+    Board board;
+    for (int r = 0; r < H; ++r) {
+      board.insert(r * stride, rows[r] & row_mask);
+    }
+    return board;
+  }
+
+  /**
+   * Bits where a run of Run marks starts, heading Step bits at a time.
+   * Runs are built by doubling, so K = 5 takes 3 shifts, not 4.
+   */
+  template <int Step, int Run>
+  static constexpr Board runs(const Board &board) {
+    if constexpr (Run == 1) {
+      return board;
+    } else if constexpr (Run % 2 == 0) {
+      Board half = runs<Step, Run / 2>(board);
+      return half & half.template shr<(Run / 2) * Step>();
+    } else {
+      Board shorter = runs<Step, Run - 1>(board);
+      return shorter & board.template shr<(Run - 1) * Step>();
+    }
+  }
+
+  static constexpr bool has_line(const Board &board) {
+    bool found = false;
+    if constexpr (K <= W) {
+      found = found || runs<1, K>(board).any();
+    }
+    if constexpr (K <= H) {
+      found = found || runs<stride, K>(board).any();
+    }
+    if constexpr (K <= W && K <= H) {
+      found = found || runs<stride + 1, K>(board).any() || runs<stride - 1, K>(board).any();
+    }
+    return found;
+  }
+
+  /**
+   * The ResultType of a board given as H row masks per side, with the
+   * same rules as board_result(): marks outside the board, X and O
+   * sharing a square, or both sides winning make it INVALID_BOARD.
+   */
+  static constexpr ResultType result(const uint16_t *x_rows, const uint16_t *o_rows) {
+    uint16_t stray = 0;
+    uint16_t shared = 0;
+    for (int r = 0; r < H; ++r) {
+      stray |= (x_rows[r] | o_rows[r]) & ~row_mask;
+      shared |= x_rows[r] & o_rows[r];
+    }
+    if (stray != 0 || shared != 0) {
+      return INVALID_BOARD;
+    }
+
+    bool x_wins = has_line(from_rows(x_rows));
+    bool o_wins = has_line(from_rows(o_rows));
+    if (x_wins && o_wins) {
+      return INVALID_BOARD;
+    } else if (x_wins) {
+      return X_WIN;
+    } else if (o_wins) {
+      return O_WIN;
+    }
+    return CATS_GAME;
+  }
+};
+
+template <int W, int H, int K>
+struct KInARow : KInARowEngine<W, H, K> {};
+
+/**
+ * Bit m of line_masks[m / 64] is set if the 9 bit TicTacToe mask m
+ * holds three in a row.
+ */
+struct LineTable {
+  uint64_t line_masks[8];
+};
+
+constexpr LineTable make_tictactoe_lines() {
+  using Engine = KInARowEngine<3, 3, 3>;
+  LineTable table{};
+  for (uint16_t mask = 0; mask < 512; ++mask) {
+    uint16_t rows[3] = {(uint16_t)(mask & 7), (uint16_t)((mask >> 3) & 7), (uint16_t)(mask >> 6)};
+    if (Engine::has_line(Engine::from_rows(rows))) {
+      table.line_masks[mask / 64] |= 1ull << (mask % 64);
+    }
+  }
+  return table;
+}
+
+inline constexpr LineTable tictactoe_lines = make_tictactoe_lines();
+
+/**
+ * TicTacToe. Whether each of the 512 possible 9 bit masks holds a line
+ * is worked out by the generic engine while compiling, so a board is
+ * graded with two bit tests.
+ */
+template <>
+struct KInARow<3, 3, 3> : KInARowEngine<3, 3, 3> {
+  using KInARowEngine<3, 3, 3>::result;
+
+  static constexpr bool mask_has_line(uint16_t mask) {
+    return (tictactoe_lines.line_masks[mask / 64] >> (mask % 64)) & 1;
+  }
+
+  /**
+   * board_result() on the 9 bit x_positions/o_positions masks.
+   */
+  static constexpr ResultType result(uint16_t x_positions, uint16_t o_positions) {
+    if ((x_positions & o_positions) != 0 || ((x_positions | o_positions) & ~0x1FF) != 0) {
+      return INVALID_BOARD;
+    }
+
+    bool x_wins = mask_has_line(x_positions);
+    bool o_wins = mask_has_line(o_positions);
+    if (x_wins && o_wins) {
+      return INVALID_BOARD;
+    } else if (x_wins) {
+      return X_WIN;
+    } else if (o_wins) {
+      return O_WIN;
+    }
+    return CATS_GAME;
+  }
+};
+
+using TicTacToe = KInARow<3, 3, 3>;
+using Gomoku = KInARow<15, 15, 5>;
+
+// The compile time table agrees with the lines of tictactoe.h
+static_assert(TicTacToe::result(0x007, 0x000) == X_WIN, "top row");
+static_assert(TicTacToe::result(0x000, 0x124) == O_WIN, "right column");
+static_assert(TicTacToe::result(0x111, 0x054 & ~0x111) == X_WIN, "diagonal");
+static_assert(TicTacToe::result(0x007, 0x038) == INVALID_BOARD, "both win");
+static_assert(TicTacToe::result(0x0A5, 0x15A) == CATS_GAME, "no line");
+
+}  // namespace kinarow
+
+#endif //IN_CLASS_UDP_EXAMPLE_KINAROW_H
@@ -0,0 +1,48 @@
+//
+// Board sizes served with the large board messages, each graded by
+// its own instantiation of the kinarow.h engine.
+//
+
+#ifndef IN_CLASS_UDP_EXAMPLE_LARGE_BOARD_H
+#define IN_CLASS_UDP_EXAMPLE_LARGE_BOARD_H
+
+#include <stdint.h>
+
+#include "tictactoe.h"
+#include "board_gen.h"
+
+/**
+ * One board size and line length, and its grader.
+ */
+struct LargeVariant {
+  uint16_t width;
+  uint16_t height;
+  uint16_t k;
+  ResultType (*result)(const uint16_t *x_rows, const uint16_t *o_rows);
+};
+
+/**
+ * @return the variant for a board size, or NULL if it isn't served
+ */
+const struct LargeVariant *find_large_variant(uint16_t width, uint16_t height, uint16_t k);
+
+/**
+ * Fill in a random board, each square a quarter likely to be X and a
+ * quarter O (with some overlaps left in to make invalid boards).
+ */
+void random_large_board(struct BoardRng *rng, const struct LargeVariant *variant, uint16_t *x_rows,
+                        uint16_t *o_rows);
+
+/**
+ * Write the X rows then the O rows as big endian uint16_t's.
+ *
+ * @return bytes written, 4 * height
+ */
+int encode_large_rows(const uint16_t *x_rows, const uint16_t *o_rows, uint16_t height, char *buf);
+
+/**
+ * Read rows written by encode_large_rows. buf must hold 4 * height bytes.
+ */
+void decode_large_rows(const char *buf, uint16_t height, uint16_t *x_rows, uint16_t *o_rows);
+
+#endif //IN_CLASS_UDP_EXAMPLE_LARGE_BOARD_H
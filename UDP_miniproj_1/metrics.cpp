@@ -0,0 +1,309 @@
+#include "metrics.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// Percentiles reported for each histogram, in tenths of a percent
+#define NUM_PERCENTILES 4
+static const int percentiles[NUM_PERCENTILES] = {500, 900, 990, 999};
+static const char *percentile_names[NUM_PERCENTILES] = {"p50", "p90", "p99", "p999"};
+
+static uint64_t metrics_now_ms() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void init_metrics_registry(struct MetricsRegistry *registry) {
+  registry->num_counters = 0;
+  registry->num_gauges = 0;
+  registry->num_histograms = 0;
+  registry->num_shards.store(0);
+  for (int i = 0; i < METRICS_MAX_SHARDS; ++i) {
+    registry->shards[i].store(NULL);
+  }
+  registry->start_ms = metrics_now_ms();
+}
+
+void free_metrics_registry(struct MetricsRegistry *registry) {
+  for (int i = 0; i < METRICS_MAX_SHARDS; ++i) {
+    delete registry->shards[i].exchange(NULL);
+  }
+  registry->num_shards.store(0);
+}
+
+static void copy_name(char *dest, const char *name) {
+  strncpy(dest, name, METRICS_NAME_LEN - 1);
+  dest[METRICS_NAME_LEN - 1] = '\0';
+}
+
+int metrics_counter(struct MetricsRegistry *registry, const char *name) {
+  if (registry->num_counters == METRICS_MAX_COUNTERS) {
+    return -1;
+  }
+  copy_name(registry->counter_names[registry->num_counters], name);
+  return registry->num_counters++;
+}
+
+int metrics_gauge(struct MetricsRegistry *registry, const char *name, MetricsGaugeFn fn, const void *arg) {
+  if (registry->num_gauges == METRICS_MAX_GAUGES) {
+    return -1;
+  }
+  copy_name(registry->gauge_names[registry->num_gauges], name);
+  registry->gauge_fns[registry->num_gauges] = fn;
+  registry->gauge_args[registry->num_gauges] = arg;
+  registry->num_gauges++;
+  return 0;
+}
+
+int metrics_histogram(struct MetricsRegistry *registry, const char *name) {
+  if (registry->num_histograms == METRICS_MAX_HISTOGRAMS) {
+    return -1;
+  }
+  copy_name(registry->histogram_names[registry->num_histograms], name);
+  return registry->num_histograms++;
+}
+
+struct MetricsShard *metrics_shard(struct MetricsRegistry *registry) {
+  int index = registry->num_shards.fetch_add(1);
+  struct MetricsShard *shard;
+
+  if (index >= METRICS_MAX_SHARDS) {
+    return NULL;
+  }
+  // Value initialized, so every counter and bucket starts at zero
+  shard = new MetricsShard();
+  registry->shards[index].store(shard, std::memory_order_release);
+  return shard;
+}
+
+/**
+ * Largest value that lands in a bucket.
+ */
+static uint64_t bucket_limit(int bucket) {
+  int block = bucket >> METRICS_SUB_BITS;
+  int sub = bucket & ((1 << METRICS_SUB_BITS) - 1);
+  int shift;
+
+  if (block == 0) {
+    return (uint64_t)bucket;
+  }
+  shift = block - 1;
+  return ((((uint64_t)1 << METRICS_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+/**
+ * printf onto the end of buf, keeping track of how much has been used.
+ * Output past cap is dropped.
+ */
+static void append(char *buf, size_t cap, size_t *used, const char *format, ...) {
+  va_list args;
+  int ret;
+
+  if (*used + 1 >= cap) {
+    return;
+  }
+  va_start(args, format);
+  ret = vsnprintf(&buf[*used], cap - *used, format, args);
+  va_end(args);
+  if (ret > 0) {
+    *used += (size_t)ret < cap - *used ? (size_t)ret : cap - *used - 1;
+  }
+}
+
+size_t metrics_format(const struct MetricsRegistry *registry, char *buf, size_t cap) {
+  static thread_local uint64_t buckets[METRICS_HIST_BUCKETS];
+  int num_shards = registry->num_shards.load(std::memory_order_acquire);
+  size_t used = 0;
+
+  if (num_shards > METRICS_MAX_SHARDS) {
+    num_shards = METRICS_MAX_SHARDS;
+  }
+  if (cap > 0) {
+    buf[0] = '\0';
+  }
+
+  append(buf, cap, &used, "uptime_ms %llu\n", (unsigned long long)(metrics_now_ms() - registry->start_ms));
+
+  for (int c = 0; c < registry->num_counters; ++c) {
+    uint64_t total = 0;
+    for (int s = 0; s < num_shards; ++s) {
+      const struct MetricsShard *shard = registry->shards[s].load(std::memory_order_acquire);
+      if (shard != NULL) {
+        total += shard->counters[c].load(std::memory_order_relaxed);
+      }
+    }
+    append(buf, cap, &used, "%s %llu\n", registry->counter_names[c], (unsigned long long)total);
+  }
+
+  for (int g = 0; g < registry->num_gauges; ++g) {
+    append(buf, cap, &used, "%s %llu\n", registry->gauge_names[g],
+           (unsigned long long)registry->gauge_fns[g](registry->gauge_args[g]));
+  }
+
+  for (int h = 0; h < registry->num_histograms; ++h) {
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t seen = 0;
+    int max_bucket = 0;
+    int p = 0;
+
+    memset(buckets, 0, sizeof(buckets));
+    for (int s = 0; s < num_shards; ++s) {
+      const struct MetricsShard *shard = registry->shards[s].load(std::memory_order_acquire);
+      if (shard == NULL) {
+        continue;
+      }
+      sum += shard->sums[h].load(std::memory_order_relaxed);
+      for (int b = 0; b < METRICS_HIST_BUCKETS; ++b) {
+        buckets[b] += shard->buckets[h][b].load(std::memory_order_relaxed);
+      }
+    }
+    for (int b = 0; b < METRICS_HIST_BUCKETS; ++b) {
+      count += buckets[b];
+      if (buckets[b] != 0) {
+        max_bucket = b;
+      }
+    }
+
+    append(buf, cap, &used, "%s count %llu mean %llu", registry->histogram_names[h], (unsigned long long)count,
+           (unsigned long long)(count == 0 ? 0 : sum / count));
+    for (int b = 0; b < METRICS_HIST_BUCKETS && p < NUM_PERCENTILES; ++b) {
+      seen += buckets[b];
+      // Smallest bucket holding at least the wanted share of the values
+      while (p < NUM_PERCENTILES && count > 0 && seen * 1000 >= count * percentiles[p]) {
+        append(buf, cap, &used, " %s %llu", percentile_names[p], (unsigned long long)bucket_limit(b));
+        p++;
+      }
+    }
+    for (; p < NUM_PERCENTILES; ++p) {
+      append(buf, cap, &used, " %s 0", percentile_names[p]);
+    }
+    append(buf, cap, &used, " max %llu\n", (unsigned long long)(count == 0 ? 0 : bucket_limit(max_bucket)));
+  }
+  return used;
+}
+
+/**
+ * Answer connections until stop is set. Each one gets a single dump
+ * and is closed, so a slow reader can hold up the stats thread but
+ * never the threads being measured.
+ */
+static void serve_stats(struct StatsServer *server) {
+  static char buf[1 << 16];
+  struct pollfd pfd;
+  size_t len;
+  size_t sent;
+  ssize_t ret;
+  int client_socket;
+
+  pfd.fd = server->listen_socket;
+  pfd.events = POLLIN;
+  while (!server->stop.load()) {
+    if (poll(&pfd, 1, 200) <= 0) {
+      continue;
+    }
+    client_socket = accept(server->listen_socket, NULL, NULL);
+    if (client_socket < 0) {
+      continue;
+    }
+
+    len = metrics_format(server->registry, buf, sizeof(buf));
+    for (sent = 0; sent < len; sent += ret) {
+      ret = send(client_socket, &buf[sent], len - sent, MSG_NOSIGNAL);
+      if (ret <= 0) {
+        break;
+      }
+    }
+    close(client_socket);
+  }
+}
+
+int start_stats_server(struct StatsServer *server, const struct MetricsRegistry *registry, const char *path) {
+  struct sockaddr_un addr;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  server->registry = registry;
+  server->stop.store(false);
+  strcpy(server->path, path);
+  server->listen_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (server->listen_socket < 0) {
+    return -1;
+  }
+
+  unlink(path);
+  if ((bind(server->listen_socket, (struct sockaddr *)&addr, sizeof(addr)) == -1) ||
+      (listen(server->listen_socket, 16) == -1)) {
+    close(server->listen_socket);
+    return -1;
+  }
+
+  server->thread = std::thread(serve_stats, server);
+  return 0;
+}
+
+void stop_stats_server(struct StatsServer *server) {
+  server->stop.store(true);
+  if (server->thread.joinable()) {
+    server->thread.join();
+  }
+  close(server->listen_socket);
+  unlink(server->path);
+}
+
+int metrics_query(const char *path, const char *name, uint64_t *value) {
+  static thread_local char buf[1 << 16];
+  struct sockaddr_un addr;
+  size_t name_len = strlen(name);
+  size_t used = 0;
+  ssize_t ret;
+  int stats_socket;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  stats_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (stats_socket < 0) {
+    return -1;
+  }
+  if (connect(stats_socket, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    close(stats_socket);
+    return -1;
+  }
+  while (used + 1 < sizeof(buf) && (ret = recv(stats_socket, &buf[used], sizeof(buf) - used - 1, 0)) > 0) {
+    used += ret;
+  }
+  close(stats_socket);
+  buf[used] = '\0';
+
+  for (const char *line = buf; *line != '\0';) {
+    const char *next = strchr(line, '\n');
+    if (strncmp(line, name, name_len) == 0 && line[name_len] == ' ') {
+      *value = strtoull(&line[name_len + 1], NULL, 10);
+      return 0;
+    }
+    if (next == NULL) {
+      break;
+    }
+    line = next + 1;
+  }
+  return -1;
+}
@@ -0,0 +1,159 @@
+#include "packet_trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/**
+ * Bytes a record takes in the file, datagram and padding included.
+ */
+static size_t record_size(size_t len) {
+  return (sizeof(struct TraceRecord) + len + 7) & ~(size_t)7;
+}
+
+uint64_t trace_now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+int open_trace_writer(struct PacketTrace *trace, const char *path, size_t capacity) {
+  struct TraceFileHeader *header;
+  struct timespec realtime;
+
+  trace->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (trace->fd == -1) {
+    return -1;
+  }
+  trace->capacity = sizeof(struct TraceFileHeader) + capacity;
+  if (ftruncate(trace->fd, trace->capacity) == -1) {
+    close(trace->fd);
+    return -1;
+  }
+  trace->map = (char *)mmap(NULL, trace->capacity, PROT_READ | PROT_WRITE, MAP_SHARED, trace->fd, 0);
+  if (trace->map == MAP_FAILED) {
+    close(trace->fd);
+    return -1;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &realtime);
+  header = (struct TraceFileHeader *)trace->map;
+  memcpy(header->magic, TRACE_MAGIC, sizeof(header->magic));
+  header->version = TRACE_VERSION;
+  header->header_size = sizeof(struct TraceFileHeader);
+  header->record_count = 0;
+  header->data_bytes = 0;
+  header->start_realtime_ns = (uint64_t)realtime.tv_sec * 1000000000ull + realtime.tv_nsec;
+
+  trace->start_ns = trace_now_ns();
+  trace->used = sizeof(struct TraceFileHeader);
+  trace->records = 0;
+  trace->dropped = 0;
+  return 0;
+}
+
+void trace_record(struct PacketTrace *trace, uint64_t now_ns, const struct sockaddr_in *from, const char *data,
+                  int len) {
+  struct TraceRecord record;
+  size_t size = record_size(len);
+  uint64_t offset = trace->used.fetch_add(size, std::memory_order_relaxed);
+
+  // Past the end, leave used over capacity so everyone after us also stops
+  if (offset + size > trace->capacity) {
+    trace->dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  record.timestamp_ns = now_ns - trace->start_ns;
+  record.addr = from->sin_addr.s_addr;
+  record.port = from->sin_port;
+  record.len = len;
+  memcpy(&trace->map[offset], &record, sizeof(struct TraceRecord));
+  memcpy(&trace->map[offset + sizeof(struct TraceRecord)], data, len);
+  trace->records.fetch_add(1, std::memory_order_relaxed);
+}
+
+int close_trace_writer(struct PacketTrace *trace) {
+  struct TraceFileHeader *header = (struct TraceFileHeader *)trace->map;
+  uint64_t used = trace->used;
+  int ret = 0;
+
+  // A writer that ran off the end claimed space it never wrote, so
+  // cut the file where the last record that fit ends
+  if (used > trace->capacity) {
+    size_t offset = sizeof(struct TraceFileHeader);
+    uint64_t count = 0;
+    while (count < trace->records) {
+      const struct TraceRecord *record = (const struct TraceRecord *)&trace->map[offset];
+      offset += record_size(record->len);
+      count++;
+    }
+    used = offset;
+  }
+
+  header->record_count = trace->records;
+  header->data_bytes = used - sizeof(struct TraceFileHeader);
+  if (munmap(trace->map, trace->capacity) == -1) {
+    ret = -1;
+  }
+  if (ftruncate(trace->fd, used) == -1) {
+    ret = -1;
+  }
+  close(trace->fd);
+  return ret;
+}
+
+int open_trace_reader(struct TraceReader *reader, const char *path) {
+  off_t size;
+
+  reader->fd = open(path, O_RDONLY);
+  if (reader->fd == -1) {
+    return -1;
+  }
+  size = lseek(reader->fd, 0, SEEK_END);
+  if (size < (off_t)sizeof(struct TraceFileHeader)) {
+    close(reader->fd);
+    errno = EINVAL;
+    return -1;
+  }
+  reader->size = size;
+  reader->map = (const char *)mmap(NULL, reader->size, PROT_READ, MAP_SHARED, reader->fd, 0);
+  if (reader->map == MAP_FAILED) {
+    close(reader->fd);
+    return -1;
+  }
+  reader->header = (const struct TraceFileHeader *)reader->map;
+  if (memcmp(reader->header->magic, TRACE_MAGIC, sizeof(reader->header->magic)) != 0 ||
+      reader->header->version != TRACE_VERSION ||
+      reader->header->header_size + reader->header->data_bytes > reader->size) {
+    close_trace_reader(reader);
+    errno = EINVAL;
+    return -1;
+  }
+  // Records are read front to back exactly once
+  madvise((void *)reader->map, reader->size, MADV_SEQUENTIAL);
+  reader->offset = reader->header->header_size;
+  return 0;
+}
+
+bool trace_next(struct TraceReader *reader, const struct TraceRecord **record, const char **data) {
+  size_t end = reader->header->header_size + reader->header->data_bytes;
+
+  if (reader->offset + sizeof(struct TraceRecord) > end) {
+    return false;
+  }
+  *record = (const struct TraceRecord *)&reader->map[reader->offset];
+  if (reader->offset + sizeof(struct TraceRecord) + (*record)->len > end) {
+    return false;
+  }
+  *data = &reader->map[reader->offset + sizeof(struct TraceRecord)];
+  reader->offset += record_size((*record)->len);
+  return true;
+}
+
+void close_trace_reader(struct TraceReader *reader) {
+  munmap((void *)reader->map, reader->size);
+  close(reader->fd);
+}
@@ -0,0 +1,125 @@
+//
+// Compact binary traces of received datagrams, written through a
+// memory mapping so recording costs a memcpy per datagram.
+//
+// File layout: a TraceFileHeader, then one TraceRecord per datagram
+// followed by the datagram bytes, padded so the next record starts
+// on an 8 byte boundary. Everything is in host byte order except the
+// address and port, which are kept as they appear in a sockaddr_in.
+//
+
+#ifndef IN_CLASS_UDP_EXAMPLE_PACKET_TRACE_H
+#define IN_CLASS_UDP_EXAMPLE_PACKET_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <atomic>
+
+#define TRACE_MAGIC "TTTTRACE"
+#define TRACE_VERSION 1
+// Default most bytes of trace a recording may fill
+#define TRACE_DEFAULT_CAPACITY (256ull << 20)
+
+struct TraceFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  /* records and bytes of record data after the header */
+  uint64_t record_count;
+  uint64_t data_bytes;
+  /* wall clock time the recording started, in ns since the epoch */
+  uint64_t start_realtime_ns;
+};
+
+struct TraceRecord {
+  /* ns since the recording started */
+  uint64_t timestamp_ns;
+  /* source of the datagram, network byte order */
+  uint32_t addr;
+  uint16_t port;
+  /* datagram length, the bytes follow the record */
+  uint16_t len;
+};
+
+/**
+ * A trace being recorded. Any number of threads may call trace_record
+ * at once; space is claimed with an atomic add into a file mapping
+ * made once up front, so recording never blocks or remaps.
+ */
+struct PacketTrace {
+  int fd;
+  char *map;
+  size_t capacity;
+  uint64_t start_ns;
+  std::atomic<uint64_t> used;
+  std::atomic<uint64_t> records;
+  /* datagrams not recorded because the trace was full */
+  std::atomic<uint64_t> dropped;
+};
+
+/**
+ * Create (or truncate) a trace file and map capacity bytes of it.
+ * The file is sparse until written and is cut down to what was used
+ * when the trace is closed.
+ *
+ * @return 0 on success, -1 on error (see errno)
+ */
+int open_trace_writer(struct PacketTrace *trace, const char *path, size_t capacity);
+
+/**
+ * Append one received datagram to the trace.
+ *
+ * @param trace the trace
+ * @param now_ns CLOCK_MONOTONIC time the datagram was received
+ * @param from sender of the datagram
+ * @param data datagram contents
+ * @param len datagram length
+ */
+void trace_record(struct PacketTrace *trace, uint64_t now_ns, const struct sockaddr_in *from, const char *data,
+                  int len);
+
+/**
+ * Fill in the header, unmap and trim the file. Call once every
+ * thread has stopped recording.
+ *
+ * @return 0 on success, -1 on error
+ */
+int close_trace_writer(struct PacketTrace *trace);
+
+/**
+ * A trace mapped read only for replay.
+ */
+struct TraceReader {
+  int fd;
+  const char *map;
+  size_t size;
+  const struct TraceFileHeader *header;
+  size_t offset;
+};
+
+/**
+ * Map a trace file and check its header.
+ *
+ * @return 0 on success, -1 if the file cannot be read or is not a trace
+ */
+int open_trace_reader(struct TraceReader *reader, const char *path);
+
+/**
+ * Step to the next record.
+ *
+ * @param reader the trace
+ * @param record set to the record
+ * @param data set to the datagram bytes
+ * @return false at the end of the trace
+ */
+bool trace_next(struct TraceReader *reader, const struct TraceRecord **record, const char **data);
+
+void close_trace_reader(struct TraceReader *reader);
+
+/**
+ * Nanoseconds from CLOCK_MONOTONIC, the clock trace timestamps use.
+ */
+uint64_t trace_now_ns();
+
+#endif //IN_CLASS_UDP_EXAMPLE_PACKET_TRACE_H
@@ -0,0 +1,235 @@
+#include "perfect_play.h"
+
+// Open addressed table slots; 765 positions fit with room to spare
+#define TABLE_SLOTS 2048
+#define TABLE_SHIFT (32 - 11)
+
+// Layout of a table entry
+#define ENTRY_KEY_MASK 0x3FFFFu
+#define ENTRY_MOVE_SHIFT 18
+#define ENTRY_VALUE_SHIFT 22
+#define ENTRY_PLIES_SHIFT 24
+#define ENTRY_USED (1u << 31)
+#define ENTRY_NO_MOVE 0xF
+
+/**
+ * The solved positions plus the symmetry tables used to find them.
+ */
+struct PerfectPlayTable {
+  /* sym_mask[s][mask] is mask with every square moved by symmetry s */
+  uint16_t sym_mask[8][512];
+  /* inverse[s][square] is the square that symmetry s moves to square */
+  uint8_t inverse[8][9];
+  /* key (x_positions | o_positions << 9 of the canonical board), best
+   * move on the canonical board, value and plies left to the end */
+  uint32_t entries[TABLE_SLOTS];
+  uint32_t count;
+};
+
+/**
+ * Where symmetry s (4 rotations, then the same after a mirror) moves
+ * the square at row r, column c.
+ */
+static int transform_square(int s, int r, int c) {
+  int row[8] = {r, c, 2 - r, 2 - c, r, c, 2 - r, 2 - c};
+  int col[8] = {c, 2 - r, 2 - c, r, 2 - c, r, c, 2 - r};
+  return row[s] * 3 + col[s];
+}
+
+static uint32_t slot_of(uint32_t key) {
+  return (key * 0x9E3779B1u) >> TABLE_SHIFT;
+}
+
+/**
+ * Key of the smallest of the 8 symmetric images of a board.
+ *
+ * @param sym set to the symmetry that maps the board to that image
+ */
+static uint32_t canonical_key(const struct PerfectPlayTable *table, uint16_t x_positions, uint16_t o_positions,
+                              int *sym) {
+  uint32_t best = UINT32_MAX;
+
+  for (int s = 0; s < 8; ++s) {
+    uint32_t key = table->sym_mask[s][x_positions] | ((uint32_t)table->sym_mask[s][o_positions] << 9);
+    if (key < best) {
+      best = key;
+      *sym = s;
+    }
+  }
+  return best;
+}
+
+/**
+ * @return the entry for key, or 0 if it is not in the table
+ */
+static uint32_t find_entry(const struct PerfectPlayTable *table, uint32_t key) {
+  for (uint32_t slot = slot_of(key);; slot = (slot + 1) & (TABLE_SLOTS - 1)) {
+    uint32_t entry = table->entries[slot];
+    if (entry == 0 || (entry & ENTRY_KEY_MASK) == key) {
+      return entry;
+    }
+  }
+}
+
+static void insert_entry(struct PerfectPlayTable *table, uint32_t entry) {
+  uint32_t slot = slot_of(entry & ENTRY_KEY_MASK);
+
+  while (table->entries[slot] != 0) {
+    slot = (slot + 1) & (TABLE_SLOTS - 1);
+  }
+  table->entries[slot] = entry;
+  table->count++;
+}
+
+static uint32_t make_entry(uint32_t key, uint32_t move, ResultType value, uint32_t plies) {
+  return ENTRY_USED | key | (move << ENTRY_MOVE_SHIFT) | ((uint32_t)(value - X_WIN) << ENTRY_VALUE_SHIFT) |
+         (plies << ENTRY_PLIES_SHIFT);
+}
+
+static ResultType entry_value(uint32_t entry) {
+  return (ResultType)(X_WIN + ((entry >> ENTRY_VALUE_SHIFT) & 0x3));
+}
+
+/**
+ * How much the player to move likes ending with value after plies more
+ * moves: wins are better sooner, losses better later.
+ */
+static int score_for(bool x_to_move, ResultType value, uint32_t plies) {
+  if (value == CATS_GAME) {
+    return 0;
+  }
+  if ((value == X_WIN) == x_to_move) {
+    return 100 - (int)plies;
+  }
+  return (int)plies - 100;
+}
+
+/**
+ * Minimax over the canonical form of a board, memoized in the table.
+ *
+ * @return the board's table entry
+ */
+static uint32_t solve(struct PerfectPlayTable *table, uint16_t x_positions, uint16_t o_positions) {
+  int sym;
+  uint32_t key = canonical_key(table, x_positions, o_positions, &sym);
+  uint32_t entry = find_entry(table, key);
+  uint16_t x_canonical = key & 0x1FF;
+  uint16_t o_canonical = key >> 9;
+  ResultType result;
+  bool x_to_move;
+  int best_score = -1000;
+
+  if (entry != 0) {
+    return entry;
+  }
+
+  result = board_result(x_canonical, o_canonical);
+  if (result != CATS_GAME || (x_canonical | o_canonical) == 0x1FF) {
+    entry = make_entry(key, ENTRY_NO_MOVE, result, 0);
+    insert_entry(table, entry);
+    return entry;
+  }
+
+  x_to_move = __builtin_popcount(x_canonical) == __builtin_popcount(o_canonical);
+  for (uint32_t square = 0; square < 9; ++square) {
+    uint16_t bit = 1 << square;
+    uint32_t child;
+    int score;
+
+    if ((x_canonical | o_canonical) & bit) {
+      continue;
+    }
+    if (x_to_move) {
+      child = solve(table, x_canonical | bit, o_canonical);
+    } else {
+      child = solve(table, x_canonical, o_canonical | bit);
+    }
+    uint32_t plies = ((child >> ENTRY_PLIES_SHIFT) & 0xF) + 1;
+    score = score_for(x_to_move, entry_value(child), plies);
+    if (score > best_score) {
+      best_score = score;
+      entry = make_entry(key, square, entry_value(child), plies);
+    }
+  }
+  insert_entry(table, entry);
+  return entry;
+}
+
+static struct PerfectPlayTable *build_table() {
+  struct PerfectPlayTable *table = new PerfectPlayTable();
+
+  for (int s = 0; s < 8; ++s) {
+    for (int square = 0; square < 9; ++square) {
+      table->inverse[s][transform_square(s, square / 3, square % 3)] = square;
+    }
+    for (int mask = 0; mask < 512; ++mask) {
+      uint16_t moved = 0;
+      for (int square = 0; square < 9; ++square) {
+        if (mask & (1 << square)) {
+          moved |= 1 << transform_square(s, square / 3, square % 3);
+        }
+      }
+      table->sym_mask[s][mask] = moved;
+    }
+  }
+
+  solve(table, 0, 0);
+  return table;
+}
+
+static const struct PerfectPlayTable *perfect_play_table() {
+  // Solved on first use; the C++ runtime makes this safe across threads
+  static const struct PerfectPlayTable *table = build_table();
+  return table;
+}
+
+uint32_t perfect_play_table_size() {
+  return perfect_play_table()->count;
+}
+
+int best_move(uint16_t x_positions, uint16_t o_positions, uint16_t *move, ResultType *value) {
+  const struct PerfectPlayTable *table = perfect_play_table();
+  uint32_t entry;
+  uint32_t canonical_move;
+  int sym = 0;
+
+  if ((x_positions & o_positions) != 0 || ((x_positions | o_positions) & ~0x1FF) != 0) {
+    return -1;
+  }
+  // Anything not in the table (wrong move counts, play after a win) is unreachable
+  entry = find_entry(table, canonical_key(table, x_positions, o_positions, &sym));
+  if (entry == 0) {
+    return -1;
+  }
+
+  canonical_move = (entry >> ENTRY_MOVE_SHIFT) & 0xF;
+  *move = canonical_move == ENTRY_NO_MOVE ? NO_MOVE : table->inverse[sym][canonical_move];
+  *value = entry_value(entry);
+  return 0;
+}
+
+ResultType minimax_value(uint16_t x_positions, uint16_t o_positions) {
+  ResultType result = board_result(x_positions, o_positions);
+  bool x_to_move = __builtin_popcount(x_positions) == __builtin_popcount(o_positions);
+  ResultType best = x_to_move ? O_WIN : X_WIN;
+
+  if (result != CATS_GAME || (x_positions | o_positions) == 0x1FF) {
+    return result;
+  }
+
+  for (int square = 0; square < 9; ++square) {
+    uint16_t bit = 1 << square;
+    if ((x_positions | o_positions) & bit) {
+      continue;
+    }
+    ResultType child = x_to_move ? minimax_value(x_positions | bit, o_positions)
+                                 : minimax_value(x_positions, o_positions | bit);
+    if (child == (x_to_move ? X_WIN : O_WIN)) {
+      return child;
+    }
+    if (child == CATS_GAME) {
+      best = CATS_GAME;
+    }
+  }
+  return best;
+}
@@ -0,0 +1,48 @@
+//
+// Perfect play for TicTacToe. Every position reachable in a real game
+// (X moving first) is solved once by minimax and kept in a small table
+// keyed by the position's canonical form under the 8 symmetries of the
+// board, so answering a query is a few table lookups.
+//
+
+#ifndef IN_CLASS_UDP_EXAMPLE_PERFECT_PLAY_H
+#define IN_CLASS_UDP_EXAMPLE_PERFECT_PLAY_H
+
+#include <stdint.h>
+
+#include "tictactoe.h"
+
+/**
+ * Move reported when the game is already over.
+ */
+#define NO_MOVE 0xFFFF
+
+/**
+ * Number of positions in the solved table (reachable positions with
+ * symmetric duplicates removed), solving it first if needed.
+ */
+uint32_t perfect_play_table_size();
+
+/**
+ * Look up the best move for the player to move and how the game ends
+ * if both sides play perfectly from here. Among equally good moves the
+ * quickest win, or slowest loss, is chosen. The first call solves the
+ * table (well under a millisecond); it is safe from several threads.
+ *
+ * @param x_positions bit mask of positions marked 'X'
+ * @param o_positions bit mask of positions marked 'O'
+ * @param move set to the square (0-8) to play, or NO_MOVE if the game is over
+ * @param value set to X_WIN, O_WIN or CATS_GAME
+ * @return 0 on success, -1 if the board can't come up in a game
+ */
+int best_move(uint16_t x_positions, uint16_t o_positions, uint16_t *move, ResultType *value);
+
+/**
+ * Solve a position by plain minimax, without the table. Slow; for
+ * checking best_move() and measuring what the table saves.
+ *
+ * @return the value of the position, as best_move() would report it
+ */
+ResultType minimax_value(uint16_t x_positions, uint16_t o_positions);
+
+#endif //IN_CLASS_UDP_EXAMPLE_PERFECT_PLAY_H
@@ -0,0 +1,23 @@
+//
+// SipHash-2-4 keyed hash, used to authenticate game tokens.
+//
+
+#ifndef IN_CLASS_UDP_EXAMPLE_SIPHASH_H
+#define IN_CLASS_UDP_EXAMPLE_SIPHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SIPHASH_KEY_LEN 16
+
+/**
+ * Compute SipHash-2-4 of data under a 128 bit key.
+ *
+ * @param key 16 byte secret key
+ * @param data bytes to hash
+ * @param len number of bytes in data
+ * @return the 64 bit MAC
+ */
+uint64_t siphash24(const uint8_t key[SIPHASH_KEY_LEN], const void *data, size_t len);
+
+#endif //IN_CLASS_UDP_EXAMPLE_SIPHASH_H
@@ -4,6 +4,7 @@
 
 #include <iostream>
 #include "tictactoe.h"
+#include "kinarow.h"
 
 // Kept getting undefined references late in the linking process no matter what return type I used or how I structured
 // the function.
@@ -68,4 +69,8 @@ void game_winner(struct Games &game) {
 		std::cout << "Cat's game.\n";
 		//return game.result = CATS_GAME;
 	}
-}
\ No newline at end of file
+}
+
+ResultType board_result(uint16_t x_positions, uint16_t o_positions) {
+	return kinarow::TicTacToe::result(x_positions, o_positions);
+}
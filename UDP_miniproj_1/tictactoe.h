@@ -19,7 +19,19 @@ enum MessageType {
   ServerInvalidRequestReply,
   ClientResult,
   ServerClientResultCorrect,
-  ServerClientResultIncorrect
+  ServerClientResultIncorrect,
+  ClientGetTokenGame,
+  ServerTokenGameReply,
+  ClientTokenResult,
+  ClientGetGameBatch,
+  ServerGameBatchReply,
+  ClientResultBatch,
+  ServerResultBatchReply,
+  ClientGetBestMove,
+  ServerBestMoveReply,
+  ClientGetLargeGame,
+  ServerLargeGameReply,
+  ClientLargeResult
 };
 
 /**
@@ -124,9 +136,238 @@ struct GameResultMessage {
   uint16_t result;
 } __attribute__((packed));
 
+/**
+ * Length of the opaque token carried by the token game messages.
+ */
+#define GAME_TOKEN_LEN 16
+
+/**
+ * Reply to a ClientGetTokenGame request (a GetGameMessage with
+ * hdr.type = ClientGetTokenGame). Identical to GameSummaryMessage
+ * except for the trailing token, which the client must echo back
+ * unchanged in its TokenGameResultMessage.
+ *
+ * The token lets the server grade the result without remembering
+ * anything about the game. Clients must treat it as opaque.
+ *
+ * hdr.type = ServerTokenGameReply
+ * hdr.len = sizeof(TokenGameSummaryMessage)
+ */
+struct TokenGameSummaryMessage {
+  struct TTTMessage hdr;
+  uint16_t client_id;
+  uint16_t game_id;
+  uint16_t x_positions;
+  uint16_t o_positions;
+  uint8_t token[GAME_TOKEN_LEN];
+} __attribute__((packed));
+
+/**
+ * Result for a game received in a TokenGameSummaryMessage. The
+ * server answers with ServerClientResultCorrect/Incorrect as for a
+ * GameResultMessage, or ServerInvalidRequestReply if the token is
+ * forged, stale or was issued to a different client address.
+ *
+ * hdr.type = ClientTokenResult
+ * hdr.len = sizeof(TokenGameResultMessage)
+ */
+struct TokenGameResultMessage {
+  struct TTTMessage hdr;
+  uint16_t game_id;
+  uint16_t result;
+  uint8_t token[GAME_TOKEN_LEN];
+} __attribute__((packed));
+
+/**
+ * Largest datagram the batch messages will be built into, so that a
+ * batch fits in a single 1500 byte Ethernet frame without fragmenting.
+ */
+#define TTT_MAX_DATAGRAM 1472
+
+/**
+ * Most games carried by one batch message.
+ */
+#define TTT_MAX_BATCH_GAMES 240
+
+/**
+ * Request for up to count games in one datagram.
+ *
+ * hdr.type = ClientGetGameBatch
+ * hdr.len = sizeof(GetGameBatchMessage)
+ */
+struct GetGameBatchMessage {
+  struct TTTMessage hdr;
+  uint16_t client_id;
+  uint16_t count;
+} __attribute__((packed));
+
+/**
+ * One game inside a GameBatchReplyMessage, the body of a
+ * GameSummaryMessage without the repeated header and client_id.
+ */
+struct BatchGame {
+  uint16_t game_id;
+  uint16_t x_positions;
+  uint16_t o_positions;
+} __attribute__((packed));
+
+/**
+ * Reply to a GetGameBatchMessage, followed by count BatchGame's.
+ * count may be less than requested (at most TTT_MAX_BATCH_GAMES).
+ *
+ * hdr.type = ServerGameBatchReply
+ * hdr.len = sizeof(GameBatchReplyMessage) + count * sizeof(BatchGame)
+ */
+struct GameBatchReplyMessage {
+  struct TTTMessage hdr;
+  uint16_t client_id;
+  uint16_t count;
+} __attribute__((packed));
+
+/**
+ * One result inside a ResultBatchMessage, the body of a
+ * GameResultMessage.
+ */
+struct BatchResult {
+  uint16_t game_id;
+  uint16_t result;
+} __attribute__((packed));
+
+/**
+ * Results for many games in one datagram, followed by count
+ * BatchResult's.
+ *
+ * hdr.type = ClientResultBatch
+ * hdr.len = sizeof(ResultBatchMessage) + count * sizeof(BatchResult)
+ */
+struct ResultBatchMessage {
+  struct TTTMessage hdr;
+  uint16_t count;
+} __attribute__((packed));
+
+/**
+ * Grades for a ResultBatchMessage, followed by count uint16_t's,
+ * one per BatchResult in the same order. Each is the MessageType a
+ * single result would have received: ServerClientResultCorrect,
+ * ServerClientResultIncorrect or ServerInvalidRequestReply.
+ *
+ * hdr.type = ServerResultBatchReply
+ * hdr.len = sizeof(ResultBatchReplyMessage) + count * sizeof(uint16_t)
+ */
+struct ResultBatchReplyMessage {
+  struct TTTMessage hdr;
+  uint16_t count;
+} __attribute__((packed));
+
+/**
+ * Ask for the perfect-play move on a board. The board must be one
+ * that can come up in a game with X moving first, or the server
+ * answers ServerInvalidRequestReply.
+ *
+ * hdr.type = ClientGetBestMove
+ * hdr.len = sizeof(BestMoveRequestMessage)
+ */
+struct BestMoveRequestMessage {
+  struct TTTMessage hdr;
+  uint16_t client_id;
+  uint16_t x_positions;
+  uint16_t o_positions;
+} __attribute__((packed));
+
+/**
+ * Answer to a BestMoveRequestMessage, echoing the request's client_id
+ * and board.
+ *
+ * move is the square (0-8) the player to move should take, or 0xFFFF
+ * if the game is already over. value is how the game ends with perfect
+ * play from here: X_WIN, O_WIN or CATS_GAME.
+ *
+ * hdr.type = ServerBestMoveReply
+ * hdr.len = sizeof(BestMoveReplyMessage)
+ */
+struct BestMoveReplyMessage {
+  struct TTTMessage hdr;
+  uint16_t client_id;
+  uint16_t x_positions;
+  uint16_t o_positions;
+  uint16_t move;
+  uint16_t value;
+} __attribute__((packed));
+
+/**
+ * Most rows (and columns) of a large board. Each row is sent as a
+ * uint16_t mask, bit c set for a mark in column c.
+ */
+#define LARGE_BOARD_MAX_ROWS 16
+
+/**
+ * Request for a game on a bigger board: width x height squares, won
+ * with k in a row (e.g., 15 x 15 with k = 5 for gomoku). The server
+ * answers ServerInvalidRequestReply for a size it does not serve.
+ *
+ * hdr.type = ClientGetLargeGame
+ * hdr.len = sizeof(GetLargeGameMessage)
+ */
+struct GetLargeGameMessage {
+  struct TTTMessage hdr;
+  uint16_t client_id;
+  uint16_t width;
+  uint16_t height;
+  uint16_t k;
+} __attribute__((packed));
+
+/**
+ * A large board game, followed by height uint16_t X row masks and then
+ * height uint16_t O row masks (top row first). Like the token games
+ * the server keeps no state: the token authenticates the board, which
+ * the client echoes back with its result.
+ *
+ * hdr.type = ServerLargeGameReply
+ * hdr.len = sizeof(LargeGameSummaryMessage) + 4 * height
+ */
+struct LargeGameSummaryMessage {
+  struct TTTMessage hdr;
+  uint16_t client_id;
+  uint16_t game_id;
+  uint16_t width;
+  uint16_t height;
+  uint16_t k;
+  uint8_t token[GAME_TOKEN_LEN];
+} __attribute__((packed));
+
+/**
+ * Result for a large board game, followed by the X and O rows exactly
+ * as received. Graded with ServerClientResultCorrect/Incorrect, or
+ * ServerInvalidRequestReply if the token does not match the board.
+ *
+ * hdr.type = ClientLargeResult
+ * hdr.len = sizeof(LargeGameResultMessage) + 4 * height
+ */
+struct LargeGameResultMessage {
+  struct TTTMessage hdr;
+  uint16_t game_id;
+  uint16_t result;
+  uint16_t width;
+  uint16_t height;
+  uint16_t k;
+  uint8_t token[GAME_TOKEN_LEN];
+} __attribute__((packed));
+
 // Function to check game states
 void game_winner(struct Games &game);
 
+/**
+ * Compute the correct ResultType for a board given as the 9 bit
+ * x_positions/o_positions masks used in GameSummaryMessage.
+ * A board is INVALID_BOARD if X and O share a position, if
+ * either mask uses bits above position 8, or if both X and O win.
+ *
+ * @param x_positions bit mask of positions marked 'X'
+ * @param o_positions bit mask of positions marked 'O'
+ * @return one of the ResultType values
+ */
+ResultType board_result(uint16_t x_positions, uint16_t o_positions);
+
 
 /***
  *	Example TTT board, with their number positions.
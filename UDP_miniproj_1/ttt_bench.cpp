@@ -0,0 +1,596 @@
+/**
+ * Micro benchmarks for the TicTacToe server building blocks.
+ *
+ * e.g., ./ttt_bench            (run everything)
+ *       ./ttt_bench sessions   (run one benchmark)
+ */
+
+#include <iostream>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "game_sessions.h"
+#include "game_tokens.h"
+#include "ttt_wire.h"
+#include "board_gen.h"
+#include "perfect_play.h"
+#include "kinarow.h"
+#include "large_board.h"
+#include "metrics.h"
+
+static uint64_t now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/**
+ * Resident set size of this process in bytes, from /proc/self/statm.
+ */
+static size_t resident_bytes() {
+  unsigned long size = 0;
+  unsigned long resident = 0;
+  FILE *statm = fopen("/proc/self/statm", "r");
+
+  if (statm == NULL) {
+    return 0;
+  }
+  if (fscanf(statm, "%lu %lu", &size, &resident) != 2) {
+    resident = 0;
+  }
+  fclose(statm);
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * Fill a session table with a million live games, look them all up,
+ * then let the timer wheel expire them, reporting per operation cost
+ * and memory per live game.
+ */
+static void bench_sessions() {
+  const uint32_t num_games = 1000000;
+  struct SessionTable table;
+  uint64_t now_ms = 1000;
+  uint64_t start;
+  uint64_t elapsed;
+  uint32_t found = 0;
+  size_t rss_before;
+  size_t rss_after;
+
+  rss_before = resident_bytes();
+  if (init_session_table(&table, num_games, 30000, now_ms) == -1) {
+    std::cerr << "Could not allocate session table." << std::endl;
+    return;
+  }
+
+  // Spread games over many client addresses and ports, with game ids
+  // wrapping like a real shard's 16 bit counter
+  start = now_ns();
+  for (uint32_t i = 0; i < num_games; ++i) {
+    session_insert(&table, 0x0A000000u + (i >> 8), (uint16_t)(i & 0xFF), (uint16_t)i, 837, i & 0x1FF,
+                   (i >> 9) & 0x1FF);
+  }
+  elapsed = now_ns() - start;
+  rss_after = resident_bytes();
+
+  std::cout << "sessions: insert " << (double)elapsed / num_games << " ns/game, "
+            << table.count << " live games" << std::endl;
+  std::cout << "sessions: table memory " << session_table_memory(&table) << " bytes, "
+            << (double)session_table_memory(&table) / table.count << " bytes/game, rss grew "
+            << (double)(rss_after - rss_before) / table.count << " bytes/game" << std::endl;
+
+  start = now_ns();
+  for (uint32_t i = 0; i < num_games; ++i) {
+    if (session_find(&table, 0x0A000000u + (i >> 8), (uint16_t)(i & 0xFF), (uint16_t)i) != nullptr) {
+      found++;
+    }
+  }
+  elapsed = now_ns() - start;
+  std::cout << "sessions: lookup " << (double)elapsed / num_games << " ns/game, found " << found << std::endl;
+
+  // Keep inserting past capacity, as a flood of clients that never
+  // send a result would, and check memory stays put
+  start = now_ns();
+  for (uint32_t i = num_games; i < 2 * num_games; ++i) {
+    session_insert(&table, 0x0B000000u + (i >> 8), (uint16_t)(i & 0xFF), (uint16_t)i, 837, 0, 0);
+  }
+  elapsed = now_ns() - start;
+  std::cout << "sessions: insert when full " << (double)elapsed / num_games << " ns/game, "
+            << table.count << " live, " << table.evicted << " evicted, rss "
+            << resident_bytes() - rss_before << " bytes" << std::endl;
+
+  // Jump past the ttl and let the wheel expire everything
+  start = now_ns();
+  now_ms += 31000;
+  session_table_advance(&table, now_ms);
+  elapsed = now_ns() - start;
+  std::cout << "sessions: expired " << table.expired << " games in " << elapsed / 1000000.0 << " ms ("
+            << (double)elapsed / (table.expired ? table.expired : 1) << " ns/game), " << table.count
+            << " left" << std::endl;
+
+  free_session_table(&table);
+}
+
+/**
+ * Cost of issuing and checking a stateless game token, which replaces
+ * one session insert plus one lookup and remove.
+ */
+static void bench_tokens() {
+  const uint32_t num_games = 1000000;
+  uint8_t key[SIPHASH_KEY_LEN];
+  uint8_t token[GAME_TOKEN_LEN];
+  uint16_t x_positions;
+  uint16_t o_positions;
+  uint32_t valid = 0;
+  uint64_t start;
+  uint64_t elapsed;
+
+  for (int i = 0; i < SIPHASH_KEY_LEN; ++i) {
+    key[i] = (uint8_t)(i * 37 + 1);
+  }
+
+  start = now_ns();
+  for (uint32_t i = 0; i < num_games; ++i) {
+    make_game_token(key, 7, 0x0A000000u + i, (uint16_t)i, 837, (uint16_t)i, i & 0x1FF, (i >> 9) & 0x1FF, token);
+    if (open_game_token(key, 7, 0x0A000000u + i, (uint16_t)i, (uint16_t)i, token, &x_positions, &o_positions) == 0) {
+      valid++;
+    }
+  }
+  elapsed = now_ns() - start;
+  std::cout << "tokens: issue + verify " << (double)elapsed / num_games << " ns/game, " << valid
+            << " valid, 0 bytes of per-game state" << std::endl;
+}
+
+/**
+ * Decode and encode GameSummaryMessage's the old hand-written way
+ * (memcpy then ntohs/htons each field) and with the generated codec,
+ * to check the codec costs nothing over the code it replaced.
+ */
+static void bench_codec() {
+  const int num_messages = 4096;
+  const int passes = 2000;
+  static char wire_buf[num_messages * sizeof(struct GameSummaryMessage)];
+  static char out_buf[num_messages * sizeof(struct GameSummaryMessage)];
+  struct GameSummaryMessage message;
+  uint64_t checksum[3] = {0, 0, 0};
+  uint64_t elapsed[3];
+  uint64_t start;
+
+  for (int i = 0; i < num_messages; ++i) {
+    message.hdr = {ServerGameReply, GameSummaryCodec::wire_size};
+    message.client_id = i;
+    message.game_id = i * 7;
+    message.x_positions = i & 0x1FF;
+    message.o_positions = (i >> 3) & 0x1FF;
+    GameSummaryCodec::encode(message, &wire_buf[i * sizeof(message)], sizeof(message));
+  }
+
+  // Hand-written decode, as the server and clients used to do it
+  start = now_ns();
+  for (int pass = 0; pass < passes; ++pass) {
+    for (int i = 0; i < num_messages; ++i) {
+      memcpy(&message, &wire_buf[i * sizeof(message)], sizeof(message));
+      message.hdr.type = ntohs(message.hdr.type);
+      message.hdr.len = ntohs(message.hdr.len);
+      message.client_id = ntohs(message.client_id);
+      message.game_id = ntohs(message.game_id);
+      message.x_positions = ntohs(message.x_positions);
+      message.o_positions = ntohs(message.o_positions);
+      if (message.hdr.len != sizeof(message)) {
+        continue;
+      }
+      checksum[0] += message.game_id + message.x_positions + message.o_positions;
+    }
+    asm volatile("" : : "r"(wire_buf) : "memory");
+  }
+  elapsed[0] = now_ns() - start;
+
+  // Generated, bounds checked decode
+  start = now_ns();
+  for (int pass = 0; pass < passes; ++pass) {
+    for (int i = 0; i < num_messages; ++i) {
+      if (!GameSummaryCodec::decode(&wire_buf[i * sizeof(message)], sizeof(message), message) ||
+          message.hdr.len != sizeof(message)) {
+        continue;
+      }
+      checksum[1] += message.game_id + message.x_positions + message.o_positions;
+    }
+    asm volatile("" : : "r"(wire_buf) : "memory");
+  }
+  elapsed[1] = now_ns() - start;
+
+  // Zero-copy view, reading only the fields used
+  start = now_ns();
+  for (int pass = 0; pass < passes; ++pass) {
+    for (int i = 0; i < num_messages; ++i) {
+      auto view = wire::View<GameSummaryCodec>::over(&wire_buf[i * sizeof(message)], sizeof(message));
+      if (!view || view.sub<&GameSummaryMessage::hdr>().get<&TTTMessage::len>() != sizeof(message)) {
+        continue;
+      }
+      checksum[2] += view.get<&GameSummaryMessage::game_id>() + view.get<&GameSummaryMessage::x_positions>() +
+                     view.get<&GameSummaryMessage::o_positions>();
+    }
+    asm volatile("" : : "r"(wire_buf) : "memory");
+  }
+  elapsed[2] = now_ns() - start;
+
+  std::cout << "codec: decode hand-written " << (double)elapsed[0] / (passes * num_messages) << " ns/msg, codec "
+            << (double)elapsed[1] / (passes * num_messages) << " ns/msg, view "
+            << (double)elapsed[2] / (passes * num_messages) << " ns/msg"
+            << (checksum[0] == checksum[1] && checksum[1] == checksum[2] ? "" : " (CHECKSUM MISMATCH)") << std::endl;
+
+  // Hand-written encode
+  start = now_ns();
+  for (int pass = 0; pass < passes; ++pass) {
+    for (int i = 0; i < num_messages; ++i) {
+      message.hdr.type = htons(ServerGameReply);
+      message.hdr.len = htons(sizeof(message));
+      message.client_id = htons(i);
+      message.game_id = htons(pass + i);
+      message.x_positions = htons(i & 0x1FF);
+      message.o_positions = htons((i >> 3) & 0x1FF);
+      memcpy(&out_buf[i * sizeof(message)], &message, sizeof(message));
+    }
+    asm volatile("" : : "r"(out_buf) : "memory");
+  }
+  elapsed[0] = now_ns() - start;
+
+  // Generated, bounds checked encode
+  start = now_ns();
+  for (int pass = 0; pass < passes; ++pass) {
+    for (int i = 0; i < num_messages; ++i) {
+      message.hdr = {ServerGameReply, GameSummaryCodec::wire_size};
+      message.client_id = i;
+      message.game_id = pass + i;
+      message.x_positions = i & 0x1FF;
+      message.o_positions = (i >> 3) & 0x1FF;
+      GameSummaryCodec::encode(message, &out_buf[i * sizeof(message)], sizeof(message));
+    }
+    asm volatile("" : : "r"(out_buf) : "memory");
+  }
+  elapsed[1] = now_ns() - start;
+
+  std::cout << "codec: encode hand-written " << (double)elapsed[0] / (passes * num_messages) << " ns/msg, codec "
+            << (double)elapsed[1] / (passes * num_messages) << " ns/msg" << std::endl;
+}
+
+/**
+ * Hand out boards with a 30/30/30/10 mix of answers, by rejection
+ * sampling random boards until one has the wanted answer, and from
+ * the precomputed tables.
+ */
+static void bench_boards() {
+  const uint32_t num_boards = 10000000;
+  const struct BoardMix mix = {{30, 30, 30, 10}};
+  struct BoardPicker picker;
+  struct BoardRng rng;
+  uint64_t counts[NUM_RESULT_TYPES] = {0, 0, 0, 0};
+  uint64_t draws = 0;
+  uint16_t x_positions;
+  uint16_t o_positions;
+  uint64_t start;
+  uint64_t elapsed;
+
+  start = now_ns();
+  init_board_picker(&picker, &mix, 1);
+  elapsed = now_ns() - start;
+  std::cout << "boards: tables built in " << (double)elapsed / 1e6 << " ms (" << board_table_size(X_WIN) << " X_WIN, "
+            << board_table_size(O_WIN) << " O_WIN, " << board_table_size(CATS_GAME) << " CATS_GAME, "
+            << board_table_size(INVALID_BOARD) << " INVALID_BOARD)" << std::endl;
+
+  // Rejection sampling: pick the answer, then draw boards until one fits
+  seed_board_rng(&rng, 1);
+  start = now_ns();
+  for (uint32_t i = 0; i < num_boards; ++i) {
+    uint64_t bits = board_rng_next(&rng);
+    int wanted = picker.slot_type[bits & (BOARD_MIX_SLOTS - 1)];
+    ResultType result;
+    do {
+      bits = board_rng_next(&rng);
+      x_positions = bits & 0x1FF;
+      o_positions = (bits >> 9) & 0x1FF;
+      // Mostly disjoint boards, or nearly every draw would be invalid
+      if (wanted != INVALID_BOARD - X_WIN) {
+        o_positions &= ~x_positions;
+      }
+      result = board_result(x_positions, o_positions);
+      draws++;
+    } while (result - X_WIN != wanted);
+  }
+  elapsed = now_ns() - start;
+  std::cout << "boards: rejection sampling " << (double)elapsed / num_boards << " ns/board, "
+            << (double)draws / num_boards << " draws/board" << std::endl;
+
+  start = now_ns();
+  for (uint32_t i = 0; i < num_boards; ++i) {
+    pick_board(&picker, &x_positions, &o_positions);
+    asm volatile("" : : "r"(x_positions), "r"(o_positions));
+  }
+  elapsed = now_ns() - start;
+
+  // Grade a sample outside the timed loop to show the mix came out right
+  for (uint32_t i = 0; i < 1000000; ++i) {
+    pick_board(&picker, &x_positions, &o_positions);
+    counts[board_result(x_positions, o_positions) - X_WIN]++;
+  }
+  std::cout << "boards: table draw " << (double)elapsed / num_boards << " ns/board, mix of 1M draws "
+            << counts[0] / 10000.0 << "/" << counts[1] / 10000.0 << "/" << counts[2] / 10000.0 << "/"
+            << counts[3] / 10000.0 << " %" << std::endl;
+}
+
+/**
+ * Perfect-play queries for reachable boards: solving each one by plain
+ * minimax against looking it up in the solved table.
+ */
+static void bench_moves() {
+  const uint32_t num_queries = 10000000;
+  const uint32_t num_minimax = 20000;
+  const struct BoardMix mix = {{1, 1, 8, 0}};
+  struct BoardPicker picker;
+  uint16_t x_positions[1024];
+  uint16_t o_positions[1024];
+  uint32_t mismatches = 0;
+  uint16_t move;
+  ResultType value;
+  uint64_t start;
+  uint64_t elapsed;
+
+  init_board_picker(&picker, &mix, 1);
+  for (int i = 0; i < 1024; ++i) {
+    pick_board(&picker, &x_positions[i], &o_positions[i]);
+  }
+
+  start = now_ns();
+  std::cout << "moves: " << perfect_play_table_size() << " positions solved in " << (now_ns() - start) / 1e6
+            << " ms" << std::endl;
+
+  start = now_ns();
+  for (uint32_t i = 0; i < num_minimax; ++i) {
+    value = minimax_value(x_positions[i & 1023], o_positions[i & 1023]);
+    asm volatile("" : : "r"(value));
+  }
+  elapsed = now_ns() - start;
+  std::cout << "moves: minimax per query " << (double)elapsed / num_minimax << " ns/query" << std::endl;
+
+  start = now_ns();
+  for (uint32_t i = 0; i < num_queries; ++i) {
+    best_move(x_positions[i & 1023], o_positions[i & 1023], &move, &value);
+    asm volatile("" : : "r"(move), "r"(value));
+  }
+  elapsed = now_ns() - start;
+
+  for (int i = 0; i < 1024; ++i) {
+    best_move(x_positions[i], o_positions[i], &move, &value);
+    if (value != minimax_value(x_positions[i], o_positions[i])) {
+      mismatches++;
+    }
+  }
+  std::cout << "moves: table lookup " << (double)elapsed / num_queries << " ns/query = "
+            << (uint64_t)(num_queries / (elapsed / 1e9)) << " queries/s, " << mismatches << " mismatches"
+            << std::endl;
+}
+
+/**
+ * The 8 TicTacToe lines checked one at a time, as board_result() did
+ * before the compile time table.
+ */
+static ResultType loop_board_result(uint16_t x_positions, uint16_t o_positions) {
+  static const uint16_t win_lines[8] = {0x007, 0x038, 0x1C0, 0x049, 0x092, 0x124, 0x111, 0x054};
+  bool x_wins = false;
+  bool o_wins = false;
+
+  if ((x_positions & o_positions) != 0 || ((x_positions | o_positions) & ~0x1FF) != 0) {
+    return INVALID_BOARD;
+  }
+  for (int i = 0; i < 8; ++i) {
+    x_wins = x_wins || (x_positions & win_lines[i]) == win_lines[i];
+    o_wins = o_wins || (o_positions & win_lines[i]) == win_lines[i];
+  }
+  if (x_wins && o_wins) {
+    return INVALID_BOARD;
+  }
+  return x_wins ? X_WIN : o_wins ? O_WIN : CATS_GAME;
+}
+
+/**
+ * Five in a row on a 15 x 15 board found by walking every square in
+ * every direction, for comparison with the bitboard engine.
+ */
+static bool scan_has_five(const uint16_t *rows) {
+  const int dr[4] = {0, 1, 1, 1};
+  const int dc[4] = {1, 0, 1, -1};
+
+  for (int r = 0; r < 15; ++r) {
+    for (int c = 0; c < 15; ++c) {
+      for (int d = 0; d < 4; ++d) {
+        int n = 0;
+        while (n < 5) {
+          int rr = r + n * dr[d];
+          int cc = c + n * dc[d];
+          if (rr < 0 || rr >= 15 || cc < 0 || cc >= 15 || !((rows[rr] >> cc) & 1)) {
+            break;
+          }
+          n++;
+        }
+        if (n == 5) {
+          return true;
+        }
+      }
+    }
+  }
+  return false;
+}
+
+/**
+ * Grading cost per board: TicTacToe by line loop and by the compile
+ * time table, gomoku by square scan and by bitboard shifts.
+ */
+static void bench_gomoku() {
+  const uint32_t num_boards = 4096;
+  const int passes = 500;
+  static uint16_t masks[num_boards][2];
+  static uint16_t rows[num_boards][2][15];
+  const struct LargeVariant *gomoku = find_large_variant(15, 15, 5);
+  struct BoardRng rng;
+  uint64_t counts[4] = {0, 0, 0, 0};
+  uint32_t mismatches = 0;
+  uint64_t start;
+  uint64_t elapsed[2];
+
+  seed_board_rng(&rng, 1);
+  for (uint32_t i = 0; i < num_boards; ++i) {
+    uint64_t bits = board_rng_next(&rng);
+    masks[i][0] = bits & 0x1FF;
+    masks[i][1] = (bits >> 9) & 0x1FF & ~masks[i][0];
+    random_large_board(&rng, gomoku, rows[i][0], rows[i][1]);
+  }
+
+  start = now_ns();
+  for (int pass = 0; pass < passes; ++pass) {
+    for (uint32_t i = 0; i < num_boards; ++i) {
+      ResultType result = loop_board_result(masks[i][0], masks[i][1]);
+      asm volatile("" : : "r"(result));
+    }
+  }
+  elapsed[0] = now_ns() - start;
+  start = now_ns();
+  for (int pass = 0; pass < passes; ++pass) {
+    for (uint32_t i = 0; i < num_boards; ++i) {
+      ResultType result = kinarow::TicTacToe::result(masks[i][0], masks[i][1]);
+      asm volatile("" : : "r"(result));
+    }
+  }
+  elapsed[1] = now_ns() - start;
+  for (uint32_t i = 0; i < num_boards; ++i) {
+    if (loop_board_result(masks[i][0], masks[i][1]) != board_result(masks[i][0], masks[i][1])) {
+      mismatches++;
+    }
+  }
+  std::cout << "gomoku: 3x3 line loop " << (double)elapsed[0] / (passes * num_boards) << " ns/board, compile time table "
+            << (double)elapsed[1] / (passes * num_boards) << " ns/board" << std::endl;
+
+  start = now_ns();
+  for (uint32_t i = 0; i < num_boards; ++i) {
+    bool x_wins = scan_has_five(rows[i][0]);
+    bool o_wins = scan_has_five(rows[i][1]);
+    asm volatile("" : : "r"(x_wins), "r"(o_wins));
+  }
+  elapsed[0] = (now_ns() - start) * passes;
+  start = now_ns();
+  for (int pass = 0; pass < passes; ++pass) {
+    for (uint32_t i = 0; i < num_boards; ++i) {
+      ResultType result = kinarow::Gomoku::result(rows[i][0], rows[i][1]);
+      asm volatile("" : : "r"(result));
+    }
+  }
+  elapsed[1] = now_ns() - start;
+  for (uint32_t i = 0; i < num_boards; ++i) {
+    ResultType result = kinarow::Gomoku::result(rows[i][0], rows[i][1]);
+    bool x_wins = scan_has_five(rows[i][0]);
+    bool o_wins = scan_has_five(rows[i][1]);
+    counts[result - X_WIN]++;
+    if (result != INVALID_BOARD && (result == X_WIN) != (x_wins && !o_wins)) {
+      mismatches++;
+    }
+  }
+  std::cout << "gomoku: 15x15 square scan " << (double)elapsed[0] / (passes * num_boards) << " ns/board, bitboard "
+            << (double)elapsed[1] / (passes * num_boards) << " ns/board (" << counts[0] << " X_WIN, " << counts[1]
+            << " O_WIN, " << counts[2] << " CATS_GAME, " << counts[3] << " INVALID_BOARD), " << mismatches
+            << " mismatches" << std::endl;
+}
+
+/**
+ * Cost of updating metrics on the hot path, next to the cost of
+ * answering a datagram, and of reading a busy registry.
+ */
+static void bench_metrics() {
+  const uint64_t updates = 50000000;
+  const int num_shards = 8;
+  static char buf[1 << 16];
+  struct MetricsRegistry *registry = new MetricsRegistry;
+  struct MetricsShard *shards[num_shards];
+  int counters[4];
+  int histogram;
+  uint64_t start;
+  uint64_t elapsed[3];
+  size_t len = 0;
+
+  init_metrics_registry(registry);
+  for (int i = 0; i < 4; ++i) {
+    char name[32];
+    snprintf(name, sizeof(name), "bench.counter%d", i);
+    counters[i] = metrics_counter(registry, name);
+  }
+  histogram = metrics_histogram(registry, "bench.latency_ns");
+  for (int i = 0; i < num_shards; ++i) {
+    shards[i] = metrics_shard(registry);
+  }
+
+  start = now_ns();
+  for (uint64_t i = 0; i < updates; ++i) {
+    metrics_add(shards[0], counters[i & 3], i);
+  }
+  elapsed[0] = now_ns() - start;
+  start = now_ns();
+  for (uint64_t i = 0; i < updates; ++i) {
+    metrics_record(shards[0], histogram, (i * 0x9E3779B97F4A7C15ull) >> 44);
+  }
+  elapsed[1] = now_ns() - start;
+  for (int i = 1; i < num_shards; ++i) {
+    for (uint64_t v = 0; v < 100000; ++v) {
+      metrics_record(shards[i], histogram, v);
+    }
+  }
+  start = now_ns();
+  for (int i = 0; i < 100; ++i) {
+    len = metrics_format(registry, buf, sizeof(buf));
+  }
+  elapsed[2] = (now_ns() - start) / 100;
+
+  std::cout << "metrics: counter add " << (double)elapsed[0] / updates << " ns, histogram record "
+            << (double)elapsed[1] / updates << " ns, " << num_shards << " shard dump " << elapsed[2] / 1000
+            << " us (" << len << " bytes)" << std::endl;
+  free_metrics_registry(registry);
+  delete registry;
+}
+
+/**
+ * Entrypoint to the program.
+ *
+ * @param argc count of arguments on command line
+ * @param argv names of the benchmarks to run, all of them if none given
+ *
+ * @return exit code of the program
+ */
+int main(int argc, char *argv[]) {
+  struct {
+    const char *name;
+    void (*run)();
+  } benchmarks[] = {
+      {"sessions", bench_sessions},
+      {"tokens", bench_tokens},
+      {"codec", bench_codec},
+      {"boards", bench_boards},
+      {"moves", bench_moves},
+      {"gomoku", bench_gomoku},
+      {"metrics", bench_metrics},
+  };
+  const int num_benchmarks = sizeof(benchmarks) / sizeof(benchmarks[0]);
+
+  for (int b = 0; b < num_benchmarks; ++b) {
+    bool selected = (argc < 2);
+    for (int i = 1; i < argc; ++i) {
+      if (strcmp(argv[i], benchmarks[b].name) == 0) {
+        selected = true;
+      }
+    }
+    if (selected) {
+      benchmarks[b].run();
+    }
+  }
+  return 0;
+}
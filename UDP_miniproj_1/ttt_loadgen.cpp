@@ -0,0 +1,727 @@
+/**
+ * Load generator for the TicTacToe server. Plays games as fast as it
+ * can, either one game per datagram or many games per batch message,
+ * and reports games/sec and request latency.
+ *
+ * With --moves it sends perfect-play move queries instead of games and
+ * reports queries/sec; with --large WxHxK it plays large board games
+ * (e.g., 15x15x5 gomoku).
+ *
+ * e.g., ./ttt_loadgen 127.0.0.1 8888 --games 200000 --window 64 --batch 32 --compare
+ *       ./ttt_loadgen 127.0.0.1 8888 --window 64 --io gso
+ *       ./ttt_loadgen 127.0.0.1 8888 --moves --games 1000000 --window 256 --io mmsg
+ *       ./ttt_loadgen 127.0.0.1 8888 --large 15x15x5 --window 64
+ */
+
+#include <iostream>
+#include <sys/socket.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <poll.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+
+#include "udp_utils.h"
+#include "udp_batch_io.h"
+#include "tictactoe.h"
+#include "ttt_wire.h"
+#include "board_gen.h"
+#include "perfect_play.h"
+#include "large_board.h"
+
+/**
+ * How datagrams are sent and received.
+ */
+enum LoadIOMode {
+  IO_PLAIN,  // one send/recv per datagram
+  IO_MMSG,   // sendmmsg/recvmmsg batches
+  IO_GSO     // batches, with UDP_SEGMENT sends and UDP_GRO receives
+};
+
+/**
+ * Options given on the command line after IP PORT.
+ */
+struct LoadgenOptions {
+  /* total games to play */
+  int num_games;
+  /* games per batch message, 1 for the single game messages */
+  int batch;
+  /* games in flight per round */
+  int window;
+  /* how long to wait for missing replies before giving up on them */
+  int timeout_ms;
+  /* run once with single games and once with batches */
+  bool compare;
+  /* send ClientGetBestMove queries instead of playing games */
+  bool moves;
+  /* play large board games of this size instead, if not NULL */
+  const struct LargeVariant *large;
+  /* how datagrams are sent and received */
+  enum LoadIOMode io_mode;
+};
+
+/**
+ * The socket plus whatever batching state the io mode needs.
+ */
+struct LoadIO {
+  int udp_socket;
+  enum LoadIOMode mode;
+  struct sockaddr_in server;
+  struct SendBatch *send_batch;
+  struct RecvBatch *recv_batch;
+  char recv_buf[2048];
+};
+
+/**
+ * Everything measured during one run.
+ */
+struct LoadStats {
+  uint64_t games_played;
+  uint64_t games_correct;
+  uint64_t replies_lost;
+  uint64_t datagrams_sent;
+  uint64_t datagrams_received;
+  uint64_t elapsed_ns;
+  /* time from sending a game request to receiving its games */
+  std::vector<uint64_t> latency_ns;
+};
+
+/**
+ * A game received from the server, waiting to be graded.
+ */
+struct PendingGame {
+  uint16_t game_id;
+  uint16_t result;
+};
+
+static uint64_t now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/**
+ * Queue (or, for IO_PLAIN, send) one datagram to the server.
+ */
+static void io_send(struct LoadIO *io, const void *data, int len) {
+  char *space;
+  int cap;
+
+  if (io->mode == IO_PLAIN) {
+    send(io->udp_socket, data, len, 0);
+    return;
+  }
+  space = send_batch_space(io->send_batch, &cap);
+  memcpy(space, data, len);
+  send_batch_commit(io->send_batch, &io->server, len);
+}
+
+/**
+ * Send everything queued by io_send.
+ */
+static void io_flush(struct LoadIO *io) {
+  if (io->mode != IO_PLAIN) {
+    flush_send_batch(io->send_batch);
+  }
+}
+
+/**
+ * Wait up to timeout_ms for the next datagram from the server.
+ *
+ * @param io the socket and batches
+ * @param data set to the datagram contents
+ * @param timeout_ms how long to wait if nothing is buffered
+ * @return bytes received, or -1 on timeout/error
+ */
+static int io_recv(struct LoadIO *io, const char **data, int timeout_ms) {
+  const struct sockaddr_in *from;
+  struct pollfd pfd;
+  int len;
+
+  if (io->mode != IO_PLAIN && recv_batch_next(io->recv_batch, data, &len, &from)) {
+    return len;
+  }
+
+  pfd.fd = io->udp_socket;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, timeout_ms) <= 0) {
+    return -1;
+  }
+
+  if (io->mode == IO_PLAIN) {
+    *data = io->recv_buf;
+    return recv(io->udp_socket, io->recv_buf, sizeof(io->recv_buf), 0);
+  }
+
+  if (recv_batch_fill(io->recv_batch, MSG_DONTWAIT) <= 0 || !recv_batch_next(io->recv_batch, data, &len, &from)) {
+    return -1;
+  }
+  return len;
+}
+
+/**
+ * Send every game request of one round. Each request carries its index
+ * in the round as its client_id so replies can be matched up.
+ */
+static void send_game_requests(struct LoadIO *io, int num_games, int batch, std::vector<uint64_t> &sent_at,
+                               struct LoadStats *stats) {
+  struct GetGameMessage single;
+  struct GetGameBatchMessage batched;
+  char msg[GetGameBatchCodec::wire_size];
+  int num_requests = (num_games + batch - 1) / batch;
+
+  sent_at.resize(num_requests);
+  for (int i = 0; i < num_requests; ++i) {
+    sent_at[i] = now_ns();
+    if (batch == 1) {
+      single.hdr = {ClientGetGame, GetGameCodec::wire_size};
+      single.client_id = i;
+      io_send(io, msg, GetGameCodec::encode(single, msg, sizeof(msg)));
+    } else {
+      batched.hdr = {ClientGetGameBatch, GetGameBatchCodec::wire_size};
+      batched.client_id = i;
+      batched.count = std::min(batch, num_games - i * batch);
+      io_send(io, msg, GetGameBatchCodec::encode(batched, msg, sizeof(msg)));
+    }
+    stats->datagrams_sent++;
+  }
+  io_flush(io);
+}
+
+/**
+ * Collect the game replies for one round and grade every game.
+ *
+ * @return the graded games, grouped by the reply they came in
+ */
+static std::vector<std::vector<struct PendingGame> > receive_games(struct LoadIO *io, int num_requests,
+                                                                  const std::vector<uint64_t> &sent_at,
+                                                                  const struct LoadgenOptions *options,
+                                                                  struct LoadStats *stats) {
+  const char *recv_buf;
+  std::vector<std::vector<struct PendingGame> > games;
+  struct BatchGame batch_game;
+  struct PendingGame pending;
+  uint16_t type;
+  int received = 0;
+  int ret;
+
+  while (received < num_requests) {
+    ret = io_recv(io, &recv_buf, options->timeout_ms);
+    if (ret < 0) {
+      stats->replies_lost += num_requests - received;
+      break;
+    }
+    stats->datagrams_received++;
+    received++;
+
+    auto hdr = wire::View<TTTMessageCodec>::over(recv_buf, ret);
+    if (!hdr) {
+      continue;
+    }
+    type = hdr.get<&TTTMessage::type>();
+
+    if ((type == ServerGameReply) && (ret == (int)GameSummaryCodec::wire_size)) {
+      auto summary = wire::View<GameSummaryCodec>::over(recv_buf, ret);
+      uint16_t index = summary.get<&GameSummaryMessage::client_id>();
+      if (index < sent_at.size()) {
+        stats->latency_ns.push_back(now_ns() - sent_at[index]);
+      }
+      pending.game_id = summary.get<&GameSummaryMessage::game_id>();
+      pending.result = board_result(summary.get<&GameSummaryMessage::x_positions>(),
+                                    summary.get<&GameSummaryMessage::o_positions>());
+      games.push_back(std::vector<struct PendingGame>(1, pending));
+    } else if (type == ServerGameBatchReply) {
+      auto batch_reply = wire::View<GameBatchReplyCodec>::over(recv_buf, ret);
+      if (!batch_reply) {
+        continue;
+      }
+      uint16_t index = batch_reply.get<&GameBatchReplyMessage::client_id>();
+      uint16_t count = batch_reply.get<&GameBatchReplyMessage::count>();
+      if (ret != (int)(GameBatchReplyCodec::wire_size + count * BatchGameCodec::wire_size)) {
+        continue;
+      }
+      if (index < sent_at.size()) {
+        stats->latency_ns.push_back(now_ns() - sent_at[index]);
+      }
+      games.push_back(std::vector<struct PendingGame>());
+      for (uint16_t i = 0; i < count; ++i) {
+        BatchGameCodec::decode_unchecked(
+            (const uint8_t *)&batch_reply.payload()[i * BatchGameCodec::wire_size], batch_game);
+        pending.game_id = batch_game.game_id;
+        pending.result = board_result(batch_game.x_positions, batch_game.o_positions);
+        games.back().push_back(pending);
+      }
+    }
+  }
+  return games;
+}
+
+/**
+ * Report every graded game of one round and count the CORRECT grades.
+ */
+static void send_and_check_results(struct LoadIO *io, const std::vector<std::vector<struct PendingGame> > &games,
+                                   const struct LoadgenOptions *options, struct LoadStats *stats) {
+  static char send_buf[TTT_MAX_DATAGRAM];
+  const char *recv_buf;
+  struct GameResultMessage single;
+  struct ResultBatchMessage batched;
+  struct BatchResult result;
+  uint16_t type;
+  uint16_t grade;
+  int expected = 0;
+  int received = 0;
+  int ret;
+
+  for (size_t g = 0; g < games.size(); ++g) {
+    if (games[g].empty()) {
+      continue;
+    }
+    if (options->batch == 1) {
+      single.hdr = {ClientResult, GameResultCodec::wire_size};
+      single.game_id = games[g][0].game_id;
+      single.result = games[g][0].result;
+      io_send(io, send_buf, GameResultCodec::encode(single, send_buf, sizeof(send_buf)));
+    } else {
+      int offset = ResultBatchCodec::wire_size;
+      for (size_t i = 0; i < games[g].size(); ++i) {
+        result.game_id = games[g][i].game_id;
+        result.result = games[g][i].result;
+        offset += BatchResultCodec::encode(result, &send_buf[offset], sizeof(send_buf) - offset);
+      }
+      batched.hdr = {ClientResultBatch, (uint16_t)offset};
+      batched.count = games[g].size();
+      ResultBatchCodec::encode(batched, send_buf, sizeof(send_buf));
+      io_send(io, send_buf, offset);
+    }
+    stats->datagrams_sent++;
+    expected++;
+  }
+  io_flush(io);
+
+  while (received < expected) {
+    ret = io_recv(io, &recv_buf, options->timeout_ms);
+    if (ret < 0) {
+      stats->replies_lost += expected - received;
+      break;
+    }
+    stats->datagrams_received++;
+    received++;
+
+    auto hdr = wire::View<TTTMessageCodec>::over(recv_buf, ret);
+    if (!hdr) {
+      continue;
+    }
+    type = hdr.get<&TTTMessage::type>();
+
+    if (type == ServerClientResultCorrect) {
+      stats->games_played++;
+      stats->games_correct++;
+    } else if (type == ServerClientResultIncorrect) {
+      stats->games_played++;
+    } else if (type == ServerResultBatchReply) {
+      auto batch_reply = wire::View<ResultBatchReplyCodec>::over(recv_buf, ret);
+      if (!batch_reply) {
+        continue;
+      }
+      uint16_t count = batch_reply.get<&ResultBatchReplyMessage::count>();
+      if (ret != (int)(ResultBatchReplyCodec::wire_size + count * sizeof(uint16_t))) {
+        continue;
+      }
+      for (uint16_t i = 0; i < count; ++i) {
+        grade = wire::load_be<uint16_t>((const uint8_t *)&batch_reply.payload()[i * sizeof(uint16_t)]);
+        if (grade == ServerClientResultCorrect) {
+          stats->games_played++;
+          stats->games_correct++;
+        } else if (grade == ServerClientResultIncorrect) {
+          stats->games_played++;
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Play options->num_games games against the server, window games per
+ * round: request them all, grade them, report all results.
+ */
+static void run_load(struct LoadIO *io, const struct LoadgenOptions *options, struct LoadStats *stats) {
+  std::vector<uint64_t> sent_at;
+  uint64_t start = now_ns();
+  int remaining = options->num_games;
+
+  while (remaining > 0) {
+    int round_games = std::min(remaining, options->window);
+    int num_requests = (round_games + options->batch - 1) / options->batch;
+
+    send_game_requests(io, round_games, options->batch, sent_at, stats);
+    send_and_check_results(io, receive_games(io, num_requests, sent_at, options, stats), options, stats);
+    remaining -= round_games;
+  }
+
+  stats->elapsed_ns = now_ns() - start;
+}
+
+/**
+ * Send options->num_games best move queries for random reachable
+ * boards, window per round, and check each answer against the local
+ * solver. games_played counts answers, games_correct matching ones.
+ */
+static void run_move_load(struct LoadIO *io, const struct LoadgenOptions *options, struct LoadStats *stats) {
+  const struct BoardMix mix = {{1, 1, 8, 0}};
+  struct BoardPicker picker;
+  struct BestMoveRequestMessage request;
+  std::vector<uint64_t> sent_at;
+  char msg[BestMoveRequestCodec::wire_size];
+  const char *recv_buf;
+  uint64_t start = now_ns();
+  int remaining = options->num_games;
+  uint16_t x_positions;
+  uint16_t o_positions;
+  uint16_t move;
+  ResultType value;
+  int ret;
+
+  // Mostly boards still in play, which is what bots ask about
+  init_board_picker(&picker, &mix, 1);
+
+  while (remaining > 0) {
+    int round_queries = std::min(remaining, options->window);
+    int received = 0;
+
+    sent_at.resize(round_queries);
+    for (int i = 0; i < round_queries; ++i) {
+      pick_board(&picker, &x_positions, &o_positions);
+      request.hdr = {ClientGetBestMove, BestMoveRequestCodec::wire_size};
+      request.client_id = i;
+      request.x_positions = x_positions;
+      request.o_positions = o_positions;
+      sent_at[i] = now_ns();
+      io_send(io, msg, BestMoveRequestCodec::encode(request, msg, sizeof(msg)));
+      stats->datagrams_sent++;
+    }
+    io_flush(io);
+
+    while (received < round_queries) {
+      ret = io_recv(io, &recv_buf, options->timeout_ms);
+      if (ret < 0) {
+        stats->replies_lost += round_queries - received;
+        break;
+      }
+      stats->datagrams_received++;
+      received++;
+
+      auto reply = wire::View<BestMoveReplyCodec>::over(recv_buf, ret);
+      if (!reply || reply.sub<&BestMoveReplyMessage::hdr>().get<&TTTMessage::type>() != ServerBestMoveReply) {
+        continue;
+      }
+      uint16_t index = reply.get<&BestMoveReplyMessage::client_id>();
+      if (index < sent_at.size()) {
+        stats->latency_ns.push_back(now_ns() - sent_at[index]);
+      }
+      stats->games_played++;
+      if (best_move(reply.get<&BestMoveReplyMessage::x_positions>(), reply.get<&BestMoveReplyMessage::o_positions>(),
+                    &move, &value) == 0 &&
+          reply.get<&BestMoveReplyMessage::move>() == move && reply.get<&BestMoveReplyMessage::value>() == value) {
+        stats->games_correct++;
+      }
+    }
+    remaining -= round_queries;
+  }
+
+  stats->elapsed_ns = now_ns() - start;
+}
+
+/**
+ * Play options->num_games large board games, window per round: request
+ * them all, grade each as it arrives and echo the board back with the
+ * result, then collect the grades.
+ */
+static void run_large_load(struct LoadIO *io, const struct LoadgenOptions *options, struct LoadStats *stats) {
+  const struct LargeVariant *variant = options->large;
+  const int rows_len = 4 * variant->height;
+  struct GetLargeGameMessage request;
+  struct LargeGameResultMessage result;
+  std::vector<uint64_t> sent_at;
+  static char send_buf[TTT_MAX_DATAGRAM];
+  uint16_t x_rows[LARGE_BOARD_MAX_ROWS];
+  uint16_t o_rows[LARGE_BOARD_MAX_ROWS];
+  const char *recv_buf;
+  uint64_t start = now_ns();
+  int remaining = options->num_games;
+  int ret;
+
+  while (remaining > 0) {
+    int round_games = std::min(remaining, options->window);
+    int received = 0;
+    int expected = 0;
+
+    sent_at.resize(round_games);
+    for (int i = 0; i < round_games; ++i) {
+      request.hdr = {ClientGetLargeGame, GetLargeGameCodec::wire_size};
+      request.client_id = i;
+      request.width = variant->width;
+      request.height = variant->height;
+      request.k = variant->k;
+      sent_at[i] = now_ns();
+      io_send(io, send_buf, GetLargeGameCodec::encode(request, send_buf, sizeof(send_buf)));
+      stats->datagrams_sent++;
+    }
+    io_flush(io);
+
+    while (received < round_games) {
+      ret = io_recv(io, &recv_buf, options->timeout_ms);
+      if (ret < 0) {
+        stats->replies_lost += round_games - received;
+        break;
+      }
+      stats->datagrams_received++;
+      received++;
+
+      auto summary = wire::View<LargeGameSummaryCodec>::over(recv_buf, ret);
+      if (!summary || summary.sub<&LargeGameSummaryMessage::hdr>().get<&TTTMessage::type>() != ServerLargeGameReply ||
+          ret != (int)LargeGameSummaryCodec::wire_size + rows_len) {
+        continue;
+      }
+      uint16_t index = summary.get<&LargeGameSummaryMessage::client_id>();
+      if (index < sent_at.size()) {
+        stats->latency_ns.push_back(now_ns() - sent_at[index]);
+      }
+
+      decode_large_rows(summary.payload(), variant->height, x_rows, o_rows);
+      result.hdr = {ClientLargeResult, (uint16_t)(LargeGameResultCodec::wire_size + rows_len)};
+      result.game_id = summary.get<&LargeGameSummaryMessage::game_id>();
+      result.result = variant->result(x_rows, o_rows);
+      result.width = variant->width;
+      result.height = variant->height;
+      result.k = variant->k;
+      memcpy(result.token, summary.bytes<&LargeGameSummaryMessage::token>(), GAME_TOKEN_LEN);
+      LargeGameResultCodec::encode(result, send_buf, sizeof(send_buf));
+      // The rows go back exactly as they came
+      memcpy(&send_buf[LargeGameResultCodec::wire_size], summary.payload(), rows_len);
+      io_send(io, send_buf, LargeGameResultCodec::wire_size + rows_len);
+      stats->datagrams_sent++;
+      expected++;
+    }
+    io_flush(io);
+
+    received = 0;
+    while (received < expected) {
+      ret = io_recv(io, &recv_buf, options->timeout_ms);
+      if (ret < 0) {
+        stats->replies_lost += expected - received;
+        break;
+      }
+      stats->datagrams_received++;
+      received++;
+
+      auto hdr = wire::View<TTTMessageCodec>::over(recv_buf, ret);
+      if (!hdr) {
+        continue;
+      }
+      if (hdr.get<&TTTMessage::type>() == ServerClientResultCorrect) {
+        stats->games_played++;
+        stats->games_correct++;
+      } else if (hdr.get<&TTTMessage::type>() == ServerClientResultIncorrect) {
+        stats->games_played++;
+      }
+    }
+    remaining -= round_games;
+  }
+
+  stats->elapsed_ns = now_ns() - start;
+}
+
+static uint64_t percentile(std::vector<uint64_t> &samples, double fraction) {
+  if (samples.empty()) {
+    return 0;
+  }
+  size_t index = (size_t)(fraction * (samples.size() - 1));
+  std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+  return samples[index];
+}
+
+/**
+ * Print throughput and latency for a run.
+ *
+ * @param unit what was counted, "games" or "queries"
+ * @return games (or queries) per second
+ */
+static double report(const char *label, const char *unit, struct LoadStats *stats) {
+  double seconds = stats->elapsed_ns / 1e9;
+  double games_per_sec = stats->games_played / seconds;
+
+  std::cout << label << ": " << stats->games_played << " " << unit << " (" << stats->games_correct
+            << " correct) in " << seconds << " s = " << (uint64_t)games_per_sec << " " << unit << "/s, "
+            << (double)(stats->datagrams_sent + stats->datagrams_received) / (stats->games_played ? stats->games_played : 1)
+            << " datagrams/" << (strcmp(unit, "games") == 0 ? "game" : "query") << ", " << stats->replies_lost << " replies lost" << std::endl;
+  std::cout << label << ": request latency p50 " << percentile(stats->latency_ns, 0.50) / 1000.0 << " us, p99 "
+            << percentile(stats->latency_ns, 0.99) / 1000.0 << " us, p99.9 "
+            << percentile(stats->latency_ns, 0.999) / 1000.0 << " us, max "
+            << percentile(stats->latency_ns, 1.0) / 1000.0 << " us" << std::endl;
+  return games_per_sec;
+}
+
+/**
+ * Entrypoint to the program.
+ *
+ * @param argc count of arguments on command line
+ * @param argv character array of command line arguments
+ *
+ * @return exit code of the program
+ */
+int main(int argc, char *argv[]) {
+  struct LoadgenOptions options;
+  struct sockaddr_in dest_addr;
+  struct LoadIO io;
+  int udp_socket;
+  int ret;
+
+  if (argc < 3) {
+    std::cerr << "Please specify IP PORT [--games N] [--batch N] [--window N] [--timeout MS] [--compare]"
+              << " [--moves | --large WxHxK] [--io plain|mmsg|gso]"
+              << " as arguments." << std::endl;
+    return 1;
+  }
+
+  options.num_games = 100000;
+  options.batch = 1;
+  options.window = 64;
+  options.timeout_ms = 200;
+  options.compare = false;
+  options.moves = false;
+  options.large = NULL;
+  options.io_mode = IO_PLAIN;
+  for (int i = 3; i < argc; ++i) {
+    if ((strcmp(argv[i], "--games") == 0) && (i + 1 < argc)) {
+      options.num_games = atoi(argv[++i]);
+    } else if ((strcmp(argv[i], "--batch") == 0) && (i + 1 < argc)) {
+      options.batch = atoi(argv[++i]);
+    } else if ((strcmp(argv[i], "--window") == 0) && (i + 1 < argc)) {
+      options.window = atoi(argv[++i]);
+    } else if ((strcmp(argv[i], "--timeout") == 0) && (i + 1 < argc)) {
+      options.timeout_ms = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--compare") == 0) {
+      options.compare = true;
+    } else if (strcmp(argv[i], "--moves") == 0) {
+      options.moves = true;
+    } else if ((strcmp(argv[i], "--large") == 0) && (i + 1 < argc)) {
+      unsigned int width;
+      unsigned int height;
+      unsigned int k;
+      if (sscanf(argv[++i], "%ux%ux%u", &width, &height, &k) != 3 ||
+          (options.large = find_large_variant(width, height, k)) == NULL) {
+        std::cerr << "--large takes a board the server plays: 3x3x3, 7x6x4 or 15x15x5" << std::endl;
+        return 1;
+      }
+    } else if ((strcmp(argv[i], "--io") == 0) && (i + 1 < argc)) {
+      ++i;
+      if (strcmp(argv[i], "mmsg") == 0) {
+        options.io_mode = IO_MMSG;
+      } else if (strcmp(argv[i], "gso") == 0) {
+        options.io_mode = IO_GSO;
+      } else {
+        options.io_mode = IO_PLAIN;
+      }
+    } else {
+      std::cerr << "Unknown option " << argv[i] << std::endl;
+      return 1;
+    }
+  }
+
+  if (options.batch < 1 || options.batch > TTT_MAX_BATCH_GAMES || options.window < 1 || options.window > 65535) {
+    std::cerr << "--batch must be 1-" << TTT_MAX_BATCH_GAMES << " and --window 1-65535." << std::endl;
+    return 1;
+  }
+
+  memset(&dest_addr, 0, sizeof(struct sockaddr_in));
+  ret = convert_ip_port_to_sockaddr_in(argv[1], argv[2], &dest_addr);
+  if (ret == -1) {
+    handle_error("ip/port conversion failed");
+    return 1;
+  }
+
+  udp_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (udp_socket < 0) {
+    handle_error("UDP socket creation failed.");
+    return 1;
+  }
+
+  // Connect so plain send/recv can be used, and only the server's replies arrive
+  ret = connect(udp_socket, (struct sockaddr *)&dest_addr, sizeof(struct sockaddr_in));
+  if (ret == -1) {
+    handle_error("connect failed");
+    close(udp_socket);
+    return 1;
+  }
+
+  io.udp_socket = udp_socket;
+  io.mode = options.io_mode;
+  io.server = dest_addr;
+  io.send_batch = nullptr;
+  io.recv_batch = nullptr;
+  if (io.mode != IO_PLAIN) {
+    bool use_gro = (io.mode == IO_GSO) && (enable_udp_gro(udp_socket) == 0);
+    io.send_batch = (struct SendBatch *)malloc(sizeof(struct SendBatch));
+    io.recv_batch = (struct RecvBatch *)malloc(sizeof(struct RecvBatch));
+    init_send_batch(io.send_batch, udp_socket, io.mode == IO_GSO);
+    if (init_recv_batch(io.recv_batch, udp_socket, use_gro) == -1) {
+      std::cerr << "Could not allocate receive buffers." << std::endl;
+      return 1;
+    }
+    if (io.mode == IO_GSO && !(io.send_batch->use_gso && use_gro)) {
+      std::cout << "GSO/GRO not supported here, falling back to sendmmsg/recvmmsg" << std::endl;
+    }
+  }
+
+  if (options.compare) {
+    struct LoadgenOptions single_options = options;
+    struct LoadStats single_stats = LoadStats();
+    struct LoadStats batch_stats = LoadStats();
+    double single_rate;
+    double batch_rate;
+
+    single_options.batch = 1;
+    run_load(&io, &single_options, &single_stats);
+    single_rate = report("single", "games", &single_stats);
+
+    if (options.batch == 1) {
+      options.batch = TTT_MAX_BATCH_GAMES;
+    }
+    run_load(&io, &options, &batch_stats);
+    batch_rate = report("batch", "games", &batch_stats);
+
+    std::cout << "batch of " << options.batch << " is " << batch_rate / single_rate << "x single game throughput"
+              << std::endl;
+  } else if (options.large != NULL) {
+    struct LoadStats stats = LoadStats();
+    run_large_load(&io, &options, &stats);
+    report("large", "games", &stats);
+  } else if (options.moves) {
+    struct LoadStats stats = LoadStats();
+    std::cout << "Solved " << perfect_play_table_size() << " positions to check answers against" << std::endl;
+    run_move_load(&io, &options, &stats);
+    report("moves", "queries", &stats);
+  } else {
+    struct LoadStats stats = LoadStats();
+    run_load(&io, &options, &stats);
+    report(options.batch == 1 ? "single" : "batch", "games", &stats);
+  }
+
+  if (io.mode != IO_PLAIN) {
+    std::cout << "io: " << io.send_batch->datagrams << " datagrams in " << io.send_batch->syscalls
+              << " send calls, " << io.recv_batch->datagrams << " datagrams in " << io.recv_batch->syscalls
+              << " receive calls" << std::endl;
+    free_recv_batch(io.recv_batch);
+    free(io.recv_batch);
+    free(io.send_batch);
+  }
+
+  close(udp_socket);
+  return 0;
+}
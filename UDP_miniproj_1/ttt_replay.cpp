@@ -0,0 +1,434 @@
+/**
+ * Replay a trace recorded with `udpserver --record` against a server.
+ * Each source address in the trace gets its own local socket, so the
+ * server sees the same set of clients talking in the same order.
+ * Reports the server's reply rate and reply latency.
+ *
+ * Games handed out by the recording server are unknown to the server
+ * being replayed against, so recorded results mostly draw
+ * ServerInvalidRequestReply; the reply types are reported so this can
+ * be told apart from real errors.
+ *
+ * e.g., ./ttt_replay 127.0.0.1 8888 incident.trace              (original timing)
+ *       ./ttt_replay 127.0.0.1 8888 incident.trace --speed 10   (10x faster)
+ *       ./ttt_replay 127.0.0.1 8888 incident.trace --max        (as fast as possible)
+ */
+
+#include <iostream>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+#include "udp_utils.h"
+#include "packet_trace.h"
+#include "ttt_wire.h"
+
+// Most datagrams handed to one sendmmsg/recvmmsg call
+#define REPLAY_BATCH 64
+
+/**
+ * Options given on the command line after IP PORT TRACE.
+ */
+struct ReplayOptions {
+  /* multiple of the recorded rate to replay at, 0 for as fast as possible */
+  double speed;
+  /* most requests without a reply before sending waits, when speed is 0 */
+  int window;
+  /* most local sockets; extra sources share them */
+  int max_sockets;
+  /* how long to wait for missing replies at the end */
+  int timeout_ms;
+};
+
+/**
+ * One datagram to send, pointing into the mapped trace.
+ */
+struct ReplayPacket {
+  uint64_t timestamp_ns;
+  int socket_index;
+  const char *data;
+  int len;
+};
+
+/**
+ * A local socket standing in for one or more recorded sources.
+ */
+struct ReplaySocket {
+  int udp_socket;
+  /* send times of requests still waiting for a reply, oldest first */
+  std::deque<uint64_t> in_flight;
+};
+
+struct ReplayStats {
+  uint64_t sent;
+  uint64_t replies;
+  uint64_t unexpected;
+  uint64_t in_flight;
+  uint64_t first_send_ns;
+  uint64_t last_reply_ns;
+  std::map<uint16_t, uint64_t> reply_types;
+  std::vector<uint64_t> latency_ns;
+};
+
+static uint64_t now_ns() {
+  return trace_now_ns();
+}
+
+static const char *message_type_name(uint16_t type) {
+  switch (type) {
+    case ServerGameReply: return "ServerGameReply";
+    case ServerInvalidRequestReply: return "ServerInvalidRequestReply";
+    case ServerClientResultCorrect: return "ServerClientResultCorrect";
+    case ServerClientResultIncorrect: return "ServerClientResultIncorrect";
+    case ServerTokenGameReply: return "ServerTokenGameReply";
+    case ServerGameBatchReply: return "ServerGameBatchReply";
+    case ServerResultBatchReply: return "ServerResultBatchReply";
+    case ServerBestMoveReply: return "ServerBestMoveReply";
+    case ServerLargeGameReply: return "ServerLargeGameReply";
+    default: return "other";
+  }
+}
+
+/**
+ * Read every record of the trace, giving each distinct source a socket
+ * index, and put the datagrams in time order (workers record in
+ * parallel, so the file is only roughly ordered).
+ *
+ * @return number of distinct sources
+ */
+static int load_trace(struct TraceReader *reader, const struct ReplayOptions *options,
+                      std::vector<struct ReplayPacket> &packets, int *num_sockets) {
+  std::unordered_map<uint64_t, int> sources;
+  const struct TraceRecord *record;
+  const char *data;
+  struct ReplayPacket packet;
+
+  while (trace_next(reader, &record, &data)) {
+    uint64_t key = ((uint64_t)record->addr << 16) | record->port;
+    auto found = sources.find(key);
+    if (found == sources.end()) {
+      found = sources.emplace(key, (int)sources.size()).first;
+    }
+    packet.timestamp_ns = record->timestamp_ns;
+    packet.socket_index = found->second % options->max_sockets;
+    packet.data = data;
+    packet.len = record->len;
+    packets.push_back(packet);
+  }
+
+  std::stable_sort(packets.begin(), packets.end(),
+                   [](const struct ReplayPacket &a, const struct ReplayPacket &b) {
+                     return a.timestamp_ns < b.timestamp_ns;
+                   });
+  *num_sockets = std::min((int)sources.size(), options->max_sockets);
+  return sources.size();
+}
+
+/**
+ * Send a run of datagrams, all on the same socket, with sendmmsg.
+ */
+static void send_run(struct ReplaySocket *sock, const struct ReplayPacket *const *run, int count,
+                     struct ReplayStats *stats) {
+  struct mmsghdr msgs[REPLAY_BATCH];
+  struct iovec iovs[REPLAY_BATCH];
+  uint64_t sent_at;
+  int done = 0;
+  int ret;
+
+  for (int i = 0; i < count; ++i) {
+    iovs[i].iov_base = (void *)run[i]->data;
+    iovs[i].iov_len = run[i]->len;
+    memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  sent_at = now_ns();
+  while (done < count) {
+    ret = sendmmsg(sock->udp_socket, &msgs[done], count - done, 0);
+    if (ret <= 0) {
+      if (ret == -1 && errno == EINTR) {
+        continue;
+      }
+      handle_error("sendmmsg failed");
+      break;
+    }
+    done += ret;
+  }
+
+  for (int i = 0; i < done; ++i) {
+    sock->in_flight.push_back(sent_at);
+  }
+  stats->sent += done;
+  stats->in_flight += done;
+  if (stats->first_send_ns == 0) {
+    stats->first_send_ns = sent_at;
+  }
+}
+
+/**
+ * Send a batch of due datagrams, one sendmmsg per socket.
+ */
+static void send_batch(std::vector<struct ReplaySocket> &sockets, const struct ReplayPacket *batch, int count,
+                       struct ReplayStats *stats) {
+  const struct ReplayPacket *order[REPLAY_BATCH];
+  int start = 0;
+
+  // Group by socket, keeping each socket's datagrams in trace order
+  for (int i = 0; i < count; ++i) {
+    order[i] = &batch[i];
+  }
+  std::stable_sort(order, order + count, [](const struct ReplayPacket *a, const struct ReplayPacket *b) {
+    return a->socket_index < b->socket_index;
+  });
+
+  for (int i = 1; i <= count; ++i) {
+    if (i == count || order[i]->socket_index != order[start]->socket_index) {
+      send_run(&sockets[order[start]->socket_index], &order[start], i - start, stats);
+      start = i;
+    }
+  }
+}
+
+/**
+ * Read every reply waiting on the sockets epoll reports ready. Replies
+ * are matched to requests in order on each socket.
+ */
+static void receive_replies(int epoll_fd, int timeout_ms, std::vector<struct ReplaySocket> &sockets,
+                            struct ReplayStats *stats) {
+  static char buffers[REPLAY_BATCH][2048];
+  struct mmsghdr msgs[REPLAY_BATCH];
+  struct iovec iovs[REPLAY_BATCH];
+  struct epoll_event events[REPLAY_BATCH];
+  int num_events;
+  int ret;
+
+  num_events = epoll_wait(epoll_fd, events, REPLAY_BATCH, timeout_ms);
+  for (int e = 0; e < num_events; ++e) {
+    struct ReplaySocket *sock = &sockets[events[e].data.u32];
+
+    do {
+      for (int i = 0; i < REPLAY_BATCH; ++i) {
+        iovs[i].iov_base = buffers[i];
+        iovs[i].iov_len = sizeof(buffers[i]);
+        memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+      }
+      ret = recvmmsg(sock->udp_socket, msgs, REPLAY_BATCH, MSG_DONTWAIT, NULL);
+      if (ret <= 0) {
+        break;
+      }
+
+      uint64_t received_at = now_ns();
+      for (int i = 0; i < ret; ++i) {
+        auto hdr = wire::View<TTTMessageCodec>::over(buffers[i], msgs[i].msg_len);
+        stats->replies++;
+        stats->reply_types[hdr ? hdr.get<&TTTMessage::type>() : 0]++;
+        if (sock->in_flight.empty()) {
+          stats->unexpected++;
+          continue;
+        }
+        stats->latency_ns.push_back(received_at - sock->in_flight.front());
+        sock->in_flight.pop_front();
+        stats->in_flight--;
+      }
+      stats->last_reply_ns = received_at;
+    } while (ret == REPLAY_BATCH);
+  }
+}
+
+static uint64_t percentile(std::vector<uint64_t> &samples, double fraction) {
+  if (samples.empty()) {
+    return 0;
+  }
+  size_t index = (size_t)(fraction * (samples.size() - 1));
+  std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+  return samples[index];
+}
+
+/**
+ * Entrypoint to the program.
+ *
+ * @param argc count of arguments on command line
+ * @param argv character array of command line arguments
+ *
+ * @return exit code of the program
+ */
+int main(int argc, char *argv[]) {
+  struct ReplayOptions options;
+  struct ReplayStats stats = {};
+  struct TraceReader reader;
+  struct sockaddr_in dest_addr;
+  std::vector<struct ReplayPacket> packets;
+  std::vector<struct ReplaySocket> sockets;
+  int num_sources;
+  int num_sockets;
+  int epoll_fd;
+  int ret;
+
+  if (argc < 4) {
+    std::cerr << "Please specify IP PORT TRACE [--speed X | --max] [--window N] [--sockets N] [--timeout MS]"
+              << " as arguments." << std::endl;
+    return 1;
+  }
+
+  options.speed = 1.0;
+  options.window = 1024;
+  options.max_sockets = 1024;
+  options.timeout_ms = 1000;
+  for (int i = 4; i < argc; ++i) {
+    if ((strcmp(argv[i], "--speed") == 0) && (i + 1 < argc)) {
+      options.speed = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--max") == 0) {
+      options.speed = 0;
+    } else if ((strcmp(argv[i], "--window") == 0) && (i + 1 < argc)) {
+      options.window = atoi(argv[++i]);
+    } else if ((strcmp(argv[i], "--sockets") == 0) && (i + 1 < argc)) {
+      options.max_sockets = atoi(argv[++i]);
+    } else if ((strcmp(argv[i], "--timeout") == 0) && (i + 1 < argc)) {
+      options.timeout_ms = atoi(argv[++i]);
+    } else {
+      std::cerr << "Unknown option " << argv[i] << std::endl;
+      return 1;
+    }
+  }
+  if (options.speed < 0 || options.window < 1 || options.max_sockets < 1) {
+    std::cerr << "Speed must not be negative, window and sockets must be at least 1." << std::endl;
+    return 1;
+  }
+
+  ret = convert_ip_port_to_sockaddr_in(argv[1], argv[2], &dest_addr);
+  if (ret == -1) {
+    handle_error("ip/port conversion failed");
+    return 1;
+  }
+
+  if (open_trace_reader(&reader, argv[3]) == -1) {
+    handle_error("could not open trace");
+    return 1;
+  }
+  num_sources = load_trace(&reader, &options, packets, &num_sockets);
+  if (packets.empty()) {
+    std::cerr << "Trace has no datagrams." << std::endl;
+    close_trace_reader(&reader);
+    return 1;
+  }
+
+  // 1. One connected socket per source (up to --sockets), all watched by epoll
+  epoll_fd = epoll_create1(0);
+  sockets.resize(num_sockets);
+  for (int i = 0; i < num_sockets; ++i) {
+    struct epoll_event event;
+    int rcvbuf = 4 << 20;
+
+    sockets[i].udp_socket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+    if (sockets[i].udp_socket < 0) {
+      handle_error("UDP socket creation failed (raise ulimit -n or lower --sockets)");
+      return 1;
+    }
+    setsockopt(sockets[i].udp_socket, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    if (connect(sockets[i].udp_socket, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) == -1) {
+      handle_error("connect failed");
+      return 1;
+    }
+    event.events = EPOLLIN;
+    event.data.u32 = i;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sockets[i].udp_socket, &event);
+  }
+
+  std::cout << "Replaying " << packets.size() << " datagrams from " << num_sources << " sources ("
+            << num_sockets << " sockets), trace spans "
+            << (packets.back().timestamp_ns - packets.front().timestamp_ns) / 1e9 << " s, speed ";
+  if (options.speed > 0) {
+    std::cout << options.speed << "x" << std::endl;
+  } else {
+    std::cout << "max" << std::endl;
+  }
+
+  // 2. Send each datagram when it is due, collecting replies in between
+  uint64_t base_ts = packets.front().timestamp_ns;
+  uint64_t start = now_ns();
+  size_t cursor = 0;
+  while (cursor < packets.size()) {
+    uint64_t now = now_ns();
+    int count = 0;
+    int timeout_ms = 0;
+
+    if (options.speed > 0) {
+      while (cursor + count < packets.size() && count < REPLAY_BATCH &&
+             start + (uint64_t)((packets[cursor + count].timestamp_ns - base_ts) / options.speed) <= now) {
+        count++;
+      }
+    } else if (stats.in_flight < (uint64_t)options.window) {
+      count = std::min((size_t)REPLAY_BATCH, packets.size() - cursor);
+    } else {
+      // Window full, wait for the server to catch up
+      timeout_ms = 1;
+    }
+
+    if (count > 0) {
+      send_batch(sockets, &packets[cursor], count, &stats);
+      cursor += count;
+    } else if (options.speed > 0) {
+      // Wait in epoll until the next datagram is due; the last
+      // millisecond is slept precisely rather than spun, so the
+      // server is not starved when it shares our CPU
+      uint64_t due = start + (uint64_t)((packets[cursor].timestamp_ns - base_ts) / options.speed);
+      if (due > now + 1000000) {
+        timeout_ms = (int)std::min<uint64_t>((due - now) / 1000000, 1000);
+      } else {
+        receive_replies(epoll_fd, 0, sockets, &stats);
+        struct timespec wait = {0, (long)(due - now)};
+        nanosleep(&wait, NULL);
+        continue;
+      }
+    }
+
+    receive_replies(epoll_fd, timeout_ms, sockets, &stats);
+  }
+
+  // 3. Wait for stragglers until nothing arrives for timeout_ms
+  uint64_t last_progress = now_ns();
+  while (stats.in_flight > 0 && now_ns() - last_progress < (uint64_t)options.timeout_ms * 1000000) {
+    uint64_t before = stats.replies;
+    receive_replies(epoll_fd, 10, sockets, &stats);
+    if (stats.replies != before) {
+      last_progress = now_ns();
+    }
+  }
+  uint64_t send_seconds_ns = now_ns() - start;
+
+  double seconds = (stats.last_reply_ns > stats.first_send_ns ? stats.last_reply_ns - stats.first_send_ns
+                                                              : send_seconds_ns) / 1e9;
+  std::cout << "replay: sent " << stats.sent << ", " << stats.replies << " replies in " << seconds << " s = "
+            << (uint64_t)(stats.replies / seconds) << " replies/s, " << stats.in_flight << " lost, "
+            << stats.unexpected << " unexpected" << std::endl;
+  std::cout << "replay: reply latency p50 " << percentile(stats.latency_ns, 0.50) / 1000.0 << " us, p99 "
+            << percentile(stats.latency_ns, 0.99) / 1000.0 << " us, p99.9 "
+            << percentile(stats.latency_ns, 0.999) / 1000.0 << " us, max "
+            << percentile(stats.latency_ns, 1.0) / 1000.0 << " us" << std::endl;
+  std::cout << "replay: replies by type:";
+  for (auto &type : stats.reply_types) {
+    std::cout << " " << message_type_name(type.first) << " " << type.second;
+  }
+  std::cout << std::endl;
+
+  for (int i = 0; i < num_sockets; ++i) {
+    close(sockets[i].udp_socket);
+  }
+  close(epoll_fd);
+  close_trace_reader(&reader);
+  return 0;
+}
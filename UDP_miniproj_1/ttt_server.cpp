@@ -0,0 +1,369 @@
+#include "ttt_server.h"
+#include "udp_utils.h"
+#include "ttt_wire.h"
+#include "perfect_play.h"
+#include "large_board.h"
+#include <string.h>
+
+int init_server_shard(struct ServerShard *shard, int index, const struct ServerConfig *config) {
+  memset(shard, 0, sizeof(struct ServerShard));
+  shard->index = index;
+  shard->config = config;
+  shard->next_game_id = 1;
+  shard->now_ms = monotonic_ms();
+  if (init_board_picker(&shard->boards, &config->board_mix, 2463534242u + (uint64_t)index * 2654435761u) == -1) {
+    return -1;
+  }
+  // Stateless shards never store a game, so skip the table entirely
+  if (config->stateless) {
+    return 0;
+  }
+  return init_session_table(&shard->sessions, config->max_sessions, config->session_ttl_ms, shard->now_ms);
+}
+
+void free_server_shard(struct ServerShard *shard) {
+  free_session_table(&shard->sessions);
+}
+
+void server_shard_tick(struct ServerShard *shard, uint64_t now_ms) {
+  shard->now_ms = now_ms;
+  session_table_advance(&shard->sessions, now_ms);
+}
+
+/**
+ * Fill in a header only reply (ServerInvalidRequestReply and the
+ * result replies are just a TTTMessage).
+ */
+static int build_header_reply(uint16_t type, char *reply_buf, int reply_cap) {
+  struct TTTMessage reply = {type, TTTMessageCodec::wire_size};
+
+  return TTTMessageCodec::encode(reply, reply_buf, reply_cap);
+}
+
+static int handle_get_game(struct ServerShard *shard, const struct sockaddr_in *from, const char *recv_buf,
+                           int recv_len, char *reply_buf, int reply_cap) {
+  struct GetGameMessage request;
+  struct GameSummaryMessage reply;
+  uint16_t x_positions;
+  uint16_t o_positions;
+
+  if (!GetGameCodec::decode(recv_buf, recv_len, request) || reply_cap < (int)GameSummaryCodec::wire_size) {
+    return 0;
+  }
+
+  reply.hdr = {ServerGameReply, GameSummaryCodec::wire_size};
+  reply.client_id = request.client_id;
+  reply.game_id = shard->next_game_id++;
+  pick_board(&shard->boards, &x_positions, &o_positions);
+  reply.x_positions = x_positions;
+  reply.o_positions = o_positions;
+
+  session_insert(&shard->sessions, from->sin_addr.s_addr, from->sin_port, reply.game_id, request.client_id,
+                 x_positions, o_positions);
+
+  return GameSummaryCodec::encode(reply, reply_buf, reply_cap);
+}
+
+static int handle_result(struct ServerShard *shard, const struct sockaddr_in *from, const char *recv_buf,
+                         int recv_len, char *reply_buf, int reply_cap) {
+  struct GameResultMessage request;
+  struct GameSession *game;
+  ResultType expected;
+
+  if (!GameResultCodec::decode(recv_buf, recv_len, request)) {
+    return build_header_reply(ServerInvalidRequestReply, reply_buf, reply_cap);
+  }
+
+  game = session_find(&shard->sessions, from->sin_addr.s_addr, from->sin_port, request.game_id);
+  if (game == nullptr) {
+    return build_header_reply(ServerInvalidRequestReply, reply_buf, reply_cap);
+  }
+  expected = board_result(game->x_positions, game->o_positions);
+  session_remove(&shard->sessions, game);
+
+  if (request.result == expected) {
+    return build_header_reply(ServerClientResultCorrect, reply_buf, reply_cap);
+  }
+  return build_header_reply(ServerClientResultIncorrect, reply_buf, reply_cap);
+}
+
+static int handle_get_token_game(struct ServerShard *shard, const struct sockaddr_in *from, const char *recv_buf,
+                                 int recv_len, char *reply_buf, int reply_cap) {
+  struct GetGameMessage request;
+  struct TokenGameSummaryMessage reply;
+  uint16_t x_positions;
+  uint16_t o_positions;
+
+  if (!GetGameCodec::decode(recv_buf, recv_len, request) || reply_cap < (int)TokenGameSummaryCodec::wire_size) {
+    return 0;
+  }
+
+  reply.hdr = {ServerTokenGameReply, TokenGameSummaryCodec::wire_size};
+  reply.client_id = request.client_id;
+  reply.game_id = shard->next_game_id++;
+  pick_board(&shard->boards, &x_positions, &o_positions);
+  reply.x_positions = x_positions;
+  reply.o_positions = o_positions;
+  make_game_token(shard->config->token_key, token_epoch(shard->now_ms), from->sin_addr.s_addr, from->sin_port,
+                  request.client_id, reply.game_id, x_positions, o_positions, reply.token);
+
+  return TokenGameSummaryCodec::encode(reply, reply_buf, reply_cap);
+}
+
+static int handle_token_result(struct ServerShard *shard, const struct sockaddr_in *from, const char *recv_buf,
+                               int recv_len, char *reply_buf, int reply_cap) {
+  // The token is checked in place, straight out of the receive buffer
+  auto request = wire::View<TokenGameResultCodec>::over(recv_buf, recv_len);
+  uint16_t x_positions;
+  uint16_t o_positions;
+  int ret;
+
+  if (!request) {
+    return build_header_reply(ServerInvalidRequestReply, reply_buf, reply_cap);
+  }
+
+  ret = open_game_token(shard->config->token_key, token_epoch(shard->now_ms), from->sin_addr.s_addr,
+                        from->sin_port, request.get<&TokenGameResultMessage::game_id>(),
+                        request.bytes<&TokenGameResultMessage::token>(), &x_positions, &o_positions);
+  if (ret == -1) {
+    return build_header_reply(ServerInvalidRequestReply, reply_buf, reply_cap);
+  }
+
+  if (request.get<&TokenGameResultMessage::result>() == board_result(x_positions, o_positions)) {
+    return build_header_reply(ServerClientResultCorrect, reply_buf, reply_cap);
+  }
+  return build_header_reply(ServerClientResultIncorrect, reply_buf, reply_cap);
+}
+
+static int handle_get_game_batch(struct ServerShard *shard, const struct sockaddr_in *from, const char *recv_buf,
+                                 int recv_len, char *reply_buf, int reply_cap) {
+  struct GetGameBatchMessage request;
+  struct GameBatchReplyMessage reply;
+  struct BatchGame game;
+  uint16_t count;
+  int offset;
+
+  if (!GetGameBatchCodec::decode(recv_buf, recv_len, request)) {
+    return build_header_reply(ServerInvalidRequestReply, reply_buf, reply_cap);
+  }
+
+  count = request.count;
+  if (count > TTT_MAX_BATCH_GAMES) {
+    count = TTT_MAX_BATCH_GAMES;
+  }
+  if (count == 0 || reply_cap < (int)(GameBatchReplyCodec::wire_size + count * BatchGameCodec::wire_size)) {
+    return build_header_reply(ServerInvalidRequestReply, reply_buf, reply_cap);
+  }
+
+  offset = GameBatchReplyCodec::wire_size;
+  for (uint16_t i = 0; i < count; ++i) {
+    uint16_t x_positions;
+    uint16_t o_positions;
+
+    pick_board(&shard->boards, &x_positions, &o_positions);
+    game.game_id = shard->next_game_id++;
+    game.x_positions = x_positions;
+    game.o_positions = o_positions;
+    session_insert(&shard->sessions, from->sin_addr.s_addr, from->sin_port, game.game_id, request.client_id,
+                   x_positions, o_positions);
+
+    offset += BatchGameCodec::encode(game, &reply_buf[offset], reply_cap - offset);
+  }
+
+  reply.hdr = {ServerGameBatchReply, (uint16_t)offset};
+  reply.client_id = request.client_id;
+  reply.count = count;
+  GameBatchReplyCodec::encode(reply, reply_buf, reply_cap);
+  return offset;
+}
+
+static int handle_result_batch(struct ServerShard *shard, const struct sockaddr_in *from, const char *recv_buf,
+                               int recv_len, char *reply_buf, int reply_cap) {
+  struct ResultBatchMessage request;
+  struct ResultBatchReplyMessage reply;
+  struct BatchResult result;
+  struct GameSession *game;
+  uint16_t grade;
+  int offset;
+
+  if (!ResultBatchCodec::decode(recv_buf, recv_len, request) || request.count > TTT_MAX_BATCH_GAMES ||
+      recv_len != (int)(ResultBatchCodec::wire_size + request.count * BatchResultCodec::wire_size) ||
+      reply_cap < (int)(ResultBatchReplyCodec::wire_size + request.count * sizeof(uint16_t))) {
+    return build_header_reply(ServerInvalidRequestReply, reply_buf, reply_cap);
+  }
+
+  offset = ResultBatchReplyCodec::wire_size;
+  for (uint16_t i = 0; i < request.count; ++i) {
+    // Length checked above for the whole batch
+    BatchResultCodec::decode_unchecked(
+        (const uint8_t *)&recv_buf[ResultBatchCodec::wire_size + i * BatchResultCodec::wire_size], result);
+
+    game = session_find(&shard->sessions, from->sin_addr.s_addr, from->sin_port, result.game_id);
+    if (game == nullptr) {
+      grade = ServerInvalidRequestReply;
+    } else {
+      if (result.result == board_result(game->x_positions, game->o_positions)) {
+        grade = ServerClientResultCorrect;
+      } else {
+        grade = ServerClientResultIncorrect;
+      }
+      session_remove(&shard->sessions, game);
+    }
+
+    wire::store_be((uint8_t *)&reply_buf[offset], grade);
+    offset += sizeof(uint16_t);
+  }
+
+  reply.hdr = {ServerResultBatchReply, (uint16_t)offset};
+  reply.count = request.count;
+  ResultBatchReplyCodec::encode(reply, reply_buf, reply_cap);
+  return offset;
+}
+
+static int handle_best_move(const char *recv_buf, int recv_len, char *reply_buf, int reply_cap) {
+  struct BestMoveRequestMessage request;
+  struct BestMoveReplyMessage reply;
+  uint16_t move;
+  ResultType value;
+
+  if (!BestMoveRequestCodec::decode(recv_buf, recv_len, request) ||
+      best_move(request.x_positions, request.o_positions, &move, &value) == -1) {
+    return build_header_reply(ServerInvalidRequestReply, reply_buf, reply_cap);
+  }
+
+  reply.hdr = {ServerBestMoveReply, BestMoveReplyCodec::wire_size};
+  reply.client_id = request.client_id;
+  reply.x_positions = request.x_positions;
+  reply.o_positions = request.o_positions;
+  reply.move = move;
+  reply.value = value;
+  return BestMoveReplyCodec::encode(reply, reply_buf, reply_cap);
+}
+
+/**
+ * What a large board token covers: the width, height and k fields as
+ * sent, then the row masks.
+ */
+static size_t large_board_bytes(uint16_t width, uint16_t height, uint16_t k, const char *rows, uint8_t *out) {
+  wire::store_be(&out[0], width);
+  wire::store_be(&out[2], height);
+  wire::store_be(&out[4], k);
+  memcpy(&out[6], rows, 4 * height);
+  return 6 + 4 * height;
+}
+
+static int handle_get_large_game(struct ServerShard *shard, const struct sockaddr_in *from, const char *recv_buf,
+                                 int recv_len, char *reply_buf, int reply_cap) {
+  struct GetLargeGameMessage request;
+  struct LargeGameSummaryMessage reply;
+  const struct LargeVariant *variant;
+  uint16_t x_rows[LARGE_BOARD_MAX_ROWS];
+  uint16_t o_rows[LARGE_BOARD_MAX_ROWS];
+  uint8_t board[6 + 4 * LARGE_BOARD_MAX_ROWS];
+  size_t board_len;
+  int offset;
+
+  if (!GetLargeGameCodec::decode(recv_buf, recv_len, request)) {
+    return build_header_reply(ServerInvalidRequestReply, reply_buf, reply_cap);
+  }
+  variant = find_large_variant(request.width, request.height, request.k);
+  if (variant == NULL || reply_cap < (int)(LargeGameSummaryCodec::wire_size + 4 * variant->height)) {
+    return build_header_reply(ServerInvalidRequestReply, reply_buf, reply_cap);
+  }
+
+  offset = LargeGameSummaryCodec::wire_size;
+  random_large_board(&shard->boards.rng, variant, x_rows, o_rows);
+  offset += encode_large_rows(x_rows, o_rows, variant->height, &reply_buf[offset]);
+
+  reply.hdr = {ServerLargeGameReply, (uint16_t)offset};
+  reply.client_id = request.client_id;
+  reply.game_id = shard->next_game_id++;
+  reply.width = variant->width;
+  reply.height = variant->height;
+  reply.k = variant->k;
+  board_len = large_board_bytes(variant->width, variant->height, variant->k,
+                                &reply_buf[LargeGameSummaryCodec::wire_size], board);
+  make_board_token(shard->config->token_key, token_epoch(shard->now_ms), from->sin_addr.s_addr, from->sin_port,
+                   reply.game_id, board, board_len, reply.token);
+  LargeGameSummaryCodec::encode(reply, reply_buf, reply_cap);
+  return offset;
+}
+
+static int handle_large_result(struct ServerShard *shard, const struct sockaddr_in *from, const char *recv_buf,
+                               int recv_len, char *reply_buf, int reply_cap) {
+  // Checked in place, like the token results
+  auto request = wire::View<LargeGameResultCodec>::over(recv_buf, recv_len);
+  const struct LargeVariant *variant;
+  uint16_t x_rows[LARGE_BOARD_MAX_ROWS];
+  uint16_t o_rows[LARGE_BOARD_MAX_ROWS];
+  uint8_t board[6 + 4 * LARGE_BOARD_MAX_ROWS];
+  size_t board_len;
+
+  if (!request) {
+    return build_header_reply(ServerInvalidRequestReply, reply_buf, reply_cap);
+  }
+  variant = find_large_variant(request.get<&LargeGameResultMessage::width>(),
+                               request.get<&LargeGameResultMessage::height>(),
+                               request.get<&LargeGameResultMessage::k>());
+  if (variant == NULL || recv_len != (int)(LargeGameResultCodec::wire_size + 4 * variant->height)) {
+    return build_header_reply(ServerInvalidRequestReply, reply_buf, reply_cap);
+  }
+
+  board_len = large_board_bytes(variant->width, variant->height, variant->k, request.payload(), board);
+  if (open_board_token(shard->config->token_key, token_epoch(shard->now_ms), from->sin_addr.s_addr,
+                       from->sin_port, request.get<&LargeGameResultMessage::game_id>(), board, board_len,
+                       request.bytes<&LargeGameResultMessage::token>()) == -1) {
+    return build_header_reply(ServerInvalidRequestReply, reply_buf, reply_cap);
+  }
+
+  decode_large_rows(request.payload(), variant->height, x_rows, o_rows);
+  if (request.get<&LargeGameResultMessage::result>() == variant->result(x_rows, o_rows)) {
+    return build_header_reply(ServerClientResultCorrect, reply_buf, reply_cap);
+  }
+  return build_header_reply(ServerClientResultIncorrect, reply_buf, reply_cap);
+}
+
+int handle_ttt_datagram(struct ServerShard *shard, const struct sockaddr_in *from,
+                        const char *recv_buf, int recv_len, char *reply_buf, int reply_cap) {
+  auto hdr = wire::View<TTTMessageCodec>::over(recv_buf, recv_len < 0 ? 0 : recv_len);
+  uint16_t type;
+
+  if (!hdr) {
+    return build_header_reply(ServerInvalidRequestReply, reply_buf, reply_cap);
+  }
+
+  // The length in the header must match what actually arrived
+  if (hdr.get<&TTTMessage::len>() != recv_len) {
+    return build_header_reply(ServerInvalidRequestReply, reply_buf, reply_cap);
+  }
+
+  type = hdr.get<&TTTMessage::type>();
+  if ((type == ClientGetTokenGame) && (recv_len == (int)GetGameCodec::wire_size)) {
+    return handle_get_token_game(shard, from, recv_buf, recv_len, reply_buf, reply_cap);
+  } else if ((type == ClientTokenResult) && (recv_len == (int)TokenGameResultCodec::wire_size)) {
+    return handle_token_result(shard, from, recv_buf, recv_len, reply_buf, reply_cap);
+  } else if ((type == ClientGetBestMove) && (recv_len == (int)BestMoveRequestCodec::wire_size)) {
+    return handle_best_move(recv_buf, recv_len, reply_buf, reply_cap);
+  } else if ((type == ClientGetLargeGame) && (recv_len == (int)GetLargeGameCodec::wire_size)) {
+    return handle_get_large_game(shard, from, recv_buf, recv_len, reply_buf, reply_cap);
+  } else if ((type == ClientLargeResult) && (recv_len >= (int)LargeGameResultCodec::wire_size)) {
+    return handle_large_result(shard, from, recv_buf, recv_len, reply_buf, reply_cap);
+  }
+
+  // Plain games need the session table, which stateless shards do not have
+  if (shard->config->stateless) {
+    return build_header_reply(ServerInvalidRequestReply, reply_buf, reply_cap);
+  }
+
+  if ((type == ClientGetGame) && (recv_len == (int)GetGameCodec::wire_size)) {
+    return handle_get_game(shard, from, recv_buf, recv_len, reply_buf, reply_cap);
+  } else if ((type == ClientResult) && (recv_len == (int)GameResultCodec::wire_size)) {
+    return handle_result(shard, from, recv_buf, recv_len, reply_buf, reply_cap);
+  } else if ((type == ClientGetGameBatch) && (recv_len == (int)GetGameBatchCodec::wire_size)) {
+    return handle_get_game_batch(shard, from, recv_buf, recv_len, reply_buf, reply_cap);
+  } else if ((type == ClientResultBatch) && (recv_len >= (int)ResultBatchCodec::wire_size)) {
+    return handle_result_batch(shard, from, recv_buf, recv_len, reply_buf, reply_cap);
+  }
+
+  return build_header_reply(ServerInvalidRequestReply, reply_buf, reply_cap);
+}
@@ -0,0 +1,86 @@
+//
+// TicTacToe server protocol handling, shared by every server worker.
+//
+
+#ifndef IN_CLASS_UDP_EXAMPLE_TTT_SERVER_H
+#define IN_CLASS_UDP_EXAMPLE_TTT_SERVER_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "tictactoe.h"
+#include "game_sessions.h"
+#include "game_tokens.h"
+#include "board_gen.h"
+
+/**
+ * Server settings shared by every shard.
+ */
+struct ServerConfig {
+  /* most games one shard remembers at a time */
+  uint32_t max_sessions;
+  /* how long a client has to report a result before the game is dropped */
+  uint32_t session_ttl_ms;
+  /* keep no per-game state: only token games (ClientGetTokenGame) are served */
+  bool stateless;
+  /* share of X_WIN/O_WIN/CATS_GAME/INVALID_BOARD boards handed out */
+  struct BoardMix board_mix;
+  /* secret used to authenticate game tokens, the same for every shard */
+  uint8_t token_key[SIPHASH_KEY_LEN];
+};
+
+/**
+ * All of the state one server worker needs to answer requests.
+ * Each worker owns exactly one shard, and the reuseport steering
+ * keeps a client on one worker, so a shard is never shared between
+ * threads and needs no locking.
+ */
+struct ServerShard {
+  int index;
+  const struct ServerConfig *config;
+  struct BoardPicker boards;
+  uint16_t next_game_id;
+  uint64_t now_ms;
+  struct SessionTable sessions;
+};
+
+/**
+ * Set up a shard before its worker starts serving.
+ *
+ * @param shard the shard to initialize
+ * @param index the worker index that owns the shard
+ * @param config server settings
+ * @return 0 on success, -1 if the session table could not be allocated
+ *         or the board mix is empty
+ */
+int init_server_shard(struct ServerShard *shard, int index, const struct ServerConfig *config);
+
+/**
+ * Release the memory held by a shard.
+ */
+void free_server_shard(struct ServerShard *shard);
+
+/**
+ * Let the shard know the time, expiring abandoned games. Called for
+ * every batch of datagrams and whenever the worker wakes up idle.
+ *
+ * @param shard the shard to update
+ * @param now_ms current monotonic_ms() time
+ */
+void server_shard_tick(struct ServerShard *shard, uint64_t now_ms);
+
+/**
+ * Handle one datagram received from a client and build the reply.
+ *
+ * @param shard the shard of the worker that received the datagram
+ * @param from address of the client that sent the datagram
+ * @param recv_buf datagram contents
+ * @param recv_len number of bytes in recv_buf
+ * @param reply_buf buffer to build the reply in
+ * @param reply_cap size of reply_buf
+ * @return the number of reply bytes to send back, or 0 for no reply
+ */
+int handle_ttt_datagram(struct ServerShard *shard, const struct sockaddr_in *from,
+                        const char *recv_buf, int recv_len, char *reply_buf, int reply_cap);
+
+#endif //IN_CLASS_UDP_EXAMPLE_TTT_SERVER_H
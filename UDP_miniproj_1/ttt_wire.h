@@ -0,0 +1,126 @@
+//
+// Wire formats of the TicTacToe messages in tictactoe.h, described
+// once for wire_codec.h. Every field is a big endian uint16_t except
+// the token bytes, which are opaque.
+//
+
+#ifndef IN_CLASS_UDP_EXAMPLE_TTT_WIRE_H
+#define IN_CLASS_UDP_EXAMPLE_TTT_WIRE_H
+
+#include "tictactoe.h"
+#include "wire_codec.h"
+
+using TTTMessageCodec = wire::Codec<TTTMessage,
+                                    wire::Field<&TTTMessage::type>,
+                                    wire::Field<&TTTMessage::len> >;
+
+using GetGameCodec = wire::Codec<GetGameMessage,
+                                 wire::Nested<&GetGameMessage::hdr, TTTMessageCodec>,
+                                 wire::Field<&GetGameMessage::client_id> >;
+
+using GameSummaryCodec = wire::Codec<GameSummaryMessage,
+                                     wire::Nested<&GameSummaryMessage::hdr, TTTMessageCodec>,
+                                     wire::Field<&GameSummaryMessage::client_id>,
+                                     wire::Field<&GameSummaryMessage::game_id>,
+                                     wire::Field<&GameSummaryMessage::x_positions>,
+                                     wire::Field<&GameSummaryMessage::o_positions> >;
+
+using GameResultCodec = wire::Codec<GameResultMessage,
+                                    wire::Nested<&GameResultMessage::hdr, TTTMessageCodec>,
+                                    wire::Field<&GameResultMessage::game_id>,
+                                    wire::Field<&GameResultMessage::result> >;
+
+using TokenGameSummaryCodec = wire::Codec<TokenGameSummaryMessage,
+                                          wire::Nested<&TokenGameSummaryMessage::hdr, TTTMessageCodec>,
+                                          wire::Field<&TokenGameSummaryMessage::client_id>,
+                                          wire::Field<&TokenGameSummaryMessage::game_id>,
+                                          wire::Field<&TokenGameSummaryMessage::x_positions>,
+                                          wire::Field<&TokenGameSummaryMessage::o_positions>,
+                                          wire::Bytes<&TokenGameSummaryMessage::token> >;
+
+using TokenGameResultCodec = wire::Codec<TokenGameResultMessage,
+                                         wire::Nested<&TokenGameResultMessage::hdr, TTTMessageCodec>,
+                                         wire::Field<&TokenGameResultMessage::game_id>,
+                                         wire::Field<&TokenGameResultMessage::result>,
+                                         wire::Bytes<&TokenGameResultMessage::token> >;
+
+using GetGameBatchCodec = wire::Codec<GetGameBatchMessage,
+                                      wire::Nested<&GetGameBatchMessage::hdr, TTTMessageCodec>,
+                                      wire::Field<&GetGameBatchMessage::client_id>,
+                                      wire::Field<&GetGameBatchMessage::count> >;
+
+using BatchGameCodec = wire::Codec<BatchGame,
+                                   wire::Field<&BatchGame::game_id>,
+                                   wire::Field<&BatchGame::x_positions>,
+                                   wire::Field<&BatchGame::o_positions> >;
+
+using GameBatchReplyCodec = wire::Codec<GameBatchReplyMessage,
+                                        wire::Nested<&GameBatchReplyMessage::hdr, TTTMessageCodec>,
+                                        wire::Field<&GameBatchReplyMessage::client_id>,
+                                        wire::Field<&GameBatchReplyMessage::count> >;
+
+using BatchResultCodec = wire::Codec<BatchResult,
+                                     wire::Field<&BatchResult::game_id>,
+                                     wire::Field<&BatchResult::result> >;
+
+using ResultBatchCodec = wire::Codec<ResultBatchMessage,
+                                     wire::Nested<&ResultBatchMessage::hdr, TTTMessageCodec>,
+                                     wire::Field<&ResultBatchMessage::count> >;
+
+using ResultBatchReplyCodec = wire::Codec<ResultBatchReplyMessage,
+                                          wire::Nested<&ResultBatchReplyMessage::hdr, TTTMessageCodec>,
+                                          wire::Field<&ResultBatchReplyMessage::count> >;
+
+using BestMoveRequestCodec = wire::Codec<BestMoveRequestMessage,
+                                         wire::Nested<&BestMoveRequestMessage::hdr, TTTMessageCodec>,
+                                         wire::Field<&BestMoveRequestMessage::client_id>,
+                                         wire::Field<&BestMoveRequestMessage::x_positions>,
+                                         wire::Field<&BestMoveRequestMessage::o_positions> >;
+
+using BestMoveReplyCodec = wire::Codec<BestMoveReplyMessage,
+                                       wire::Nested<&BestMoveReplyMessage::hdr, TTTMessageCodec>,
+                                       wire::Field<&BestMoveReplyMessage::client_id>,
+                                       wire::Field<&BestMoveReplyMessage::x_positions>,
+                                       wire::Field<&BestMoveReplyMessage::o_positions>,
+                                       wire::Field<&BestMoveReplyMessage::move>,
+                                       wire::Field<&BestMoveReplyMessage::value> >;
+
+using GetLargeGameCodec = wire::Codec<GetLargeGameMessage,
+                                      wire::Nested<&GetLargeGameMessage::hdr, TTTMessageCodec>,
+                                      wire::Field<&GetLargeGameMessage::client_id>,
+                                      wire::Field<&GetLargeGameMessage::width>,
+                                      wire::Field<&GetLargeGameMessage::height>,
+                                      wire::Field<&GetLargeGameMessage::k> >;
+
+using LargeGameSummaryCodec = wire::Codec<LargeGameSummaryMessage,
+                                          wire::Nested<&LargeGameSummaryMessage::hdr, TTTMessageCodec>,
+                                          wire::Field<&LargeGameSummaryMessage::client_id>,
+                                          wire::Field<&LargeGameSummaryMessage::game_id>,
+                                          wire::Field<&LargeGameSummaryMessage::width>,
+                                          wire::Field<&LargeGameSummaryMessage::height>,
+                                          wire::Field<&LargeGameSummaryMessage::k>,
+                                          wire::Bytes<&LargeGameSummaryMessage::token> >;
+
+using LargeGameResultCodec = wire::Codec<LargeGameResultMessage,
+                                         wire::Nested<&LargeGameResultMessage::hdr, TTTMessageCodec>,
+                                         wire::Field<&LargeGameResultMessage::game_id>,
+                                         wire::Field<&LargeGameResultMessage::result>,
+                                         wire::Field<&LargeGameResultMessage::width>,
+                                         wire::Field<&LargeGameResultMessage::height>,
+                                         wire::Field<&LargeGameResultMessage::k>,
+                                         wire::Bytes<&LargeGameResultMessage::token> >;
+
+// The wire layouts are the packed structs, so sizeof() and wire_size agree
+static_assert(GetGameCodec::wire_size == sizeof(GetGameMessage), "GetGameMessage layout");
+static_assert(GameSummaryCodec::wire_size == sizeof(GameSummaryMessage), "GameSummaryMessage layout");
+static_assert(GameResultCodec::wire_size == sizeof(GameResultMessage), "GameResultMessage layout");
+static_assert(TokenGameSummaryCodec::wire_size == sizeof(TokenGameSummaryMessage), "TokenGameSummaryMessage layout");
+static_assert(TokenGameResultCodec::wire_size == sizeof(TokenGameResultMessage), "TokenGameResultMessage layout");
+static_assert(GameBatchReplyCodec::wire_size == sizeof(GameBatchReplyMessage), "GameBatchReplyMessage layout");
+static_assert(ResultBatchCodec::wire_size == sizeof(ResultBatchMessage), "ResultBatchMessage layout");
+static_assert(BestMoveRequestCodec::wire_size == sizeof(BestMoveRequestMessage), "BestMoveRequestMessage layout");
+static_assert(BestMoveReplyCodec::wire_size == sizeof(BestMoveReplyMessage), "BestMoveReplyMessage layout");
+static_assert(LargeGameSummaryCodec::wire_size == sizeof(LargeGameSummaryMessage), "LargeGameSummaryMessage layout");
+static_assert(LargeGameResultCodec::wire_size == sizeof(LargeGameResultMessage), "LargeGameResultMessage layout");
+
+#endif //IN_CLASS_UDP_EXAMPLE_TTT_WIRE_H
@@ -0,0 +1,233 @@
+#include "udp_batch_io.h"
+#include <errno.h>
+#include <netinet/udp.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+bool udp_gso_supported(int udp_socket) {
+  // A segment size of 0 is the default, so this only probes for support
+  int segment_size = 0;
+  return setsockopt(udp_socket, SOL_UDP, UDP_SEGMENT, &segment_size, sizeof(segment_size)) == 0;
+}
+
+int enable_udp_gro(int udp_socket) {
+  int one = 1;
+  return setsockopt(udp_socket, SOL_UDP, UDP_GRO, &one, sizeof(one));
+}
+
+void init_send_batch(struct SendBatch *batch, int udp_socket, bool use_gso) {
+  batch->udp_socket = udp_socket;
+  batch->use_gso = use_gso && udp_gso_supported(udp_socket);
+  batch->count = 0;
+  batch->used = 0;
+  batch->syscalls = 0;
+  batch->datagrams = 0;
+}
+
+char *send_batch_space(struct SendBatch *batch, int *cap) {
+  if (batch->count == SEND_BATCH_MAX || SEND_BATCH_BYTES - batch->used < 2048) {
+    flush_send_batch(batch);
+  }
+  *cap = SEND_BATCH_BYTES - batch->used;
+  return &batch->data[batch->used];
+}
+
+void send_batch_commit(struct SendBatch *batch, const struct sockaddr_in *to, int len) {
+  batch->to[batch->count] = *to;
+  batch->offset[batch->count] = batch->used;
+  batch->len[batch->count] = len;
+  batch->count++;
+  batch->used += len;
+}
+
+static inline bool same_peer(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+  return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+/**
+ * Drop the first num_sent datagrams, keeping the rest queued.
+ */
+static void discard_sent(struct SendBatch *batch, int num_sent) {
+  int base = (num_sent < batch->count) ? batch->offset[num_sent] : batch->used;
+
+  memmove(batch->data, &batch->data[base], batch->used - base);
+  for (int i = num_sent; i < batch->count; ++i) {
+    batch->to[i - num_sent] = batch->to[i];
+    batch->offset[i - num_sent] = batch->offset[i] - base;
+    batch->len[i - num_sent] = batch->len[i];
+  }
+  batch->count -= num_sent;
+  batch->used -= base;
+}
+
+int flush_send_batch(struct SendBatch *batch) {
+  struct mmsghdr msgs[SEND_BATCH_MAX];
+  struct iovec iovs[SEND_BATCH_MAX];
+  char control[SEND_BATCH_MAX][CMSG_SPACE(sizeof(uint16_t))];
+  int first_datagram[SEND_BATCH_MAX];
+  int num_msgs = 0;
+  int total = batch->count;
+  int sent = 0;
+  int i = 0;
+  int ret;
+
+  if (batch->count == 0) {
+    return 0;
+  }
+
+  memset(msgs, 0, sizeof(struct mmsghdr) * batch->count);
+
+  // Datagrams are laid out back to back in data, so a run of equal
+  // sized datagrams to one peer is already one contiguous GSO buffer.
+  while (i < batch->count) {
+    int run = 1;
+    if (batch->use_gso) {
+      while ((i + run < batch->count) && (run < GSO_MAX_SEGMENTS) && same_peer(&batch->to[i], &batch->to[i + run]) &&
+             (batch->len[i + run] == batch->len[i]) && ((run + 1) * batch->len[i] <= GSO_MAX_BYTES)) {
+        run++;
+      }
+    }
+
+    iovs[num_msgs].iov_base = &batch->data[batch->offset[i]];
+    iovs[num_msgs].iov_len = run * batch->len[i];
+    msgs[num_msgs].msg_hdr.msg_iov = &iovs[num_msgs];
+    msgs[num_msgs].msg_hdr.msg_iovlen = 1;
+    msgs[num_msgs].msg_hdr.msg_name = &batch->to[i];
+    msgs[num_msgs].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+
+    if (run > 1) {
+      struct cmsghdr *cmsg;
+      uint16_t segment_size = batch->len[i];
+
+      msgs[num_msgs].msg_hdr.msg_control = control[num_msgs];
+      msgs[num_msgs].msg_hdr.msg_controllen = sizeof(control[num_msgs]);
+      cmsg = CMSG_FIRSTHDR(&msgs[num_msgs].msg_hdr);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(uint16_t));
+    }
+
+    first_datagram[num_msgs] = i;
+    num_msgs++;
+    i += run;
+  }
+
+  while (sent < num_msgs) {
+    ret = sendmmsg(batch->udp_socket, &msgs[sent], num_msgs - sent, 0);
+    batch->syscalls++;
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // The kernel or device refused segmentation offload; resend the
+      // rest one datagram per message from now on.
+      if (batch->use_gso && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP)) {
+        batch->use_gso = false;
+        discard_sent(batch, first_datagram[sent]);
+        batch->datagrams += first_datagram[sent];
+        ret = flush_send_batch(batch);
+        return (ret < 0) ? -1 : first_datagram[sent] + ret;
+      }
+      batch->count = 0;
+      batch->used = 0;
+      return -1;
+    }
+    sent += ret;
+  }
+
+  batch->datagrams += total;
+  batch->count = 0;
+  batch->used = 0;
+  return total;
+}
+
+int init_recv_batch(struct RecvBatch *batch, int udp_socket, bool use_gro) {
+  memset(batch, 0, sizeof(struct RecvBatch));
+  batch->udp_socket = udp_socket;
+  batch->use_gro = use_gro;
+  // A GRO buffer can hold up to 64KB of coalesced datagrams
+  batch->buffer_size = use_gro ? 65536 : 2048;
+  batch->buffers = (char *)malloc((size_t)RECV_BATCH_MAX * batch->buffer_size);
+  return (batch->buffers == nullptr) ? -1 : 0;
+}
+
+void free_recv_batch(struct RecvBatch *batch) {
+  free(batch->buffers);
+  batch->buffers = nullptr;
+}
+
+int recv_batch_fill(struct RecvBatch *batch, int flags) {
+  struct cmsghdr *cmsg;
+  int ret;
+
+  for (int i = 0; i < RECV_BATCH_MAX; ++i) {
+    batch->iovs[i].iov_base = &batch->buffers[(size_t)i * batch->buffer_size];
+    batch->iovs[i].iov_len = batch->buffer_size;
+    batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+    batch->msgs[i].msg_hdr.msg_iovlen = 1;
+    batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+    batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    batch->msgs[i].msg_hdr.msg_control = batch->use_gro ? batch->control[i] : nullptr;
+    batch->msgs[i].msg_hdr.msg_controllen = batch->use_gro ? sizeof(batch->control[i]) : 0;
+    batch->msgs[i].msg_hdr.msg_flags = 0;
+  }
+
+  batch->received = 0;
+  batch->msg_index = 0;
+  batch->segment_offset = 0;
+
+  ret = recvmmsg(batch->udp_socket, batch->msgs, RECV_BATCH_MAX, MSG_WAITFORONE | flags, nullptr);
+  batch->syscalls++;
+  if (ret <= 0) {
+    return ret;
+  }
+
+  for (int i = 0; i < ret; ++i) {
+    batch->segment_size[i] = batch->msgs[i].msg_len;
+    if (!batch->use_gro) {
+      continue;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&batch->msgs[i].msg_hdr); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(&batch->msgs[i].msg_hdr, cmsg)) {
+      if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+        int gso_size;
+        memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(int));
+        if (gso_size > 0) {
+          batch->segment_size[i] = gso_size;
+        }
+      }
+    }
+  }
+
+  batch->received = ret;
+  return ret;
+}
+
+bool recv_batch_next(struct RecvBatch *batch, const char **data, int *len, const struct sockaddr_in **from) {
+  while (batch->msg_index < batch->received) {
+    int i = batch->msg_index;
+    int total = batch->msgs[i].msg_len;
+
+    if (batch->segment_offset < total) {
+      int remaining = total - batch->segment_offset;
+      *data = &batch->buffers[(size_t)i * batch->buffer_size + batch->segment_offset];
+      *len = (remaining < batch->segment_size[i]) ? remaining : batch->segment_size[i];
+      *from = &batch->addrs[i];
+      batch->segment_offset += *len;
+      batch->datagrams++;
+      return true;
+    }
+
+    batch->msg_index++;
+    batch->segment_offset = 0;
+  }
+  return false;
+}
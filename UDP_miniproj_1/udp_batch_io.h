@@ -0,0 +1,147 @@
+//
+// Batched UDP send/receive with optional segmentation offload
+// (UDP_SEGMENT on send, UDP_GRO on receive).
+//
+
+#ifndef IN_CLASS_UDP_EXAMPLE_UDP_BATCH_IO_H
+#define IN_CLASS_UDP_EXAMPLE_UDP_BATCH_IO_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+// Most datagrams queued before a SendBatch flushes itself
+#define SEND_BATCH_MAX 256
+// Bytes of datagram data a SendBatch holds
+#define SEND_BATCH_BYTES (SEND_BATCH_MAX * 2048)
+// Most segments the kernel accepts in one UDP_SEGMENT send
+#define GSO_MAX_SEGMENTS 64
+// Largest coalesced buffer, for UDP_SEGMENT sends and UDP_GRO receives
+#define GSO_MAX_BYTES 65000
+// Most messages read by one recvmmsg call
+#define RECV_BATCH_MAX 32
+
+/**
+ * Check whether the kernel supports UDP_SEGMENT on this socket.
+ *
+ * @return true if GSO sends can be used
+ */
+bool udp_gso_supported(int udp_socket);
+
+/**
+ * Turn on UDP_GRO so the kernel may hand back several datagrams from
+ * the same sender coalesced into one buffer.
+ *
+ * @return 0 on success, -1 if the kernel does not support it
+ */
+int enable_udp_gro(int udp_socket);
+
+/**
+ * Datagrams waiting to be sent with one sendmmsg call. Runs of
+ * equal sized datagrams to the same peer are sent as a single
+ * UDP_SEGMENT message when GSO is enabled.
+ */
+struct SendBatch {
+  int udp_socket;
+  bool use_gso;
+  int count;
+  int used;
+  struct sockaddr_in to[SEND_BATCH_MAX];
+  int offset[SEND_BATCH_MAX];
+  int len[SEND_BATCH_MAX];
+  char data[SEND_BATCH_BYTES];
+  /* send syscalls made and datagrams sent, for reporting */
+  uint64_t syscalls;
+  uint64_t datagrams;
+};
+
+/**
+ * @param batch the batch to set up
+ * @param udp_socket socket the batch sends on
+ * @param use_gso coalesce runs with UDP_SEGMENT (falls back by itself if the kernel refuses)
+ */
+void init_send_batch(struct SendBatch *batch, int udp_socket, bool use_gso);
+
+/**
+ * Get space for the next datagram, flushing the batch first if it is
+ * full. Fill in at most *cap bytes, then call send_batch_commit.
+ *
+ * @param batch the batch
+ * @param cap set to the number of bytes available
+ * @return where to write the datagram
+ */
+char *send_batch_space(struct SendBatch *batch, int *cap);
+
+/**
+ * Queue the datagram just written to send_batch_space.
+ *
+ * @param batch the batch
+ * @param to destination of the datagram
+ * @param len length of the datagram
+ */
+void send_batch_commit(struct SendBatch *batch, const struct sockaddr_in *to, int len);
+
+/**
+ * Send everything queued.
+ *
+ * @return number of datagrams sent, or -1 on error
+ */
+int flush_send_batch(struct SendBatch *batch);
+
+/**
+ * Buffers for reading many datagrams with one recvmmsg call, and for
+ * walking the individual datagrams inside UDP_GRO coalesced buffers.
+ */
+struct RecvBatch {
+  int udp_socket;
+  bool use_gro;
+  int buffer_size;
+  char *buffers;
+  struct mmsghdr msgs[RECV_BATCH_MAX];
+  struct iovec iovs[RECV_BATCH_MAX];
+  struct sockaddr_in addrs[RECV_BATCH_MAX];
+  char control[RECV_BATCH_MAX][64];
+  /* size of each datagram inside a GRO buffer, or the whole buffer */
+  int segment_size[RECV_BATCH_MAX];
+  /* iteration state over the last recv_batch_fill */
+  int received;
+  int msg_index;
+  int segment_offset;
+  /* receive syscalls made and datagrams received, for reporting */
+  uint64_t syscalls;
+  uint64_t datagrams;
+};
+
+/**
+ * @param batch the batch to set up
+ * @param udp_socket socket to receive on
+ * @param use_gro whether UDP_GRO was enabled on the socket (needs 64KB buffers)
+ * @return 0 on success, -1 if buffers could not be allocated
+ */
+int init_recv_batch(struct RecvBatch *batch, int udp_socket, bool use_gro);
+
+void free_recv_batch(struct RecvBatch *batch);
+
+/**
+ * Read as many datagrams as are ready (at least one unless flags has
+ * MSG_DONTWAIT or the socket times out).
+ *
+ * @param batch the batch
+ * @param flags extra recvmmsg flags
+ * @return number of receive buffers filled, or -1 on error (see errno)
+ */
+int recv_batch_fill(struct RecvBatch *batch, int flags);
+
+/**
+ * Get the next datagram from the last recv_batch_fill, splitting GRO
+ * buffers back into the datagrams that were sent.
+ *
+ * @param batch the batch
+ * @param data set to the datagram contents
+ * @param len set to the datagram length
+ * @param from set to the sender address
+ * @return true if a datagram was returned, false once all are used up
+ */
+bool recv_batch_next(struct RecvBatch *batch, const char **data, int *len, const struct sockaddr_in **from);
+
+#endif //IN_CLASS_UDP_EXAMPLE_UDP_BATCH_IO_H
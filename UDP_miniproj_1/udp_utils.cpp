@@ -1,5 +1,10 @@
 #include "udp_utils.h"
 #include <arpa/inet.h>
+#include <linux/filter.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
 
 /**
  * Print an error related to networking to stderr using perror()
@@ -32,4 +37,98 @@ int convert_ip_port_to_sockaddr_in(char *ip_str, char *port_str, struct sockaddr
   result->sin_family = AF_INET;
 
   return 0;
-}
\ No newline at end of file
+}
+
+int create_reuseport_udp_socket(struct sockaddr_in *addr) {
+  int udp_socket;
+  int one = 1;
+  int ret;
+
+  udp_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (udp_socket == -1) {
+    return -1;
+  }
+
+  ret = setsockopt(udp_socket, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+  if (ret == -1) {
+    close(udp_socket);
+    return -1;
+  }
+
+  ret = bind(udp_socket, (struct sockaddr *)addr, sizeof(struct sockaddr_in));
+  if (ret == -1) {
+    close(udp_socket);
+    return -1;
+  }
+
+  return udp_socket;
+}
+
+int attach_reuseport_cbpf(int udp_socket, unsigned int num_sockets) {
+  // When the program runs the packet data starts at the UDP payload,
+  // so the IP header is reached through the SKF_NET_OFF negative offset.
+  struct sock_filter code[] = {
+      // X = IPv4 header length
+      {BPF_LDX | BPF_B | BPF_MSH, 0, 0, (uint32_t)SKF_NET_OFF},
+      // A = UDP source port, stash it in M[0]
+      {BPF_LD | BPF_H | BPF_IND, 0, 0, (uint32_t)SKF_NET_OFF},
+      {BPF_ST, 0, 0, 0},
+      // A = IPv4 source address ^ source port
+      {BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_NET_OFF + 12)},
+      {BPF_LDX | BPF_W | BPF_MEM, 0, 0, 0},
+      {BPF_ALU | BPF_XOR | BPF_X, 0, 0, 0},
+      // Return the index of the socket in the reuseport group
+      {BPF_ALU | BPF_MOD | BPF_K, 0, 0, num_sockets},
+      {BPF_RET | BPF_A, 0, 0, 0},
+  };
+  struct sock_fprog prog;
+
+  if (num_sockets == 0) {
+    return -1;
+  }
+
+  prog.len = sizeof(code) / sizeof(code[0]);
+  prog.filter = code;
+
+  return setsockopt(udp_socket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+int pin_thread_to_cpu(int index) {
+  cpu_set_t allowed;
+  cpu_set_t target;
+  int num_allowed;
+  int cpu;
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+    return -1;
+  }
+
+  num_allowed = CPU_COUNT(&allowed);
+  if (num_allowed == 0) {
+    return -1;
+  }
+
+  // Find the (index % num_allowed)'th allowed CPU
+  index = index % num_allowed;
+  for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &allowed)) {
+      if (index == 0) {
+        break;
+      }
+      --index;
+    }
+  }
+
+  CPU_ZERO(&target);
+  CPU_SET(cpu, &target);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(target), &target) != 0) {
+    return -1;
+  }
+  return cpu;
+}
+
+uint64_t monotonic_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 
 /**
  * Print an error related to networking to stderr using perror()
@@ -12,4 +14,42 @@ void handle_error(const char *context);
 
 int convert_ip_port_to_sockaddr_in(char *ip_str, char *port_str, struct sockaddr_in *result);
 
+/**
+ * Create a UDP socket with SO_REUSEPORT set and bind it to addr.
+ * Several sockets bound this way to the same address form one
+ * reuseport group, and the kernel spreads datagrams between them.
+ *
+ * @param addr address to bind to
+ * @return the bound socket, or -1 on error
+ */
+int create_reuseport_udp_socket(struct sockaddr_in *addr);
+
+/**
+ * Attach a classic BPF program to the reuseport group of udp_socket
+ * that picks the group member from the datagram source address
+ * (source IPv4 address XOR source port, modulo num_sockets). All
+ * datagrams from one client address then land on the same socket.
+ * Call this after all num_sockets sockets have been bound.
+ *
+ * @param udp_socket any socket of the reuseport group
+ * @param num_sockets number of sockets in the group
+ * @return 0 on success, -1 on error
+ */
+int attach_reuseport_cbpf(int udp_socket, unsigned int num_sockets);
+
+/**
+ * Pin the calling thread to the index'th CPU this process is allowed
+ * to run on (wrapping around if there are fewer CPUs than index).
+ *
+ * @param index worker index
+ * @return the CPU pinned to, or -1 on error
+ */
+int pin_thread_to_cpu(int index);
+
+/**
+ * Milliseconds from the coarse monotonic clock. Cheap enough to call
+ * for every datagram.
+ */
+uint64_t monotonic_ms();
+
 #endif //IN_CLASS_UDP_EXAMPLE_UDP_UTILS_H
\ No newline at end of file